@@ -20,6 +20,8 @@ int process_anim(struct goat3d *goat, struct aiAnimation *aianim);
 static int output_filename(char *buf, int bufsz, const char *fname, const char *suffix);
 static long assimp_time(const struct aiAnimation *anim, double aitime);
 
+static int opt_meshes;
+
 int main(int argc, char **argv)
 {
 	int i, num_done = 0;
@@ -41,6 +43,11 @@ int main(int argc, char **argv)
 				conv_targ = CONV_SCENE;
 				break;
 
+			case 'o':
+				/* optimize mesh face and vertex order for the vertex cache */
+				opt_meshes = 1;
+				break;
+
 			default:
 				fprintf(stderr, "invalid option: %s\n", argv[i]);
 				return 1;
@@ -109,6 +116,9 @@ int convert(const char *infname)
 		struct goat3d_mesh *mesh = goat3d_create_mesh();
 
 		process_mesh(goat, mesh, aimesh);
+		if(opt_meshes) {
+			goat3d_optimize_mesh_indices(mesh);
+		}
 		goat3d_add_mesh(goat, mesh);
 	}
 
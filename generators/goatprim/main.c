@@ -158,6 +158,8 @@ int main(int argc, char **argv)
 	default:
 		return 1;
 	}
+	/* the immediate mode interface doesn't share vertices between faces */
+	goat3d_weld_mesh(mesh, 0);
 	goat3d_set_mesh_mtl(mesh, mtl);
 	goat3d_add_mesh(goat, mesh);
 
@@ -0,0 +1,262 @@
+#include <string.h>
+#include <math.h>
+#include "treestor.h"
+
+/* Locale-independent conversions between numbers and strings.
+ *
+ * Parsing accumulates up to 19 significant digits in an integer, and when
+ * that fits in the 53 bits of a double mantissa and the decimal exponent is
+ * small enough for the power of 10 to be exact, a single multiplication or
+ * division gives the correctly rounded result. Anything else is scaled in
+ * long double precision, which is still well beyond what a float needs.
+ *
+ * Formatting tries increasing numbers of significant digits, and stops at the
+ * first one which parses back to exactly the same float, through the same
+ * conversion the parser uses, so saved numbers always read back bit-exact.
+ */
+
+#define MAX_DIGITS		19
+#define MAX_EXACT_MANT	(1ull << 53)
+#define MAX_EXACT_POW	22
+
+static const double pow10tab[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static double dec_to_double(unsigned long long mant, int exp10)
+{
+	long double res, p;
+	int e;
+
+	if(!mant) return 0.0;
+
+	if(mant <= MAX_EXACT_MANT) {
+		if(exp10 >= 0 && exp10 <= MAX_EXACT_POW) {
+			return (double)mant * pow10tab[exp10];
+		}
+		if(exp10 < 0 && exp10 >= -MAX_EXACT_POW) {
+			return (double)mant / pow10tab[-exp10];
+		}
+	}
+
+	if(exp10 > 330) return HUGE_VAL;
+	if(exp10 < -360) return 0.0;
+
+	/* binary exponentiation of 10^|exp10| */
+	res = 1.0;
+	p = 10.0;
+	e = exp10 < 0 ? -exp10 : exp10;
+	while(e) {
+		if(e & 1) res *= p;
+		p *= p;
+		e >>= 1;
+	}
+	return exp10 < 0 ? (double)((long double)mant / res) : (double)((long double)mant * res);
+}
+
+double ts_parse_num(const char *str, const char *end, const char **endp)
+{
+	const char *s = str;
+	unsigned long long mant = 0;
+	int neg = 0, ndig = 0, exp10 = 0, eneg, e, any = 0;
+	double res;
+
+	if(!end) end = s + strlen(s);
+
+	if(s < end && (*s == '-' || *s == '+')) {
+		neg = *s++ == '-';
+	}
+
+	/* skip leading zeros, they don't count as significant digits */
+	while(s < end && *s == '0') {
+		s++;
+		any = 1;
+	}
+	while(s < end && *s >= '0' && *s <= '9') {
+		if(ndig < MAX_DIGITS) {
+			mant = mant * 10 + (*s - '0');
+			ndig++;
+		} else {
+			exp10++;
+		}
+		s++;
+		any = 1;
+	}
+	if(s < end && *s == '.') {
+		s++;
+		if(!ndig) {
+			while(s < end && *s == '0') {
+				exp10--;
+				s++;
+				any = 1;
+			}
+		}
+		while(s < end && *s >= '0' && *s <= '9') {
+			if(ndig < MAX_DIGITS) {
+				mant = mant * 10 + (*s - '0');
+				ndig++;
+				exp10--;
+			}
+			s++;
+			any = 1;
+		}
+	}
+
+	if(!any) {
+		if(endp) *endp = str;
+		return 0.0;
+	}
+
+	if(s < end && (*s == 'e' || *s == 'E')) {
+		const char *estart = s++;
+
+		eneg = 0;
+		if(s < end && (*s == '-' || *s == '+')) {
+			eneg = *s++ == '-';
+		}
+		if(s < end && *s >= '0' && *s <= '9') {
+			e = 0;
+			while(s < end && *s >= '0' && *s <= '9') {
+				if(e < 10000) e = e * 10 + (*s - '0');
+				s++;
+			}
+			exp10 += eneg ? -e : e;
+		} else {
+			s = estart;		/* not an exponent after all */
+		}
+	}
+
+	if(endp) *endp = s;
+
+	res = dec_to_double(mant, exp10);
+	return neg ? -res : res;
+}
+
+static char *write_uint(char *buf, unsigned int x)
+{
+	char tmp[16], *p = tmp;
+	do {
+		*p++ = '0' + x % 10;
+		x /= 10;
+	} while(x);
+	while(p > tmp) *buf++ = *--p;
+	return buf;
+}
+
+static double scale10(double x, int exp10)
+{
+	while(exp10 > MAX_EXACT_POW) {
+		x *= pow10tab[MAX_EXACT_POW];
+		exp10 -= MAX_EXACT_POW;
+	}
+	while(exp10 < -MAX_EXACT_POW) {
+		x /= pow10tab[MAX_EXACT_POW];
+		exp10 += MAX_EXACT_POW;
+	}
+	return exp10 >= 0 ? x * pow10tab[exp10] : x / pow10tab[-exp10];
+}
+
+int ts_format_num(char *buf, float x)
+{
+	char digits[16] = {0}, *p = buf;	/* init only to quiet -Wmaybe-uninitialized */
+	double v, d;
+	unsigned int m, alt, found = 0;
+	int i, n, e10, exp10 = 0, ndig;
+
+	if(x != x) {
+		strcpy(buf, "nan");
+		return 3;
+	}
+	if(x < 0.0f || (x == 0.0f && 1.0f / x < 0.0f)) {
+		*p++ = '-';
+		x = -x;
+	}
+	if(x == 0.0f) {
+		*p++ = '0';
+		*p = 0;
+		return p - buf;
+	}
+	if(x > 3.4028235e38f) {
+		strcpy(p, "inf");
+		return p + 3 - buf;
+	}
+
+	v = x;
+	e10 = (int)floor(log10(v));
+	/* log10 can be off by one near powers of 10 */
+	if(scale10(1.0, e10) > v) {
+		e10--;
+	} else if(scale10(1.0, e10 + 1) <= v) {
+		e10++;
+	}
+
+	/* 9 significant digits are always enough to round-trip a float */
+	for(n=1; n<=9 && !found; n++) {
+		exp10 = e10 - n + 1;
+		d = scale10(v, -exp10);
+		m = (unsigned int)(d + 0.5);
+
+		if((float)dec_to_double(m, exp10) == x) {
+			found = 1;
+			break;
+		}
+		/* the nearest n-digit number doesn't read back correctly, but the
+		 * next one on the other side might, if the rounding interval of x
+		 * is lopsided (x is a power of 2).
+		 */
+		alt = (double)m < d ? m + 1 : m - 1;
+		if(alt && (float)dec_to_double(alt, exp10) == x) {
+			m = alt;
+			found = 1;
+			break;
+		}
+	}
+	if(!found) {
+		exp10 = e10 - 8;
+		m = (unsigned int)(scale10(v, -exp10) + 0.5);
+	}
+
+	/* drop trailing zeros */
+	while(m && m % 10 == 0) {
+		m /= 10;
+		exp10++;
+	}
+	ndig = write_uint(digits, m) - digits;
+	e10 = exp10 + ndig - 1;		/* exponent of the first digit */
+
+	if(e10 >= -5 && e10 < 16) {
+		if(e10 < 0) {
+			*p++ = '0';
+			*p++ = '.';
+			for(i=0; i<-e10-1; i++) *p++ = '0';
+			memcpy(p, digits, ndig);
+			p += ndig;
+		} else if(e10 >= ndig - 1) {
+			memcpy(p, digits, ndig);
+			p += ndig;
+			for(i=0; i<e10-ndig+1; i++) *p++ = '0';
+		} else {
+			memcpy(p, digits, e10 + 1);
+			p += e10 + 1;
+			*p++ = '.';
+			memcpy(p, digits + e10 + 1, ndig - e10 - 1);
+			p += ndig - e10 - 1;
+		}
+	} else {
+		*p++ = digits[0];
+		if(ndig > 1) {
+			*p++ = '.';
+			memcpy(p, digits + 1, ndig - 1);
+			p += ndig - 1;
+		}
+		*p++ = 'e';
+		if(e10 < 0) {
+			*p++ = '-';
+			e10 = -e10;
+		}
+		p = write_uint(p, e10);
+	}
+	*p = 0;
+	return p - buf;
+}
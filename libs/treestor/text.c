@@ -6,18 +6,50 @@
 #include "treestor.h"
 #include "dynarr.h"
 
+#define RDBUF_SIZE	65536
+
 struct parser {
 	struct ts_io *io;
 	int nline;
+
+	/* input buffer, either allocated by the parser and refilled from io in
+	 * large blocks, or a caller-supplied memory block (io is null).
+	 */
+	char *buf, *ptr, *end;
+	long bufsz;
+
+	/* the current token is a span in the input buffer */
+	char *tok;
+	long toklen;
+
+	/* tokstr terminates tokens in place in our own buffer, saving the
+	 * overwritten character here, or copies them to token if the buffer
+	 * is read-only.
+	 */
+	char *savep, savec;
 	char *token;
-	int nextc;
+
+	/* if set, the tree is allocated from this arena instead of the heap */
+	struct ts_arena *arena;
 };
 
 enum { TOK_SYM, TOK_ID, TOK_NUM, TOK_STR };
 
+static struct ts_node *load(struct parser *pst);
 static struct ts_node *read_node(struct parser *pstate);
 static int read_array(struct parser *pstate, struct ts_value *tsv, char endsym);
 static int next_token(struct parser *pstate);
+static char *tokstr(struct parser *pst);
+static char *tokdup(struct parser *pst);
+static struct ts_node *new_node(struct parser *pst);
+static struct ts_attr *new_attr(struct parser *pst);
+static void del_node(struct parser *pst, struct ts_node *node);
+static void del_attr(struct parser *pst, struct ts_attr *attr);
+static void del_value(struct parser *pst, struct ts_value *val);
+static int set_value_tok(struct parser *pst, struct ts_value *val);
+static int set_value_num(struct parser *pst, struct ts_value *val, float num);
+static int set_value_arr(struct parser *pst, struct ts_value *val, int count,
+		struct ts_value *arr, int heaparr);
 
 static int print_attr(struct ts_attr *attr, struct ts_io *io, int level);
 static char *value_to_str(struct ts_value *value);
@@ -35,41 +67,75 @@ static const char *toktypestr(int type);
 
 #define EXPECT_SYM(c) \
 	do { \
-		if(next_token(pst) != TOK_SYM || pst->token[0] != (c)) { \
+		if(next_token(pst) != TOK_SYM || pst->tok[0] != (c)) { \
 			fprintf(stderr, "line %d: expected symbol: %c\n", pst->nline, c); \
 			goto err; \
 		} \
 	} while(0)
 
 
-struct ts_node *ts_text_load(struct ts_io *io)
+struct ts_node *ts_text_load(struct ts_io *io, struct ts_arena *arena)
 {
-	char *root_name;
-	struct parser pstate, *pst = &pstate;
-	struct ts_node *node = 0;
+	struct parser pstate;
+	struct ts_node *node;
 
+	memset(&pstate, 0, sizeof pstate);
 	pstate.io = io;
-	pstate.nline = 1;
-	pstate.nextc = -1;
-	if(!(pstate.token = ts_dynarr_alloc(0, 1))) {
+	pstate.arena = arena;
+
+	/* one extra byte to let tokstr terminate a token ending at the end of
+	 * the buffer
+	 */
+	pstate.bufsz = RDBUF_SIZE;
+	if(!(pstate.buf = malloc(pstate.bufsz + 1))) {
+		perror("failed to allocate input buffer");
+		return 0;
+	}
+	pstate.ptr = pstate.end = pstate.buf;
+
+	node = load(&pstate);
+	free(pstate.buf);
+	return node;
+}
+
+struct ts_node *ts_text_load_mem(const void *buf, long size, struct ts_arena *arena)
+{
+	struct parser pstate;
+
+	memset(&pstate, 0, sizeof pstate);
+	pstate.arena = arena;
+	pstate.buf = pstate.ptr = (char*)buf;
+	pstate.end = pstate.buf + size;
+	pstate.bufsz = size;
+
+	return load(&pstate);
+}
+
+static struct ts_node *load(struct parser *pst)
+{
+	char *root_name = 0;
+	struct ts_node *node = 0;
+
+	pst->nline = 1;
+	if(!(pst->token = ts_dynarr_alloc(0, 1))) {
 		perror("failed to allocate token string");
 		return 0;
 	}
 
 	EXPECT(TOK_ID);
-	if(!(root_name = strdup(pst->token))) {
+	if(!(root_name = tokdup(pst))) {
 		perror("failed to allocate root node name");
-		ts_dynarr_free(pst->token);
-		return 0;
+		goto err;
 	}
 	EXPECT_SYM('{');
 	if(!(node = read_node(pst))) {
-		ts_dynarr_free(pst->token);
-		return 0;
+		goto err;
 	}
 	node->name = root_name;
+	root_name = 0;
 
 err:
+	if(!pst->arena) free(root_name);
 	ts_dynarr_free(pst->token);
 	return node;
 }
@@ -78,24 +144,28 @@ static int read_value(struct parser *pst, int toktype, struct ts_value *val)
 {
 	switch(toktype) {
 	case TOK_NUM:
-		ts_set_valuef(val, atof(pst->token));
+		if(set_value_num(pst, val, ts_parse_num(pst->tok, pst->tok + pst->toklen, 0)) == -1) {
+			return -1;
+		}
 		break;
 
 	case TOK_SYM:
-		if(pst->token[0] == '[' || pst->token[0] == '{') {
-			char endsym = pst->token[0] + 2; /* end symbol is dist 2 from either '[' or '{' */
+		if(pst->tok[0] == '[' || pst->tok[0] == '{') {
+			char endsym = pst->tok[0] + 2; /* end symbol is dist 2 from either '[' or '{' */
 			if(read_array(pst, val, endsym) == -1) {
 				return -1;
 			}
 		} else {
-			fprintf(stderr, "read_node: unexpected rhs symbol: %c\n", pst->token[0]);
+			fprintf(stderr, "read_node: unexpected rhs symbol: %c\n", pst->tok[0]);
 		}
 		break;
 
 	case TOK_ID:
 	case TOK_STR:
 	default:
-		ts_set_value_str(val, pst->token);
+		if(set_value_tok(pst, val) == -1) {
+			return -1;
+		}
 	}
 
 	return 0;
@@ -105,63 +175,65 @@ static struct ts_node *read_node(struct parser *pst)
 {
 	int type;
 	struct ts_node *node;
+	char *id = 0;
 
-	if(!(node = ts_alloc_node())) {
+	if(!(node = new_node(pst))) {
 		perror("failed to allocate treestore node");
 		return 0;
 	}
 
 	while((type = next_token(pst)) == TOK_ID) {
-		char *id;
-
-		if(!(id = strdup(pst->token))) {
+		if(!(id = tokdup(pst))) {
 			goto err;
 		}
 
 		EXPECT(TOK_SYM);
 
-		if(pst->token[0] == '=') {
+		if(pst->tok[0] == '=') {
 			/* attribute */
 			struct ts_attr *attr;
 			int type;
 
-			if(!(attr = ts_alloc_attr())) {
+			if(!(attr = new_attr(pst))) {
 				goto err;
 			}
 
 			if((type = next_token(pst)) == -1) {
-				ts_free_attr(attr);
+				del_attr(pst, attr);
 				fprintf(stderr, "read_node: unexpected EOF\n");
 				goto err;
 			}
 
 			if(read_value(pst, type, &attr->val) == -1) {
-				ts_free_attr(attr);
+				del_attr(pst, attr);
 				fprintf(stderr, "failed to read value\n");
 				goto err;
 			}
 			attr->name = id;
+			id = 0;
 			ts_add_attr(node, attr);
 
-		} else if(pst->token[0] == '{') {
+		} else if(pst->tok[0] == '{') {
 			/* child */
 			struct ts_node *child;
 
 			if(!(child = read_node(pst))) {
-				ts_free_node(node);
+				if(!pst->arena) free(id);
+				del_node(pst, node);
 				return 0;
 			}
 
 			child->name = id;
+			id = 0;
 			ts_add_child(node, child);
 
 		} else {
-			fprintf(stderr, "unexpected token: %s\n", pst->token);
+			fprintf(stderr, "unexpected token: %s\n", tokstr(pst));
 			goto err;
 		}
 	}
 
-	if(type != TOK_SYM || pst->token[0] != '}') {
+	if(type != TOK_SYM || pst->tok[0] != '}') {
 		fprintf(stderr, "expected closing brace\n");
 		goto err;
 	}
@@ -169,77 +241,131 @@ static struct ts_node *read_node(struct parser *pst)
 
 err:
 	fprintf(stderr, "treestore read_node failed\n");
-	ts_free_node(node);
+	if(!pst->arena) free(id);
+	del_node(pst, node);
 	return 0;
 }
 
+/* Array elements are read into a small buffer on the stack, which moves to
+ * the heap and keeps doubling in size for longer arrays. The elements are then
+ * moved into the array value, without copying their contents.
+ */
+#define ARRBUF_SIZE		16
+
 static int read_array(struct parser *pst, struct ts_value *tsv, char endsym)
 {
 	int type;
-	struct ts_value values[32];
-	int i, nval = 0;
-	int res;
+	struct ts_value stackbuf[ARRBUF_SIZE];
+	struct ts_value *values = stackbuf, *tmp;
+	int i, nval = 0, maxval = ARRBUF_SIZE;
 
 	while((type = next_token(pst)) != -1) {
+		if(nval >= maxval) {
+			if(values == stackbuf) {
+				if((tmp = malloc(maxval * 2 * sizeof *values))) {
+					memcpy(tmp, stackbuf, nval * sizeof *values);
+				}
+			} else {
+				tmp = realloc(values, maxval * 2 * sizeof *values);
+			}
+			if(!tmp) {
+				perror("read_array: failed to grow array");
+				goto err;
+			}
+			values = tmp;
+			maxval *= 2;
+		}
+
 		ts_init_value(values + nval);
 		if(read_value(pst, type, values + nval) == -1) {
-			return -1;
-		}
-		if(nval < 31) {
-			++nval;
-		} else {
-			ts_destroy_value(values + nval);
+			del_value(pst, values + nval);
+			goto err;
 		}
+		nval++;
 
 		type = next_token(pst);
-		if(!(type == TOK_SYM && (pst->token[0] == ',' || pst->token[0] == endsym))) {
+		if(!(type == TOK_SYM && (pst->tok[0] == ',' || pst->tok[0] == endsym))) {
 			fprintf(stderr, "read_array: line %d: expected comma or end symbol ('%c')\n",
 					pst->nline, endsym);
-			return -1;
+			goto err;
 		}
-		if(pst->token[0] == endsym) {
+		if(pst->tok[0] == endsym) {
 			break;	/* we're done */
 		}
 	}
 
-	if(!nval) {
-		return -1;
+	if(!nval || set_value_arr(pst, tsv, nval, values, values != stackbuf) == -1) {
+		goto err;
 	}
+	return 0;
 
-	res = ts_set_value_arr(tsv, nval, values);
-
+err:
 	for(i=0; i<nval; i++) {
-		ts_destroy_value(values + i);
+		del_value(pst, values + i);
 	}
-	return res;
+	if(values != stackbuf) {
+		free(values);
+	}
+	return -1;
 }
 
-static int nextchar(struct parser *pst)
+/* refill the input buffer from io, keeping the part of the current token which
+ * has been read so far (if any), and growing the buffer if it doesn't fit.
+ */
+static int refill(struct parser *pst)
 {
-	char c;
+	long keep, sz;
+	char *tmp;
 
-	if(pst->nextc >= 0) {
-		c = pst->nextc;
-		pst->nextc = -1;
-	} else {
-		if(pst->io->read(&c, 1, pst->io->data) < 1) {
+	if(!pst->io) return -1;
+
+	keep = pst->tok ? pst->end - pst->tok : 0;
+	if(keep >= pst->bufsz) {
+		if(!(tmp = realloc(pst->buf, pst->bufsz * 2 + 1))) {
+			perror("failed to resize input buffer");
 			return -1;
 		}
+		pst->buf = tmp;
+		pst->bufsz *= 2;
+	} else if(keep > 0) {
+		memmove(pst->buf, pst->tok, keep);
+	}
+	if(pst->tok) {
+		pst->tok = pst->buf;
+	}
+	pst->ptr = pst->end = pst->buf + keep;
+
+	if((sz = pst->io->read(pst->ptr, pst->bufsz - keep, pst->io->data)) <= 0) {
+		return -1;
 	}
-	return c;
+	pst->end += sz;
+	return 0;
 }
 
-static void ungetchar(char c, struct parser *pst)
+static int nextchar(struct parser *pst)
 {
-	assert(pst->nextc == -1);
-	pst->nextc = c;
+	if(pst->ptr >= pst->end && refill(pst) == -1) {
+		return -1;
+	}
+	return (unsigned char)*pst->ptr++;
+}
+
+/* always called right after nextchar, so the character is still in the buffer */
+static void ungetchar(struct parser *pst)
+{
+	pst->ptr--;
 }
 
 static int next_token(struct parser *pst)
 {
 	int c;
 
-	DYNARR_CLEAR(pst->token);
+	if(pst->savep) {
+		*pst->savep = pst->savec;
+		pst->savep = 0;
+	}
+	pst->tok = 0;
+	pst->toklen = 0;
 
 	/* skip whitespace */
 	while((c = nextchar(pst)) != -1) {
@@ -252,42 +378,245 @@ static int next_token(struct parser *pst)
 	}
 	if(c == -1) return -1;
 
-	DYNARR_STRPUSH(pst->token, c);
+	pst->tok = pst->ptr - 1;
 
 	if(isdigit(c) || c == '-' || c == '+') {
-		/* token is a number */
-		int found_dot = 0;
-		while((c = nextchar(pst)) != -1 &&
-				(isdigit(c) || (c == '.' && !found_dot))) {
-			DYNARR_STRPUSH(pst->token, c);
-			if(c == '.') found_dot = 1;
+		/* token is a number, with an optional exponent */
+		int found_dot = 0, found_exp = 0, prev = c;
+		while((c = nextchar(pst)) != -1) {
+			if(isdigit(c)) {
+			} else if(c == '.' && !found_dot && !found_exp) {
+				found_dot = 1;
+			} else if((c == 'e' || c == 'E') && !found_exp) {
+				found_exp = 1;
+			} else if((c == '-' || c == '+') && (prev == 'e' || prev == 'E')) {
+			} else {
+				break;
+			}
+			prev = c;
 		}
-		if(c != -1) ungetchar(c, pst);
+		if(c != -1) ungetchar(pst);
+		pst->toklen = pst->ptr - pst->tok;
 		return TOK_NUM;
 	}
 	if(isalpha(c)) {
 		/* token is an identifier */
-		while((c = nextchar(pst)) != -1 && (isalnum(c) || c == '_')) {
-			DYNARR_STRPUSH(pst->token, c);
-		}
-		if(c != -1) ungetchar(c, pst);
+		while((c = nextchar(pst)) != -1 && (isalnum(c) || c == '_'));
+		if(c != -1) ungetchar(pst);
+		pst->toklen = pst->ptr - pst->tok;
 		return TOK_ID;
 	}
 	if(c == '"') {
-		/* token is a string constant, remove the opening quote */
-		DYNARR_STRPOP(pst->token);
+		/* token is a string constant, skip the opening quote */
+		pst->tok = pst->ptr;
 		while((c = nextchar(pst)) != -1 && c != '"') {
-			DYNARR_STRPUSH(pst->token, c);
 			if(c == '\n') ++pst->nline;
 		}
 		if(c != '"') {
 			return -1;
 		}
+		pst->toklen = pst->ptr - 1 - pst->tok;
 		return TOK_STR;
 	}
+	pst->toklen = 1;
 	return TOK_SYM;
 }
 
+/* returns the current token as a zero-terminated string, valid until the next
+ * call to next_token.
+ */
+static char *tokstr(struct parser *pst)
+{
+	char *tmp;
+
+	if(pst->io) {
+		if(pst->savep != pst->tok + pst->toklen) {
+			pst->savep = pst->tok + pst->toklen;
+			pst->savec = *pst->savep;
+			*pst->savep = 0;
+		}
+		return pst->tok;
+	}
+
+	if(!(tmp = ts_dynarr_resize(pst->token, pst->toklen + 1))) {
+		perror("failed to resize token string");
+		return 0;
+	}
+	pst->token = tmp;
+	memcpy(pst->token, pst->tok, pst->toklen);
+	pst->token[pst->toklen] = 0;
+	return pst->token;
+}
+
+static char *tokdup(struct parser *pst)
+{
+	char *str;
+
+	if(pst->arena) {
+		str = ts_arena_alloc(pst->arena, pst->toklen + 1);
+	} else {
+		str = malloc(pst->toklen + 1);
+	}
+	if(!str) {
+		return 0;
+	}
+	memcpy(str, pst->tok, pst->toklen);
+	str[pst->toklen] = 0;
+	return str;
+}
+
+/* The following allocate and set up tree nodes, attributes and values, either
+ * on the heap through the regular treestore functions, or in the arena if we
+ * have one. Arena allocations are never freed individually.
+ */
+static struct ts_node *new_node(struct parser *pst)
+{
+	struct ts_node *node;
+
+	if(!pst->arena) {
+		return ts_alloc_node();
+	}
+	if(!(node = ts_arena_alloc(pst->arena, sizeof *node))) {
+		return 0;
+	}
+	ts_init_node(node);
+	return node;
+}
+
+static struct ts_attr *new_attr(struct parser *pst)
+{
+	struct ts_attr *attr;
+
+	if(!pst->arena) {
+		return ts_alloc_attr();
+	}
+	if(!(attr = ts_arena_alloc(pst->arena, sizeof *attr))) {
+		return 0;
+	}
+	ts_init_attr(attr);
+	return attr;
+}
+
+static void del_node(struct parser *pst, struct ts_node *node)
+{
+	if(!pst->arena) {
+		ts_free_tree(node);
+	}
+}
+
+static void del_attr(struct parser *pst, struct ts_attr *attr)
+{
+	if(!pst->arena) {
+		ts_free_attr(attr);
+	}
+}
+
+static void del_value(struct parser *pst, struct ts_value *val)
+{
+	if(!pst->arena) {
+		ts_destroy_value(val);
+	}
+}
+
+/* sets a string value from the current token */
+static int set_value_tok(struct parser *pst, struct ts_value *val)
+{
+	if(!pst->arena) {
+		return ts_set_value_str(val, tokstr(pst));
+	}
+	val->type = TS_STRING;
+	if(!(val->str = tokdup(pst))) {
+		return -1;
+	}
+	val->str_len = pst->toklen;
+	return 0;
+}
+
+static int set_value_num(struct parser *pst, struct ts_value *val, float num)
+{
+	char buf[64];
+
+	if(!pst->arena) {
+		return ts_set_valuef(val, num);
+	}
+	/* same as ts_set_valuef: numbers also have a string representation */
+	ts_format_num(buf, num);
+	if(!(val->str = ts_arena_strdup(pst->arena, buf))) {
+		return -1;
+	}
+	val->str_len = strlen(val->str);
+	val->type = TS_NUMBER;
+	val->fnum = num;
+	val->inum = (int)num;
+	return 0;
+}
+
+/* the array value takes over the elements in arr, which must not be destroyed
+ * afterwards if this succeeds. If heaparr is set, arr itself was allocated
+ * with malloc, and is also taken over, or freed.
+ */
+static int set_value_arr(struct parser *pst, struct ts_value *val, int count,
+		struct ts_value *arr, int heaparr)
+{
+	int i, allnum = 1;
+	size_t arrsz = count * sizeof *arr;
+	struct ts_value *tmp;
+
+	if(count <= 1) {
+		/* a single value in brackets is just that value */
+		if(count < 1) return -1;
+		*val = *arr;
+		if(heaparr) free(arr);
+		return 0;
+	}
+
+	for(i=0; i<count; i++) {
+		if(arr[i].type != TS_NUMBER) {
+			allnum = 0;
+			break;
+		}
+	}
+
+	if(allnum) {
+		if(pst->arena) {
+			val->vec = ts_arena_alloc(pst->arena, count * sizeof *val->vec);
+		} else {
+			val->vec = malloc(count * sizeof *val->vec);
+		}
+		if(!val->vec) {
+			return -1;
+		}
+		for(i=0; i<count; i++) {
+			val->vec[i] = arr[i].fnum;
+		}
+		val->vec_size = count;
+	}
+
+	if(pst->arena) {
+		if(!(val->array = ts_arena_alloc(pst->arena, arrsz))) {
+			return -1;
+		}
+		memcpy(val->array, arr, arrsz);
+		if(heaparr) free(arr);
+	} else if(heaparr) {
+		/* shrink to fit, or keep it as it is if that fails */
+		val->array = arr;
+		if((tmp = realloc(arr, arrsz))) {
+			val->array = tmp;
+		}
+	} else {
+		if(!(val->array = malloc(arrsz))) {
+			free(val->vec);
+			val->vec = 0;
+			return -1;
+		}
+		memcpy(val->array, arr, arrsz);
+	}
+	val->array_size = count;
+	val->type = allnum ? TS_VECTOR : TS_ARRAY;
+	return 0;
+}
+
 int ts_text_save(struct ts_node *tree, struct ts_io *io)
 {
 	char *buf;
@@ -400,12 +729,20 @@ end:
 	return res;
 }
 
-static char *append_dynstr(char *dest, char *s)
+/* dest is a zero-terminated dynarr string */
+static char *append_dynstr(char *dest, const char *s)
 {
-	while(*s) {
-		DYNARR_STRPUSH(dest, *s++);
+	int len = strlen(s);
+	int cur = ts_dynarr_size(dest);
+	char *tmp;
+
+	if(cur > 0) cur--;	/* overwrite the terminator */
+
+	if(!(tmp = ts_dynarr_resize(dest, cur + len + 1))) {
+		return dest;
 	}
-	return dest;
+	memcpy(tmp + cur, s, len + 1);
+	return tmp;
 }
 
 static char *value_to_str(struct ts_value *value)
@@ -420,7 +757,7 @@ static char *value_to_str(struct ts_value *value)
 
 	switch(value->type) {
 	case TS_NUMBER:
-		sprintf(buf, "%f", value->fnum);
+		ts_format_num(buf, value->fnum);
 		str = append_dynstr(str, buf);
 		break;
 
@@ -428,9 +765,11 @@ static char *value_to_str(struct ts_value *value)
 		DYNARR_STRPUSH(str, '[');
 		for(i=0; i<value->vec_size; i++) {
 			if(i == 0) {
-				sprintf(buf, "%f", value->vec[i]);
+				ts_format_num(buf, value->vec[i]);
 			} else {
-				sprintf(buf, ", %f", value->vec[i]);
+				buf[0] = ',';
+				buf[1] = ' ';
+				ts_format_num(buf + 2, value->vec[i]);
 			}
 			str = append_dynstr(str, buf);
 		}
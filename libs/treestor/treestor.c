@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <assert.h>
 #include "treestor.h"
@@ -11,7 +12,8 @@
 #include <alloca.h>
 #endif
 
-struct ts_node *ts_text_load(struct ts_io *io);
+struct ts_node *ts_text_load(struct ts_io *io, struct ts_arena *arena);
+struct ts_node *ts_text_load_mem(const void *buf, long size, struct ts_arena *arena);
 int ts_text_save(struct ts_node *tree, struct ts_io *io);
 
 static long io_read(void *buf, size_t bytes, void *uptr);
@@ -117,7 +119,17 @@ fail:
 	}
 
 MAKE_NUMSTR_FUNC(int, "%d")
-MAKE_NUMSTR_FUNC(float, "%g")
+
+static char *make_floatstr(float x)
+{
+	char buf[TS_NUMSTR_MAX];
+	char *str;
+	int sz = ts_format_num(buf, x);
+
+	if(!(str = malloc(sz + 1))) return 0;
+	memcpy(str, buf, sz + 1);
+	return str;
+}
 
 
 struct val_list_node {
@@ -137,10 +149,11 @@ int ts_set_value_str(struct ts_value *tsv, const char *str)
 	}
 
 	tsv->type = TS_STRING;
-	if(!(tsv->str = malloc(strlen(str) + 1))) {
+	tsv->str_len = strlen(str);
+	if(!(tsv->str = malloc(tsv->str_len + 1))) {
 		return -1;
 	}
-	strcpy(tsv->str, str);
+	memcpy(tsv->str, str, tsv->str_len + 1);
 
 #if 0
 	/* try to parse the string and see if it fits any of the value types */
@@ -202,6 +215,7 @@ int ts_set_valuei_arr(struct ts_value *tsv, int count, const int *arr)
 		if(!(tsv->str = make_intstr(*arr))) {
 			return -1;
 		}
+		tsv->str_len = strlen(tsv->str);
 
 		tsv->type = TS_NUMBER;
 		tsv->fnum = (float)*arr;
@@ -277,6 +291,7 @@ int ts_set_valuef_arr(struct ts_value *tsv, int count, const float *arr)
 		if(!(tsv->str = make_floatstr(*arr))) {
 			return -1;
 		}
+		tsv->str_len = strlen(tsv->str);
 
 		tsv->type = TS_NUMBER;
 		tsv->fnum = *arr;
@@ -689,7 +704,119 @@ struct ts_node *ts_load_file(FILE *fp)
 
 struct ts_node *ts_load_io(struct ts_io *io)
 {
-	return ts_text_load(io);
+	return ts_text_load(io, 0);
+}
+
+struct ts_node *ts_load_mem(const void *buf, long size)
+{
+	return ts_text_load_mem(buf, size, 0);
+}
+
+struct ts_node *ts_load_io_arena(struct ts_io *io, struct ts_arena *arena)
+{
+	return ts_text_load(io, arena);
+}
+
+struct ts_node *ts_load_mem_arena(const void *buf, long size, struct ts_arena *arena)
+{
+	return ts_text_load_mem(buf, size, arena);
+}
+
+
+/* ---- ts_arena implementation ---- */
+
+#define ARENA_BLOCK_SIZE	65536
+
+/* allocations are aligned to the size of this union */
+union arena_align {
+	double d;
+	long l;
+	void *p;
+};
+#define ARENA_ALIGN		(sizeof(union arena_align))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	union arena_align data[1];
+};
+
+struct ts_arena {
+	struct arena_block *blocks;
+};
+
+struct ts_arena *ts_alloc_arena(void)
+{
+	struct ts_arena *arena = malloc(sizeof *arena);
+	if(!arena) return 0;
+	arena->blocks = 0;
+	return arena;
+}
+
+void ts_free_arena(struct ts_arena *arena)
+{
+	if(!arena) return;
+
+	while(arena->blocks) {
+		struct arena_block *blk = arena->blocks;
+		arena->blocks = blk->next;
+		free(blk);
+	}
+	free(arena);
+}
+
+static struct arena_block *alloc_block(size_t size)
+{
+	struct arena_block *blk = malloc(offsetof(struct arena_block, data) + size);
+	if(!blk) return 0;
+	blk->size = size;
+	blk->used = 0;
+	return blk;
+}
+
+void *ts_arena_alloc(struct ts_arena *arena, size_t size)
+{
+	struct arena_block *blk = arena->blocks;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if(!blk || blk->used + size > blk->size) {
+		if(size > ARENA_BLOCK_SIZE / 4) {
+			/* large allocations get a block of their own, which goes after the
+			 * current one, to avoid wasting the rest of it
+			 */
+			if(!(blk = alloc_block(size))) {
+				return 0;
+			}
+			if(arena->blocks) {
+				blk->next = arena->blocks->next;
+				arena->blocks->next = blk;
+			} else {
+				blk->next = 0;
+				arena->blocks = blk;
+			}
+		} else {
+			if(!(blk = alloc_block(ARENA_BLOCK_SIZE))) {
+				return 0;
+			}
+			blk->next = arena->blocks;
+			arena->blocks = blk;
+		}
+	}
+
+	ptr = (char*)blk->data + blk->used;
+	blk->used += size;
+	return ptr;
+}
+
+char *ts_arena_strdup(struct ts_arena *arena, const char *s)
+{
+	size_t len = strlen(s);
+	char *str = ts_arena_alloc(arena, len + 1);
+	if(!str) return 0;
+	memcpy(str, s, len + 1);
+	return str;
 }
 
 int ts_save(struct ts_node *tree, const char *fname)
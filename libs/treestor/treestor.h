@@ -27,6 +27,7 @@ struct ts_value {
 	enum ts_value_type type;
 
 	char *str;		/**< string values will have this set */
+	long str_len;	/**< length of str, without the terminator */
 	int inum;		/**< numeric values will have this set */
 	float fnum;		/**< numeric values will have this set */
 
@@ -146,6 +147,37 @@ int ts_save_file(struct ts_node *tree, FILE *fp);
 struct ts_node *ts_load_io(struct ts_io *io);
 int ts_save_io(struct ts_node *tree, struct ts_io *io);
 
+/* load by parsing directly from a memory block */
+struct ts_node *ts_load_mem(const void *buf, long size);
+
+
+/** bump allocator for parse trees. Trees loaded into an arena are allocated
+ * in large blocks, and released all at once by ts_free_arena. They must be
+ * treated as read-only: don't free them with ts_free_tree, don't change them
+ * with any of the ts_set_* or ts_add_* functions.
+ */
+struct ts_arena;
+
+struct ts_arena *ts_alloc_arena(void);
+void ts_free_arena(struct ts_arena *arena);	/**< frees all trees loaded into it */
+
+void *ts_arena_alloc(struct ts_arena *arena, size_t size);
+char *ts_arena_strdup(struct ts_arena *arena, const char *s);
+
+struct ts_node *ts_load_io_arena(struct ts_io *io, struct ts_arena *arena);
+struct ts_node *ts_load_mem_arena(const void *buf, long size, struct ts_arena *arena);
+
+
+/** locale-independent number conversions.
+ * ts_format_num writes the shortest string which reads back as exactly the
+ * same float, to a buffer of at least TS_NUMSTR_MAX bytes, and returns its
+ * length. ts_parse_num parses a number with an optional exponent, up to end
+ * (or the terminating zero if end is null), and sets endp past its end.
+ */
+#define TS_NUMSTR_MAX	32
+int ts_format_num(char *buf, float x);
+double ts_parse_num(const char *str, const char *end, const char **endp);
+
 
 struct ts_attr *ts_lookup(struct ts_node *root, const char *path);
 const char *ts_lookup_str(struct ts_node *root, const char *path,
@@ -16,6 +16,7 @@ You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <float.h>
+#include <math.h>
 #include "aabox.h"
 
 void g3dimpl_aabox_init(struct aabox *box)
@@ -54,3 +55,32 @@ void g3dimpl_aabox_union(struct aabox *res, const struct aabox *a, const struct
 	res->bmax.y = MAX(a->bmax.y, b->bmax.y);
 	res->bmax.z = MAX(a->bmax.z, b->bmax.z);
 }
+
+/* transforming the center, and projecting the half-extents onto each axis
+ * through the absolute values of the matrix, gives the same box as
+ * transforming all 8 corners.
+ */
+void g3dimpl_aabox_xform(struct aabox *res, const struct aabox *box, const float *xform)
+{
+	int i;
+	float c[3], e[3], nc, ne;
+
+	if(box->bmin.x > box->bmax.x) {
+		g3dimpl_aabox_init(res);
+		return;
+	}
+
+	c[0] = (box->bmin.x + box->bmax.x) * 0.5f;
+	c[1] = (box->bmin.y + box->bmax.y) * 0.5f;
+	c[2] = (box->bmin.z + box->bmax.z) * 0.5f;
+	e[0] = box->bmax.x - c[0];
+	e[1] = box->bmax.y - c[1];
+	e[2] = box->bmax.z - c[2];
+
+	for(i=0; i<3; i++) {
+		nc = c[0] * xform[i] + c[1] * xform[i + 4] + c[2] * xform[i + 8] + xform[i + 12];
+		ne = e[0] * fabs(xform[i]) + e[1] * fabs(xform[i + 4]) + e[2] * fabs(xform[i + 8]);
+		(&res->bmin.x)[i] = nc - ne;
+		(&res->bmax.x)[i] = nc + ne;
+	}
+}
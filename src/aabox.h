@@ -33,4 +33,7 @@ int g3dimpl_aabox_equal(const struct aabox *a, const struct aabox *b);
 void g3dimpl_aabox_union(struct aabox *res, const struct aabox *a,
 		const struct aabox *b);
 
+/* bounds of box transformed by the 4x4 matrix xform. res may be box */
+void g3dimpl_aabox_xform(struct aabox *res, const struct aabox *box, const float *xform);
+
 #endif	/* AABOX_H_ */
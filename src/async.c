@@ -0,0 +1,253 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "goat3d.h"
+#include "g3dscn.h"
+#include "log.h"
+#include "thread.h"
+
+/* Asynchronous loading runs the regular loaders on a background thread,
+ * through an io wrapper which keeps track of the input position, and fails
+ * any further reads once cancellation is requested. The loaders themselves
+ * report created objects through the scene's loader pointer (see add_named in
+ * goat3d.c), and check for cancellation between objects.
+ *
+ * The scene's loader pointer is only written by the caller: it's set before
+ * the thread is created, and cleared by goat3d_load_poll or goat3d_load_wait
+ * once the thread is done with the scene.
+ */
+struct goat3d_loader {
+	struct goat3d *g;
+	struct goat3d_io io, wrapio;
+	FILE *fp;
+	char *basename;
+	long pos;
+
+	g3dimpl_thread thr;
+	int joined;
+
+	/* everything below is protected by lock */
+	g3dimpl_mutex lock;
+	struct goat3d_load_progress prog;
+	int status;
+	int cancel;
+};
+
+static void detach(struct goat3d_loader *ldr);
+static void load_thread(void *arg);
+static long ldr_read(void *buf, size_t bytes, void *uptr);
+static long ldr_write(const void *buf, size_t bytes, void *uptr);
+static long ldr_seek(long offs, int whence, void *uptr);
+
+struct goat3d_loader *g3dimpl_load_async(struct goat3d *g, struct goat3d_io *io,
+		FILE *fp, const char *basename)
+{
+	struct goat3d_loader *ldr;
+
+	if(g->loader) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_async: scene is already being loaded\n");
+		return 0;
+	}
+
+	if(!(ldr = calloc(1, sizeof *ldr))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_async: failed to allocate loader\n");
+		return 0;
+	}
+	if(basename && !(ldr->basename = malloc(strlen(basename) + 1))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_async: failed to allocate loader\n");
+		free(ldr);
+		return 0;
+	}
+	if(g3dimpl_mutex_init(&ldr->lock) == -1) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_async: failed to create mutex\n");
+		free(ldr->basename);
+		free(ldr);
+		return 0;
+	}
+	if(basename) {
+		strcpy(ldr->basename, basename);
+	}
+
+	ldr->g = g;
+	ldr->io = *io;
+	ldr->fp = fp;
+	ldr->status = GOAT3D_LOAD_RUNNING;
+
+	ldr->wrapio.cls = ldr;
+	ldr->wrapio.read = ldr_read;
+	ldr->wrapio.write = ldr_write;
+	ldr->wrapio.seek = ldr_seek;
+
+	/* find the input size if the stream is seekable */
+	ldr->prog.total = -1;
+	if(io->seek && (ldr->pos = io->seek(0, SEEK_CUR, io->cls)) >= 0) {
+		ldr->prog.total = io->seek(0, SEEK_END, io->cls);
+		io->seek(ldr->pos, SEEK_SET, io->cls);
+	} else {
+		ldr->pos = 0;
+	}
+
+	g->loader = ldr;
+	if(g3dimpl_thread_create(&ldr->thr, load_thread, ldr) == -1) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_async: failed to start loader thread\n");
+		g->loader = 0;
+		g3dimpl_mutex_destroy(&ldr->lock);
+		free(ldr->basename);
+		free(ldr);
+		return 0;
+	}
+	return ldr;
+}
+
+GOAT3DAPI int goat3d_load_poll(struct goat3d_loader *ldr, struct goat3d_load_progress *prog)
+{
+	int status;
+
+	g3dimpl_mutex_lock(&ldr->lock);
+	status = ldr->status;
+	if(prog) {
+		*prog = ldr->prog;
+	}
+	g3dimpl_mutex_unlock(&ldr->lock);
+
+	if(status != GOAT3D_LOAD_RUNNING) {
+		detach(ldr);
+	}
+	return status;
+}
+
+GOAT3DAPI int goat3d_load_wait(struct goat3d_loader *ldr)
+{
+	if(!ldr->joined) {
+		g3dimpl_thread_join(ldr->thr);
+		ldr->joined = 1;
+	}
+	detach(ldr);
+	return ldr->status == GOAT3D_LOAD_DONE ? 0 : -1;
+}
+
+GOAT3DAPI void goat3d_load_cancel(struct goat3d_loader *ldr)
+{
+	g3dimpl_mutex_lock(&ldr->lock);
+	ldr->cancel = 1;
+	g3dimpl_mutex_unlock(&ldr->lock);
+}
+
+GOAT3DAPI void goat3d_load_free(struct goat3d_loader *ldr)
+{
+	if(!ldr) return;
+
+	goat3d_load_wait(ldr);
+	g3dimpl_mutex_destroy(&ldr->lock);
+	free(ldr->basename);
+	free(ldr);
+}
+
+void g3dimpl_load_addobj(struct goat3d_loader *ldr)
+{
+	g3dimpl_mutex_lock(&ldr->lock);
+	ldr->prog.objects++;
+	g3dimpl_mutex_unlock(&ldr->lock);
+}
+
+int g3dimpl_load_cancelled(struct goat3d *g)
+{
+	int res;
+
+	if(!g->loader) return 0;
+
+	g3dimpl_mutex_lock(&g->loader->lock);
+	res = g->loader->cancel;
+	g3dimpl_mutex_unlock(&g->loader->lock);
+	return res;
+}
+
+/* called by the caller once the loader thread has finished with the scene. A
+ * new load might have been started on the scene since.
+ */
+static void detach(struct goat3d_loader *ldr)
+{
+	if(ldr->g->loader == ldr) {
+		ldr->g->loader = 0;
+	}
+}
+
+static void load_thread(void *arg)
+{
+	int res, status;
+	struct goat3d_loader *ldr = arg;
+	struct goat3d *g = ldr->g;
+
+	res = goat3d_load_io(g, &ldr->wrapio);
+
+	if(res == 0 && ldr->basename && !g->name) {
+		goat3d_set_name(g, ldr->basename);
+	}
+	if(ldr->fp) {
+		fclose(ldr->fp);
+		ldr->fp = 0;
+	}
+
+	g3dimpl_mutex_lock(&ldr->lock);
+	if(res == 0) {
+		status = GOAT3D_LOAD_DONE;
+	} else {
+		status = ldr->cancel ? GOAT3D_LOAD_CANCELLED : GOAT3D_LOAD_FAILED;
+	}
+	ldr->status = status;
+	g3dimpl_mutex_unlock(&ldr->lock);
+}
+
+static long ldr_read(void *buf, size_t bytes, void *uptr)
+{
+	long res;
+	struct goat3d_loader *ldr = uptr;
+
+	if(g3dimpl_load_cancelled(ldr->g)) {
+		return -1;
+	}
+
+	if((res = ldr->io.read(buf, bytes, ldr->io.cls)) > 0) {
+		ldr->pos += res;
+
+		g3dimpl_mutex_lock(&ldr->lock);
+		if(ldr->pos > ldr->prog.bytes) {
+			ldr->prog.bytes = ldr->pos;
+		}
+		g3dimpl_mutex_unlock(&ldr->lock);
+	}
+	return res;
+}
+
+static long ldr_write(const void *buf, size_t bytes, void *uptr)
+{
+	struct goat3d_loader *ldr = uptr;
+	return ldr->io.write(buf, bytes, ldr->io.cls);
+}
+
+static long ldr_seek(long offs, int whence, void *uptr)
+{
+	long res;
+	struct goat3d_loader *ldr = uptr;
+
+	if((res = ldr->io.seek(offs, whence, ldr->io.cls)) >= 0) {
+		ldr->pos = res;
+	}
+	return res;
+}
@@ -0,0 +1,1268 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <float.h>
+#include "g3dscn.h"
+#include "bvh.h"
+#include "log.h"
+#include "dynarr.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BVH_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#define NUM_BINS		16
+/* past this depth, split at the median to keep the tree from degenerating */
+#define MAX_SAH_DEPTH	48
+/* traversal stack size which doesn't need allocating */
+#define STACK_SIZE		64
+
+struct builder {
+	struct bvh *bvh;
+	const struct aabox *boxes;
+	cgm_vec3 *cent;
+	int max_leaf;
+};
+
+struct stack_entry {
+	int node;
+	float t;				/* (nearest) ray entry distance */
+	unsigned int mask;		/* active packet rays, or frustum planes still to be tested */
+};
+
+/* packet rays, laid out one array per component, to test all of them against
+ * a box or triangle at once. Unused lanes are copies of the first ray, and are
+ * masked out of the results.
+ */
+struct packet {
+	float org[3][BVH_PACKET_SIZE];
+	float dir[3][BVH_PACKET_SIZE];
+	float inv[3][BVH_PACKET_SIZE];
+	int num;
+};
+
+typedef unsigned int (*packet_box_func)(const struct aabox *box, const struct packet *pk,
+		const float *tmax, unsigned int active, float *tret);
+
+static void build_node(struct builder *b, int nidx, int start, int end, int depth);
+static int split_sah(struct builder *b, struct bvh_node *node, int start, int end, int axis,
+		const struct aabox *cbox);
+static void split_median(struct builder *b, int start, int end, int axis);
+static float surf_area(const struct aabox *box);
+static int ray_box(const struct aabox *box, const float *org, const float *inv, float tmax, float *tret);
+static void init_packet(struct packet *pk, const cgm_ray *rays, int nrays);
+static unsigned int packet_box(const struct aabox *box, const struct packet *pk, const float *tmax,
+		unsigned int active, float *tret);
+static packet_box_func get_packet_box_simd(void);
+
+
+int g3dimpl_bvh_build(struct bvh *bvh, const struct aabox *boxes, int count, int max_leaf)
+{
+	int i;
+	struct builder b;
+
+	bvh->nodes = 0;
+	bvh->num_nodes = 0;
+	bvh->items = 0;
+	bvh->num_items = count;
+	bvh->depth = 0;
+
+	if(!count) return 0;
+
+	if(!(bvh->nodes = malloc((2 * count - 1) * sizeof *bvh->nodes)) ||
+			!(bvh->items = malloc(count * sizeof *bvh->items)) ||
+			!(b.cent = malloc(count * sizeof *b.cent))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_bvh_build: failed to allocate %d nodes\n", 2 * count - 1);
+		free(bvh->nodes);
+		free(bvh->items);
+		bvh->nodes = 0;
+		bvh->items = 0;
+		return -1;
+	}
+
+	for(i=0; i<count; i++) {
+		bvh->items[i] = i;
+		b.cent[i].x = (boxes[i].bmin.x + boxes[i].bmax.x) * 0.5f;
+		b.cent[i].y = (boxes[i].bmin.y + boxes[i].bmax.y) * 0.5f;
+		b.cent[i].z = (boxes[i].bmin.z + boxes[i].bmax.z) * 0.5f;
+	}
+
+	b.bvh = bvh;
+	b.boxes = boxes;
+	b.max_leaf = max_leaf < 1 ? 1 : max_leaf;
+
+	bvh->num_nodes = 1;
+	build_node(&b, 0, 0, count, 0);
+
+	free(b.cent);
+	return 0;
+}
+
+void g3dimpl_bvh_destroy(struct bvh *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->items);
+	bvh->nodes = 0;
+	bvh->items = 0;
+	bvh->num_nodes = bvh->num_items = 0;
+}
+
+int g3dimpl_bvh_validate(struct bvh *bvh)
+{
+	int i, res = -1, *depth, *parents;
+	struct bvh_node *node;
+
+	bvh->depth = 0;
+	if(!bvh->num_items) {
+		return bvh->num_nodes ? -1 : 0;
+	}
+	if(bvh->num_nodes < 1 || bvh->num_nodes > 2 * bvh->num_items - 1) {
+		return -1;
+	}
+	for(i=0; i<bvh->num_items; i++) {
+		if(bvh->items[i] < 0 || bvh->items[i] >= bvh->num_items) {
+			return -1;
+		}
+	}
+
+	depth = calloc(bvh->num_nodes, sizeof *depth);
+	parents = calloc(bvh->num_nodes, sizeof *parents);
+	if(!depth || !parents) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_bvh_validate: failed to allocate depth array\n");
+		goto end;
+	}
+
+	/* children must come after their parents, which rules out cycles, and
+	 * every node except the root must have exactly one parent, which rules
+	 * out shared subtrees and unreachable nodes. Parents are then always
+	 * visited before their children, so the depths come out right.
+	 */
+	for(i=0; i<bvh->num_nodes; i++) {
+		node = bvh->nodes + i;
+		if(node->count) {
+			if(node->count < 0 || node->first < 0 || node->first > bvh->num_items - node->count) {
+				goto end;
+			}
+		} else {
+			if(node->first <= i || node->first >= bvh->num_nodes - 1) {
+				goto end;
+			}
+			if(parents[node->first]++ || parents[node->first + 1]++) {
+				goto end;
+			}
+			depth[node->first] = depth[node->first + 1] = depth[i] + 1;
+		}
+		if(depth[i] > bvh->depth) {
+			bvh->depth = depth[i];
+		}
+	}
+	for(i=1; i<bvh->num_nodes; i++) {
+		if(!parents[i]) goto end;
+	}
+	res = 0;
+
+end:
+	free(depth);
+	free(parents);
+	return res;
+}
+
+void g3dimpl_bvh_refit(struct bvh *bvh, const struct aabox *boxes)
+{
+	int i, j;
+	struct bvh_node *node;
+
+	/* children always come after their parents */
+	for(i=bvh->num_nodes - 1; i>=0; i--) {
+		node = bvh->nodes + i;
+		if(node->count) {
+			node->box = boxes[bvh->items[node->first]];
+			for(j=1; j<node->count; j++) {
+				g3dimpl_aabox_union(&node->box, &node->box, boxes + bvh->items[node->first + j]);
+			}
+		} else {
+			g3dimpl_aabox_union(&node->box, &bvh->nodes[node->first].box,
+					&bvh->nodes[node->first + 1].box);
+		}
+	}
+}
+
+int g3dimpl_bvh_ray(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_ray_func func, void *cls)
+{
+	int i, sp = 0, hitl, hitr;
+	float org[3], inv[3], t, tl, tr;
+	struct stack_entry stackbuf[STACK_SIZE], *stack = stackbuf;
+	struct bvh_node *node, *left, *right;
+
+	if(!bvh->num_nodes) return 0;
+
+	org[0] = ray->origin.x;
+	org[1] = ray->origin.y;
+	org[2] = ray->origin.z;
+	inv[0] = 1.0f / ray->dir.x;
+	inv[1] = 1.0f / ray->dir.y;
+	inv[2] = 1.0f / ray->dir.z;
+
+	if(!ray_box(&bvh->nodes[0].box, org, inv, tmax, &t)) {
+		return 0;
+	}
+	if(bvh->depth + 2 > STACK_SIZE && !(stack = malloc((bvh->depth + 2) * sizeof *stack))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_bvh_ray: failed to allocate traversal stack\n");
+		return -1;
+	}
+
+	stack[sp].node = 0;
+	stack[sp++].t = t;
+
+	while(sp > 0) {
+		sp--;
+		if(stack[sp].t > tmax) continue;
+		node = bvh->nodes + stack[sp].node;
+
+		if(node->count) {
+			for(i=0; i<node->count; i++) {
+				tmax = func(bvh->items[node->first + i], tmax, cls);
+			}
+			continue;
+		}
+
+		left = bvh->nodes + node->first;
+		right = left + 1;
+		hitl = ray_box(&left->box, org, inv, tmax, &tl);
+		hitr = ray_box(&right->box, org, inv, tmax, &tr);
+
+		/* push the far child first, to visit the near one first */
+		if(hitl && hitr && tl < tr) {
+			stack[sp].node = node->first + 1;
+			stack[sp++].t = tr;
+			hitr = 0;
+		}
+		if(hitl) {
+			stack[sp].node = node->first;
+			stack[sp++].t = tl;
+		}
+		if(hitr) {
+			stack[sp].node = node->first + 1;
+			stack[sp++].t = tr;
+		}
+	}
+
+	if(stack != stackbuf) {
+		free(stack);
+	}
+	return 0;
+}
+
+int g3dimpl_bvh_packet(const struct bvh *bvh, const cgm_ray *rays, int nrays, float *tmax,
+		bvh_packet_func func, void *cls)
+{
+	int i, sp = 0;
+	unsigned int mask, maskl, maskr;
+	float t, tl, tr, tm[BVH_PACKET_SIZE];
+	struct stack_entry stackbuf[STACK_SIZE], *stack = stackbuf;
+	struct bvh_node *node;
+	struct packet pk;
+	packet_box_func boxtest;
+
+	if(!bvh->num_nodes || nrays <= 0) return 0;
+	if(nrays > BVH_PACKET_SIZE) nrays = BVH_PACKET_SIZE;
+
+	if(!(boxtest = get_packet_box_simd())) {
+		boxtest = packet_box;
+	}
+	init_packet(&pk, rays, nrays);
+
+	/* unused lanes get a negative tmax, so that they never hit anything */
+	for(i=0; i<BVH_PACKET_SIZE; i++) {
+		tm[i] = i < nrays ? tmax[i] : -1.0f;
+	}
+
+	if(!(mask = boxtest(&bvh->nodes[0].box, &pk, tm, (1u << nrays) - 1, &t))) {
+		return 0;
+	}
+	if(bvh->depth + 2 > STACK_SIZE && !(stack = malloc((bvh->depth + 2) * sizeof *stack))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_bvh_packet: failed to allocate traversal stack\n");
+		return -1;
+	}
+
+	stack[sp].node = 0;
+	stack[sp].t = t;
+	stack[sp++].mask = mask;
+
+	while(sp > 0) {
+		sp--;
+		node = bvh->nodes + stack[sp].node;
+		mask = stack[sp].mask;
+
+		/* drop the rays which found a hit nearer than the node since it was
+		 * pushed, and the whole node if that leaves none
+		 */
+		for(i=0; i<nrays; i++) {
+			if(stack[sp].t > tm[i]) {
+				mask &= ~(1u << i);
+			}
+		}
+		if(!mask) continue;
+
+		if(node->count) {
+			for(i=0; i<node->count; i++) {
+				func(bvh->items[node->first + i], mask, tm, cls);
+			}
+			continue;
+		}
+
+		maskl = boxtest(&bvh->nodes[node->first].box, &pk, tm, mask, &tl);
+		maskr = boxtest(&bvh->nodes[node->first + 1].box, &pk, tm, mask, &tr);
+
+		/* push the far child first, to visit the near one first */
+		if(maskl && maskr && tl < tr) {
+			stack[sp].node = node->first + 1;
+			stack[sp].t = tr;
+			stack[sp++].mask = maskr;
+			maskr = 0;
+		}
+		if(maskl) {
+			stack[sp].node = node->first;
+			stack[sp].t = tl;
+			stack[sp++].mask = maskl;
+		}
+		if(maskr) {
+			stack[sp].node = node->first + 1;
+			stack[sp].t = tr;
+			stack[sp++].mask = maskr;
+		}
+	}
+
+	for(i=0; i<nrays; i++) {
+		tmax[i] = tm[i];
+	}
+
+	if(stack != stackbuf) {
+		free(stack);
+	}
+	return 0;
+}
+
+int g3dimpl_bvh_cull(const struct bvh *bvh, const float *planes, int nplanes,
+		bvh_cull_func func, void *cls)
+{
+	int i, sp = 0, num = 0, outside;
+	unsigned int mask;
+	float px, py, pz, nx, ny, nz;
+	const float *p;
+	struct stack_entry stackbuf[STACK_SIZE], *stack = stackbuf;
+	struct bvh_node *node;
+	const struct aabox *box;
+
+	if(!bvh->num_nodes) return 0;
+	if(nplanes > 32) nplanes = 32;
+
+	if(bvh->depth + 2 > STACK_SIZE && !(stack = malloc((bvh->depth + 2) * sizeof *stack))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_bvh_cull: failed to allocate traversal stack\n");
+		return -1;
+	}
+
+	stack[sp].node = 0;
+	stack[sp++].mask = nplanes < 32 ? (1u << nplanes) - 1 : 0xffffffff;
+
+	while(sp > 0) {
+		sp--;
+		node = bvh->nodes + stack[sp].node;
+		mask = stack[sp].mask;
+		box = &node->box;
+
+		if(box->bmin.x > box->bmax.x) continue;
+
+		/* test against the planes the parent wasn't entirely inside of */
+		outside = 0;
+		for(i=0; i<nplanes; i++) {
+			if(!(mask & (1u << i))) continue;
+			p = planes + i * 4;
+
+			/* corners farthest along and against the plane normal */
+			px = p[0] >= 0.0f ? box->bmax.x : box->bmin.x;
+			py = p[1] >= 0.0f ? box->bmax.y : box->bmin.y;
+			pz = p[2] >= 0.0f ? box->bmax.z : box->bmin.z;
+			if(p[0] * px + p[1] * py + p[2] * pz + p[3] < 0.0f) {
+				outside = 1;
+				break;
+			}
+			nx = p[0] >= 0.0f ? box->bmin.x : box->bmax.x;
+			ny = p[1] >= 0.0f ? box->bmin.y : box->bmax.y;
+			nz = p[2] >= 0.0f ? box->bmin.z : box->bmax.z;
+			if(p[0] * nx + p[1] * ny + p[2] * nz + p[3] >= 0.0f) {
+				mask &= ~(1u << i);
+			}
+		}
+		if(outside) continue;
+
+		if(node->count) {
+			for(i=0; i<node->count; i++) {
+				func(bvh->items[node->first + i], cls);
+			}
+			num += node->count;
+			continue;
+		}
+
+		stack[sp].node = node->first + 1;
+		stack[sp++].mask = mask;
+		stack[sp].node = node->first;
+		stack[sp++].mask = mask;
+	}
+
+	if(stack != stackbuf) {
+		free(stack);
+	}
+	return num;
+}
+
+static void build_node(struct builder *b, int nidx, int start, int end, int depth)
+{
+	int i, axis, mid, count = end - start;
+	struct bvh_node *node = b->bvh->nodes + nidx;
+	int *items = b->bvh->items;
+	struct aabox cbox;
+	cgm_vec3 *c, ext;
+
+	if(depth > b->bvh->depth) {
+		b->bvh->depth = depth;
+	}
+
+	node->box = b->boxes[items[start]];
+	g3dimpl_aabox_init(&cbox);
+	for(i=start; i<end; i++) {
+		if(i > start) {
+			g3dimpl_aabox_union(&node->box, &node->box, b->boxes + items[i]);
+		}
+		c = b->cent + items[i];
+		if(c->x < cbox.bmin.x) cbox.bmin.x = c->x;
+		if(c->y < cbox.bmin.y) cbox.bmin.y = c->y;
+		if(c->z < cbox.bmin.z) cbox.bmin.z = c->z;
+		if(c->x > cbox.bmax.x) cbox.bmax.x = c->x;
+		if(c->y > cbox.bmax.y) cbox.bmax.y = c->y;
+		if(c->z > cbox.bmax.z) cbox.bmax.z = c->z;
+	}
+
+	if(count <= 1) {
+		goto leaf;
+	}
+
+	ext.x = cbox.bmax.x - cbox.bmin.x;
+	ext.y = cbox.bmax.y - cbox.bmin.y;
+	ext.z = cbox.bmax.z - cbox.bmin.z;
+	axis = ext.x >= ext.y ? (ext.x >= ext.z ? 0 : 2) : (ext.y >= ext.z ? 1 : 2);
+
+	if((&ext.x)[axis] <= 0.0f) {
+		/* all centroids coincide, nothing to sort out, split anywhere */
+		if(count <= b->max_leaf) goto leaf;
+		mid = start + count / 2;
+	} else if(depth >= MAX_SAH_DEPTH) {
+		split_median(b, start, end, axis);
+		mid = start + count / 2;
+	} else {
+		if((mid = split_sah(b, node, start, end, axis, &cbox)) == -1) {
+			goto leaf;
+		}
+	}
+
+	node->first = b->bvh->num_nodes;
+	node->count = 0;
+	b->bvh->num_nodes += 2;
+
+	build_node(b, node->first, start, mid, depth + 1);
+	build_node(b, node->first + 1, mid, end, depth + 1);
+	return;
+
+leaf:
+	node->first = start;
+	node->count = count;
+}
+
+#define BIN_INDEX(c) \
+	do { \
+		bin = (int)(((&(c)->x)[axis] - cmin) * scale); \
+		if(bin >= NUM_BINS) bin = NUM_BINS - 1; \
+	} while(0)
+
+/* partitions the items at the best binned SAH split plane along axis, and
+ * returns the start of the right half, or -1 if it's better to make a leaf
+ */
+static int split_sah(struct builder *b, struct bvh_node *node, int start, int end, int axis,
+		const struct aabox *cbox)
+{
+	int i, j, bin, best = -1, count = end - start, tmp;
+	int bincount[NUM_BINS], lcount[NUM_BINS];
+	struct aabox binbox[NUM_BINS], acc;
+	float larea[NUM_BINS], cost, best_cost, cmin, scale;
+	int *items = b->bvh->items;
+
+	cmin = (&cbox->bmin.x)[axis];
+	scale = NUM_BINS / ((&cbox->bmax.x)[axis] - cmin);
+
+	for(i=0; i<NUM_BINS; i++) {
+		bincount[i] = 0;
+		g3dimpl_aabox_init(binbox + i);
+	}
+	for(i=start; i<end; i++) {
+		BIN_INDEX(b->cent + items[i]);
+		bincount[bin]++;
+		g3dimpl_aabox_union(binbox + bin, binbox + bin, b->boxes + items[i]);
+	}
+
+	/* sweep from the left, then from the right evaluating the split cost
+	 * after each bin: traversal + intersection of each side relative to the
+	 * node's area, against the cost of intersecting all items in a leaf.
+	 */
+	g3dimpl_aabox_init(&acc);
+	j = 0;
+	for(i=0; i<NUM_BINS - 1; i++) {
+		g3dimpl_aabox_union(&acc, &acc, binbox + i);
+		j += bincount[i];
+		lcount[i] = j;
+		larea[i] = j ? surf_area(&acc) : 0.0f;
+	}
+
+	best_cost = FLT_MAX;
+	g3dimpl_aabox_init(&acc);
+	j = 0;
+	for(i=NUM_BINS - 1; i>0; i--) {
+		g3dimpl_aabox_union(&acc, &acc, binbox + i);
+		j += bincount[i];
+		if(!j || !lcount[i - 1]) continue;
+
+		cost = lcount[i - 1] * larea[i - 1] + j * surf_area(&acc);
+		if(cost < best_cost) {
+			best_cost = cost;
+			best = i - 1;
+		}
+	}
+
+	if(best == -1) {
+		/* can't happen with distinct centroids, but just in case */
+		if(count <= b->max_leaf) return -1;
+		split_median(b, start, end, axis);
+		return start + count / 2;
+	}
+
+	best_cost = 1.0f + best_cost / surf_area(&node->box);
+	if(count <= b->max_leaf && best_cost >= (float)count) {
+		return -1;
+	}
+
+	i = start;
+	j = end - 1;
+	while(i <= j) {
+		BIN_INDEX(b->cent + items[i]);
+		if(bin <= best) {
+			i++;
+		} else {
+			tmp = items[i];
+			items[i] = items[j];
+			items[j--] = tmp;
+		}
+	}
+	return i;
+}
+
+/* quickselect, placing the median centroid along axis at the middle, with
+ * smaller ones before it and larger after
+ */
+static void split_median(struct builder *b, int start, int end, int axis)
+{
+	int i, j, tmp, *items = b->bvh->items;
+	int lo = start, hi = end - 1, mid = start + (end - start) / 2;
+	float pivot;
+
+#define CENT(i)	(&b->cent[items[i]].x)[axis]
+	while(lo < hi) {
+		pivot = CENT(lo + (hi - lo) / 2);
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(CENT(i) < pivot) i++;
+			while(CENT(j) > pivot) j--;
+			if(i <= j) {
+				tmp = items[i];
+				items[i++] = items[j];
+				items[j--] = tmp;
+			}
+		}
+		if(mid <= j) {
+			hi = j;
+		} else if(mid >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+#undef CENT
+}
+
+static float surf_area(const struct aabox *box)
+{
+	float dx = box->bmax.x - box->bmin.x;
+	float dy = box->bmax.y - box->bmin.y;
+	float dz = box->bmax.z - box->bmin.z;
+	return dx * dy + dy * dz + dz * dx;
+}
+
+static int ray_box(const struct aabox *box, const float *org, const float *inv, float tmax, float *tret)
+{
+	int i;
+	float t0, t1, tmp, tnear = 0.0f, tfar = tmax;
+
+	if(box->bmin.x > box->bmax.x) {
+		return 0;
+	}
+
+	for(i=0; i<3; i++) {
+		t0 = ((&box->bmin.x)[i] - org[i]) * inv[i];
+		t1 = ((&box->bmax.x)[i] - org[i]) * inv[i];
+		if(t0 > t1) {
+			tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+		if(t0 > tnear) tnear = t0;
+		if(t1 < tfar) tfar = t1;
+		if(tnear > tfar) return 0;
+	}
+	*tret = tnear;
+	return 1;
+}
+
+static void init_packet(struct packet *pk, const cgm_ray *rays, int nrays)
+{
+	int i;
+	const cgm_ray *ray;
+
+	pk->num = nrays;
+	for(i=0; i<BVH_PACKET_SIZE; i++) {
+		ray = rays + (i < nrays ? i : 0);
+		pk->org[0][i] = ray->origin.x;
+		pk->org[1][i] = ray->origin.y;
+		pk->org[2][i] = ray->origin.z;
+		pk->dir[0][i] = ray->dir.x;
+		pk->dir[1][i] = ray->dir.y;
+		pk->dir[2][i] = ray->dir.z;
+		pk->inv[0][i] = 1.0f / ray->dir.x;
+		pk->inv[1][i] = 1.0f / ray->dir.y;
+		pk->inv[2][i] = 1.0f / ray->dir.z;
+	}
+}
+
+/* slab test of all rays of a packet. Returns the mask of active rays which hit
+ * the box, and the nearest entry distance of those in tret.
+ */
+static unsigned int packet_box(const struct aabox *box, const struct packet *pk, const float *tmax,
+		unsigned int active, float *tret)
+{
+	int i, j;
+	unsigned int mask = 0;
+	float t0, t1, tnear, tfar, tmin = FLT_MAX;
+
+	if(box->bmin.x > box->bmax.x) {
+		return 0;
+	}
+
+	for(i=0; i<pk->num; i++) {
+		if(!(active & (1u << i))) continue;
+
+		tnear = 0.0f;
+		tfar = tmax[i];
+		for(j=0; j<3; j++) {
+			t0 = ((&box->bmin.x)[j] - pk->org[j][i]) * pk->inv[j][i];
+			t1 = ((&box->bmax.x)[j] - pk->org[j][i]) * pk->inv[j][i];
+			if(t0 > t1) {
+				float tmp = t0;
+				t0 = t1;
+				t1 = tmp;
+			}
+			if(t0 > tnear) tnear = t0;
+			if(t1 < tfar) tfar = t1;
+		}
+		if(tnear <= tfar) {
+			mask |= 1u << i;
+			if(tnear < tmin) tmin = tnear;
+		}
+	}
+	*tret = tmin;
+	return mask;
+}
+
+#ifdef BVH_SIMD_X86
+/* 4 rays at a time. Min/max take the slab distance first, so that the NaNs
+ * from rays parallel to a slab and starting on it are ignored.
+ */
+__attribute__((target("sse")))
+static unsigned int packet_box_sse(const struct aabox *box, const struct packet *pk, const float *tmax,
+		unsigned int active, float *tret)
+{
+	int i, j;
+	unsigned int mask = 0;
+	float tn[BVH_PACKET_SIZE];
+	__m128 t0, t1, tnear, tfar;
+
+	if(box->bmin.x > box->bmax.x) {
+		return 0;
+	}
+
+	for(i=0; i<pk->num; i+=4) {
+		tnear = _mm_setzero_ps();
+		tfar = _mm_loadu_ps(tmax + i);
+		for(j=0; j<3; j++) {
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps((&box->bmin.x)[j]), _mm_loadu_ps(pk->org[j] + i)),
+					_mm_loadu_ps(pk->inv[j] + i));
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps((&box->bmax.x)[j]), _mm_loadu_ps(pk->org[j] + i)),
+					_mm_loadu_ps(pk->inv[j] + i));
+			tnear = _mm_max_ps(_mm_min_ps(t0, t1), tnear);
+			tfar = _mm_min_ps(_mm_max_ps(t0, t1), tfar);
+		}
+		mask |= (unsigned int)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << i;
+		_mm_storeu_ps(tn + i, tnear);
+	}
+	mask &= active;
+
+	*tret = FLT_MAX;
+	for(i=0; i<pk->num; i++) {
+		if((mask & (1u << i)) && tn[i] < *tret) {
+			*tret = tn[i];
+		}
+	}
+	return mask;
+}
+
+static packet_box_func get_packet_box_simd(void)
+{
+	if(__builtin_cpu_supports("sse")) {
+		return packet_box_sse;
+	}
+	return 0;
+}
+
+#else	/* !BVH_SIMD_X86 */
+static packet_box_func get_packet_box_simd(void)
+{
+	return 0;
+}
+#endif
+
+/* ---- scene node BVH ---- */
+struct goat3d_bvh {
+	struct goat3d *g;
+	struct bvh bvh;
+	struct goat3d_node **nodes;		/* mesh nodes, indexed by bvh item */
+	struct aabox *boxes;			/* world bounds of each node */
+	int num;
+};
+
+struct query {
+	struct goat3d_bvh *bvh;
+	void (*cull)(struct goat3d_node*, void*);
+	float (*ray)(struct goat3d_node*, float, void*);
+	void *cls;
+};
+
+static int calc_node_boxes(struct goat3d_bvh *bvh)
+{
+	int i;
+	struct goat3d_node *n;
+
+	if(goat3d_update_matrices(bvh->g) == -1) {
+		return -1;
+	}
+	for(i=0; i<bvh->num; i++) {
+		n = bvh->nodes[i];
+		g3dimpl_mesh_bounds(bvh->boxes + i, (struct goat3d_mesh*)n->obj, bvh->g->xform + n->idx * 16);
+	}
+	return 0;
+}
+
+GOAT3DAPI struct goat3d_bvh *goat3d_build_bvh(struct goat3d *g)
+{
+	int i, num_nodes = dynarr_size(g->nodes);
+	struct goat3d_bvh *bvh;
+	struct goat3d_node *n;
+	struct object *obj;
+
+	if(!(bvh = calloc(1, sizeof *bvh))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_build_bvh: failed to allocate BVH\n");
+		return 0;
+	}
+	bvh->g = g;
+
+	if(num_nodes) {
+		bvh->nodes = malloc(num_nodes * sizeof *bvh->nodes);
+		bvh->boxes = malloc(num_nodes * sizeof *bvh->boxes);
+		if(!bvh->nodes || !bvh->boxes) {
+			goat3d_logmsg(LOG_ERROR, "goat3d_build_bvh: failed to allocate node arrays\n");
+			goto err;
+		}
+	}
+
+	for(i=0; i<num_nodes; i++) {
+		n = g->nodes[i];
+		obj = n->obj;
+		if(obj && obj->type == OBJTYPE_MESH) {
+			bvh->nodes[bvh->num++] = n;
+		}
+	}
+	if(calc_node_boxes(bvh) == -1) {
+		goto err;
+	}
+	if(g3dimpl_bvh_build(&bvh->bvh, bvh->boxes, bvh->num, 1) == -1) {
+		goto err;
+	}
+	return bvh;
+
+err:
+	goat3d_free_bvh(bvh);
+	return 0;
+}
+
+GOAT3DAPI void goat3d_free_bvh(struct goat3d_bvh *bvh)
+{
+	if(!bvh) return;
+
+	g3dimpl_bvh_destroy(&bvh->bvh);
+	free(bvh->nodes);
+	free(bvh->boxes);
+	free(bvh);
+}
+
+GOAT3DAPI int goat3d_refit_bvh(struct goat3d_bvh *bvh)
+{
+	if(calc_node_boxes(bvh) == -1) {
+		return -1;
+	}
+	g3dimpl_bvh_refit(&bvh->bvh, bvh->boxes);
+	return 0;
+}
+
+static void frustum_item(int item, void *cls)
+{
+	struct query *q = cls;
+	q->cull(q->bvh->nodes[item], q->cls);
+}
+
+GOAT3DAPI int goat3d_bvh_frustum(struct goat3d_bvh *bvh, const float *planes, int nplanes,
+		void (*func)(struct goat3d_node*, void*), void *cls)
+{
+	struct query q;
+
+	if(nplanes > 32) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_bvh_frustum: too many planes (%d, max 32)\n", nplanes);
+		return -1;
+	}
+
+	q.bvh = bvh;
+	q.cull = func;
+	q.cls = cls;
+	return g3dimpl_bvh_cull(&bvh->bvh, planes, nplanes, frustum_item, &q);
+}
+
+static float ray_item(int item, float tmax, void *cls)
+{
+	struct query *q = cls;
+	return q->ray(q->bvh->nodes[item], tmax, q->cls);
+}
+
+GOAT3DAPI int goat3d_bvh_ray(struct goat3d_bvh *bvh, const float *origin, const float *dir, float tmax,
+		float (*func)(struct goat3d_node*, float, void*), void *cls)
+{
+	struct query q;
+	cgm_ray ray;
+
+	cgm_rcons(&ray, origin[0], origin[1], origin[2], dir[0], dir[1], dir[2]);
+
+	q.bvh = bvh;
+	q.ray = func;
+	q.cls = cls;
+	return g3dimpl_bvh_ray(&bvh->bvh, &ray, tmax, ray_item, &q);
+}
+
+/* ---- mesh triangle BVH ---- */
+#define TRIS_PER_LEAF	4
+
+/* tests the active rays of a packet against a triangle, returns the mask of
+ * rays which hit it closer than their tmax, with their t, u, v
+ */
+typedef unsigned int (*packet_tri_func)(const struct packet *pk, const cgm_vec3 *varr,
+		const struct face *face, unsigned int active, const float *tmax, float (*tuv)[BVH_PACKET_SIZE]);
+
+struct tri_query {
+	const cgm_vec3 *varr;
+	int nverts;
+	const struct face *faces;
+	const cgm_ray *rays;
+	struct goat3d_ray_hit *hits;
+	/* for packets */
+	struct packet pk;
+	packet_tri_func tritest;
+};
+
+static int ray_tri(const cgm_ray *ray, const cgm_vec3 *varr, const struct face *face,
+		float tmax, struct goat3d_ray_hit *hit);
+static unsigned int packet_tri(const struct packet *pk, const cgm_vec3 *varr, const struct face *face,
+		unsigned int active, const float *tmax, float (*tuv)[BVH_PACKET_SIZE]);
+static packet_tri_func get_packet_tri_simd(void);
+
+GOAT3DAPI int goat3d_mesh_build_bvh(struct goat3d_mesh *mesh)
+{
+	int i, j, nverts, nfaces;
+	const cgm_vec3 *varr, *v;
+	const struct face *faces;
+	struct aabox *boxes, *box;
+	struct bvh *bvh;
+
+	varr = g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+	nfaces = g3dimpl_mesh_count(mesh, MESH_FACES);
+
+	if(!(boxes = malloc((nfaces ? nfaces : 1) * sizeof *boxes))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_mesh_build_bvh: failed to allocate %d boxes\n", nfaces);
+		return -1;
+	}
+	for(i=0; i<nfaces; i++) {
+		box = boxes + i;
+		g3dimpl_aabox_init(box);
+		for(j=0; j<3; j++) {
+			if(faces[i].v[j] < 0 || faces[i].v[j] >= nverts) {
+				goat3d_logmsg(LOG_ERROR, "goat3d_mesh_build_bvh: mesh %s face %d has invalid vertex index: %d\n",
+						mesh->name, i, faces[i].v[j]);
+				free(boxes);
+				return -1;
+			}
+			v = varr + faces[i].v[j];
+			if(v->x < box->bmin.x) box->bmin.x = v->x;
+			if(v->y < box->bmin.y) box->bmin.y = v->y;
+			if(v->z < box->bmin.z) box->bmin.z = v->z;
+			if(v->x > box->bmax.x) box->bmax.x = v->x;
+			if(v->y > box->bmax.y) box->bmax.y = v->y;
+			if(v->z > box->bmax.z) box->bmax.z = v->z;
+		}
+	}
+
+	if(!(bvh = malloc(sizeof *bvh))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_mesh_build_bvh: failed to allocate BVH\n");
+		free(boxes);
+		return -1;
+	}
+	if(g3dimpl_bvh_build(bvh, boxes, nfaces, TRIS_PER_LEAF) == -1) {
+		free(bvh);
+		free(boxes);
+		return -1;
+	}
+	free(boxes);
+
+	g3dimpl_mesh_free_bvh(mesh);
+	mesh->bvh = bvh;
+	return 0;
+}
+
+GOAT3DAPI int goat3d_mesh_has_bvh(const struct goat3d_mesh *mesh)
+{
+	return mesh->bvh ? 1 : 0;
+}
+
+GOAT3DAPI void goat3d_mesh_free_bvh(struct goat3d_mesh *mesh)
+{
+	g3dimpl_mesh_free_bvh(mesh);
+}
+
+void g3dimpl_mesh_free_bvh(struct goat3d_mesh *m)
+{
+	if(m->bvh) {
+		g3dimpl_bvh_destroy(m->bvh);
+		free(m->bvh);
+		m->bvh = 0;
+	}
+}
+
+/* faces may come from a file, or be changed through goat3d_get_mesh_faces after
+ * building the BVH, so their vertex indices are checked before they're used
+ */
+#define FACE_VALID(q, f) \
+	((unsigned int)(f)->v[0] < (unsigned int)(q)->nverts && \
+	 (unsigned int)(f)->v[1] < (unsigned int)(q)->nverts && \
+	 (unsigned int)(f)->v[2] < (unsigned int)(q)->nverts)
+
+static float tri_item(int item, float tmax, void *cls)
+{
+	struct tri_query *q = cls;
+
+	if(!FACE_VALID(q, q->faces + item)) {
+		return tmax;
+	}
+	if(ray_tri(q->rays, q->varr, q->faces + item, tmax, q->hits)) {
+		q->hits->face = item;
+		return q->hits->t;
+	}
+	return tmax;
+}
+
+static void tri_packet_item(int item, unsigned int mask, float *tmax, void *cls)
+{
+	int i;
+	float tuv[3][BVH_PACKET_SIZE];
+	struct tri_query *q = cls;
+
+	if(!FACE_VALID(q, q->faces + item)) {
+		return;
+	}
+	mask = q->tritest(&q->pk, q->varr, q->faces + item, mask, tmax, tuv);
+
+	for(i=0; mask; i++, mask >>= 1) {
+		if(mask & 1) {
+			q->hits[i].t = tmax[i] = tuv[0][i];
+			q->hits[i].u = tuv[1][i];
+			q->hits[i].v = tuv[2][i];
+			q->hits[i].face = item;
+		}
+	}
+}
+
+GOAT3DAPI int goat3d_mesh_ray(const struct goat3d_mesh *mesh, const float *origin, const float *dir,
+		float tmax, struct goat3d_ray_hit *hit)
+{
+	int i, nfaces;
+	struct tri_query q;
+	cgm_ray ray;
+
+	cgm_rcons(&ray, origin[0], origin[1], origin[2], dir[0], dir[1], dir[2]);
+
+	q.varr = g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	q.nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	q.faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+	q.rays = &ray;
+	q.hits = hit;
+	hit->t = tmax;
+	hit->face = -1;
+
+	if(mesh->bvh) {
+		if(g3dimpl_bvh_ray(mesh->bvh, &ray, tmax, tri_item, &q) == -1) {
+			return -1;
+		}
+	} else {
+		/* no BVH, test all faces */
+		nfaces = g3dimpl_mesh_count(mesh, MESH_FACES);
+		for(i=0; i<nfaces; i++) {
+			tmax = tri_item(i, tmax, &q);
+		}
+	}
+	return hit->face >= 0 ? 1 : 0;
+}
+
+GOAT3DAPI int goat3d_mesh_ray_packet(const struct goat3d_mesh *mesh, int count, const float *origins,
+		const float *dirs, const float *tmax, struct goat3d_ray_hit *hits)
+{
+	int i, j, n, num_hits = 0;
+	float tmaxbuf[BVH_PACKET_SIZE];
+	cgm_ray rays[BVH_PACKET_SIZE];
+	struct tri_query q;
+
+	if(!mesh->bvh) {
+		for(i=0; i<count; i++) {
+			if((n = goat3d_mesh_ray(mesh, origins + i * 3, dirs + i * 3, tmax[i], hits + i)) == -1) {
+				return -1;
+			}
+			num_hits += n;
+		}
+		return num_hits;
+	}
+
+	q.varr = g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	q.nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	q.faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+	q.rays = rays;
+	if(!(q.tritest = get_packet_tri_simd())) {
+		q.tritest = packet_tri;
+	}
+
+	for(i=0; i<count; i+=BVH_PACKET_SIZE) {
+		n = count - i < BVH_PACKET_SIZE ? count - i : BVH_PACKET_SIZE;
+		for(j=0; j<n; j++) {
+			cgm_rcons(rays + j, origins[(i + j) * 3], origins[(i + j) * 3 + 1], origins[(i + j) * 3 + 2],
+					dirs[(i + j) * 3], dirs[(i + j) * 3 + 1], dirs[(i + j) * 3 + 2]);
+			tmaxbuf[j] = tmax[i + j];
+			hits[i + j].t = tmax[i + j];
+			hits[i + j].face = -1;
+		}
+
+		q.hits = hits + i;
+		init_packet(&q.pk, rays, n);
+		if(g3dimpl_bvh_packet(mesh->bvh, rays, n, tmaxbuf, tri_packet_item, &q) == -1) {
+			return -1;
+		}
+		for(j=0; j<n; j++) {
+			if(hits[i + j].face >= 0) num_hits++;
+		}
+	}
+	return num_hits;
+}
+
+/* Moller-Trumbore, fills in t, u, and v of hit if the triangle is hit in (0, tmax) */
+static int ray_tri(const cgm_ray *ray, const cgm_vec3 *varr, const struct face *face,
+		float tmax, struct goat3d_ray_hit *hit)
+{
+	float det, inv_det, t, u, v;
+	cgm_vec3 e1, e2, pv, tv, qv;
+	const cgm_vec3 *v0 = varr + face->v[0];
+	const cgm_vec3 *v1 = varr + face->v[1];
+	const cgm_vec3 *v2 = varr + face->v[2];
+
+	e1.x = v1->x - v0->x;
+	e1.y = v1->y - v0->y;
+	e1.z = v1->z - v0->z;
+	e2.x = v2->x - v0->x;
+	e2.y = v2->y - v0->y;
+	e2.z = v2->z - v0->z;
+
+	cgm_vcross(&pv, &ray->dir, &e2);
+	det = cgm_vdot(&e1, &pv);
+	if(det == 0.0f) return 0;
+	inv_det = 1.0f / det;
+
+	tv.x = ray->origin.x - v0->x;
+	tv.y = ray->origin.y - v0->y;
+	tv.z = ray->origin.z - v0->z;
+	u = cgm_vdot(&tv, &pv) * inv_det;
+	if(u < 0.0f || u > 1.0f) return 0;
+
+	cgm_vcross(&qv, &tv, &e1);
+	v = cgm_vdot(&ray->dir, &qv) * inv_det;
+	if(v < 0.0f || u + v > 1.0f) return 0;
+
+	t = cgm_vdot(&e2, &qv) * inv_det;
+	if(t <= 0.0f || t >= tmax) return 0;
+
+	hit->t = t;
+	hit->u = u;
+	hit->v = v;
+	return 1;
+}
+
+static unsigned int packet_tri(const struct packet *pk, const cgm_vec3 *varr, const struct face *face,
+		unsigned int active, const float *tmax, float (*tuv)[BVH_PACKET_SIZE])
+{
+	int i;
+	unsigned int mask = 0;
+	cgm_ray ray;
+	struct goat3d_ray_hit hit;
+
+	for(i=0; i<pk->num; i++) {
+		if(!(active & (1u << i))) continue;
+
+		cgm_rcons(&ray, pk->org[0][i], pk->org[1][i], pk->org[2][i],
+				pk->dir[0][i], pk->dir[1][i], pk->dir[2][i]);
+		if(ray_tri(&ray, varr, face, tmax[i], &hit)) {
+			tuv[0][i] = hit.t;
+			tuv[1][i] = hit.u;
+			tuv[2][i] = hit.v;
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+}
+
+#ifdef BVH_SIMD_X86
+/* same operations in the same order as ray_tri, 4 rays at a time, so that
+ * packets find exactly the same hits as single rays
+ */
+__attribute__((target("sse")))
+static unsigned int packet_tri_sse(const struct packet *pk, const cgm_vec3 *varr, const struct face *face,
+		unsigned int active, const float *tmax, float (*tuv)[BVH_PACKET_SIZE])
+{
+	int i;
+	unsigned int mask = 0;
+	const cgm_vec3 *v0 = varr + face->v[0];
+	const cgm_vec3 *v1 = varr + face->v[1];
+	const cgm_vec3 *v2 = varr + face->v[2];
+	__m128 e1x, e1y, e1z, e2x, e2y, e2z, dx, dy, dz, pvx, pvy, pvz, tvx, tvy, tvz;
+	__m128 qvx, qvy, qvz, det, inv_det, t, u, v, zero, one, valid;
+
+	e1x = _mm_set1_ps(v1->x - v0->x);
+	e1y = _mm_set1_ps(v1->y - v0->y);
+	e1z = _mm_set1_ps(v1->z - v0->z);
+	e2x = _mm_set1_ps(v2->x - v0->x);
+	e2y = _mm_set1_ps(v2->y - v0->y);
+	e2z = _mm_set1_ps(v2->z - v0->z);
+	zero = _mm_setzero_ps();
+	one = _mm_set1_ps(1.0f);
+
+	for(i=0; i<pk->num; i+=4) {
+		if(!((active >> i) & 0xf)) continue;
+
+		dx = _mm_loadu_ps(pk->dir[0] + i);
+		dy = _mm_loadu_ps(pk->dir[1] + i);
+		dz = _mm_loadu_ps(pk->dir[2] + i);
+
+		pvx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		pvy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		pvz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+		det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, pvx), _mm_mul_ps(e1y, pvy)), _mm_mul_ps(e1z, pvz));
+		inv_det = _mm_div_ps(one, det);
+
+		tvx = _mm_sub_ps(_mm_loadu_ps(pk->org[0] + i), _mm_set1_ps(v0->x));
+		tvy = _mm_sub_ps(_mm_loadu_ps(pk->org[1] + i), _mm_set1_ps(v0->y));
+		tvz = _mm_sub_ps(_mm_loadu_ps(pk->org[2] + i), _mm_set1_ps(v0->z));
+		u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tvx, pvx), _mm_mul_ps(tvy, pvy)),
+					_mm_mul_ps(tvz, pvz)), inv_det);
+
+		qvx = _mm_sub_ps(_mm_mul_ps(tvy, e1z), _mm_mul_ps(tvz, e1y));
+		qvy = _mm_sub_ps(_mm_mul_ps(tvz, e1x), _mm_mul_ps(tvx, e1z));
+		qvz = _mm_sub_ps(_mm_mul_ps(tvx, e1y), _mm_mul_ps(tvy, e1x));
+		v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qvx), _mm_mul_ps(dy, qvy)),
+					_mm_mul_ps(dz, qvz)), inv_det);
+		t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qvx), _mm_mul_ps(e2y, qvy)),
+					_mm_mul_ps(e2z, qvz)), inv_det);
+
+		/* the comparisons are false for NaNs, as they are in ray_tri */
+		valid = _mm_cmpneq_ps(det, zero);
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(u, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(u, one));
+		valid = _mm_and_ps(valid, _mm_cmpge_ps(v, zero));
+		valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(u, v), one));
+		valid = _mm_and_ps(valid, _mm_cmpgt_ps(t, zero));
+		valid = _mm_and_ps(valid, _mm_cmplt_ps(t, _mm_loadu_ps(tmax + i)));
+
+		mask |= (unsigned int)_mm_movemask_ps(valid) << i;
+		_mm_storeu_ps(tuv[0] + i, t);
+		_mm_storeu_ps(tuv[1] + i, u);
+		_mm_storeu_ps(tuv[2] + i, v);
+	}
+	return mask & active;
+}
+
+static packet_tri_func get_packet_tri_simd(void)
+{
+	if(__builtin_cpu_supports("sse")) {
+		return packet_tri_sse;
+	}
+	return 0;
+}
+
+#else	/* !BVH_SIMD_X86 */
+static packet_tri_func get_packet_tri_simd(void)
+{
+	return 0;
+}
+#endif
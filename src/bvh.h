@@ -0,0 +1,79 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GOAT3D_BVH_H_
+#define GOAT3D_BVH_H_
+
+#include "aabox.h"
+
+/* Bounding volume hierarchy over an array of boxes. The builder only keeps
+ * the order of the items in the leaves, and callers keep whatever the items
+ * are: scene nodes (goat3d_build_bvh), triangles, etc.
+ */
+struct bvh_node {
+	struct aabox box;
+	int first;		/* leaves: first item, interior: left child (right is first + 1) */
+	int count;		/* number of items for leaves, 0 for interior nodes */
+};
+
+struct bvh {
+	struct bvh_node *nodes;		/* nodes[0] is the root, children after parents */
+	int num_nodes;
+	int *items;					/* indices into the array of boxes, in leaf order */
+	int num_items;
+	int depth;
+};
+
+/* called for every item in a leaf hit by a ray, returns the new tmax */
+typedef float (*bvh_ray_func)(int item, float tmax, void *cls);
+/* called for every item in a leaf which isn't culled */
+typedef void (*bvh_cull_func)(int item, void *cls);
+/* called for every item in a leaf hit by any of the rays in a packet, with a
+ * mask of the rays which hit it, and their tmax to be updated
+ */
+typedef void (*bvh_packet_func)(int item, unsigned int mask, float *tmax, void *cls);
+
+/* max number of rays traced together by g3dimpl_bvh_packet */
+#define BVH_PACKET_SIZE	8
+
+/* binned SAH build, with at most max_leaf items per leaf */
+int g3dimpl_bvh_build(struct bvh *bvh, const struct aabox *boxes, int count, int max_leaf);
+void g3dimpl_bvh_destroy(struct bvh *bvh);
+/* check the structure of a tree which didn't come from g3dimpl_bvh_build (read
+ * from a file) before using it, and compute its depth. Returns -1 if invalid.
+ */
+int g3dimpl_bvh_validate(struct bvh *bvh);
+
+/* recompute node bounds bottom-up, from new item boxes, keeping the tree */
+void g3dimpl_bvh_refit(struct bvh *bvh, const struct aabox *boxes);
+
+/* visit leaves hit by the ray before tmax, nearest first */
+int g3dimpl_bvh_ray(const struct bvh *bvh, const cgm_ray *ray, float tmax,
+		bvh_ray_func func, void *cls);
+/* same as g3dimpl_bvh_ray for up to BVH_PACKET_SIZE rays at once, each with
+ * its own tmax. Faster than tracing them one by one if they're coherent.
+ */
+int g3dimpl_bvh_packet(const struct bvh *bvh, const cgm_ray *rays, int nrays, float *tmax,
+		bvh_packet_func func, void *cls);
+/* visit leaves not completely outside any of the planes (at most 32, a, b, c, d
+ * each, with the inside where ax + by + cz + d >= 0). Returns the number of
+ * items visited.
+ */
+int g3dimpl_bvh_cull(const struct bvh *bvh, const float *planes, int nplanes,
+		bvh_cull_func func, void *cls);
+
+#endif	/* GOAT3D_BVH_H_ */
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "goat3d.h"
 #include "chunk.h"
+#include "log.h"
 
 void g3dimpl_chunk_header(struct chunk_header *hdr, int id)
 {
@@ -24,10 +25,30 @@ void g3dimpl_chunk_header(struct chunk_header *hdr, int id)
 	hdr->size = sizeof *hdr;
 }
 
+/* goes back to the start of a chunk which has just been written in full, to
+ * fill in its header, and then returns to the end of the chunk.
+ */
 int g3dimpl_write_chunk_header(const struct chunk_header *hdr, struct goat3d_io *io)
 {
-	io->seek(-(long)hdr->size, SEEK_CUR, io->cls);
-	if(io->write(hdr, sizeof *hdr, io->cls) < (long)sizeof *hdr) {
+	if(io->seek(-(long)hdr->size, SEEK_CUR, io->cls) == -1) {
+		return -1;
+	}
+	if(g3dimpl_put_chunk_header(hdr, io) == -1) {
+		return -1;
+	}
+	if(io->seek(hdr->size - sizeof *hdr, SEEK_CUR, io->cls) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+int g3dimpl_put_chunk_header(const struct chunk_header *hdr, struct goat3d_io *io)
+{
+	struct chunk_header tmp = *hdr;
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(&tmp, 2);
+#endif
+	if(io->write(&tmp, sizeof tmp, io->cls) < (long)sizeof tmp) {
 		return -1;
 	}
 	return 0;
@@ -38,9 +59,47 @@ int g3dimpl_read_chunk_header(struct chunk_header *hdr, struct goat3d_io *io)
 	if(io->read(hdr, sizeof *hdr, io->cls) < (long)sizeof *hdr) {
 		return -1;
 	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(hdr, 2);
+#endif
+	if(hdr->size < sizeof *hdr) {
+		return -1;
+	}
 	return 0;
 }
 
+long g3dimpl_begin_chunk(struct chunk_header *hdr, int id, struct goat3d_io *io)
+{
+	long start;
+
+	if((start = io->seek(0, SEEK_CUR, io->cls)) == -1) {
+		return -1;
+	}
+	g3dimpl_chunk_header(hdr, id);
+	hdr->size = UNKNOWN_SIZE;
+	if(g3dimpl_put_chunk_header(hdr, io) == -1) {
+		return -1;
+	}
+	return start;
+}
+
+int g3dimpl_end_chunk(struct chunk_header *hdr, long start, struct goat3d_io *io)
+{
+	long end;
+
+	if((end = io->seek(0, SEEK_CUR, io->cls)) == -1) {
+		return -1;
+	}
+	/* sizes are 32bit, so no chunk can be 4GB or larger, including the scene */
+	if(end - start > (long)UINT32_MAX) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_end_chunk: chunk %u is too large (%ld bytes)\n",
+				(unsigned int)hdr->id, end - start);
+		return -1;
+	}
+	hdr->size = end - start;
+	return g3dimpl_write_chunk_header(hdr, io);
+}
+
 void g3dimpl_skip_chunk(const struct chunk_header *hdr, struct goat3d_io *io)
 {
 	io->seek(hdr->size - sizeof *hdr, SEEK_CUR, io->cls);
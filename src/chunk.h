@@ -63,15 +63,19 @@ enum {
 	/* children of CNK_MESH */
 	CNK_MESH_NAME,			/* has a single CNK_STRING */
 	CNK_MESH_MATERIAL,		/* has one of CNK_STRING or CNK_INT to identify the material */
-	CNK_MESH_VERTEX_LIST,	/* has a series of CNK_FLOAT3 chunks */
-	CNK_MESH_NORMAL_LIST,	/* has a series of CNK_FLOAT3 chunks */
-	CNK_MESH_TANGENT_LIST,	/* has a series of CNK_FLOAT3 chunks */
-	CNK_MESH_TEXCOORD_LIST,	/* has a series of CNK_FLOAT3 chunks */
-	CNK_MESH_SKINWEIGHT_LIST,	/* has a series of CNK_FLOAT4 chunks (4 skin weights) */
-	CNK_MESH_SKINMATRIX_LIST,	/* has a series of CNK_INT4 chunks (4 matrix indices) */
-	CNK_MESH_COLOR_LIST,	/* has a series of CNK_FLOAT4 chunks */
+	/* the vertex attribute and face lists don't have child chunks. Their data
+	 * is a raw little-endian array of 32bit floats or ints, with the number
+	 * of elements implied by the chunk size.
+	 */
+	CNK_MESH_VERTEX_LIST,	/* 3 floats per vertex */
+	CNK_MESH_NORMAL_LIST,	/* 3 floats per vertex */
+	CNK_MESH_TANGENT_LIST,	/* 3 floats per vertex */
+	CNK_MESH_TEXCOORD_LIST,	/* 2 floats per vertex */
+	CNK_MESH_SKINWEIGHT_LIST,	/* 4 floats per vertex (4 skin weights) */
+	CNK_MESH_SKINMATRIX_LIST,	/* 4 ints per vertex (4 matrix indices) */
+	CNK_MESH_COLOR_LIST,	/* 4 floats per vertex */
 	CNK_MESH_BONES_LIST,	/* has a series of CNK_INT or CNK_STRING chunks identifying the bone nodes */
-	CNK_MESH_FACE_LIST,		/* has a series of CNK_FACE chunks */
+	CNK_MESH_FACE_LIST,		/* 3 ints per face */
 	CNK_MESH_FILE,			/* optionally mesh data may be in another file, has a CNK_STRING filename */
 
 	/* child of CNK_MESH_FACE_LIST */
@@ -114,6 +118,26 @@ enum {
 
 	CNK_ANIM,		/* the animation root chunk */
 
+	/* children of CNK_ANIM */
+	CNK_ANIM_NAME,			/* has a single CNK_STRING */
+	CNK_ANIM_TRACK,
+
+	/* children of CNK_ANIM_TRACK */
+	CNK_TRACK_NAME,			/* has a single CNK_STRING */
+	CNK_TRACK_TYPE,			/* has a single CNK_INT (enum goat3d_track_type) */
+	CNK_TRACK_INTERP,		/* has a single CNK_INT (enum goat3d_interp) */
+	CNK_TRACK_EXTRAP,		/* has a single CNK_INT (enum goat3d_extrap) */
+	CNK_TRACK_NODE,			/* has a CNK_INT or a CNK_STRING to identify the node */
+	CNK_TRACK_KEYS,			/* raw array of keys, each an int time (msec) followed
+							 * by 1, 3, or 4 floats depending on the track type */
+
+	/* children of CNK_MESH, after CNK_MESH_FACE_LIST */
+	CNK_MESH_BVH,			/* triangle BVH, raw array of 32bit values: node count,
+							 * face count, nodes (6 float bounds, int first, int count),
+							 * and face indices in leaf order */
+	CNK_MESH_BOUNDS,		/* object-space bounds of the vertices, raw array of 6
+							 * 32bit floats: min x, y, z, max x, y, z */
+
 	MAX_NUM_CHUNKS
 };
 
@@ -132,7 +156,15 @@ struct chunk {
 
 void g3dimpl_chunk_header(struct chunk_header *hdr, int id);
 int g3dimpl_write_chunk_header(const struct chunk_header *hdr, struct goat3d_io *io);
+int g3dimpl_put_chunk_header(const struct chunk_header *hdr, struct goat3d_io *io);
 int g3dimpl_read_chunk_header(struct chunk_header *hdr, struct goat3d_io *io);
 void g3dimpl_skip_chunk(const struct chunk_header *hdr, struct goat3d_io *io);
 
+/* container chunks of unknown size: g3dimpl_begin_chunk writes a placeholder
+ * header and returns the file offset of the chunk, which must be passed to
+ * g3dimpl_end_chunk after writing all the child chunks, to fill in the size.
+ */
+long g3dimpl_begin_chunk(struct chunk_header *hdr, int id, struct goat3d_io *io);
+int g3dimpl_end_chunk(struct chunk_header *hdr, long start, struct goat3d_io *io);
+
 #endif	/* CHUNK_H_ */
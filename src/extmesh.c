@@ -15,11 +15,224 @@ GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include "g3dscn.h"
 #include "log.h"
+#include "thread.h"
+
+/* External mesh files contain a single CNK_MESH chunk, with the same layout
+ * as mesh chunks in binary scene files. Only the vertex attribute and face
+ * lists are used, everything else is defined by the mesh in the scene file.
+ *
+ * Decoded mesh files are kept in a process-wide cache, keyed by their full
+ * path, and shared by all meshes referencing them through their read-only
+ * mapped arrays. A mesh gets its own copy when it's modified, or when its data
+ * pointers are handed out by the getters in goat3d.c (see g3dimpl_mesh_unmap),
+ * so the cached data never change. A cache entry is freed when the last mesh
+ * referencing it is destroyed or copied. The cache is protected by a lock,
+ * since meshes may be loaded from multiple threads, but files are decoded
+ * outside of it. If two threads load the same file at once, the one to finish
+ * second drops its copy.
+ */
+struct extmesh {
+	char *path;
+	int nref;
+	struct goat3d_mesh mesh;
+	struct extmesh *next;
+};
+
+static struct extmesh *find_extmesh(const char *path);
+static void free_extmesh(struct extmesh *ext);
+static struct extmesh *load_extmesh(const char *path);
+static char *resolve_path(const char *fname);
+static long read_file(void *buf, size_t bytes, void *uptr);
+static long seek_file(long offs, int whence, void *uptr);
+
+static struct extmesh *cache;
+static g3dimpl_mutex cache_lock = G3DIMPL_MUTEX_INITIALIZER;
+
 
 int g3dimpl_loadmesh(struct goat3d_mesh *mesh, const char *fname)
 {
-	goat3d_logmsg(LOG_ERROR, "loading external mesh files not implemented yet!\n");
-	return -1;
+	int i;
+	char *path;
+	struct extmesh *ext, *dup;
+
+	if(!(path = resolve_path(fname))) {
+		return -1;
+	}
+
+	g3dimpl_mutex_lock(&cache_lock);
+	if((ext = find_extmesh(path))) {
+		ext->nref++;
+		g3dimpl_mutex_unlock(&cache_lock);
+		free(path);
+	} else {
+		/* decode without holding the lock, so that meshes loaded in parallel
+		 * don't wait for each other
+		 */
+		g3dimpl_mutex_unlock(&cache_lock);
+		if(!(ext = load_extmesh(path))) {
+			free(path);
+			return -1;
+		}
+
+		g3dimpl_mutex_lock(&cache_lock);
+		if((dup = find_extmesh(path))) {
+			/* another thread loaded the same file in the meantime, use theirs */
+			dup->nref++;
+			g3dimpl_mutex_unlock(&cache_lock);
+			free_extmesh(ext);
+			ext = dup;
+		} else {
+			ext->nref = 1;
+			ext->next = cache;
+			cache = ext;
+			g3dimpl_mutex_unlock(&cache_lock);
+		}
+	}
+
+	if(mesh->ext) {
+		g3dimpl_release_extmesh(mesh->ext);
+	}
+	mesh->ext = ext;
+
+	for(i=0; i<=MESH_FACES; i++) {
+		mesh->mapped[i].data = g3dimpl_mesh_data(&ext->mesh, i);
+		mesh->mapped[i].count = g3dimpl_mesh_count(&ext->mesh, i);
+	}
+	return 0;
+}
+
+void g3dimpl_release_extmesh(struct extmesh *ext)
+{
+	struct extmesh dummy, *prev;
+
+	g3dimpl_mutex_lock(&cache_lock);
+
+	if(--ext->nref > 0) {
+		g3dimpl_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	dummy.next = cache;
+	prev = &dummy;
+	while(prev->next) {
+		if(prev->next == ext) {
+			prev->next = ext->next;
+			break;
+		}
+		prev = prev->next;
+	}
+	cache = dummy.next;
+
+	g3dimpl_mutex_unlock(&cache_lock);
+
+	free_extmesh(ext);
+}
+
+/* call with cache_lock held */
+static struct extmesh *find_extmesh(const char *path)
+{
+	struct extmesh *ext = cache;
+
+	while(ext) {
+		if(strcmp(ext->path, path) == 0) {
+			break;
+		}
+		ext = ext->next;
+	}
+	return ext;
+}
+
+static void free_extmesh(struct extmesh *ext)
+{
+	g3dimpl_obj_destroy((struct object*)&ext->mesh);
+	free(ext->mesh.name);	/* the default name given by g3dimpl_obj_init */
+	free(ext->path);
+	free(ext);
+}
+
+static struct extmesh *load_extmesh(const char *path)
+{
+	FILE *fp;
+	struct goat3d_io io;
+	struct extmesh *ext;
+
+	if(!(fp = fopen(path, "rb"))) {
+		goat3d_logmsg(LOG_ERROR, "failed to open mesh file: %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	if(!(ext = calloc(1, sizeof *ext))) {
+		goat3d_logmsg(LOG_ERROR, "failed to allocate external mesh\n");
+		fclose(fp);
+		return 0;
+	}
+	if(g3dimpl_obj_init((struct object*)&ext->mesh, OBJTYPE_MESH) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to initialize external mesh\n");
+		free(ext);
+		fclose(fp);
+		return 0;
+	}
+
+	io.cls = fp;
+	io.read = read_file;
+	io.write = 0;
+	io.seek = seek_file;
+
+	if(g3dimpl_loadbin_mesh(&ext->mesh, &io) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to load mesh file: %s\n", path);
+		g3dimpl_obj_destroy((struct object*)&ext->mesh);
+		free(ext->mesh.name);
+		free(ext);
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	ext->path = (char*)path;
+	return ext;
+}
+
+/* returns a malloc'ed absolute path, so that different relative paths to the
+ * same file share a cache entry
+ */
+static char *resolve_path(const char *fname)
+{
+	char *path;
+
+#if defined(unix) || defined(__unix__) || defined(__APPLE__)
+	if((path = realpath(fname, 0))) {
+		return path;
+	}
+#elif defined(_WIN32)
+	if((path = _fullpath(0, fname, 0))) {
+		return path;
+	}
+#endif
+
+	/* fallback to the path as given, if it can't be resolved */
+	if(!(path = malloc(strlen(fname) + 1))) {
+		goat3d_logmsg(LOG_ERROR, "failed to allocate mesh file path\n");
+		return 0;
+	}
+	strcpy(path, fname);
+	return path;
+}
+
+static long read_file(void *buf, size_t bytes, void *uptr)
+{
+	return (long)fread(buf, 1, bytes, (FILE*)uptr);
+}
+
+static long seek_file(long offs, int whence, void *uptr)
+{
+	if(fseek((FILE*)uptr, offs, whence) == -1) {
+		return -1;
+	}
+	return ftell((FILE*)uptr);
 }
@@ -16,13 +16,19 @@ You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdlib.h>
+#include <string.h>
 #include "g3danm.h"
+#include "g3dscn.h"
 #include "dynarr.h"
 #include "log.h"
 
 int g3dimpl_anim_init(struct goat3d_anim *anim)
 {
 	anim->name = 0;
+	anim->scn = 0;
+	anim->idx = 0;
+	anim->bind = 0;
+	anim->bind_valid = 0;
 	if(!(anim->tracks = dynarr_alloc(0, sizeof *anim->tracks))) {
 		goat3d_logmsg(LOG_ERROR, "g3dimpl_anim_init: failed to allocate tracks array\n");
 		return -1;
@@ -42,6 +48,88 @@ void g3dimpl_anim_destroy(struct goat3d_anim *anim)
 		goat3d_destroy_track(anim->tracks[i]);
 	}
 	dynarr_free(anim->tracks);
+	if(anim->bind) {
+		dynarr_free(anim->bind);
+	}
+}
+
+static int cmp_track_node(const void *a, const void *b)
+{
+	const struct goat3d_node *na = (*(struct goat3d_track**)a)->node;
+	const struct goat3d_node *nb = (*(struct goat3d_track**)b)->node;
+
+	if(!na || !nb) {
+		return (na ? 1 : 0) - (nb ? 1 : 0);
+	}
+	/* keep the bindings in scene node order, for cache-friendlier evaluation */
+	if(na->idx != nb->idx) {
+		return na->idx - nb->idx;
+	}
+	return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+int g3dimpl_anim_bind(struct goat3d_anim *anim)
+{
+	int i, num;
+	struct goat3d_track **trk, *t;
+	struct anim_binding *bind, *b;
+
+	if(anim->bind_valid) return 0;
+
+	if(anim->bind) {
+		DYNARR_CLEAR(anim->bind);
+	} else {
+		if(!(anim->bind = dynarr_alloc(0, sizeof *anim->bind))) {
+			goat3d_logmsg(LOG_ERROR, "g3dimpl_anim_bind: failed to allocate bindings array\n");
+			return -1;
+		}
+	}
+
+	num = dynarr_size(anim->tracks);
+	if(!(trk = malloc(num * sizeof *trk + 1))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_anim_bind: failed to allocate temporary track array\n");
+		return -1;
+	}
+	memcpy(trk, anim->tracks, num * sizeof *trk);
+	qsort(trk, num, sizeof *trk, cmp_track_node);
+
+	b = 0;
+	for(i=0; i<num; i++) {
+		t = trk[i];
+		if(!t->node) continue;
+		if(t->type != GOAT3D_TRACK_POS && t->type != GOAT3D_TRACK_ROT &&
+				t->type != GOAT3D_TRACK_SCALE) {
+			continue;
+		}
+
+		if(!b || b->node != t->node) {
+			if(!(bind = dynarr_push(anim->bind, 0))) {
+				goat3d_logmsg(LOG_ERROR, "g3dimpl_anim_bind: failed to add node binding\n");
+				free(trk);
+				return -1;
+			}
+			anim->bind = bind;
+			b = bind + dynarr_size(bind) - 1;
+			memset(b, 0, sizeof *b);
+			b->node = t->node;
+		}
+
+		/* if there are multiple tracks of the same type, the first one wins */
+		switch(t->type) {
+		case GOAT3D_TRACK_POS:
+			if(!b->pos) b->pos = t;
+			break;
+		case GOAT3D_TRACK_ROT:
+			if(!b->rot) b->rot = t;
+			break;
+		default:
+			if(!b->scale) b->scale = t;
+		}
+	}
+	free(trk);
+
+	anim->bind_valid = 1;
+	return 0;
 }
 
 
@@ -24,18 +24,34 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 struct goat3d_track {
 	char *name;
 	enum goat3d_track_type type;
-	struct anm_track trk[4];
+	struct anm_track trk;		/* one component per element of the track type */
 	struct goat3d_node *node;	/* node associated with this track */
+	struct goat3d_anim *anim;	/* animation this track was added to */
+};
+
+/* node transformation tracks of an animation, grouped by node */
+struct anim_binding {
+	struct goat3d_node *node;
+	struct goat3d_track *pos, *rot, *scale;
+	struct anm_cursor cur[3];	/* sampling cursors for pos, rot, scale */
 };
 
 struct goat3d_anim {
 	char *name;
+	struct goat3d *scn;		/* scene this animation was added to */
+	int idx;				/* index in the scene anims array */
 	struct goat3d_track **tracks;	/* dynarr */
+
+	struct anim_binding *bind;	/* dynarr, see g3dimpl_anim_bind */
+	int bind_valid;
 };
 
 int g3dimpl_anim_init(struct goat3d_anim *anim);
 void g3dimpl_anim_destroy(struct goat3d_anim *anim);
 
+/* (re)build the node bindings of the animation if any of its tracks changed */
+int g3dimpl_anim_bind(struct goat3d_anim *anim);
+
 const char *g3dimpl_trktypestr(enum goat3d_track_type type);
 
 #endif	/* G3DANM_H_ */
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <string.h>
 #include "g3dscn.h"
+#include "thread.h"
 #include "dynarr.h"
 
 int g3dimpl_obj_init(struct object *o, int type)
@@ -99,6 +100,12 @@ void g3dimpl_obj_destroy(struct object *o)
 		dynarr_free(m->colors);
 		dynarr_free(m->faces);
 		dynarr_free(m->bones);
+		if(m->ext) {
+			g3dimpl_release_extmesh(m->ext);
+		}
+		free(m->lazy);
+		free(m->lazy_done);
+		g3dimpl_mesh_free_bvh(m);
 		break;
 
 	default:
@@ -108,23 +115,175 @@ void g3dimpl_obj_destroy(struct object *o)
 
 void g3dimpl_mesh_bounds(struct aabox *bb, struct goat3d_mesh *m, float *xform)
 {
-	int i, nverts;
+	int nverts;
+	cgm_vec3 *varr;
+	struct aabox *mbox = &m->bbox;
+
+	if(!m->bbox_valid) {
+		varr = g3dimpl_mesh_data(m, GOAT3D_MESH_ATTR_VERTEX);
+		nverts = g3dimpl_mesh_count(m, GOAT3D_MESH_ATTR_VERTEX);
+		goat3d_calc_bounds((float*)varr, nverts, &mbox->bmin.x, &mbox->bmax.x);
+		m->bbox_valid = 1;
+	}
+
+	if(xform) {
+		g3dimpl_aabox_xform(bb, mbox, xform);
+	} else {
+		*bb = *mbox;
+	}
+}
+
+void g3dimpl_mesh_invalidate(struct goat3d_mesh *m)
+{
+	m->bbox_valid = 0;
+	g3dimpl_mesh_free_bvh(m);
+	if(m->scn) {
+		m->scn->bbox_valid = 0;
+	}
+}
+
+static void **mesh_dynarr(const struct goat3d_mesh *m, int attr)
+{
+	struct goat3d_mesh *mesh = (struct goat3d_mesh*)m;
+
+	switch(attr) {
+	case GOAT3D_MESH_ATTR_VERTEX:
+		return (void**)&mesh->vertices;
+	case GOAT3D_MESH_ATTR_NORMAL:
+		return (void**)&mesh->normals;
+	case GOAT3D_MESH_ATTR_TANGENT:
+		return (void**)&mesh->tangents;
+	case GOAT3D_MESH_ATTR_TEXCOORD:
+		return (void**)&mesh->texcoords;
+	case GOAT3D_MESH_ATTR_SKIN_WEIGHT:
+		return (void**)&mesh->skin_weights;
+	case GOAT3D_MESH_ATTR_SKIN_MATRIX:
+		return (void**)&mesh->skin_matrices;
+	case GOAT3D_MESH_ATTR_COLOR:
+		return (void**)&mesh->colors;
+	case MESH_FACES:
+		return (void**)&mesh->faces;
+	default:
+		break;
+	}
+	return 0;
+}
+
+void *g3dimpl_mesh_data(const struct goat3d_mesh *m, int attr)
+{
+	void **arr;
+
+	/* reading lazily loaded data doesn't change the mesh as far as the user
+	 * is concerned, so it's fine to do it through a const pointer
+	 */
+	if(g3dimpl_load_acquire((void*const*)&m->lazy) && g3dimpl_mesh_fetch((struct goat3d_mesh*)m) == -1) {
+		return 0;
+	}
+	if(m->mapped[attr].data) {
+		return m->mapped[attr].data;
+	}
+	arr = mesh_dynarr(m, attr);
+	return arr ? *arr : 0;
+}
+
+int g3dimpl_mesh_count(const struct goat3d_mesh *m, int attr)
+{
+	void **arr;
+	struct mesh_lazy *lz;
+
+	/* counts are known without reading lazily loaded data */
+	if((lz = g3dimpl_load_acquire((void*const*)&m->lazy)) && lz->offs[attr] >= 0) {
+		return lz->count[attr];
+	}
+	if(m->mapped[attr].data) {
+		return m->mapped[attr].count;
+	}
+	arr = mesh_dynarr(m, attr);
+	return arr ? dynarr_size(*arr) : 0;
+}
+
+void *g3dimpl_mesh_elem(const struct goat3d_mesh *m, int attr, int idx)
+{
+	if(attr < 0 || attr > MESH_FACES || !g3dimpl_mesh_count(m, attr)) {
+		return 0;
+	}
+	return (char*)g3dimpl_mesh_data(m, attr) + idx * g3dimpl_mesh_elemsize(attr);
+}
 
-	g3dimpl_aabox_init(bb);
+int g3dimpl_mesh_elemsize(int attr)
+{
+	static const int elemsz[] = {
+		sizeof(cgm_vec3), sizeof(cgm_vec3), sizeof(cgm_vec3), sizeof(cgm_vec2),
+		sizeof(cgm_vec4), sizeof(int4), sizeof(cgm_vec4), sizeof(struct face)
+	};
+	return elemsz[attr];
+}
 
-	nverts = dynarr_size(m->vertices);
-	for(i=0; i<nverts; i++) {
-		cgm_vec3 v = m->vertices[i];
-		if(xform) cgm_vmul_m4v3(&v, xform);
+void *g3dimpl_mesh_alloc(struct goat3d_mesh *m, int attr, int count)
+{
+	void **arr, *tmp;
 
-		if(v.x < bb->bmin.x) bb->bmin.x = v.x;
-		if(v.y < bb->bmin.y) bb->bmin.y = v.y;
-		if(v.z < bb->bmin.z) bb->bmin.z = v.z;
+	arr = mesh_dynarr(m, attr);
+	if(!(tmp = dynarr_resize(*arr, count))) {
+		return 0;
+	}
+	*arr = tmp;
+	m->mapped[attr].data = 0;
+	m->mapped[attr].count = 0;
+	if(attr == GOAT3D_MESH_ATTR_VERTEX) {
+		g3dimpl_mesh_invalidate(m);
+	} else if(attr == MESH_FACES) {
+		g3dimpl_mesh_free_bvh(m);
+	}
+	if(m->lazy) {
+		m->lazy->offs[attr] = -1;
+	}
+	return tmp;
+}
 
-		if(v.x > bb->bmax.x) bb->bmax.x = v.x;
-		if(v.y > bb->bmax.y) bb->bmax.y = v.y;
-		if(v.z > bb->bmax.z) bb->bmax.z = v.z;
+void g3dimpl_mesh_setarr(struct goat3d_mesh *m, int attr, void *arr)
+{
+	void **dest = mesh_dynarr(m, attr);
+
+	if(arr) {
+		dynarr_free(*dest);
+		*dest = arr;
+	} else if((arr = dynarr_clear(*dest))) {
+		*dest = arr;
+	}
+	m->mapped[attr].data = 0;
+	m->mapped[attr].count = 0;
+}
+
+int g3dimpl_mesh_unmap(struct goat3d_mesh *m)
+{
+	int i;
+	void **arr, *tmp;
+	struct mesh_view *view;
+
+	if(m->lazy && g3dimpl_mesh_fetch(m) == -1) {
+		return -1;
 	}
+
+	for(i=0; i<=MESH_FACES; i++) {
+		view = m->mapped + i;
+		if(!view->data) continue;
+
+		arr = mesh_dynarr(m, i);
+		if(!(tmp = dynarr_resize(*arr, view->count))) {
+			return -1;
+		}
+		*arr = tmp;
+		memcpy(*arr, view->data, view->count * g3dimpl_mesh_elemsize(i));
+		view->data = 0;
+		view->count = 0;
+	}
+
+	if(m->ext) {
+		g3dimpl_release_extmesh(m->ext);
+		m->ext = 0;
+	}
+	return 0;
 }
 
 int g3dimpl_mtl_init(struct goat3d_material *mtl)
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "goat3d.h"
 #include "g3danm.h"
 #include "aabox.h"
+#include "nametab.h"
 
 enum {
 	OBJTYPE_UNKNOWN,
@@ -41,6 +42,18 @@ enum {
 	CAMTYPE_TARGET
 };
 
+/* per-scene name lookup tables (goat3d names array) */
+enum {
+	NAMES_MTL,
+	NAMES_MESH,
+	NAMES_LIGHT,
+	NAMES_CAMERA,
+	NAMES_NODE,
+	NAMES_ANIM,
+
+	NUM_NAME_TABLES
+};
+
 
 struct face {
 	int v[3];
@@ -59,26 +72,56 @@ struct material_attrib {
 struct goat3d_material {
 	char *name;
 	int idx;
+	struct goat3d *scn;		/* scene this material was added to */
 	struct material_attrib *attrib;	/* dynarr */
 };
 
 
+/* scn and idx are set when the object is added to a scene */
 #define OBJECT_COMMON	\
 	int type; \
 	char *name; \
 	cgm_vec3 pos; \
 	cgm_quat rot; \
 	cgm_vec3 scale; \
+	struct goat3d *scn; \
+	int idx; \
 	void *next
 
 struct object {
 	OBJECT_COMMON;
 };
 
+/* index of the face list in the goat3d_mesh mapped array, after the vertex
+ * attributes (enum goat3d_mesh_attrib)
+ */
+#define MESH_FACES	NUM_GOAT3D_MESH_ATTRIBS
+
+struct mesh_view {
+	void *data;
+	int count;
+};
+
+/* data lists of a mesh left in a binary scene file, to be read on first
+ * access (GOAT3D_OPT_LAZYMESH). The file is owned by the scene.
+ */
+struct mesh_lazy {
+	FILE *fp;
+	long offs[NUM_GOAT3D_MESH_ATTRIBS + 1];		/* -1 for lists not in the file */
+	int count[NUM_GOAT3D_MESH_ATTRIBS + 1];
+	int failed;		/* set by g3dimpl_mesh_fetch if reading failed */
+};
+
+struct bvh;
+
 struct goat3d_mesh {
 	OBJECT_COMMON;
 	struct goat3d_material *mtl;
 
+	/* object-space bounds of the vertices, computed on demand */
+	struct aabox bbox;
+	int bbox_valid;
+
 	/* dynamic arrays */
 	cgm_vec3 *vertices;
 	cgm_vec3 *normals;
@@ -89,6 +132,24 @@ struct goat3d_mesh {
 	cgm_vec4 *colors;
 	struct face *faces;
 	struct goat3d_node **bones;
+
+	/* read-only arrays pointing into a memory-mapped binary file (see
+	 * goat3d_load_mapped). When set, they take precedence over the dynamic
+	 * arrays above. Any modification copies them to the dynarrs first.
+	 */
+	struct mesh_view mapped[NUM_GOAT3D_MESH_ATTRIBS + 1];
+	/* external mesh file the mapped arrays point into, if any */
+	struct extmesh *ext;
+	/* lists not read yet, if loaded with GOAT3D_OPT_LAZYMESH. Cleared by
+	 * g3dimpl_mesh_fetch, which may run from const accessors on any thread,
+	 * so it's read with g3dimpl_load_acquire. The table itself is kept in
+	 * lazy_done until the mesh is destroyed, for concurrent count queries.
+	 */
+	struct mesh_lazy *lazy;
+	struct mesh_lazy *lazy_done;
+
+	/* triangle BVH (goat3d_mesh_build_bvh), dropped when the mesh changes */
+	struct bvh *bvh;
 };
 
 struct goat3d_light {
@@ -112,6 +173,8 @@ struct goat3d_camera {
 struct goat3d_node {
 	char *name;
 	enum goat3d_node_type type;
+	struct goat3d *scn;		/* scene this node was added to */
+	int idx;				/* index in the scene nodes array */
 	void *obj;
 	int child_count;
 
@@ -128,6 +191,8 @@ struct goat3d_node {
 	/* matrix computed from the above*/
 	float matrix[16];
 	int matrix_valid;
+	/* world matrix in the scene xform array is up to date */
+	int world_valid;
 
 	struct goat3d_node *parent;
 	struct goat3d_node *child;
@@ -135,6 +200,11 @@ struct goat3d_node {
 };
 
 
+struct file_mapping {
+	void *addr;
+	long size;
+};
+
 struct goat3d {
 	unsigned int flags;
 	char *search_path;
@@ -150,9 +220,27 @@ struct goat3d {
 	struct goat3d_node **nodes;
 	struct goat3d_anim **anims;
 
+	/* name -> index lookup for each of the arrays above */
+	struct name_table names[NUM_NAME_TABLES];
+
 	struct aabox bbox;
 	int bbox_valid;
 
+	/* world matrices of all nodes, computed by goat3d_update_matrices */
+	float *xform;			/* dynarr, 16 floats per node, indexed like nodes */
+	int *xform_order;		/* dynarr, node indices with parents before children */
+	int xform_order_valid;
+
+	/* memory-mapped files referenced by mesh data (goat3d_load_mapped) */
+	struct file_mapping *fmaps;	/* dynarr */
+	/* open files mesh data are read from on demand (GOAT3D_OPT_LAZYMESH) */
+	FILE **datafiles;			/* dynarr */
+
+	/* asynchronous loader currently filling this scene, if any. Only written
+	 * by the thread which started the load (see async.c)
+	 */
+	struct goat3d_loader *loader;
+
 	/* namegen */
 	unsigned int namecnt[7];
 	char namebuf[64];
@@ -170,7 +258,28 @@ void goat3d_clear(struct goat3d *g);
 int g3dimpl_obj_init(struct object *o, int type);
 void g3dimpl_obj_destroy(struct object *o);
 
+/* bounds of the mesh vertices, or if xform is not null, bounds of the cached
+ * object-space box transformed by it
+ */
 void g3dimpl_mesh_bounds(struct aabox *bb, struct goat3d_mesh *m, float *xform);
+/* invalidate cached bounds and BVH, whenever vertex positions change */
+void g3dimpl_mesh_invalidate(struct goat3d_mesh *m);
+
+/* access mesh vertex attributes (or MESH_FACES), whether they're in the
+ * dynamic arrays or mapped from a file.
+ */
+void *g3dimpl_mesh_data(const struct goat3d_mesh *m, int attr);
+int g3dimpl_mesh_count(const struct goat3d_mesh *m, int attr);
+void *g3dimpl_mesh_elem(const struct goat3d_mesh *m, int attr, int idx);
+int g3dimpl_mesh_elemsize(int attr);
+/* resize the dynamic array of a vertex attribute (or MESH_FACES) and return it */
+void *g3dimpl_mesh_alloc(struct goat3d_mesh *m, int attr, int count);
+/* copy any mapped data into the dynamic arrays, before modifying the mesh */
+int g3dimpl_mesh_unmap(struct goat3d_mesh *m);
+/* replace the dynamic array of a vertex attribute (or MESH_FACES) with arr, or
+ * empty it if arr is null, without invalidating anything derived from it
+ */
+void g3dimpl_mesh_setarr(struct goat3d_mesh *m, int attr, void *arr);
 
 int g3dimpl_mtl_init(struct goat3d_material *mtl);
 void g3dimpl_mtl_destroy(struct goat3d_material *mtl);
@@ -192,10 +301,53 @@ int g3dimpl_anmload(struct goat3d *g, struct goat3d_io *io);
 int g3dimpl_scnsave(const struct goat3d *g, struct goat3d_io *io);
 int g3dimpl_anmsave(const struct goat3d *g, struct goat3d_io *io);
 
+/* defined in readbin.c */
+int g3dimpl_loadbin(struct goat3d *g, struct goat3d_io *io);
+/* load from a memory-mapped file, referencing mesh data in place if possible */
+int g3dimpl_loadbin_mapped(struct goat3d *g, void *addr, long size);
+/* load the data lists of an external mesh file, starting with a CNK_MESH chunk */
+int g3dimpl_loadbin_mesh(struct goat3d_mesh *mesh, struct goat3d_io *io);
+/* load from fp (wrapped by io), leaving mesh data lists in the file */
+int g3dimpl_loadbin_lazy(struct goat3d *g, struct goat3d_io *io, FILE *fp);
+/* read the data lists left in the file by g3dimpl_loadbin_lazy. Safe to call
+ * from multiple threads. If reading fails, the lists are left empty, and it
+ * keeps returning -1.
+ */
+int g3dimpl_mesh_fetch(struct goat3d_mesh *mesh);
+
+/* defined in writebin.c */
+int g3dimpl_savebin(const struct goat3d *g, struct goat3d_io *io);
+
+/* defined in bvh.c */
+void g3dimpl_mesh_free_bvh(struct goat3d_mesh *m);
+
+/* defined in meshops.c */
+/* temporary copy of a mesh with its data reordered by
+ * goat3d_optimize_mesh_indices, for saving with GOAT3D_OPT_OPTMESH without
+ * changing the scene. Name, material and bones are shared with the original,
+ * so free it only with g3dimpl_mesh_free_optcopy. Returns null on failure.
+ */
+struct goat3d_mesh *g3dimpl_mesh_optcopy(const struct goat3d_mesh *mesh);
+void g3dimpl_mesh_free_optcopy(struct goat3d_mesh *copy);
+
 /* defined in extmesh.c */
+struct extmesh;
+/* load mesh data from an external file (or the cache), and map it to the mesh */
 int g3dimpl_loadmesh(struct goat3d_mesh *mesh, const char *fname);
+void g3dimpl_release_extmesh(struct extmesh *ext);
 
 /* defined in readgltf.c */
 int g3dimpl_loadgltf(struct goat3d *g, struct goat3d_io *io);
 
+/* defined in async.c */
+/* starts loading from io on a new thread. If fp is not null, it's closed when
+ * loading is done, and if basename is not null, it's used as the scene name if
+ * the file doesn't provide one.
+ */
+struct goat3d_loader *g3dimpl_load_async(struct goat3d *g, struct goat3d_io *io,
+		FILE *fp, const char *basename);
+/* progress reporting and cancellation checks, called by the loaders */
+void g3dimpl_load_addobj(struct goat3d_loader *ldr);
+int g3dimpl_load_cancelled(struct goat3d *g);
+
 #endif	/* GOAT3D_SCENE_H_ */
@@ -22,11 +22,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "g3dscn.h"
 #include "log.h"
 #include "dynarr.h"
-
+#include "chunk.h"
+
+#if defined(unix) || defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define USE_MMAP
+#elif defined(_WIN32)
+#include <windows.h>
+#define USE_MMAP
+#endif
+
+static const char *set_search_path(struct goat3d *g, const char *fname);
+static int load_lazy(struct goat3d *g, FILE *fp);
 static long read_file(void *buf, size_t bytes, void *uptr);
 static long write_file(const void *buf, size_t bytes, void *uptr);
 static long seek_file(long offs, int whence, void *uptr);
+static void *map_file(const char *fname, long *sizeret);
+static void unmap_file(void *addr, long size);
 static char *clean_filename(char *str);
+static int add_named(struct goat3d *g, int tab, void *arrp, void *objp, const char *name);
+static int rename_obj(struct goat3d *g, int tab, char **dest, const char *name, int idx);
+static void invalidate_subtree(struct goat3d_node *node);
 
 static const char *def_scn_name = "unnamed";
 
@@ -76,6 +96,10 @@ int goat3d_init(struct goat3d *g)
 	if(!(g->cameras = dynarr_alloc(0, sizeof *g->cameras))) goto err;
 	if(!(g->nodes = dynarr_alloc(0, sizeof *g->nodes))) goto err;
 	if(!(g->anims = dynarr_alloc(0, sizeof *g->anims))) goto err;
+	if(!(g->fmaps = dynarr_alloc(0, sizeof *g->fmaps))) goto err;
+	if(!(g->datafiles = dynarr_alloc(0, sizeof *g->datafiles))) goto err;
+	if(!(g->xform = dynarr_alloc(0, 16 * sizeof *g->xform))) goto err;
+	if(!(g->xform_order = dynarr_alloc(0, sizeof *g->xform_order))) goto err;
 
 	return 0;
 
@@ -86,6 +110,8 @@ err:
 
 void goat3d_destroy(struct goat3d *g)
 {
+	int i;
+
 	goat3d_clear(g);
 
 	dynarr_free(g->materials);
@@ -94,6 +120,14 @@ void goat3d_destroy(struct goat3d *g)
 	dynarr_free(g->cameras);
 	dynarr_free(g->nodes);
 	dynarr_free(g->anims);
+	dynarr_free(g->fmaps);
+	dynarr_free(g->datafiles);
+	dynarr_free(g->xform);
+	dynarr_free(g->xform_order);
+
+	for(i=0; i<NUM_NAME_TABLES; i++) {
+		g3dimpl_nametab_destroy(g->names + i);
+	}
 }
 
 void goat3d_clear(struct goat3d *g)
@@ -139,6 +173,32 @@ void goat3d_clear(struct goat3d *g)
 		g3dimpl_anim_destroy(g->anims[i]);
 	}
 
+	/* mapped files must be released after the meshes referencing them */
+	if(g->fmaps) {
+		num = dynarr_size(g->fmaps);
+		for(i=0; i<num; i++) {
+			unmap_file(g->fmaps[i].addr, g->fmaps[i].size);
+		}
+		DYNARR_CLEAR(g->fmaps);
+	}
+	if(g->datafiles) {
+		num = dynarr_size(g->datafiles);
+		for(i=0; i<num; i++) {
+			fclose(g->datafiles[i]);
+		}
+		DYNARR_CLEAR(g->datafiles);
+	}
+
+	for(i=0; i<NUM_NAME_TABLES; i++) {
+		g3dimpl_nametab_clear(g->names + i);
+	}
+
+	if(g->xform) {
+		DYNARR_CLEAR(g->xform);
+		DYNARR_CLEAR(g->xform_order);
+	}
+	g->xform_order_valid = 0;
+
 	g->name = 0;
 	g->bbox_valid = 0;
 }
@@ -159,45 +219,115 @@ GOAT3DAPI int goat3d_getopt(const struct goat3d *g, enum goat3d_option opt)
 
 GOAT3DAPI int goat3d_load(struct goat3d *g, const char *fname)
 {
-	int len, res;
-	char *slash;
+	int res;
+	const char *basename;
 	FILE *fp = fopen(fname, "rb");
 	if(!fp) {
 		goat3d_logmsg(LOG_ERROR, "failed to open file \"%s\" for reading: %s\n", fname, strerror(errno));
 		return -1;
 	}
 
-	/* if the filename contained any directory components, keep the prefix
-	 * to use it as a search path for external mesh file loading
-	 */
-	len = strlen(fname);
-	if(!(g->search_path = malloc(len + 1))) {
+	if(!(basename = set_search_path(g, fname))) {
 		fclose(fp);
 		return -1;
 	}
-	memcpy(g->search_path, fname, len + 1);
 
-	if((slash = strrchr(g->search_path, '/'))) {
-		*slash = 0;
+	if(goat3d_getopt(g, GOAT3D_OPT_LAZYMESH) && (res = load_lazy(g, fp)) != -2) {
+		fp = 0;		/* now owned by the scene */
 	} else {
-		if((slash = strrchr(g->search_path, '\\'))) {
-			*slash = 0;
-		} else {
-			free(g->search_path);
-			g->search_path = 0;
+		res = goat3d_load_file(g, fp);
+	}
+
+	if(res == 0) {
+		if(goat3d_get_name(g) == def_scn_name) {
+			goat3d_set_name(g, basename);
 		}
 	}
+	if(fp) {
+		fclose(fp);
+	}
+	return res;
+}
+
+GOAT3DAPI int goat3d_load_mapped(struct goat3d *g, const char *fname)
+{
+	int res;
+	const char *basename;
+	struct file_mapping fmap;
+	struct chunk_header hdr;
+	void *tmp;
 
-	if((res = goat3d_load_file(g, fp)) == 0) {
-		const char *name;
-		if((name = goat3d_get_name(g)) == def_scn_name) {
-			goat3d_set_name(g, slash ? slash + 1 : fname);
+	if(!(fmap.addr = map_file(fname, &fmap.size))) {
+		return goat3d_load(g, fname);
+	}
+
+	/* only binary files can be used in place, load anything else normally */
+	hdr.id = CNK_INVALID;
+	if(fmap.size >= (long)sizeof hdr) {
+		memcpy(&hdr, fmap.addr, sizeof hdr);
+#ifdef GOAT3D_BIGEND
+		goat3d_bswap32(&hdr, 2);
+#endif
+	}
+	if(hdr.id != CNK_SCENE) {
+		unmap_file(fmap.addr, fmap.size);
+		return goat3d_load(g, fname);
+	}
+
+	if(!(tmp = dynarr_push(g->fmaps, &fmap))) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_load_mapped: failed to resize mapping array\n");
+		unmap_file(fmap.addr, fmap.size);
+		return -1;
+	}
+	g->fmaps = tmp;
+
+	if(!(basename = set_search_path(g, fname))) {
+		return -1;
+	}
+
+	/* the mapping is kept even if loading fails, since any meshes added to the
+	 * scene up to that point might reference it.
+	 */
+	if((res = g3dimpl_loadbin_mapped(g, fmap.addr, fmap.size)) == 0) {
+		if(goat3d_get_name(g) == def_scn_name) {
+			goat3d_set_name(g, basename);
 		}
 	}
-	fclose(fp);
 	return res;
 }
 
+GOAT3DAPI struct goat3d_loader *goat3d_load_async(struct goat3d *g, const char *fname)
+{
+	struct goat3d_io io;
+	struct goat3d_loader *ldr;
+	const char *basename;
+	FILE *fp = fopen(fname, "rb");
+	if(!fp) {
+		goat3d_logmsg(LOG_ERROR, "failed to open file \"%s\" for reading: %s\n", fname, strerror(errno));
+		return 0;
+	}
+
+	if(!(basename = set_search_path(g, fname))) {
+		fclose(fp);
+		return 0;
+	}
+
+	io.cls = fp;
+	io.read = read_file;
+	io.write = write_file;
+	io.seek = seek_file;
+
+	if(!(ldr = g3dimpl_load_async(g, &io, fp, basename))) {
+		fclose(fp);
+	}
+	return ldr;
+}
+
+GOAT3DAPI struct goat3d_loader *goat3d_load_async_io(struct goat3d *g, struct goat3d_io *io)
+{
+	return g3dimpl_load_async(g, io, 0, 0);
+}
+
 GOAT3DAPI int goat3d_save(const struct goat3d *g, const char *fname)
 {
 	int res;
@@ -241,9 +371,24 @@ GOAT3DAPI int goat3d_load_io(struct goat3d *g, struct goat3d_io *io)
 
 GOAT3DAPI int goat3d_save_io(const struct goat3d *g, struct goat3d_io *io)
 {
+	int i, num;
+
+	/* read any lazily loaded mesh data first, to fail instead of saving a
+	 * mesh left empty by a read error
+	 */
+	num = dynarr_size(g->meshes);
+	for(i=0; i<num; i++) {
+		if(g3dimpl_mesh_fetch(g->meshes[i]) == -1) {
+			goat3d_logmsg(LOG_ERROR, "failed to read the data of mesh: %s\n", g->meshes[i]->name);
+			return -1;
+		}
+	}
+
 	if(goat3d_getopt(g, GOAT3D_OPT_SAVEXML)) {
 		goat3d_logmsg(LOG_ERROR, "saving in the original xml format is no longer supported\n");
 		return -1;
+	} else if(goat3d_getopt(g, GOAT3D_OPT_SAVEBIN)) {
+		return g3dimpl_savebin(g, io);
 	} else if(goat3d_getopt(g, GOAT3D_OPT_SAVETEXT)) {
 		/* TODO set treestore output format as text */
 	}
@@ -399,13 +544,9 @@ use_mesh_bounds:
 // ---- materials ----
 GOAT3DAPI int goat3d_add_mtl(struct goat3d *g, struct goat3d_material *mtl)
 {
-	struct goat3d_material **newarr;
+	mtl->scn = g;
 	mtl->idx = dynarr_size(g->materials);
-	if(!(newarr = dynarr_push(g->materials, &mtl))) {
-		return -1;
-	}
-	g->materials = newarr;
-	return 0;
+	return add_named(g, NAMES_MTL, &g->materials, &mtl, mtl->name);
 }
 
 GOAT3DAPI int goat3d_get_mtl_count(struct goat3d *g)
@@ -420,13 +561,8 @@ GOAT3DAPI struct goat3d_material *goat3d_get_mtl(struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_material *goat3d_get_mtl_by_name(struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->materials);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->materials[i]->name, name) == 0) {
-			return g->materials[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_MTL, name);
+	return idx >= 0 ? g->materials[idx] : 0;
 }
 
 GOAT3DAPI struct goat3d_material *goat3d_create_mtl(void)
@@ -447,7 +583,7 @@ GOAT3DAPI void goat3d_destroy_mtl(struct goat3d_material *mtl)
 
 GOAT3DAPI int goat3d_set_mtl_name(struct goat3d_material *mtl, const char *name)
 {
-	SETNAME(mtl->name, name);
+	return rename_obj(mtl->scn, NAMES_MTL, &mtl->name, name, mtl->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_mtl_name(const struct goat3d_material *mtl)
@@ -531,12 +667,9 @@ GOAT3DAPI int goat3d_get_mtl_attrib_count(struct goat3d_material *mtl)
 // ---- meshes ----
 GOAT3DAPI int goat3d_add_mesh(struct goat3d *g, struct goat3d_mesh *mesh)
 {
-	struct goat3d_mesh **arr;
-	if(!(arr = dynarr_push(g->meshes, &mesh))) {
-		return -1;
-	}
-	g->meshes = arr;
-	return 0;
+	mesh->scn = g;
+	mesh->idx = dynarr_size(g->meshes);
+	return add_named(g, NAMES_MESH, &g->meshes, &mesh, mesh->name);
 }
 
 GOAT3DAPI int goat3d_get_mesh_count(struct goat3d *g)
@@ -551,13 +684,8 @@ GOAT3DAPI struct goat3d_mesh *goat3d_get_mesh(struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_mesh *goat3d_get_mesh_by_name(struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->meshes);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->meshes[i]->name, name) == 0) {
-			return g->meshes[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_MESH, name);
+	return idx >= 0 ? g->meshes[idx] : 0;
 }
 
 GOAT3DAPI struct goat3d_mesh *goat3d_create_mesh(void)
@@ -582,7 +710,7 @@ GOAT3DAPI void goat3d_destroy_mesh(struct goat3d_mesh *mesh)
 
 GOAT3DAPI int goat3d_set_mesh_name(struct goat3d_mesh *mesh, const char *name)
 {
-	SETNAME(mesh->name, name);
+	return rename_obj(mesh->scn, NAMES_MESH, &mesh->name, name, mesh->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_mesh_name(const struct goat3d_mesh *mesh)
@@ -600,37 +728,27 @@ GOAT3DAPI struct goat3d_material *goat3d_get_mesh_mtl(struct goat3d_mesh *mesh)
 	return mesh->mtl;
 }
 
+GOAT3DAPI int goat3d_fetch_mesh(struct goat3d_mesh *mesh)
+{
+	return g3dimpl_mesh_fetch(mesh);
+}
+
 GOAT3DAPI int goat3d_get_mesh_vertex_count(struct goat3d_mesh *mesh)
 {
-	return dynarr_size(mesh->vertices);
+	return g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
 }
 
 GOAT3DAPI int goat3d_get_mesh_attrib_count(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib)
 {
-	switch(attrib) {
-	case GOAT3D_MESH_ATTR_VERTEX:
-		return dynarr_size(mesh->vertices);
-	case GOAT3D_MESH_ATTR_NORMAL:
-		return dynarr_size(mesh->normals);
-	case GOAT3D_MESH_ATTR_TANGENT:
-		return dynarr_size(mesh->tangents);
-	case GOAT3D_MESH_ATTR_TEXCOORD:
-		return dynarr_size(mesh->texcoords);
-	case GOAT3D_MESH_ATTR_SKIN_WEIGHT:
-		return dynarr_size(mesh->skin_weights);
-	case GOAT3D_MESH_ATTR_SKIN_MATRIX:
-		return dynarr_size(mesh->skin_matrices);
-	case GOAT3D_MESH_ATTR_COLOR:
-		return dynarr_size(mesh->colors);
-	default:
-		break;
+	if((int)attrib < 0 || attrib >= NUM_GOAT3D_MESH_ATTRIBS) {
+		return 0;
 	}
-	return 0;
+	return g3dimpl_mesh_count(mesh, attrib);
 }
 
 GOAT3DAPI int goat3d_get_mesh_face_count(struct goat3d_mesh *mesh)
 {
-	return dynarr_size(mesh->faces);
+	return g3dimpl_mesh_count(mesh, MESH_FACES);
 }
 
 #define SET_VERTEX_DATA(arr, p, n) \
@@ -646,8 +764,14 @@ GOAT3DAPI int goat3d_get_mesh_face_count(struct goat3d_mesh *mesh)
 
 GOAT3DAPI int goat3d_set_mesh_attribs(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib, const void *data, int vnum)
 {
+	if(g3dimpl_mesh_unmap(mesh) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to copy mapped mesh data\n");
+		return -1;
+	}
+
 	if(attrib == GOAT3D_MESH_ATTR_VERTEX) {
 		SET_VERTEX_DATA(mesh->vertices, data, vnum);
+		g3dimpl_mesh_invalidate(mesh);
 		return 0;
 	}
 
@@ -674,6 +798,7 @@ GOAT3DAPI int goat3d_set_mesh_attribs(struct goat3d_mesh *mesh, enum goat3d_mesh
 		break;
 	case GOAT3D_MESH_ATTR_COLOR:
 		SET_VERTEX_DATA(mesh->colors, data, vnum);
+		break;
 	default:
 		goat3d_logmsg(LOG_ERROR, "trying to set unknown vertex attrib: %d\n", attrib);
 		return -1;
@@ -706,6 +831,10 @@ GOAT3DAPI int goat3d_add_mesh_attrib4f(struct goat3d_mesh *mesh, enum goat3d_mes
 	int4 intvec;
 	void *tmp;
 
+	if(g3dimpl_mesh_unmap(mesh) == -1) {
+		goto err;
+	}
+
 	switch(attrib) {
 	case GOAT3D_MESH_ATTR_VERTEX:
 		cgm_vcons((cgm_vec3*)vec, x, y, z);
@@ -713,6 +842,7 @@ GOAT3DAPI int goat3d_add_mesh_attrib4f(struct goat3d_mesh *mesh, enum goat3d_mes
 			goto err;
 		}
 		mesh->vertices = tmp;
+		g3dimpl_mesh_invalidate(mesh);
 		break;
 
 	case GOAT3D_MESH_ATTR_NORMAL:
@@ -764,6 +894,7 @@ GOAT3DAPI int goat3d_add_mesh_attrib4f(struct goat3d_mesh *mesh, enum goat3d_mes
 			goto err;
 		}
 		mesh->colors = tmp;
+		break;
 
 	default:
 		goat3d_logmsg(LOG_ERROR, "trying to add unknown vertex attrib: %d\n", attrib);
@@ -776,6 +907,18 @@ err:
 	return -1;
 }
 
+/* the pointers returned to the user are writable, so data still in a read-only
+ * mapping, or in an external mesh shared through the cache, is copied first
+ */
+static void *writable_elem(struct goat3d_mesh *mesh, int attr, int idx)
+{
+	if(mesh->mapped[attr].data && g3dimpl_mesh_unmap(mesh) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to copy mapped mesh data: %s\n", mesh->name);
+		return 0;
+	}
+	return g3dimpl_mesh_elem(mesh, attr, idx);
+}
+
 GOAT3DAPI void *goat3d_get_mesh_attribs(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib)
 {
 	return goat3d_get_mesh_attrib(mesh, attrib, 0);
@@ -783,36 +926,19 @@ GOAT3DAPI void *goat3d_get_mesh_attribs(struct goat3d_mesh *mesh, enum goat3d_me
 
 GOAT3DAPI void *goat3d_get_mesh_attrib(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib, int idx)
 {
-	switch(attrib) {
-	case GOAT3D_MESH_ATTR_VERTEX:
-		return dynarr_empty(mesh->vertices) ? 0 : mesh->vertices + idx;
-	case GOAT3D_MESH_ATTR_NORMAL:
-		return dynarr_empty(mesh->normals) ? 0 : mesh->normals + idx;
-	case GOAT3D_MESH_ATTR_TANGENT:
-		return dynarr_empty(mesh->tangents) ? 0 : mesh->tangents + idx;
-	case GOAT3D_MESH_ATTR_TEXCOORD:
-		return dynarr_empty(mesh->texcoords) ? 0 : mesh->texcoords + idx;
-	case GOAT3D_MESH_ATTR_SKIN_WEIGHT:
-		return dynarr_empty(mesh->skin_weights) ? 0 : mesh->skin_weights + idx;
-	case GOAT3D_MESH_ATTR_SKIN_MATRIX:
-		return dynarr_empty(mesh->skin_matrices) ? 0 : mesh->skin_matrices + idx;
-	case GOAT3D_MESH_ATTR_COLOR:
-		return dynarr_empty(mesh->colors) ? 0 : mesh->colors + idx;
-	default:
-		break;
+	if((int)attrib < 0 || attrib >= NUM_GOAT3D_MESH_ATTRIBS) {
+		return 0;
 	}
-	return 0;
+	return writable_elem(mesh, attrib, idx);
 }
 
 
 GOAT3DAPI int goat3d_set_mesh_faces(struct goat3d_mesh *mesh, const int *data, int num)
 {
-	void *tmp;
-	if(!(tmp = dynarr_resize(mesh->faces, num))) {
+	if(!g3dimpl_mesh_alloc(mesh, MESH_FACES, num)) {
 		goat3d_logmsg(LOG_ERROR, "failed to resize face array (%d)\n", num);
 		return -1;
 	}
-	mesh->faces = tmp;
 	memcpy(mesh->faces, data, num * sizeof *mesh->faces);
 	return 0;
 }
@@ -826,11 +952,16 @@ GOAT3DAPI int goat3d_add_mesh_face(struct goat3d_mesh *mesh, int a, int b, int c
 	face.v[1] = b;
 	face.v[2] = c;
 
+	if(g3dimpl_mesh_unmap(mesh) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to copy mapped mesh data\n");
+		return -1;
+	}
 	if(!(tmp = dynarr_push(mesh->faces, &face))) {
 		goat3d_logmsg(LOG_ERROR, "failed to add face\n");
 		return -1;
 	}
 	mesh->faces = tmp;
+	g3dimpl_mesh_free_bvh(mesh);
 	return 0;
 }
 
@@ -841,7 +972,7 @@ GOAT3DAPI int *goat3d_get_mesh_faces(struct goat3d_mesh *mesh)
 
 GOAT3DAPI int *goat3d_get_mesh_face(struct goat3d_mesh *mesh, int idx)
 {
-	return dynarr_empty(mesh->faces) ? 0 : mesh->faces[idx].v;
+	return writable_elem(mesh, MESH_FACES, idx);
 }
 
 // immedate mode state
@@ -856,6 +987,11 @@ static int im_use[NUM_GOAT3D_MESH_ATTRIBS];
 
 GOAT3DAPI void goat3d_begin(struct goat3d_mesh *mesh, enum goat3d_im_primitive prim)
 {
+	memset(mesh->mapped, 0, sizeof mesh->mapped);
+	if(mesh->ext) {
+		g3dimpl_release_extmesh(mesh->ext);
+		mesh->ext = 0;
+	}
 	DYNARR_CLEAR(mesh->vertices);
 	DYNARR_CLEAR(mesh->normals);
 	DYNARR_CLEAR(mesh->tangents);
@@ -932,6 +1068,7 @@ GOAT3DAPI void goat3d_vertex3f(float x, float y, float z)
 		return;
 	}
 	im_mesh->vertices = tmp;
+	g3dimpl_mesh_invalidate(im_mesh);
 
 	if(im_use[GOAT3D_MESH_ATTR_NORMAL]) {
 		if((tmp = dynarr_push(im_mesh->normals, &im_norm))) {
@@ -1027,12 +1164,9 @@ GOAT3DAPI void goat3d_get_mesh_bounds(const struct goat3d_mesh *mesh, float *bmi
 /* lights */
 GOAT3DAPI int goat3d_add_light(struct goat3d *g, struct goat3d_light *lt)
 {
-	struct goat3d_light **arr;
-	if(!(arr = dynarr_push(g->lights, &lt))) {
-		return -1;
-	}
-	g->lights = arr;
-	return 0;
+	lt->scn = g;
+	lt->idx = dynarr_size(g->lights);
+	return add_named(g, NAMES_LIGHT, &g->lights, &lt, lt->name);
 }
 
 GOAT3DAPI int goat3d_get_light_count(struct goat3d *g)
@@ -1047,13 +1181,8 @@ GOAT3DAPI struct goat3d_light *goat3d_get_light(struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_light *goat3d_get_light_by_name(struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->lights);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->lights[i]->name, name) == 0) {
-			return g->lights[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_LIGHT, name);
+	return idx >= 0 ? g->lights[idx] : 0;
 }
 
 
@@ -1079,7 +1208,7 @@ GOAT3DAPI void goat3d_destroy_light(struct goat3d_light *lt)
 
 GOAT3DAPI int goat3d_set_light_name(struct goat3d_light *lt, const char *name)
 {
-	SETNAME(lt->name, name);
+	return rename_obj(lt->scn, NAMES_LIGHT, &lt->name, name, lt->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_light_name(const struct goat3d_light *lt)
@@ -1090,12 +1219,9 @@ GOAT3DAPI const char *goat3d_get_light_name(const struct goat3d_light *lt)
 /* cameras */
 GOAT3DAPI int goat3d_add_camera(struct goat3d *g, struct goat3d_camera *cam)
 {
-	struct goat3d_camera **arr;
-	if(!(arr = dynarr_push(g->cameras, &cam))) {
-		return -1;
-	}
-	g->cameras = arr;
-	return 0;
+	cam->scn = g;
+	cam->idx = dynarr_size(g->cameras);
+	return add_named(g, NAMES_CAMERA, &g->cameras, &cam, cam->name);
 }
 
 GOAT3DAPI int goat3d_get_camera_count(struct goat3d *g)
@@ -1110,13 +1236,8 @@ GOAT3DAPI struct goat3d_camera *goat3d_get_camera(struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_camera *goat3d_get_camera_by_name(struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->cameras);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->cameras[i]->name, name) == 0) {
-			return g->cameras[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_CAMERA, name);
+	return idx >= 0 ? g->cameras[idx] : 0;
 }
 
 GOAT3DAPI struct goat3d_camera *goat3d_create_camera(void)
@@ -1141,7 +1262,7 @@ GOAT3DAPI void goat3d_destroy_camera(struct goat3d_camera *cam)
 
 GOAT3DAPI int goat3d_set_camera_name(struct goat3d_camera *cam, const char *name)
 {
-	SETNAME(cam->name, name);
+	return rename_obj(cam->scn, NAMES_CAMERA, &cam->name, name, cam->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_camera_name(const struct goat3d_camera *cam)
@@ -1152,12 +1273,11 @@ GOAT3DAPI const char *goat3d_get_camera_name(const struct goat3d_camera *cam)
 /* node */
 GOAT3DAPI int goat3d_add_node(struct goat3d *g, struct goat3d_node *node)
 {
-	struct goat3d_node **arr;
-	if(!(arr = dynarr_push(g->nodes, &node))) {
-		return -1;
-	}
-	g->nodes = arr;
-	return 0;
+	node->scn = g;
+	node->idx = dynarr_size(g->nodes);
+	node->world_valid = 0;
+	g->xform_order_valid = 0;
+	return add_named(g, NAMES_NODE, &g->nodes, &node, node->name);
 }
 
 GOAT3DAPI int goat3d_get_node_count(struct goat3d *g)
@@ -1172,13 +1292,8 @@ GOAT3DAPI struct goat3d_node *goat3d_get_node(struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_node *goat3d_get_node_by_name(struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->nodes);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->nodes[i]->name, name) == 0) {
-			return g->nodes[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_NODE, name);
+	return idx >= 0 ? g->nodes[idx] : 0;
 }
 
 GOAT3DAPI struct goat3d_node *goat3d_create_node(void)
@@ -1208,7 +1323,7 @@ GOAT3DAPI void goat3d_destroy_node(struct goat3d_node *node)
 
 GOAT3DAPI int goat3d_set_node_name(struct goat3d_node *node, const char *name)
 {
-	SETNAME(node->name, name);
+	return rename_obj(node->scn, NAMES_NODE, &node->name, name, node->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_node_name(const struct goat3d_node *node)
@@ -1239,7 +1354,10 @@ GOAT3DAPI void goat3d_add_node_child(struct goat3d_node *node, struct goat3d_nod
 	child->parent = node;
 	node->child_count++;
 
-	child->matrix_valid = 0;
+	if(child->scn) {
+		child->scn->xform_order_valid = 0;
+	}
+	invalidate_subtree(child);
 }
 
 GOAT3DAPI int goat3d_get_node_child_count(const struct goat3d_node *node)
@@ -1261,15 +1379,32 @@ GOAT3DAPI struct goat3d_node *goat3d_get_node_parent(const struct goat3d_node *n
 	return node->parent;
 }
 
+static void invalidate_world(struct goat3d_node *node)
+{
+	struct goat3d_node *c;
+
+	/* an invalid world matrix implies the whole subtree is invalid */
+	if(!node->world_valid) return;
+	node->world_valid = 0;
+
+	c = node->child;
+	while(c) {
+		invalidate_world(c);
+		c = c->next;
+	}
+}
+
 static void invalidate_subtree(struct goat3d_node *node)
 {
 	struct goat3d_node *c = node->child;
 
+	node->matrix_valid = 0;
+	node->world_valid = 0;
+
 	while(c) {
-		invalidate_subtree(c);
+		invalidate_world(c);
 		c = c->next;
 	}
-	node->matrix_valid = 0;
 }
 
 
@@ -1392,10 +1527,101 @@ GOAT3DAPI void goat3d_get_node_matrix(const struct goat3d_node *node, float *mat
 
 GOAT3DAPI void goat3d_get_matrix(const struct goat3d_node *node, float *matrix)
 {
+	float pmat[16];
+
+	if(node->world_valid) {
+		memcpy(matrix, node->scn->xform + node->idx * 16, 16 * sizeof *matrix);
+		return;
+	}
+
 	goat3d_get_node_matrix(node, matrix);
 	if(node->parent) {
-		cgm_mmul(matrix, node->parent->matrix);
+		goat3d_get_matrix(node->parent, pmat);
+		cgm_mmul(matrix, pmat);
+	}
+}
+
+static int sort_nodes(struct goat3d *g)
+{
+	int i, head, num = dynarr_size(g->nodes);
+	int *order;
+	struct goat3d_node *n;
+
+	if(!(order = dynarr_resize(g->xform_order, num))) {
+		goat3d_logmsg(LOG_ERROR, "failed to resize node order array\n");
+		return -1;
+	}
+	g->xform_order = order;
+
+	/* breadth-first from the roots, using the order array as the queue */
+	head = 0;
+	for(i=0; i<num; i++) {
+		if(!g->nodes[i]->parent || g->nodes[i]->parent->scn != g) {
+			order[head++] = i;
+		}
+	}
+	for(i=0; i<head; i++) {
+		n = g->nodes[order[i]]->child;
+		while(n) {
+			if(n->scn == g && head < num) {
+				order[head++] = n->idx;
+			}
+			n = n->next;
+		}
+	}
+	if(head < num) {
+		goat3d_logmsg(LOG_WARNING, "goat3d_update_matrices: %d nodes unreachable from the roots\n", num - head);
+		DYNARR_RESIZE(g->xform_order, head);
+	}
+
+	g->xform_order_valid = 1;
+	return 0;
+}
+
+GOAT3DAPI int goat3d_update_matrices(struct goat3d *g)
+{
+	int i, num = dynarr_size(g->nodes);
+	float *xform;
+	struct goat3d_node *n;
+
+	if(dynarr_size(g->xform) != num) {
+		if(!(xform = dynarr_resize(g->xform, num))) {
+			goat3d_logmsg(LOG_ERROR, "failed to resize world matrix array\n");
+			return -1;
+		}
+		/* the array may have moved, so everything has to be recomputed */
+		for(i=0; i<num; i++) {
+			g->nodes[i]->world_valid = 0;
+		}
+		g->xform = xform;
 	}
+	if(!g->xform_order_valid && sort_nodes(g) == -1) {
+		return -1;
+	}
+
+	num = dynarr_size(g->xform_order);
+	for(i=0; i<num; i++) {
+		n = g->nodes[g->xform_order[i]];
+		if(n->world_valid) continue;
+
+		xform = g->xform + n->idx * 16;
+		if(!n->matrix_valid) {
+			calc_node_matrix(n, n->matrix);
+			n->matrix_valid = 1;
+		}
+		memcpy(xform, n->matrix, sizeof n->matrix);
+		if(n->parent && n->parent->scn == g) {
+			/* parents come first, so their world matrix is already valid */
+			cgm_mmul(xform, g->xform + n->parent->idx * 16);
+		}
+		n->world_valid = 1;
+	}
+	return 0;
+}
+
+GOAT3DAPI const float *goat3d_get_matrices(const struct goat3d *g)
+{
+	return g->xform;
 }
 
 GOAT3DAPI void goat3d_get_node_bounds(const struct goat3d_node *node, float *bmin, float *bmax)
@@ -1418,37 +1644,24 @@ static const int key_val_sz[] = {1, 3, 4, 4};
 
 GOAT3DAPI struct goat3d_track *goat3d_create_track(void)
 {
-	int i;
 	struct goat3d_track *trk;
 
 	if(!(trk = calloc(1, sizeof *trk))) {
 		return 0;
 	}
-
-	for(i=0; i<4; i++) {
-		if(anm_init_track(trk->trk + i) == -1) {
-			while(--i >= 0) {
-				anm_destroy_track(trk->trk + i);
-			}
-			free(trk);
-			return 0;
-		}
+	if(anm_init_track(&trk->trk, 1) == -1) {
+		free(trk);
+		return 0;
 	}
-
 	return trk;
 }
 
 GOAT3DAPI void goat3d_destroy_track(struct goat3d_track *trk)
 {
-	int i;
-
 	if(!trk) return;
 
 	free(trk->name);
-
-	for(i=0; i<4; i++) {
-		anm_destroy_track(trk->trk + i);
-	}
+	anm_destroy_track(&trk->trk);
 }
 
 GOAT3DAPI int goat3d_set_track_name(struct goat3d_track *trk, const char *name)
@@ -1461,20 +1674,34 @@ GOAT3DAPI const char *goat3d_get_track_name(const struct goat3d_track *trk)
 	return trk->name;
 }
 
-GOAT3DAPI void goat3d_set_track_type(struct goat3d_track *trk, enum goat3d_track_type type)
+GOAT3DAPI int goat3d_set_track_type(struct goat3d_track *trk, enum goat3d_track_type type)
 {
-	trk->type = type;
+	float prev_def[ANM_MAX_COMP];
+
+	/* the new defaults fill in any components added to existing keys */
+	memcpy(prev_def, trk->trk.def_val, sizeof prev_def);
 
 	switch(BASETYPE(type)) {
 	case GOAT3D_TRACK_QUAT:
 	case GOAT3D_TRACK_VEC4:
-		anm_set_track_default(trk->trk + 3, 1);
+		anm_set_track_default(&trk->trk, 3, 1);
 	case GOAT3D_TRACK_VEC3:
-		anm_set_track_default(trk->trk + 1, 0);
-		anm_set_track_default(trk->trk + 2, 0);
+		anm_set_track_default(&trk->trk, 1, 0);
+		anm_set_track_default(&trk->trk, 2, 0);
 	case GOAT3D_TRACK_VAL:
-		anm_set_track_default(trk->trk + 0, 0);
+		anm_set_track_default(&trk->trk, 0, 0);
 	}
+	if(anm_set_track_components(&trk->trk, key_val_sz[BASETYPE(type)]) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to convert track keyframe values\n");
+		memcpy(trk->trk.def_val, prev_def, sizeof prev_def);
+		return -1;
+	}
+
+	trk->type = type;
+	if(trk->anim) {
+		trk->anim->bind_valid = 0;
+	}
+	return 0;
 }
 
 GOAT3DAPI enum goat3d_track_type goat3d_get_track_type(const struct goat3d_track *trk)
@@ -1485,6 +1712,9 @@ GOAT3DAPI enum goat3d_track_type goat3d_get_track_type(const struct goat3d_track
 GOAT3DAPI void goat3d_set_track_node(struct goat3d_track *trk, struct goat3d_node *node)
 {
 	trk->node = node;
+	if(trk->anim) {
+		trk->anim->bind_valid = 0;
+	}
 }
 
 GOAT3DAPI struct goat3d_node *goat3d_get_track_node(const struct goat3d_track *trk)
@@ -1494,71 +1724,44 @@ GOAT3DAPI struct goat3d_node *goat3d_get_track_node(const struct goat3d_track *t
 
 GOAT3DAPI void goat3d_set_track_interp(struct goat3d_track *trk, enum goat3d_interp in)
 {
-	int i;
-	for(i=0; i<4; i++) {
-		anm_set_track_interpolator(trk->trk + i, in);
-	}
+	anm_set_track_interpolator(&trk->trk, in);
 }
 
 GOAT3DAPI enum goat3d_interp goat3d_get_track_interp(const struct goat3d_track *trk)
 {
-	return trk->trk[0].interp;
+	return trk->trk.interp;
 }
 
 GOAT3DAPI void goat3d_set_track_extrap(struct goat3d_track *trk, enum goat3d_extrap ex)
 {
-	int i;
-	for(i=0; i<4; i++) {
-		anm_set_track_extrapolator(trk->trk + i, ex);
-	}
+	anm_set_track_extrapolator(&trk->trk, ex);
 }
 
 GOAT3DAPI enum goat3d_extrap goat3d_get_track_extrap(const struct goat3d_track *trk)
 {
-	return trk->trk[0].extrap;
+	return trk->trk.extrap;
 }
 
 GOAT3DAPI int goat3d_set_track_key(struct goat3d_track *trk, const struct goat3d_key *key)
 {
-	int i, num;
-	enum goat3d_track_type basetype;
-	long tm = ANM_MSEC2TM(key->tm);
-
-	basetype = BASETYPE(trk->type);	/* e.g. ROT -> QUAT */
-	num = key_val_sz[basetype];
-
-	for(i=0; i<num; i++) {
-		if(anm_set_value(trk->trk + i, tm, key->val[i]) == -1) {
-			return -1;
-		}
-	}
-	return 0;
+	return anm_set_keyframe(&trk->trk, ANM_MSEC2TM(key->tm), key->val);
 }
 
 GOAT3DAPI int goat3d_get_track_key(const struct goat3d_track *trk, int idx, struct goat3d_key *key)
 {
-	int i, num;
-	struct anm_keyframe *akey;
-	enum goat3d_track_type basetype;
+	const float *val;
 
-	basetype = BASETYPE(trk->type);
-	num = key_val_sz[basetype];
-
-	for(i=0; i<num; i++) {
-		if(!(akey = anm_get_keyframe(trk->trk + i, idx))) {
-			return -1;
-		}
-		if(i == 0) {
-			key->tm = ANM_TM2MSEC(akey->time);
-		}
-		key->val[i] = akey->val;
+	if(!(val = anm_get_key_value(&trk->trk, idx))) {
+		return -1;
 	}
+	key->tm = ANM_TM2MSEC(anm_get_key_time(&trk->trk, idx));
+	memcpy(key->val, val, trk->trk.ncomp * sizeof *val);
 	return 0;
 }
 
 GOAT3DAPI int goat3d_get_track_key_count(const struct goat3d_track *trk)
 {
-	return trk->trk[0].count;
+	return trk->trk.count;
 }
 
 GOAT3DAPI int goat3d_set_track_val(struct goat3d_track *trk, long msec, float val)
@@ -1655,12 +1858,13 @@ GOAT3DAPI void goat3d_get_track_val(const struct goat3d_track *trk, long msec, f
 		return;
 	}
 
-	*valp = anm_get_value(trk->trk, tm);
+	anm_get_value(&trk->trk, tm, valp);
 }
 
 GOAT3DAPI void goat3d_get_track_vec3(const struct goat3d_track *trk, long msec, float *xp, float *yp, float *zp)
 {
 	enum goat3d_track_type basetype;
+	float val[4];
 	anm_time_t tm = ANM_MSEC2TM(msec);
 
 	basetype = BASETYPE(trk->type);
@@ -1671,14 +1875,16 @@ GOAT3DAPI void goat3d_get_track_vec3(const struct goat3d_track *trk, long msec,
 		return;
 	}
 
-	*xp = anm_get_value(trk->trk, tm);
-	*yp = anm_get_value(trk->trk + 1, tm);
-	*zp = anm_get_value(trk->trk + 2, tm);
+	anm_get_value(&trk->trk, tm, val);
+	*xp = val[0];
+	*yp = val[1];
+	*zp = val[2];
 }
 
 GOAT3DAPI void goat3d_get_track_vec4(const struct goat3d_track *trk, long msec, float *xp, float *yp, float *zp, float *wp)
 {
 	enum goat3d_track_type basetype;
+	float val[4];
 	anm_time_t tm = ANM_MSEC2TM(msec);
 
 	basetype = BASETYPE(trk->type);
@@ -1689,10 +1895,11 @@ GOAT3DAPI void goat3d_get_track_vec4(const struct goat3d_track *trk, long msec,
 		return;
 	}
 
-	*xp = anm_get_value(trk->trk, tm);
-	*yp = anm_get_value(trk->trk + 1, tm);
-	*zp = anm_get_value(trk->trk + 2, tm);
-	*wp = anm_get_value(trk->trk + 3, tm);
+	anm_get_value(&trk->trk, tm, val);
+	*xp = val[0];
+	*yp = val[1];
+	*zp = val[2];
+	*wp = val[3];
 }
 
 GOAT3DAPI void goat3d_get_track_quat(const struct goat3d_track *trk, long msec, float *xp, float *yp, float *zp, float *wp)
@@ -1709,7 +1916,7 @@ GOAT3DAPI void goat3d_get_track_quat(const struct goat3d_track *trk, long msec,
 		return;
 	}
 
-	anm_get_quat(trk->trk, trk->trk + 1, trk->trk + 2, trk->trk + 3, tm, quat);
+	anm_get_quat(&trk->trk, tm, quat);
 	*xp = quat[0];
 	*yp = quat[1];
 	*zp = quat[2];
@@ -1718,40 +1925,37 @@ GOAT3DAPI void goat3d_get_track_quat(const struct goat3d_track *trk, long msec,
 
 GOAT3DAPI long goat3d_get_track_timeline(const struct goat3d_track *trk, long *tstart, long *tend)
 {
-	int i, j, num;
-	enum goat3d_track_type basetype;
-	struct anm_keyframe *key;
-	anm_time_t start = ANM_TIME_MAX;
-	anm_time_t end = ANM_TIME_MIN;
-
-	basetype = BASETYPE(trk->type);
-	num = key_val_sz[basetype];
-
-	for(i=0; i<num; i++) {
-		for(j=0; j<trk->trk[i].count; j++) {
-			key = anm_get_keyframe(trk->trk + i, j);
-			if(key->time < start) start = key->time;
-			if(key->time > end) end = key->time;
-		}
-	}
-
-	if(end < start) {
+	if(!trk->trk.count) {
 		return -1;
 	}
-	*tstart = ANM_TM2MSEC(start);
-	*tend = ANM_TM2MSEC(end);
+	/* keys are kept sorted by time */
+	*tstart = ANM_TM2MSEC(trk->trk.times[0]);
+	*tend = ANM_TM2MSEC(trk->trk.times[trk->trk.count - 1]);
 	return *tend - *tstart;
 }
 
+GOAT3DAPI int goat3d_sample_track(const struct goat3d_track *trk, long msec,
+		struct goat3d_track_cursor *cur, float *val)
+{
+	struct anm_cursor acur;
+	anm_time_t tm = ANM_MSEC2TM(msec);
+
+	acur.key = cur->key;
+	if(BASETYPE(trk->type) == GOAT3D_TRACK_QUAT) {
+		anm_get_quat_cursor(&trk->trk, tm, &acur, val);
+	} else {
+		anm_get_value_cursor(&trk->trk, tm, &acur, val);
+	}
+	cur->key = acur.key;
+	return trk->trk.ncomp;
+}
+
 /* animation */
 GOAT3DAPI int goat3d_add_anim(struct goat3d *g, struct goat3d_anim *anim)
 {
-	struct goat3d_anim **arr;
-	if(!(arr = dynarr_push(g->anims, &anim))) {
-		return -1;
-	}
-	g->anims = arr;
-	return 0;
+	anim->scn = g;
+	anim->idx = dynarr_size(g->anims);
+	return add_named(g, NAMES_ANIM, &g->anims, &anim, anim->name);
 }
 
 GOAT3DAPI int goat3d_get_anim_count(const struct goat3d *g)
@@ -1766,13 +1970,8 @@ GOAT3DAPI struct goat3d_anim *goat3d_get_anim(const struct goat3d *g, int idx)
 
 GOAT3DAPI struct goat3d_anim *goat3d_get_anim_by_name(const struct goat3d *g, const char *name)
 {
-	int i, num = dynarr_size(g->anims);
-	for(i=0; i<num; i++) {
-		if(strcmp(g->anims[i]->name, name) == 0) {
-			return g->anims[i];
-		}
-	}
-	return 0;
+	int idx = g3dimpl_nametab_find(g->names + NAMES_ANIM, name);
+	return idx >= 0 ? g->anims[idx] : 0;
 }
 
 GOAT3DAPI struct goat3d_anim *goat3d_create_anim(void)
@@ -1797,7 +1996,7 @@ GOAT3DAPI void goat3d_destroy_anim(struct goat3d_anim *anim)
 
 GOAT3DAPI int goat3d_set_anim_name(struct goat3d_anim *anim, const char *name)
 {
-	SETNAME(anim->name, name);
+	return rename_obj(anim->scn, NAMES_ANIM, &anim->name, name, anim->idx);
 }
 
 GOAT3DAPI const char *goat3d_get_anim_name(const struct goat3d_anim *anim)
@@ -1813,6 +2012,8 @@ GOAT3DAPI int goat3d_add_anim_track(struct goat3d_anim *anim, struct goat3d_trac
 		return -1;
 	}
 	anim->tracks = tmptrk;
+	trk->anim = anim;
+	anim->bind_valid = 0;
 	return 0;
 }
 
@@ -1873,7 +2074,118 @@ GOAT3DAPI long goat3d_get_anim_timeline(const struct goat3d_anim *anim, long *ts
 }
 
 
+GOAT3DAPI int goat3d_eval_anim(struct goat3d *g, struct goat3d_anim *anim, long msec)
+{
+	int i, num;
+	struct anim_binding *b;
+	struct goat3d_node *n;
+	anm_time_t tm = ANM_MSEC2TM(msec);
+
+	if(!anim) {
+		num = dynarr_size(g->nodes);
+		for(i=0; i<num; i++) {
+			n = g->nodes[i];
+			if(n->has_anim) {
+				n->has_anim = 0;
+				invalidate_subtree(n);
+			}
+		}
+		return 0;
+	}
+
+	if(g3dimpl_anim_bind(anim) == -1) {
+		return -1;
+	}
+
+	b = anim->bind;
+	num = dynarr_size(anim->bind);
+	for(i=0; i<num; i++) {
+		n = b->node;
+
+		if(b->pos) {
+			anm_get_value_cursor(&b->pos->trk, tm, b->cur, &n->apos.x);
+		} else {
+			n->apos = n->pos;
+		}
+		if(b->rot) {
+			anm_get_quat_cursor(&b->rot->trk, tm, b->cur + 1, &n->arot.x);
+		} else {
+			n->arot = n->rot;
+		}
+		if(b->scale) {
+			anm_get_value_cursor(&b->scale->trk, tm, b->cur + 2, &n->ascale.x);
+		} else {
+			n->ascale = n->scale;
+		}
+
+		n->has_anim = 1;
+		invalidate_subtree(n);
+		b++;
+	}
+	return 0;
+}
+
+
+/* if the filename contains any directory components, keep the prefix to use
+ * it as a search path for external mesh file loading. Returns the filename
+ * part of fname.
+ */
+static const char *set_search_path(struct goat3d *g, const char *fname)
+{
+	int len;
+	char *slash;
+
+	free(g->search_path);
+
+	len = strlen(fname);
+	if(!(g->search_path = malloc(len + 1))) {
+		return 0;
+	}
+	memcpy(g->search_path, fname, len + 1);
+
+	if((slash = strrchr(g->search_path, '/'))) {
+		*slash = 0;
+	} else {
+		if((slash = strrchr(g->search_path, '\\'))) {
+			*slash = 0;
+		} else {
+			free(g->search_path);
+			g->search_path = 0;
+		}
+	}
+	return slash ? slash + 1 : fname;
+}
+
+/* loads a binary scene, leaving mesh data in the file to be read on demand.
+ * Returns -2 without taking ownership of fp if it's not a binary scene file.
+ * Otherwise the file is added to the scene's data files, and kept open even if
+ * loading fails, since meshes added up to that point might refer to it.
+ */
+static int load_lazy(struct goat3d *g, FILE *fp)
+{
+	struct goat3d_io io;
+	struct chunk_header hdr;
+	void *tmp;
+
+	io.cls = fp;
+	io.read = read_file;
+	io.write = write_file;
+	io.seek = seek_file;
 
+	if(g3dimpl_read_chunk_header(&hdr, &io) == -1 || hdr.id != CNK_SCENE) {
+		rewind(fp);
+		return -2;
+	}
+	rewind(fp);
+
+	if(!(tmp = dynarr_push(g->datafiles, &fp))) {
+		goat3d_logmsg(LOG_ERROR, "load_lazy: failed to resize data file array\n");
+		return -2;
+	}
+	g->datafiles = tmp;
+
+	return g3dimpl_loadbin_lazy(g, &io, fp);
+}
 
 static long read_file(void *buf, size_t bytes, void *uptr)
 {
@@ -1893,6 +2205,79 @@ static long seek_file(long offs, int whence, void *uptr)
 	return ftell((FILE*)uptr);
 }
 
+#if defined(USE_MMAP) && !defined(_WIN32)
+static void *map_file(const char *fname, long *sizeret)
+{
+	int fd;
+	struct stat st;
+	void *addr;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return 0;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size <= 0) {
+		close(fd);
+		return 0;
+	}
+	addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if(addr == MAP_FAILED) {
+		return 0;
+	}
+	*sizeret = st.st_size;
+	return addr;
+}
+
+static void unmap_file(void *addr, long size)
+{
+	munmap(addr, size);
+}
+
+#elif defined(USE_MMAP) && defined(_WIN32)
+static void *map_file(const char *fname, long *sizeret)
+{
+	HANDLE fd, fmap;
+	DWORD size;
+	void *addr;
+
+	fd = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
+	if(fd == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	if((size = GetFileSize(fd, 0)) == INVALID_FILE_SIZE || !size) {
+		CloseHandle(fd);
+		return 0;
+	}
+	if(!(fmap = CreateFileMapping(fd, 0, PAGE_READONLY, 0, 0, 0))) {
+		CloseHandle(fd);
+		return 0;
+	}
+	addr = MapViewOfFile(fmap, FILE_MAP_READ, 0, 0, 0);
+	/* the view keeps a reference to the mapping object and the file */
+	CloseHandle(fmap);
+	CloseHandle(fd);
+
+	*sizeret = size;
+	return addr;
+}
+
+static void unmap_file(void *addr, long size)
+{
+	UnmapViewOfFile(addr);
+}
+
+#else
+static void *map_file(const char *fname, long *sizeret)
+{
+	return 0;
+}
+
+static void unmap_file(void *addr, long size)
+{
+}
+#endif
+
 static char *clean_filename(char *str)
 {
 	char *last_slash, *ptr;
@@ -1912,3 +2297,52 @@ static char *clean_filename(char *str)
 	*ptr = 0;
 	return str;
 }
+
+/* push an object pointer to one of the scene object arrays (arrp points to the
+ * dynarr pointer), and register its name in the corresponding lookup table
+ */
+static int add_named(struct goat3d *g, int tab, void *arrp, void *objp, const char *name)
+{
+	void *arr, **dynarr = arrp;
+	int idx = dynarr_size(*dynarr);
+
+	if(g3dimpl_nametab_add(g->names + tab, name, idx) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to add \"%s\" to the name lookup table\n", name);
+		return -1;
+	}
+	if(!(arr = dynarr_push(*dynarr, objp))) {
+		g3dimpl_nametab_remove(g->names + tab, name);
+		return -1;
+	}
+	*dynarr = arr;
+
+	if(g->loader) {
+		g3dimpl_load_addobj(g->loader);
+	}
+	return 0;
+}
+
+/* set the name of an object, updating the name lookup table of its scene
+ * if it's been added to one
+ */
+static int rename_obj(struct goat3d *g, int tab, char **dest, const char *name, int idx)
+{
+	char *tmpname;
+	int len = strlen(name);
+
+	if(!(tmpname = malloc(len + 1))) {
+		return -1;
+	}
+	memcpy(tmpname, name, len + 1);
+
+	if(g) {
+		if(g3dimpl_nametab_add(g->names + tab, tmpname, idx) == -1) {
+			free(tmpname);
+			return -1;
+		}
+		g3dimpl_nametab_remove(g->names + tab, *dest);
+	}
+	free(*dest);
+	*dest = tmpname;
+	return 0;
+}
@@ -81,6 +81,14 @@ struct goat3d_key {
 	float val[4];
 };
 
+/* Track sampling cursor (see goat3d_sample_track). Remembers the keyframe
+ * interval of the last sample, to speed up evaluation when time advances in
+ * small steps. Any initial value is valid.
+ */
+struct goat3d_track_cursor {
+	int key;
+};
+
 /* track interpolation modes */
 enum goat3d_interp {
 	GOAT3D_INTERP_STEP,
@@ -99,14 +107,63 @@ enum goat3d_option {
 	GOAT3D_OPT_SAVEXML,		/* save in XML format (dropped) */
 	GOAT3D_OPT_SAVETEXT,	/* save in text format */
 	GOAT3D_OPT_SAVEBINDATA,	/* save mesh data in text files as binary blobs */
-	GOAT3D_OPT_SAVEBIN,		/* not implemented yet */
+	GOAT3D_OPT_SAVEBIN,		/* save in binary chunk format */
 	GOAT3D_OPT_SAVEGLTF,	/* not implemented yet */
 	GOAT3D_OPT_SAVEGLB,		/* not implemented yet */
+	GOAT3D_OPT_THREADS,		/* decode mesh data on all CPU cores when loading */
+	GOAT3D_OPT_LAZYMESH,	/* read binary mesh data on first access (goat3d_load) */
+	GOAT3D_OPT_OPTMESH,		/* save mesh data reordered for the vertex cache */
 
 	NUM_GOAT3D_OPTIONS
 };
 
+enum goat3d_load_status {
+	GOAT3D_LOAD_RUNNING,
+	GOAT3D_LOAD_DONE,
+	GOAT3D_LOAD_FAILED,
+	GOAT3D_LOAD_CANCELLED
+};
+
+/* asynchronous load progress (see goat3d_load_poll) */
+struct goat3d_load_progress {
+	long bytes;		/* bytes of input consumed so far */
+	long total;		/* size of the input, or -1 if unknown */
+	int objects;	/* materials, meshes, lights, cameras, nodes and animations created */
+};
+
+/* vertex component formats for goat3d_get_mesh_interleaved */
+enum goat3d_vertex_format {
+	GOAT3D_VFMT_FLOAT,		/* 32bit float */
+	GOAT3D_VFMT_HALF,		/* 16bit half float */
+	GOAT3D_VFMT_SNORM16,	/* 16bit signed normalized, -1 to 1 as -32767 to 32767 */
+	GOAT3D_VFMT_UNORM16,	/* 16bit unsigned normalized, 0 to 1 as 0 to 65535 */
+	GOAT3D_VFMT_SNORM8,		/* 8bit signed normalized, -1 to 1 as -127 to 127 */
+	GOAT3D_VFMT_UNORM8,		/* 8bit unsigned normalized, 0 to 1 as 0 to 255 */
+	/* integer formats, only for GOAT3D_MESH_ATTR_SKIN_MATRIX */
+	GOAT3D_VFMT_INT32,
+	GOAT3D_VFMT_UINT16,
+	GOAT3D_VFMT_UINT8,
+
+	NUM_GOAT3D_VERTEX_FORMATS
+};
+
+/* one attribute of an interleaved vertex layout */
+struct goat3d_vertex_elem {
+	enum goat3d_mesh_attrib attrib;
+	enum goat3d_vertex_format format;
+	int ncomp;		/* components to write (1-4), 0 for as many as the attribute has */
+	int offset;		/* byte offset from the start of each vertex */
+};
+
+/* ray-mesh intersection (see goat3d_mesh_ray) */
+struct goat3d_ray_hit {
+	float t;		/* distance along the ray, in multiples of dir */
+	int face;		/* index of the face hit, or -1 for no hit */
+	float u, v;		/* barycentric coordinates of the hit point: v0 + u (v1 - v0) + v (v2 - v0) */
+};
+
 struct goat3d;
+struct goat3d_loader;
 struct goat3d_material;
 struct goat3d_mtlattr;
 struct goat3d_mesh;
@@ -115,6 +172,7 @@ struct goat3d_camera;
 struct goat3d_node;
 struct goat3d_anim;
 struct goat3d_track;
+struct goat3d_bvh;
 
 struct goat3d_io {
 	void *cls;	/* closure data */
@@ -145,6 +203,35 @@ GOAT3DAPI int goat3d_save_file(const struct goat3d *g, FILE *fp);
 GOAT3DAPI int goat3d_load_io(struct goat3d *g, struct goat3d_io *io);
 GOAT3DAPI int goat3d_save_io(const struct goat3d *g, struct goat3d_io *io);
 
+/* memory-map a binary scene file, and use mesh data directly from the mapping
+ * instead of copying it. The mapping is owned by the goat3d object, and is
+ * released by goat3d_free. Mesh data are copied when first modified, or when
+ * the pointers to them are requested (goat3d_get_mesh_attribs).
+ * Falls back to goat3d_load for text/gltf files, or if mmap is not available.
+ */
+GOAT3DAPI int goat3d_load_mapped(struct goat3d *g, const char *fname);
+
+/* asynchronous loading: the scene is parsed on a background thread, and the
+ * returned handle can be polled, waited on, or cancelled. The goat3d object
+ * must not be accessed until the load is finished (poll no longer returns
+ * GOAT3D_LOAD_RUNNING, or wait has returned). The io structure is copied, and
+ * its callbacks are called from the loader thread. On failure or cancellation
+ * the scene may be left partially loaded.
+ */
+GOAT3DAPI struct goat3d_loader *goat3d_load_async(struct goat3d *g, const char *fname);
+GOAT3DAPI struct goat3d_loader *goat3d_load_async_io(struct goat3d *g, struct goat3d_io *io);
+
+/* returns the load status (enum goat3d_load_status), and if prog is not null,
+ * fills it in with the current progress
+ */
+GOAT3DAPI int goat3d_load_poll(struct goat3d_loader *ldr, struct goat3d_load_progress *prog);
+/* blocks until the load is finished, returns 0 on success, -1 otherwise */
+GOAT3DAPI int goat3d_load_wait(struct goat3d_loader *ldr);
+/* asks the loader to stop as soon as possible, without waiting for it */
+GOAT3DAPI void goat3d_load_cancel(struct goat3d_loader *ldr);
+/* waits for the load to finish, and frees the handle */
+GOAT3DAPI void goat3d_load_free(struct goat3d_loader *ldr);
+
 /* load/save animation files (g must already be loaded to load animations) */
 GOAT3DAPI int goat3d_load_anim(struct goat3d *g, const char *fname);
 GOAT3DAPI int goat3d_save_anim(const struct goat3d *g, const char *fname);
@@ -205,6 +292,18 @@ GOAT3DAPI const char *goat3d_get_mesh_name(const struct goat3d_mesh *mesh);
 GOAT3DAPI void goat3d_set_mesh_mtl(struct goat3d_mesh *mesh, struct goat3d_material *mtl);
 GOAT3DAPI struct goat3d_material *goat3d_get_mesh_mtl(struct goat3d_mesh *mesh);
 
+/* with GOAT3D_OPT_LAZYMESH, binary scene files loaded with goat3d_load only
+ * record where mesh data lists are in the file, and keep it open until the
+ * scene is cleared. Any access to the data of a mesh (but not the counts, or
+ * the bounds stored in files written by goat3d) reads all its lists;
+ * goat3d_fetch_mesh does it explicitly. Returns -1 if reading fails, 0
+ * otherwise, or if there's nothing left to read. A mesh whose data can't be
+ * read is left empty, and saving a scene with it fails. Fetching is
+ * serialized, so a lazily loaded mesh can be queried from multiple threads at
+ * once (goat3d_mesh_ray and the like).
+ */
+GOAT3DAPI int goat3d_fetch_mesh(struct goat3d_mesh *mesh);
+
 GOAT3DAPI int goat3d_get_mesh_vertex_count(struct goat3d_mesh *mesh);
 GOAT3DAPI int goat3d_get_mesh_attrib_count(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib);
 GOAT3DAPI int goat3d_get_mesh_face_count(struct goat3d_mesh *mesh);
@@ -229,7 +328,13 @@ GOAT3DAPI int goat3d_add_mesh_attrib3f(struct goat3d_mesh *mesh, enum goat3d_mes
 		float x, float y, float z);
 GOAT3DAPI int goat3d_add_mesh_attrib4f(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib,
 		float x, float y, float z, float w);
-/* returns a pointer to the beginning of the requested mesh attribute array */
+/* returns a pointer to the beginning of the requested mesh attribute array.
+ * The data can be modified through it (see goat3d_get_mesh_bounds). Data
+ * still in a file mapping (goat3d_load_mapped) or shared with other meshes
+ * using the same external mesh file are copied to the mesh first, by this and
+ * the other mesh data getters. goat3d_get_mesh_interleaved reads without
+ * copying.
+ */
 GOAT3DAPI void *goat3d_get_mesh_attribs(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib);
 /* returns a pointer to the requested mesh attribute */
 GOAT3DAPI void *goat3d_get_mesh_attrib(struct goat3d_mesh *mesh, enum goat3d_mesh_attrib attrib, int idx);
@@ -243,7 +348,8 @@ GOAT3DAPI int *goat3d_get_mesh_faces(struct goat3d_mesh *mesh);
 GOAT3DAPI int *goat3d_get_mesh_face(struct goat3d_mesh *mesh, int idx);
 
 /* immediate mode OpenGL-like interface for setting mesh data
- *  NOTE: using this interface will result in no vertex sharing between faces
+ *  NOTE: using this interface will result in no vertex sharing between faces,
+ *        call goat3d_weld_mesh after goat3d_end to merge duplicate vertices
  * NOTE2: the immedate mode interface is not thread-safe, either use locks, or don't
  *        use it at all in multithreaded situations.
  */
@@ -258,8 +364,60 @@ GOAT3DAPI void goat3d_skin_matrix4i(int x, int y, int z, int w);
 GOAT3DAPI void goat3d_color3f(float x, float y, float z);
 GOAT3DAPI void goat3d_color4f(float x, float y, float z, float w);
 
+/* merges vertices with identical attributes, and changes the faces to share
+ * them. If epsilon is not 0, attributes which round to the same multiple of
+ * epsilon count as identical. The first vertex of each group is kept as is.
+ * Returns the new number of vertices, or -1 on error.
+ */
+GOAT3DAPI int goat3d_weld_mesh(struct goat3d_mesh *mesh, float epsilon);
+/* reorders the faces to make the most of the GPU post-transform vertex cache,
+ * and then the vertices in the order the faces use them. The mesh looks the
+ * same, but face and vertex indices change. Saving with GOAT3D_OPT_OPTMESH
+ * writes copies of the meshes reordered this way, leaving the scene as is.
+ * Returns 0, or -1 on error.
+ */
+GOAT3DAPI int goat3d_optimize_mesh_indices(struct goat3d_mesh *mesh);
+
+/* fills buf with the vertices of the mesh, stride bytes apart, each with the
+ * attributes described by the num_elem elements of layout, converted to their
+ * formats. Components past the ones an attribute has are filled in with 0,
+ * or 1 for the fourth, as are attributes the mesh doesn't have. Values out of
+ * range of the normalized formats are clamped. buf must have room for
+ * goat3d_get_mesh_vertex_count(mesh) vertices. Returns the number of vertices
+ * written, or -1 on error.
+ */
+GOAT3DAPI int goat3d_get_mesh_interleaved(const struct goat3d_mesh *mesh,
+		const struct goat3d_vertex_elem *layout, int num_elem, void *buf, int stride);
+
+/* mesh bounds are cached, and recomputed after the vertex positions are changed
+ * through the API. Writing through pointers returned by goat3d_get_mesh_attribs
+ * is not tracked; set the vertices again with goat3d_set_mesh_attribs.
+ */
 GOAT3DAPI void goat3d_get_mesh_bounds(const struct goat3d_mesh *mesh, float *bmin, float *bmax);
 
+/* builds a triangle BVH to speed up ray casting against the mesh. It's saved
+ * in binary files (.g3db), and loaded back with them. It's dropped when the
+ * vertex positions or faces are changed through the API; after writing through
+ * pointers, call goat3d_mesh_build_bvh again.
+ */
+GOAT3DAPI int goat3d_mesh_build_bvh(struct goat3d_mesh *mesh);
+GOAT3DAPI int goat3d_mesh_has_bvh(const struct goat3d_mesh *mesh);
+GOAT3DAPI void goat3d_mesh_free_bvh(struct goat3d_mesh *mesh);
+
+/* finds the nearest face hit by the ray closer than tmax (in multiples of dir),
+ * using the BVH if there is one, or testing every face otherwise. Returns 1
+ * and fills in hit if there's a hit, 0 if not, or -1 on error.
+ */
+GOAT3DAPI int goat3d_mesh_ray(const struct goat3d_mesh *mesh, const float *origin, const float *dir,
+		float tmax, struct goat3d_ray_hit *hit);
+/* same for count rays, with 3 floats per origin and direction, and one tmax
+ * and hit each. With a BVH, rays are traced in packets of 8, which is faster
+ * for coherent rays (neighbouring pixels, nearby probe directions...).
+ * Returns the number of rays which hit something, or -1 on error.
+ */
+GOAT3DAPI int goat3d_mesh_ray_packet(const struct goat3d_mesh *mesh, int count, const float *origins,
+		const float *dirs, const float *tmax, struct goat3d_ray_hit *hits);
+
 /* lights (TODO) */
 GOAT3DAPI int goat3d_add_light(struct goat3d *g, struct goat3d_light *lt);
 GOAT3DAPI int goat3d_get_light_count(struct goat3d *g);
@@ -320,8 +478,49 @@ GOAT3DAPI void goat3d_get_node_matrix(const struct goat3d_node *node, float *mat
 /* same as above, but also takes hierarchy into account */
 GOAT3DAPI void goat3d_get_matrix(const struct goat3d_node *node, float *matrix);
 
+/* compute the world matrices of all nodes in the scene, in a single pass over
+ * the hierarchy. Only nodes whose transformation (or that of an ancestor)
+ * changed since the last call are recomputed.
+ */
+GOAT3DAPI int goat3d_update_matrices(struct goat3d *g);
+/* returns the array of world matrices computed by goat3d_update_matrices,
+ * 16 floats per node, in the same order as goat3d_get_node. The pointer is
+ * invalidated by the next call to goat3d_update_matrices if nodes were added.
+ */
+GOAT3DAPI const float *goat3d_get_matrices(const struct goat3d *g);
+
+/* world-space bounds of the node subtree, made of the cached mesh bounds
+ * transformed by the node matrices, which may be looser than the bounds of the
+ * transformed vertices
+ */
 GOAT3DAPI void goat3d_get_node_bounds(const struct goat3d_node *node, float *bmin, float *bmax);
 
+/* bounding volume hierarchy over the world-space bounds of all mesh nodes
+ * (see goat3d_get_node_bounds, without the children), for visibility and
+ * picking queries. The BVH must be rebuilt after adding or removing nodes,
+ * and refitted after moving them.
+ */
+GOAT3DAPI struct goat3d_bvh *goat3d_build_bvh(struct goat3d *g);
+GOAT3DAPI void goat3d_free_bvh(struct goat3d_bvh *bvh);
+/* updates the node bounds in place, without rebuilding the tree. Cheap, but
+ * queries get slower as nodes move far from where they were at build time.
+ */
+GOAT3DAPI int goat3d_refit_bvh(struct goat3d_bvh *bvh);
+
+/* calls func for each mesh node whose bounds are not completely outside any
+ * of the planes (at most 32, given as a, b, c, d with ax + by + cz + d >= 0
+ * on the inside). Returns the number of nodes visited, or -1 on error.
+ */
+GOAT3DAPI int goat3d_bvh_frustum(struct goat3d_bvh *bvh, const float *planes, int nplanes,
+		void (*func)(struct goat3d_node*, void*), void *cls);
+/* calls func for each mesh node whose bounds are hit by the ray closer than
+ * tmax (in multiples of dir), roughly nearest first. func returns the new tmax,
+ * so that returning the distance of an actual hit prunes farther nodes, and
+ * returning tmax keeps going. Returns 0, or -1 on error.
+ */
+GOAT3DAPI int goat3d_bvh_ray(struct goat3d_bvh *bvh, const float *origin, const float *dir, float tmax,
+		float (*func)(struct goat3d_node*, float, void*), void *cls);
+
 /* keyframe track */
 GOAT3DAPI struct goat3d_track *goat3d_create_track(void);
 GOAT3DAPI void goat3d_destroy_track(struct goat3d_track *trk);
@@ -329,7 +528,10 @@ GOAT3DAPI void goat3d_destroy_track(struct goat3d_track *trk);
 GOAT3DAPI int goat3d_set_track_name(struct goat3d_track *trk, const char *name);
 GOAT3DAPI const char *goat3d_get_track_name(const struct goat3d_track *trk);
 
-GOAT3DAPI void goat3d_set_track_type(struct goat3d_track *trk, enum goat3d_track_type type);
+/* changing the type of a track with keyframes converts their values, and
+ * fails leaving the track unchanged if that can't be done
+ */
+GOAT3DAPI int goat3d_set_track_type(struct goat3d_track *trk, enum goat3d_track_type type);
 GOAT3DAPI enum goat3d_track_type goat3d_get_track_type(const struct goat3d_track *trk);
 
 GOAT3DAPI void goat3d_set_track_node(struct goat3d_track *trk, struct goat3d_node *node);
@@ -356,6 +558,13 @@ GOAT3DAPI void goat3d_get_track_quat(const struct goat3d_track *trk, long msec,
 
 GOAT3DAPI long goat3d_get_track_timeline(const struct goat3d_track *trk, long *tstart, long *tend);
 
+/* evaluate a track of any type, writing as many values as the track type has
+ * components to val (at most 4), and returning the number of components. Uses
+ * and updates the cursor, which should be kept per track by the caller.
+ */
+GOAT3DAPI int goat3d_sample_track(const struct goat3d_track *trk, long msec,
+		struct goat3d_track_cursor *cur, float *val);
+
 /* animation */
 GOAT3DAPI int goat3d_add_anim(struct goat3d *g, struct goat3d_anim *anim);
 GOAT3DAPI int goat3d_get_anim_count(const struct goat3d *g);
@@ -376,6 +585,26 @@ GOAT3DAPI int goat3d_get_anim_track_count(const struct goat3d_anim *anim);
 
 GOAT3DAPI long goat3d_get_anim_timeline(const struct goat3d_anim *anim, long *tstart, long *tend);
 
+/* evaluate the position, rotation and scaling tracks of an animation at the
+ * specified time, and apply the results to the nodes they're attached to. The
+ * animated transformation takes precedence over the node's own, and affects
+ * node and world matrices. Passing a null anim reverts all nodes to their
+ * static transformation.
+ */
+GOAT3DAPI int goat3d_eval_anim(struct goat3d *g, struct goat3d_anim *anim, long msec);
+
+/* vectorized operations on arrays of packed 3-component vectors, like the
+ * vertex, normal and tangent arrays of meshes. Matrices are 4x4, in the same
+ * layout as node matrices.
+ */
+/* bounds of count vectors. If count is 0, bmin is FLT_MAX and bmax -FLT_MAX */
+GOAT3DAPI void goat3d_calc_bounds(const float *varr, int count, float *bmin, float *bmax);
+/* transform positions (w = 1), or directions (w = 0, normals should be
+ * transformed by the inverse transpose). dest may be the same as src.
+ */
+GOAT3DAPI void goat3d_xform_points(float *dest, const float *src, int count, const float *xform);
+GOAT3DAPI void goat3d_xform_dirs(float *dest, const float *src, int count, const float *xform);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,439 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <math.h>
+#include "g3dscn.h"
+#include "util.h"
+#include "log.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VFMT_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* Interleaved vertex export. Vertices are processed in blocks, and for each
+ * element of the layout the block is first gathered from the attribute array
+ * into a packed array of exactly as many components as the element has, then
+ * converted to its format as one flat run of values, and finally scattered
+ * into the destination buffer with the caller's stride. Only the middle step
+ * depends on the format, and it runs over plain arrays, which is where the
+ * SIMD kernels come in.
+ *
+ * The kernels round the same way as the scalar code: clamping with NaN going
+ * to the low end of the range, then rounding to nearest even in the default
+ * rounding mode (cvtps2dq and lrintf), so results don't depend on the CPU.
+ */
+
+#define BLOCK_SIZE	256
+#define MAX_ELEMS	16
+
+typedef int (*half_func)(uint16_t *dest, const float *src, int count);
+typedef int (*norm_func)(void *dest, const float *src, int count, int fmt);
+
+static half_func get_half_simd(void);
+static norm_func get_norm_simd(void);
+
+static const int fmt_size[] = {4, 2, 2, 2, 1, 1, 4, 2, 1};
+
+
+static uint16_t float_to_half(float f)
+{
+	uint32_t x, sign, mant, rem, half;
+	int shift;
+
+	memcpy(&x, &f, 4);
+	sign = (x >> 16) & 0x8000;
+	x &= 0x7fffffff;
+
+	if(x >= 0x7f800000) {
+		/* infinity, or NaN keeping the top of the payload, made quiet */
+		return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 | ((x >> 13) & 0x3ff) : 0);
+	}
+	if(x >= 0x477ff000) {
+		return sign | 0x7c00;	/* rounds past 65504 */
+	}
+	if(x < 0x38800000) {
+		/* half denormal, in units of 2^-24 */
+		if(x < 0x33000000) {
+			return sign;		/* up to 2^-25 rounds to 0 */
+		}
+		mant = (x & 0x7fffff) | 0x800000;
+		shift = 126 - (x >> 23);
+		half = 1 << (shift - 1);
+		rem = mant & ((half << 1) - 1);
+		mant >>= shift;
+		if(rem > half || (rem == half && (mant & 1))) {
+			mant++;
+		}
+		return sign | mant;
+	}
+	/* rebias the exponent from 127 to 15, and round the mantissa to even */
+	x += 0xc8000fff + ((x >> 13) & 1);
+	return sign | (x >> 13);
+}
+
+static void conv_half(uint16_t *dest, const float *src, int count, half_func simd)
+{
+	int i = 0;
+
+	if(simd) {
+		i = simd(dest, src, count);
+	}
+	for(; i<count; i++) {
+		dest[i] = float_to_half(src[i]);
+	}
+}
+
+static void conv_norm(void *dest, const float *src, int count, int fmt, norm_func simd)
+{
+	int i = 0;
+	float x, lo, scale;
+
+	if(simd) {
+		i = simd(dest, src, count, fmt);
+	}
+
+	lo = fmt == GOAT3D_VFMT_SNORM16 || fmt == GOAT3D_VFMT_SNORM8 ? -1.0f : 0.0f;
+	switch(fmt) {
+	case GOAT3D_VFMT_SNORM16: scale = 32767.0f; break;
+	case GOAT3D_VFMT_UNORM16: scale = 65535.0f; break;
+	case GOAT3D_VFMT_SNORM8: scale = 127.0f; break;
+	default: scale = 255.0f;
+	}
+
+	for(; i<count; i++) {
+		x = src[i] > lo ? src[i] : lo;
+		x = x < 1.0f ? x : 1.0f;
+		switch(fmt) {
+		case GOAT3D_VFMT_SNORM16:
+			((int16_t*)dest)[i] = lrintf(x * scale);
+			break;
+		case GOAT3D_VFMT_UNORM16:
+			((uint16_t*)dest)[i] = lrintf(x * scale);
+			break;
+		case GOAT3D_VFMT_SNORM8:
+			((int8_t*)dest)[i] = lrintf(x * scale);
+			break;
+		default:
+			((uint8_t*)dest)[i] = lrintf(x * scale);
+		}
+	}
+}
+
+static void conv_int(void *dest, const int *src, int count, int fmt)
+{
+	int i, x;
+
+	switch(fmt) {
+	case GOAT3D_VFMT_INT32:
+		memcpy(dest, src, count * sizeof *src);
+		break;
+
+	case GOAT3D_VFMT_UINT16:
+		for(i=0; i<count; i++) {
+			x = src[i] > 0 ? src[i] : 0;
+			((uint16_t*)dest)[i] = x < 65535 ? x : 65535;
+		}
+		break;
+
+	default:
+		for(i=0; i<count; i++) {
+			x = src[i] > 0 ? src[i] : 0;
+			((uint8_t*)dest)[i] = x < 255 ? x : 255;
+		}
+	}
+}
+
+static int check_elem(const struct goat3d_mesh *mesh, const struct goat3d_vertex_elem *elem,
+		int stride, int nverts)
+{
+	int attr = elem->attrib, fmt = elem->format, ncomp, count;
+
+	if(attr < 0 || attr >= NUM_GOAT3D_MESH_ATTRIBS) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: invalid attribute: %d\n", attr);
+		return -1;
+	}
+	if(fmt < 0 || fmt >= NUM_GOAT3D_VERTEX_FORMATS) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: invalid vertex format: %d\n", fmt);
+		return -1;
+	}
+	if(attr == GOAT3D_MESH_ATTR_SKIN_MATRIX) {
+		if(fmt != GOAT3D_VFMT_FLOAT && fmt != GOAT3D_VFMT_HALF && fmt < GOAT3D_VFMT_INT32) {
+			goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: skin matrix indices can't be normalized\n");
+			return -1;
+		}
+	} else if(fmt >= GOAT3D_VFMT_INT32) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: integer format for floating point attribute %d\n", attr);
+		return -1;
+	}
+
+	ncomp = elem->ncomp ? elem->ncomp : g3dimpl_mesh_elemsize(attr) / 4;
+	if(ncomp < 1 || ncomp > 4) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: invalid number of components: %d\n", ncomp);
+		return -1;
+	}
+	if(elem->offset < 0 || elem->offset + ncomp * fmt_size[fmt] > stride) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: attribute %d at offset %d doesn't fit in a %d byte vertex\n",
+				attr, elem->offset, stride);
+		return -1;
+	}
+
+	if((count = g3dimpl_mesh_count(mesh, attr)) && count != nverts) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: mesh %s has %d elements of attribute %d, for %d vertices\n",
+				mesh->name, count, attr, nverts);
+		return -1;
+	}
+	return ncomp;
+}
+
+/* gathers ncomp components of count vertices into dest, as floats, or as ints
+ * if to_int is set, padding with (0, 0, 0, 1) past the components the source
+ * has. A null src is an attribute the mesh doesn't have. Returns dest, or src
+ * itself if it's already laid out the right way.
+ */
+static const void *gather(void *dest, const void *src, int srccomp, int src_int,
+		int ncomp, int to_int, int count)
+{
+	int i, j, n;
+	float *fdest = dest;
+	int *idest = dest;
+	const float *fsrc = src;
+	const int *isrc = src;
+
+	if(src && srccomp == ncomp && src_int == to_int) {
+		return src;
+	}
+
+	n = src ? (srccomp < ncomp ? srccomp : ncomp) : 0;
+	for(i=0; i<count; i++) {
+		for(j=0; j<n; j++) {
+			if(to_int) {
+				idest[j] = isrc[j];
+			} else {
+				fdest[j] = src_int ? (float)isrc[j] : fsrc[j];
+			}
+		}
+		for(; j<ncomp; j++) {
+			if(to_int) {
+				idest[j] = j == 3;
+			} else {
+				fdest[j] = j == 3 ? 1.0f : 0.0f;
+			}
+		}
+		idest += ncomp;
+		fdest += ncomp;
+		isrc += srccomp;
+		fsrc += srccomp;
+	}
+	return dest;
+}
+
+GOAT3DAPI int goat3d_get_mesh_interleaved(const struct goat3d_mesh *mesh,
+		const struct goat3d_vertex_elem *layout, int num_elem, void *buf, int stride)
+{
+	int i, j, start, count, nverts, ncomp, srccomp, fmt, src_int, to_int, size;
+	int elem_ncomp[MAX_ELEMS];
+	const char *src;
+	const void *vals;
+	char *dest;
+	half_func half_simd;
+	norm_func norm_simd;
+	union {
+		float f[BLOCK_SIZE * 4];
+		int i[BLOCK_SIZE * 4];
+	} tmp;
+	uint32_t conv[BLOCK_SIZE * 4];	/* up to 4 components of 4 bytes */
+
+	if(num_elem < 1 || num_elem > MAX_ELEMS) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: invalid number of layout elements: %d\n", num_elem);
+		return -1;
+	}
+	if(stride <= 0) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_get_mesh_interleaved: invalid stride: %d\n", stride);
+		return -1;
+	}
+	/* counts are taken before any data access, so read lazily loaded data now */
+	if(g3dimpl_mesh_fetch((struct goat3d_mesh*)mesh) == -1) {
+		return -1;
+	}
+
+	nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	for(i=0; i<num_elem; i++) {
+		if((elem_ncomp[i] = check_elem(mesh, layout + i, stride, nverts)) == -1) {
+			return -1;
+		}
+	}
+
+	half_simd = get_half_simd();
+	norm_simd = get_norm_simd();
+
+	for(start=0; start<nverts; start+=BLOCK_SIZE) {
+		count = nverts - start < BLOCK_SIZE ? nverts - start : BLOCK_SIZE;
+
+		for(i=0; i<num_elem; i++) {
+			fmt = layout[i].format;
+			ncomp = elem_ncomp[i];
+			srccomp = g3dimpl_mesh_elemsize(layout[i].attrib) / 4;
+			src_int = layout[i].attrib == GOAT3D_MESH_ATTR_SKIN_MATRIX;
+			to_int = fmt >= GOAT3D_VFMT_INT32;
+
+			if((src = g3dimpl_mesh_data(mesh, layout[i].attrib)) && g3dimpl_mesh_count(mesh, layout[i].attrib)) {
+				src += (size_t)start * srccomp * 4;
+			} else {
+				src = 0;
+			}
+			vals = gather(tmp.f, src, srccomp, src_int, ncomp, to_int, count);
+
+			switch(fmt) {
+			case GOAT3D_VFMT_FLOAT:
+				memcpy(conv, vals, count * ncomp * 4);
+				break;
+			case GOAT3D_VFMT_HALF:
+				conv_half((uint16_t*)conv, vals, count * ncomp, half_simd);
+				break;
+			case GOAT3D_VFMT_INT32:
+			case GOAT3D_VFMT_UINT16:
+			case GOAT3D_VFMT_UINT8:
+				conv_int(conv, vals, count * ncomp, fmt);
+				break;
+			default:
+				conv_norm(conv, vals, count * ncomp, fmt, norm_simd);
+			}
+
+			size = ncomp * fmt_size[fmt];
+			dest = (char*)buf + (size_t)start * stride + layout[i].offset;
+			for(j=0; j<count; j++) {
+				memcpy(dest, (char*)conv + j * size, size);
+				dest += stride;
+			}
+		}
+	}
+	return nverts;
+}
+
+
+#ifdef VFMT_SIMD_X86
+__attribute__((target("f16c")))
+static int half_f16c(uint16_t *dest, const float *src, int count)
+{
+	int i, nblk = count / 4;
+	__m128i h;
+
+	for(i=0; i<nblk; i++) {
+		h = _mm_cvtps_ph(_mm_loadu_ps(src), _MM_FROUND_TO_NEAREST_INT);
+		_mm_storel_epi64((__m128i*)dest, h);
+		src += 4;
+		dest += 4;
+	}
+	return nblk * 4;
+}
+
+/* 16 values at a time: clamp (maxps returns the second operand for NaN, so
+ * lo has to be second), scale and round to 32bit ints, then narrow with
+ * saturating packs. Unsigned 16bit packing is SSE4.1, so unorm16 is offset
+ * to the signed range and back instead.
+ */
+__attribute__((target("sse2")))
+static int norm_sse2(void *dest, const float *src, int count, int fmt)
+{
+	int i, j, nblk = count / 16;
+	__m128 lo, hi, scale;
+	__m128i v[4], bias, p0, p1;
+	char *dptr = dest;
+
+	if(fmt == GOAT3D_VFMT_SNORM16 || fmt == GOAT3D_VFMT_SNORM8) {
+		lo = _mm_set1_ps(-1.0f);
+		scale = _mm_set1_ps(fmt == GOAT3D_VFMT_SNORM16 ? 32767.0f : 127.0f);
+	} else {
+		lo = _mm_setzero_ps();
+		scale = _mm_set1_ps(fmt == GOAT3D_VFMT_UNORM16 ? 65535.0f : 255.0f);
+	}
+	hi = _mm_set1_ps(1.0f);
+	bias = _mm_set1_epi32(32768);
+
+	for(i=0; i<nblk; i++) {
+		for(j=0; j<4; j++) {
+			__m128 x = _mm_max_ps(_mm_loadu_ps(src + j * 4), lo);
+			x = _mm_min_ps(x, hi);
+			v[j] = _mm_cvtps_epi32(_mm_mul_ps(x, scale));
+		}
+		src += 16;
+
+		switch(fmt) {
+		case GOAT3D_VFMT_SNORM16:
+			_mm_storeu_si128((__m128i*)dptr, _mm_packs_epi32(v[0], v[1]));
+			_mm_storeu_si128((__m128i*)dptr + 1, _mm_packs_epi32(v[2], v[3]));
+			dptr += 32;
+			break;
+
+		case GOAT3D_VFMT_UNORM16:
+			for(j=0; j<4; j++) {
+				v[j] = _mm_sub_epi32(v[j], bias);
+			}
+			p0 = _mm_xor_si128(_mm_packs_epi32(v[0], v[1]), _mm_set1_epi16(-32768));
+			p1 = _mm_xor_si128(_mm_packs_epi32(v[2], v[3]), _mm_set1_epi16(-32768));
+			_mm_storeu_si128((__m128i*)dptr, p0);
+			_mm_storeu_si128((__m128i*)dptr + 1, p1);
+			dptr += 32;
+			break;
+
+		case GOAT3D_VFMT_SNORM8:
+			p0 = _mm_packs_epi32(v[0], v[1]);
+			p1 = _mm_packs_epi32(v[2], v[3]);
+			_mm_storeu_si128((__m128i*)dptr, _mm_packs_epi16(p0, p1));
+			dptr += 16;
+			break;
+
+		default:
+			p0 = _mm_packs_epi32(v[0], v[1]);
+			p1 = _mm_packs_epi32(v[2], v[3]);
+			_mm_storeu_si128((__m128i*)dptr, _mm_packus_epi16(p0, p1));
+			dptr += 16;
+		}
+	}
+	return nblk * 16;
+}
+
+static half_func get_half_simd(void)
+{
+	/* f16c instructions are VEX encoded, so they need OS support for AVX */
+	if(__builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c")) {
+		return half_f16c;
+	}
+	return 0;
+}
+
+static norm_func get_norm_simd(void)
+{
+	if(__builtin_cpu_supports("sse2")) {
+		return norm_sse2;
+	}
+	return 0;
+}
+
+#else	/* no SIMD */
+static half_func get_half_simd(void)
+{
+	return 0;
+}
+
+static norm_func get_norm_simd(void)
+{
+	return 0;
+}
+#endif
@@ -0,0 +1,556 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "g3dscn.h"
+#include "dynarr.h"
+#include "util.h"
+#include "log.h"
+
+/* Mesh processing passes, working on the vertex attribute and face arrays
+ * through g3dimpl_mesh_data & co.
+ */
+
+static int check_faces(struct goat3d_mesh *mesh, const char *func);
+static int vertex_attribs(struct goat3d_mesh *mesh, int *attrs, const char *func);
+
+
+/* ---- vertex welding ---- */
+static unsigned int hash_key(const uint32_t *key, int len)
+{
+	int i;
+	unsigned int h = 2166136261u;	/* FNV-1a, a word at a time */
+
+	for(i=0; i<len; i++) {
+		h = (h ^ key[i]) * 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+/* The key of each vertex is all of its attributes, as 32bit words. Floats are
+ * quantized to multiples of epsilon if it's not 0, and negative zeros turned
+ * to positive, so that the same values always produce the same words.
+ */
+static void make_key(uint32_t *key, char **data, const int *attrs, int nattr, int idx, float inv_eps)
+{
+	int i, j, n;
+	float f, *fptr;
+
+	for(i=0; i<nattr; i++) {
+		n = g3dimpl_mesh_elemsize(attrs[i]) / 4;
+		fptr = (float*)(data[i] + idx * n * 4);
+
+		if(attrs[i] == GOAT3D_MESH_ATTR_SKIN_MATRIX) {
+			memcpy(key, fptr, n * 4);
+			key += n;
+			continue;
+		}
+		for(j=0; j<n; j++) {
+			f = fptr[j];
+			if(inv_eps > 0.0f) {
+				f = (float)floor((double)f * inv_eps + 0.5);
+			}
+			if(f == 0.0f) f = 0.0f;
+			memcpy(key++, &f, 4);
+		}
+	}
+}
+
+GOAT3DAPI int goat3d_weld_mesh(struct goat3d_mesh *mesh, float epsilon)
+{
+	int i, j, nverts, nfaces, nattr, keylen, newcount, elemsz, *remap, *table;
+	int attrs[NUM_GOAT3D_MESH_ATTRIBS];
+	char *data[NUM_GOAT3D_MESH_ATTRIBS];
+	unsigned int tabsize, mask, h;
+	uint32_t *keys, *key;
+	struct face *faces;
+
+	if(g3dimpl_mesh_unmap(mesh) == -1) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_weld_mesh: failed to copy mapped mesh data\n");
+		return -1;
+	}
+	if((nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX)) <= 1) {
+		return nverts;
+	}
+	if((nattr = vertex_attribs(mesh, attrs, "goat3d_weld_mesh")) == -1 ||
+			check_faces(mesh, "goat3d_weld_mesh") == -1) {
+		return -1;
+	}
+
+	keylen = 0;
+	for(i=0; i<nattr; i++) {
+		keylen += g3dimpl_mesh_elemsize(attrs[i]) / 4;
+		data[i] = g3dimpl_mesh_data(mesh, attrs[i]);
+	}
+
+	tabsize = 1;
+	while(tabsize < (unsigned int)nverts * 2) tabsize <<= 1;
+	mask = tabsize - 1;
+
+	keys = malloc((size_t)nverts * keylen * sizeof *keys);
+	table = malloc(tabsize * sizeof *table);
+	remap = malloc(nverts * sizeof *remap);
+	if(!keys || !table || !remap) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_weld_mesh: failed to allocate hash table for %d vertices\n", nverts);
+		free(keys);
+		free(table);
+		free(remap);
+		return -1;
+	}
+	memset(table, 0xff, tabsize * sizeof *table);
+
+	/* vertices keep the attributes of their first occurrence, and are moved
+	 * down to their new index as soon as they're found to be unique, which
+	 * never overwrites any vertex still to be looked at.
+	 */
+	newcount = 0;
+	for(i=0; i<nverts; i++) {
+		key = keys + (size_t)i * keylen;
+		make_key(key, data, attrs, nattr, i, epsilon > 0.0f ? 1.0f / epsilon : 0.0f);
+
+		h = hash_key(key, keylen) & mask;
+		while(table[h] >= 0) {
+			if(memcmp(keys + (size_t)table[h] * keylen, key, keylen * sizeof *key) == 0) {
+				break;
+			}
+			h = (h + 1) & mask;
+		}
+
+		if(table[h] >= 0) {
+			remap[i] = remap[table[h]];
+			continue;
+		}
+		table[h] = i;
+		remap[i] = newcount;
+
+		if(newcount != i) {
+			for(j=0; j<nattr; j++) {
+				elemsz = g3dimpl_mesh_elemsize(attrs[j]);
+				memcpy(data[j] + newcount * elemsz, data[j] + i * elemsz, elemsz);
+			}
+		}
+		newcount++;
+	}
+
+	faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+	nfaces = g3dimpl_mesh_count(mesh, MESH_FACES);
+	for(i=0; i<nfaces; i++) {
+		for(j=0; j<3; j++) {
+			faces[i].v[j] = remap[faces[i].v[j]];
+		}
+	}
+
+	free(keys);
+	free(table);
+	free(remap);
+
+	/* shrinking keeps the contents, and drops the cached bounds and BVH */
+	for(i=0; i<nattr; i++) {
+		g3dimpl_mesh_alloc(mesh, attrs[i], newcount);
+	}
+	return newcount;
+}
+
+/* fails if any face refers to a vertex which doesn't exist */
+static int check_faces(struct goat3d_mesh *mesh, const char *func)
+{
+	int i, j, nverts, nfaces;
+	struct face *faces;
+
+	nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	nfaces = g3dimpl_mesh_count(mesh, MESH_FACES);
+	faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+
+	for(i=0; i<nfaces; i++) {
+		for(j=0; j<3; j++) {
+			if(faces[i].v[j] < 0 || faces[i].v[j] >= nverts) {
+				goat3d_logmsg(LOG_ERROR, "%s: mesh %s face %d has invalid vertex index: %d\n",
+						func, mesh->name, i, faces[i].v[j]);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* fills attrs with the vertex attributes the mesh has, and returns how many.
+ * Fails if any of them doesn't have one element per vertex.
+ */
+static int vertex_attribs(struct goat3d_mesh *mesh, int *attrs, const char *func)
+{
+	int i, count, nverts, nattr = 0;
+
+	nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	for(i=0; i<NUM_GOAT3D_MESH_ATTRIBS; i++) {
+		if(!(count = g3dimpl_mesh_count(mesh, i))) {
+			continue;
+		}
+		if(count != nverts) {
+			goat3d_logmsg(LOG_ERROR, "%s: mesh %s has %d elements of attribute %d, for %d vertices\n",
+					func, mesh->name, count, i, nverts);
+			return -1;
+		}
+		attrs[nattr++] = i;
+	}
+	return nattr;
+}
+
+/* ---- vertex cache optimization ---- */
+/* Tom Forsyth's "Linear-Speed Vertex Cache Optimisation": triangles are added
+ * greedily, picking the one with the highest score, which is the sum of the
+ * scores of its vertices. Vertices score higher the more recently they were
+ * used (the position in a simulated LRU cache), and the fewer triangles they
+ * have left to be added (to finish off vertices instead of leaving them hanging
+ * around). Only the triangles of vertices in the cache have their scores
+ * changed after each step, so finding the next one is cheap.
+ */
+#define VCACHE_SIZE			32
+#define CACHE_DECAY_POW		1.5f
+#define LAST_TRI_SCORE		0.75f
+#define VALENCE_BOOST_SCALE	2.0f
+#define VALENCE_BOOST_POW	0.5f
+#define MAX_VALENCE_SCORE	32
+
+struct vcache_vert {
+	int cache_pos;		/* -1 if not in the cache */
+	int num_left;		/* triangles left to be added */
+	int *tris;			/* triangles using it, the first num_left of which aren't added */
+	float score;
+};
+
+struct vcache_scores {
+	float cache[VCACHE_SIZE];
+	float valence[MAX_VALENCE_SCORE];
+};
+
+static void init_scores(struct vcache_scores *sc)
+{
+	int i;
+	float s;
+
+	for(i=0; i<VCACHE_SIZE; i++) {
+		if(i < 3) {
+			/* the vertices of the last triangle score the same, whichever order
+			 * it had them in, and less than the next few, so that strips don't
+			 * go back on themselves
+			 */
+			sc->cache[i] = LAST_TRI_SCORE;
+		} else {
+			s = 1.0f - (float)(i - 3) / (float)(VCACHE_SIZE - 3);
+			sc->cache[i] = powf(s, CACHE_DECAY_POW);
+		}
+	}
+	for(i=0; i<MAX_VALENCE_SCORE; i++) {
+		sc->valence[i] = i ? VALENCE_BOOST_SCALE * powf((float)i, -VALENCE_BOOST_POW) : 0.0f;
+	}
+}
+
+static float vert_score(const struct vcache_vert *v, const struct vcache_scores *sc)
+{
+	float score;
+
+	if(!v->num_left) {
+		return -1.0f;	/* no triangles left, doesn't matter */
+	}
+	score = v->cache_pos >= 0 ? sc->cache[v->cache_pos] : 0.0f;
+	if(v->num_left < MAX_VALENCE_SCORE) {
+		score += sc->valence[v->num_left];
+	}
+	return score;
+}
+
+/* writes the new face order to order, returns -1 if out of memory */
+static int vcache_order(const struct face *faces, int nfaces, int nverts, int *order)
+{
+	int i, j, k, best, next_tri, *adj, *tri_added, cache[VCACHE_SIZE + 3], cache_len, new_len;
+	int newcache[VCACHE_SIZE + 3];
+	float best_score, s;
+	struct vcache_vert *verts, *v;
+	struct vcache_scores sc;
+
+	init_scores(&sc);
+
+	verts = calloc(nverts ? nverts : 1, sizeof *verts);
+	adj = malloc((size_t)nfaces * 3 * sizeof *adj);
+	tri_added = calloc(nfaces, sizeof *tri_added);
+	if(!verts || !adj || !tri_added) {
+		free(verts);
+		free(adj);
+		free(tri_added);
+		return -1;
+	}
+
+	/* triangle lists of all vertices, packed in adj */
+	for(i=0; i<nfaces; i++) {
+		for(j=0; j<3; j++) {
+			verts[faces[i].v[j]].num_left++;
+		}
+	}
+	k = 0;
+	for(i=0; i<nverts; i++) {
+		verts[i].tris = adj + k;
+		k += verts[i].num_left;
+		verts[i].num_left = 0;
+		verts[i].cache_pos = -1;
+	}
+	for(i=0; i<nfaces; i++) {
+		for(j=0; j<3; j++) {
+			v = verts + faces[i].v[j];
+			v->tris[v->num_left++] = i;
+		}
+	}
+	for(i=0; i<nverts; i++) {
+		verts[i].score = vert_score(verts + i, &sc);
+	}
+
+	best = -1;
+	best_score = -1.0f;
+	for(i=0; i<nfaces; i++) {
+		s = verts[faces[i].v[0]].score + verts[faces[i].v[1]].score + verts[faces[i].v[2]].score;
+		if(s > best_score) {
+			best_score = s;
+			best = i;
+		}
+	}
+
+	cache_len = 0;
+	next_tri = 0;
+	for(i=0; i<nfaces; i++) {
+		if(best < 0) {
+			/* nothing in the cache has triangles left, carry on with the next
+			 * triangle in the original order instead of searching them all
+			 */
+			while(tri_added[next_tri]) next_tri++;
+			best = next_tri;
+		}
+
+		order[i] = best;
+		tri_added[best] = 1;
+
+		/* the vertices of the new triangle go to the front of the cache, and
+		 * the triangle is moved out of their lists of triangles left
+		 */
+		new_len = 0;
+		for(j=0; j<3; j++) {
+			int vidx = faces[best].v[j];
+			v = verts + vidx;
+
+			for(k=0; k<v->num_left; k++) {
+				if(v->tris[k] == best) {
+					v->tris[k] = v->tris[--v->num_left];
+					v->tris[v->num_left] = best;
+					break;
+				}
+			}
+			/* degenerate triangles may use a vertex more than once */
+			if(v->cache_pos != -2) {
+				newcache[new_len++] = vidx;
+				v->cache_pos = -2;	/* marks it as already placed */
+			}
+		}
+		for(j=0; j<cache_len; j++) {
+			if(verts[cache[j]].cache_pos != -2) {
+				newcache[new_len++] = cache[j];
+			}
+		}
+
+		/* update the scores of everything in the cache, and of anything which
+		 * just fell out of it
+		 */
+		for(j=0; j<new_len; j++) {
+			v = verts + newcache[j];
+			v->cache_pos = j < VCACHE_SIZE ? j : -1;
+			v->score = vert_score(v, &sc);
+		}
+		cache_len = new_len < VCACHE_SIZE ? new_len : VCACHE_SIZE;
+		memcpy(cache, newcache, cache_len * sizeof *cache);
+
+		/* rescore the triangles left around the cached vertices, and pick
+		 * the best one of those
+		 */
+		best = -1;
+		best_score = -1.0f;
+		for(j=0; j<new_len; j++) {
+			v = verts + newcache[j];
+			for(k=0; k<v->num_left; k++) {
+				int tri = v->tris[k];
+				s = verts[faces[tri].v[0]].score + verts[faces[tri].v[1]].score +
+					verts[faces[tri].v[2]].score;
+				if(s > best_score) {
+					best_score = s;
+					best = tri;
+				}
+			}
+		}
+	}
+
+	free(verts);
+	free(adj);
+	free(tri_added);
+	return 0;
+}
+
+GOAT3DAPI int goat3d_optimize_mesh_indices(struct goat3d_mesh *mesh)
+{
+	int i, j, nverts, nfaces, nattr, elemsz, next, had_bvh, *order, *remap;
+	int attrs[NUM_GOAT3D_MESH_ATTRIBS];
+	struct face *faces, *newfaces;
+	char *data, *tmp = 0;
+
+	if(g3dimpl_mesh_unmap(mesh) == -1) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_optimize_mesh_indices: failed to copy mapped mesh data\n");
+		return -1;
+	}
+	nverts = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX);
+	if((nfaces = g3dimpl_mesh_count(mesh, MESH_FACES)) <= 1) {
+		return 0;
+	}
+	if((nattr = vertex_attribs(mesh, attrs, "goat3d_optimize_mesh_indices")) == -1 ||
+			check_faces(mesh, "goat3d_optimize_mesh_indices") == -1) {
+		return -1;
+	}
+	faces = g3dimpl_mesh_data(mesh, MESH_FACES);
+
+	/* everything is allocated up front, to fail before changing anything */
+	order = malloc(nfaces * sizeof *order);
+	remap = malloc(nverts * sizeof *remap);
+	newfaces = malloc(nfaces * sizeof *newfaces);
+	tmp = malloc((size_t)nverts * sizeof(cgm_vec4));
+	if(!order || !remap || !newfaces || !tmp || vcache_order(faces, nfaces, nverts, order) == -1) {
+		goat3d_logmsg(LOG_ERROR, "goat3d_optimize_mesh_indices: failed to allocate memory\n");
+		goto err;
+	}
+
+	/* vertices are renumbered in the order the new faces use them, so that
+	 * they're fetched sequentially. Unused ones go at the end.
+	 */
+	memset(remap, 0xff, nverts * sizeof *remap);
+	next = 0;
+	for(i=0; i<nfaces; i++) {
+		for(j=0; j<3; j++) {
+			int vidx = faces[order[i]].v[j];
+			if(remap[vidx] < 0) {
+				remap[vidx] = next++;
+			}
+			newfaces[i].v[j] = remap[vidx];
+		}
+	}
+	for(i=0; i<nverts; i++) {
+		if(remap[i] < 0) {
+			remap[i] = next++;
+		}
+	}
+	memcpy(faces, newfaces, nfaces * sizeof *faces);
+
+	for(i=0; i<nattr; i++) {
+		elemsz = g3dimpl_mesh_elemsize(attrs[i]);
+		data = g3dimpl_mesh_data(mesh, attrs[i]);
+		for(j=0; j<nverts; j++) {
+			memcpy(tmp + remap[j] * elemsz, data + j * elemsz, elemsz);
+		}
+		memcpy(data, tmp, (size_t)nverts * elemsz);
+	}
+
+	/* same shape, so the bounds still hold, but the BVH refers to faces by index */
+	had_bvh = mesh->bvh != 0;
+	g3dimpl_mesh_free_bvh(mesh);
+	if(had_bvh) {
+		goat3d_mesh_build_bvh(mesh);
+	}
+
+	free(order);
+	free(remap);
+	free(newfaces);
+	free(tmp);
+	return 0;
+
+err:
+	free(order);
+	free(remap);
+	free(newfaces);
+	free(tmp);
+	return -1;
+}
+
+struct goat3d_mesh *g3dimpl_mesh_optcopy(const struct goat3d_mesh *mesh)
+{
+	int i, count, elemsz;
+	void *arr;
+	struct goat3d_mesh *copy;
+
+	if(!(copy = malloc(sizeof *copy))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_mesh_optcopy: failed to allocate mesh\n");
+		return 0;
+	}
+	*copy = *mesh;
+	copy->vertices = 0;
+	copy->normals = 0;
+	copy->tangents = 0;
+	copy->texcoords = 0;
+	copy->skin_weights = 0;
+	copy->skin_matrices = 0;
+	copy->colors = 0;
+	copy->faces = 0;
+	memset(copy->mapped, 0, sizeof copy->mapped);
+	copy->ext = 0;
+	copy->lazy = copy->lazy_done = 0;
+	copy->bvh = 0;
+
+	/* installed with setarr, because allocating would invalidate the scene bounds */
+	for(i=0; i<=MESH_FACES; i++) {
+		count = g3dimpl_mesh_count(mesh, i);
+		elemsz = g3dimpl_mesh_elemsize(i);
+		if(!(arr = dynarr_alloc(count, elemsz))) {
+			goat3d_logmsg(LOG_ERROR, "g3dimpl_mesh_optcopy: failed to allocate mesh data\n");
+			goto err;
+		}
+		if(count) {
+			memcpy(arr, g3dimpl_mesh_data(mesh, i), (size_t)count * elemsz);
+		}
+		g3dimpl_mesh_setarr(copy, i, arr);
+	}
+
+	if(goat3d_optimize_mesh_indices(copy) == -1) {
+		goto err;
+	}
+	if(mesh->bvh && goat3d_mesh_build_bvh(copy) == -1) {
+		goto err;
+	}
+	return copy;
+
+err:
+	g3dimpl_mesh_free_optcopy(copy);
+	return 0;
+}
+
+void g3dimpl_mesh_free_optcopy(struct goat3d_mesh *copy)
+{
+	if(!copy) return;
+
+	dynarr_free(copy->vertices);
+	dynarr_free(copy->normals);
+	dynarr_free(copy->tangents);
+	dynarr_free(copy->texcoords);
+	dynarr_free(copy->skin_weights);
+	dynarr_free(copy->skin_matrices);
+	dynarr_free(copy->colors);
+	dynarr_free(copy->faces);
+	g3dimpl_mesh_free_bvh(copy);
+	free(copy);
+}
@@ -0,0 +1,158 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "nametab.h"
+
+#define INIT_SIZE	16
+
+/* marks a removed entry, which must not terminate a probe sequence */
+static const char deleted[] = "";
+#define DELETED	deleted
+
+static int rehash(struct name_table *tab, int newsz);
+
+static unsigned int hash_str(const char *s)
+{
+	unsigned int h = 2166136261u;	/* FNV-1a */
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void g3dimpl_nametab_init(struct name_table *tab)
+{
+	memset(tab, 0, sizeof *tab);
+}
+
+void g3dimpl_nametab_destroy(struct name_table *tab)
+{
+	free(tab->ent);
+	memset(tab, 0, sizeof *tab);
+}
+
+void g3dimpl_nametab_clear(struct name_table *tab)
+{
+	if(tab->ent) {
+		memset(tab->ent, 0, tab->size * sizeof *tab->ent);
+	}
+	tab->count = tab->used = 0;
+}
+
+int g3dimpl_nametab_add(struct name_table *tab, const char *name, int idx)
+{
+	unsigned int h, i, mask;
+	struct name_entry *ent;
+
+	if(!name) return 0;
+
+	/* keep the load factor (deleted markers included) under 3/4 */
+	if((tab->used + 1) * 4 > tab->size * 3) {
+		int newsz = tab->size ? tab->size : INIT_SIZE;
+		while((tab->count + 1) * 2 > newsz) {
+			newsz <<= 1;
+		}
+		if(rehash(tab, newsz) == -1) {
+			return -1;
+		}
+	}
+
+	h = hash_str(name);
+	mask = tab->size - 1;
+	i = h & mask;
+	while((ent = tab->ent + i)->name && ent->name != DELETED) {
+		i = (i + 1) & mask;
+	}
+	if(!ent->name) tab->used++;
+	ent->name = name;
+	ent->hash = h;
+	ent->idx = idx;
+	tab->count++;
+	return 0;
+}
+
+void g3dimpl_nametab_remove(struct name_table *tab, const char *name)
+{
+	unsigned int i, mask;
+	struct name_entry *ent;
+
+	if(!name || !tab->count) return;
+
+	mask = tab->size - 1;
+	i = hash_str(name) & mask;
+	while((ent = tab->ent + i)->name) {
+		if(ent->name == name) {
+			ent->name = DELETED;
+			tab->count--;
+			return;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+int g3dimpl_nametab_find(const struct name_table *tab, const char *name)
+{
+	unsigned int h, i, mask;
+	struct name_entry *ent;
+	int res = -1;
+
+	if(!name || !tab->count) return -1;
+
+	h = hash_str(name);
+	mask = tab->size - 1;
+	i = h & mask;
+	/* duplicate names are allowed, keep looking for the first one added */
+	while((ent = tab->ent + i)->name) {
+		if(ent->name != DELETED && ent->hash == h && strcmp(ent->name, name) == 0) {
+			if(res == -1 || ent->idx < res) {
+				res = ent->idx;
+			}
+		}
+		i = (i + 1) & mask;
+	}
+	return res;
+}
+
+static int rehash(struct name_table *tab, int newsz)
+{
+	int i;
+	unsigned int j, mask = newsz - 1;
+	struct name_entry *newent, *ent = tab->ent;
+
+	if(!(newent = calloc(newsz, sizeof *newent))) {
+		return -1;
+	}
+
+	for(i=0; i<tab->size; i++) {
+		if(!ent[i].name || ent[i].name == DELETED) continue;
+
+		j = ent[i].hash & mask;
+		while(newent[j].name) {
+			j = (j + 1) & mask;
+		}
+		newent[j] = ent[i];
+	}
+
+	free(tab->ent);
+	tab->ent = newent;
+	tab->size = newsz;
+	tab->used = tab->count;
+	return 0;
+}
@@ -0,0 +1,48 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2018  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef NAMETAB_H_
+#define NAMETAB_H_
+
+/* open-addressing hash table mapping object names to their index in one of the
+ * per-scene object arrays. Entries point to the name strings owned by the
+ * objects, so a renamed object must be removed before its old name is freed.
+ */
+struct name_entry {
+	const char *name;
+	unsigned int hash;
+	int idx;
+};
+
+struct name_table {
+	struct name_entry *ent;
+	int size;		/* power of two, or 0 before the first insertion */
+	int count;		/* live entries */
+	int used;		/* live entries + deleted markers */
+};
+
+void g3dimpl_nametab_init(struct name_table *tab);
+void g3dimpl_nametab_destroy(struct name_table *tab);
+void g3dimpl_nametab_clear(struct name_table *tab);
+
+int g3dimpl_nametab_add(struct name_table *tab, const char *name, int idx);
+/* removes the entry referencing this exact name string */
+void g3dimpl_nametab_remove(struct name_table *tab, const char *name);
+/* returns the lowest index with a matching name, or -1 */
+int g3dimpl_nametab_find(const struct name_table *tab, const char *name);
+
+#endif	/* NAMETAB_H_ */
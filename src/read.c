@@ -23,6 +23,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dynarr.h"
 #include "track.h"
 #include "util.h"
+#include "chunk.h"
+#include "thread.h"
 
 #if defined(__WATCOMC__) || defined(_WIN32) || defined(__DJGPP__)
 #include <malloc.h>
@@ -38,10 +40,132 @@ struct key {
 
 static struct goat3d_material *read_material(struct goat3d *g, struct ts_node *tsmtl);
 static char *read_material_attrib(struct material_attrib *attr, struct ts_node *tsmattr);
-static struct goat3d_mesh *read_mesh(struct goat3d *g, struct ts_node *tsmesh);
-static void *read_veclist(void *arr, int dim, const char *nodename, const char *attrname, struct ts_node *tsnode);
-static void *read_intlist(void *arr, int dim, const char *nodename, const char *attrname, struct ts_node *tsnode);
-static void *read_bonelist(struct goat3d *g, struct goat3d_node **arr, struct ts_node *tsnode);
+static struct goat3d_mesh *read_mesh(struct goat3d *g, struct ts_node *tsmesh, int read_lists);
+static int read_meshlist(struct goat3d *g, struct goat3d_mesh *mesh, struct ts_node *tslist);
+static void read_meshes_mt(struct goat3d *g, struct ts_node *tsroot);
+static void free_mesh(struct goat3d_mesh *mesh);
+struct meshlist_job {
+	int mesh_idx;
+	struct ts_node *tslist;
+	int res;
+};
+
+struct mesh_loader {
+	struct goat3d *g;
+	struct goat3d_mesh **meshes;
+	struct meshlist_job *jobs;
+};
+
+static void run_meshlist_job(int idx, void *cls)
+{
+	struct mesh_loader *ml = cls;
+	struct meshlist_job *job = ml->jobs + idx;
+
+	if(g3dimpl_load_cancelled(ml->g)) {
+		job->res = -1;
+		return;
+	}
+	job->res = read_meshlist(ml->g, ml->meshes[job->mesh_idx], job->tslist);
+}
+
+/* reads all meshes, with every data list of every mesh decoded as a separate
+ * job on a pool of threads, and then adds them to the scene in file order.
+ */
+static void read_meshes_mt(struct goat3d *g, struct ts_node *tsroot)
+{
+	int i, nmeshes = 0, njobs = 0;
+	struct ts_node *c, *tslist, *next;
+	struct goat3d_mesh *mesh;
+	struct mesh_loader ml;
+
+	c = tsroot->child_list;
+	while(c) {
+		if(strcmp(c->name, "mesh") == 0) {
+			nmeshes++;
+			njobs += c->child_count;
+		}
+		c = c->next;
+	}
+	if(!nmeshes) return;
+
+	ml.g = g;
+	ml.meshes = malloc(nmeshes * sizeof *ml.meshes);
+	ml.jobs = malloc((njobs + 1) * sizeof *ml.jobs);
+	if(!ml.meshes || !ml.jobs) {
+		goat3d_logmsg(LOG_WARNING, "read_meshes_mt: failed to allocate job list, loading meshes serially\n");
+		free(ml.meshes);
+		free(ml.jobs);
+
+		c = tsroot->child_list;
+		while(c) {
+			if(strcmp(c->name, "mesh") == 0 && (mesh = read_mesh(g, c, 1))) {
+				goat3d_add_mesh(g, mesh);
+			}
+			c = c->next;
+		}
+		return;
+	}
+
+	nmeshes = njobs = 0;
+	c = tsroot->child_list;
+	while(c) {
+		if(strcmp(c->name, "mesh") == 0) {
+			mesh = read_mesh(g, c, 0);
+			ml.meshes[nmeshes] = mesh;
+
+			if(mesh && !mesh->ext) {
+				tslist = c->child_list;
+				while(tslist) {
+					/* if the same list appears again, the last one is used */
+					next = tslist->next;
+					while(next && strcmp(next->name, tslist->name) != 0) {
+						next = next->next;
+					}
+					if(!next) {
+						ml.jobs[njobs].mesh_idx = nmeshes;
+						ml.jobs[njobs].tslist = tslist;
+						ml.jobs[njobs].res = 0;
+						njobs++;
+					}
+					tslist = tslist->next;
+				}
+			}
+			nmeshes++;
+		}
+		c = c->next;
+	}
+
+	if(!g3dimpl_load_cancelled(g)) {
+		g3dimpl_parallel_for(njobs, g3dimpl_num_cpus(), run_meshlist_job, &ml);
+	}
+
+	if(g3dimpl_load_cancelled(g)) {
+		/* the caller notices too, and stops loading */
+		for(i=0; i<nmeshes; i++) {
+			free_mesh(ml.meshes[i]);
+		}
+	} else {
+		for(i=0; i<njobs; i++) {
+			int midx = ml.jobs[i].mesh_idx;
+			if(ml.jobs[i].res == -1 && ml.meshes[midx]) {
+				free_mesh(ml.meshes[midx]);
+				ml.meshes[midx] = 0;
+			}
+		}
+		for(i=0; i<nmeshes; i++) {
+			if(ml.meshes[i]) {
+				goat3d_add_mesh(g, ml.meshes[i]);
+			}
+		}
+	}
+
+	free(ml.meshes);
+	free(ml.jobs);
+}
+
+static void *read_veclist(void *prev, int dim, const char *nodename, const char *attrname, struct ts_node *tsnode);
+static void *read_intlist(void *prev, int dim, const char *nodename, const char *attrname, struct ts_node *tsnode);
+static void *read_bonelist(struct goat3d *g, struct goat3d_node **prev, struct ts_node *tsnode);
 static int read_node(struct goat3d *g, struct goat3d_node *node, struct ts_node *tsnode);
 static int read_anim(struct goat3d *g, struct ts_node *tsanim);
 static struct goat3d_track *read_track(struct goat3d *g, struct ts_node *tstrk);
@@ -52,7 +176,9 @@ int g3dimpl_scnload(struct goat3d *g, struct goat3d_io *io)
 	int idx;
 	struct ts_io tsio;
 	struct ts_node *tsroot, *c;
+	struct ts_arena *arena;
 	const char *str;
+	struct chunk_header hdr;
 
 	/* attempt to load it as gltf first */
 	if((g3dimpl_loadgltf(g, io)) == 0) {
@@ -60,17 +186,32 @@ int g3dimpl_scnload(struct goat3d *g, struct goat3d_io *io)
 	}
 	io->seek(0, SEEK_SET, io->cls);
 
+	/* then check for a binary chunk file */
+	if(g3dimpl_read_chunk_header(&hdr, io) != -1 && hdr.id == CNK_SCENE) {
+		io->seek(0, SEEK_SET, io->cls);
+		return g3dimpl_loadbin(g, io);
+	}
+	io->seek(0, SEEK_SET, io->cls);
+
 	tsio.data = io->cls;
 	tsio.read = io->read;
 	tsio.write = io->write;
 
-	if(!(tsroot = ts_load_io(&tsio))) {
+	/* the parse tree is only needed while loading, allocate it all in an
+	 * arena, to be freed in one go at the end
+	 */
+	if(!(arena = ts_alloc_arena())) {
+		goat3d_logmsg(LOG_ERROR, "failed to allocate parser arena\n");
+		return -1;
+	}
+	if(!(tsroot = ts_load_io_arena(&tsio, arena))) {
 		goat3d_logmsg(LOG_ERROR, "failed to load scene\n");
+		ts_free_arena(arena);
 		return -1;
 	}
 	if(strcmp(tsroot->name, "scene") != 0) {
 		goat3d_logmsg(LOG_ERROR, "invalid scene file, root node is not \"scene\"\n");
-		ts_free_tree(tsroot);
+		ts_free_arena(arena);
 		return -1;
 	}
 
@@ -109,12 +250,20 @@ int g3dimpl_scnload(struct goat3d *g, struct goat3d_io *io)
 	}
 
 	/* read all meshes, cameras, lights, animations */
+	if(goat3d_getopt(g, GOAT3D_OPT_THREADS)) {
+		read_meshes_mt(g, tsroot);
+	}
 	c = tsroot->child_list;
 	while(c) {
+		if(g3dimpl_load_cancelled(g)) {
+			goto cancel;
+		}
 		if(strcmp(c->name, "mesh") == 0) {
-			struct goat3d_mesh *mesh = read_mesh(g, c);
-			if(mesh) {
-				goat3d_add_mesh(g, mesh);
+			if(!goat3d_getopt(g, GOAT3D_OPT_THREADS)) {
+				struct goat3d_mesh *mesh = read_mesh(g, c, 1);
+				if(mesh) {
+					goat3d_add_mesh(g, mesh);
+				}
 			}
 		} else if(strcmp(c->name, "anim") == 0) {
 			read_anim(g, c);
@@ -127,6 +276,9 @@ int g3dimpl_scnload(struct goat3d *g, struct goat3d_io *io)
 	idx = 0;
 	c = tsroot->child_list;
 	while(c) {
+		if(g3dimpl_load_cancelled(g)) {
+			goto cancel;
+		}
 		if(strcmp(c->name, "node") == 0) {
 			struct goat3d_node *node = goat3d_get_node(g, idx++);
 			assert(node);
@@ -135,8 +287,13 @@ int g3dimpl_scnload(struct goat3d *g, struct goat3d_io *io)
 		c = c->next;
 	}
 
-	ts_free_tree(tsroot);
+	ts_free_arena(arena);
 	return 0;
+
+cancel:
+	goat3d_logmsg(LOG_INFO, "scene loading cancelled\n");
+	ts_free_arena(arena);
+	return -1;
 }
 
 int g3dimpl_anmload(struct goat3d *g, struct goat3d_io *io)
@@ -241,18 +398,25 @@ static char *read_material_attrib(struct material_attrib *attr, struct ts_node *
 	return attr->name;
 }
 
-static struct goat3d_mesh *read_mesh(struct goat3d *g, struct ts_node *tsmesh)
+/* if read_lists is 0, only the mesh properties are read, and the data lists
+ * are left to the caller (see read_meshes_mt), unless it's an external mesh.
+ */
+static struct goat3d_mesh *read_mesh(struct goat3d *g, struct ts_node *tsmesh, int read_lists)
 {
 	struct goat3d_mesh *mesh;
 	struct goat3d_material *mtl;
 	struct ts_node *c;
 	const char *str;
 	int num;
-	void *tmp;
 
-	if(!(mesh = malloc(sizeof *mesh)) || g3dimpl_obj_init((struct object*)mesh, OBJTYPE_MESH)) {
+	if(!(mesh = malloc(sizeof *mesh))) {
 		goat3d_logmsg(LOG_ERROR, "read_mesh: failed to allocate mesh\n");
-		goto fail;
+		return 0;
+	}
+	if(g3dimpl_obj_init((struct object*)mesh, OBJTYPE_MESH) == -1) {
+		goat3d_logmsg(LOG_ERROR, "read_mesh: failed to allocate mesh\n");
+		free(mesh);
+		return 0;
 	}
 
 	if((str = ts_get_attr_str(tsmesh, "name", 0))) {
@@ -301,115 +465,153 @@ static struct goat3d_mesh *read_mesh(struct goat3d *g, struct ts_node *tsmesh)
 		return mesh;
 	}
 
+	if(!read_lists) {
+		return mesh;
+	}
+
 	c = tsmesh->child_list;
 	while(c) {
-		if(strcmp(c->name, "vertex_list") == 0) {
-			if(!(tmp = read_veclist(mesh->vertices, 3, "vertex", "pos", c))) {
-				goat3d_logmsg(LOG_ERROR, "read_mesh: failed to read vertex array for mesh %s\n",
-						mesh->name);
-				goto fail;
-			}
-			mesh->vertices = tmp;
+		if(read_meshlist(g, mesh, c) == -1) {
+			goto fail;
+		}
+		c = c->next;
+	}
+	return mesh;
 
-		} else if(strcmp(c->name, "normal_list") == 0) {
-			if(!(tmp = read_veclist(mesh->normals, 3, "normal", "dir", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read normals array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->normals = tmp;
-			}
+fail:
+	free_mesh(mesh);
+	return 0;
+}
 
-		} else if(strcmp(c->name, "tangent_list") == 0) {
-			if(!(tmp = read_veclist(mesh->tangents, 3, "tangent", "dir", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read tangents array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->tangents = tmp;
-			}
+/* for meshes which didn't make it into the scene */
+static void free_mesh(struct goat3d_mesh *mesh)
+{
+	if(!mesh) return;
 
-		} else if(strcmp(c->name, "texcoord_list") == 0) {
-			if(!(tmp = read_veclist(mesh->texcoords, 2, "texcoord", "uv", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read texcoord array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->texcoords = tmp;
-			}
+	g3dimpl_obj_destroy((struct object*)mesh);
+	free(mesh->name);
+	free(mesh);
+}
 
-		} else if(strcmp(c->name, "skinweight_list") == 0) {
-			if(!(tmp = read_veclist(mesh->skin_weights, 4, "skinweight", "weights", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read skin weights array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->skin_weights = tmp;
-			}
+/* reads one of the data lists of a mesh. Returns -1 if the mesh can't be used
+ * without it (vertices and faces), 0 otherwise. Different lists of the same
+ * mesh can be read concurrently.
+ */
+static int read_meshlist(struct goat3d *g, struct goat3d_mesh *mesh, struct ts_node *c)
+{
+	void *tmp;
 
-		} else if(strcmp(c->name, "skinmatrix_list") == 0) {
-			if(!(tmp = read_intlist(mesh->skin_matrices, 4, "skinmatrix", "idx", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read skin matrix index array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->skin_matrices = tmp;
-			}
+	if(strcmp(c->name, "vertex_list") == 0) {
+		if(!(tmp = read_veclist(mesh->vertices, 3, "vertex", "pos", c))) {
+			goat3d_logmsg(LOG_ERROR, "read_mesh: failed to read vertex array for mesh %s\n",
+					mesh->name);
+			return -1;
+		}
+		mesh->vertices = tmp;
 
-		} else if(strcmp(c->name, "color_list") == 0) {
-			if(!(tmp = read_veclist(mesh->colors, 4, "color", "color", c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read color array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->colors = tmp;
-			}
+	} else if(strcmp(c->name, "normal_list") == 0) {
+		if(!(tmp = read_veclist(mesh->normals, 3, "normal", "dir", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read normals array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->normals = tmp;
+		}
 
-		} else if(strcmp(c->name, "bone_list") == 0) {
-			if(!(tmp = read_bonelist(g, mesh->bones, c))) {
-				goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read bones array for mesh %s\n",
-						mesh->name);
-			} else {
-				mesh->bones = tmp;
-			}
+	} else if(strcmp(c->name, "tangent_list") == 0) {
+		if(!(tmp = read_veclist(mesh->tangents, 3, "tangent", "dir", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read tangents array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->tangents = tmp;
+		}
 
-		} else if(strcmp(c->name, "face_list") == 0) {
-			if(!(tmp = read_intlist(mesh->faces, 3, "face", "idx", c))) {
-				goat3d_logmsg(LOG_ERROR, "read_mesh: failed to read faces array for mesh %s\n",
-						mesh->name);
-				goto fail;
-			}
-			mesh->faces = tmp;
+	} else if(strcmp(c->name, "texcoord_list") == 0) {
+		if(!(tmp = read_veclist(mesh->texcoords, 2, "texcoord", "uv", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read texcoord array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->texcoords = tmp;
 		}
-		c = c->next;
-	}
-	return mesh;
 
-fail:
-	g3dimpl_obj_destroy((struct object*)mesh);
+	} else if(strcmp(c->name, "skinweight_list") == 0) {
+		if(!(tmp = read_veclist(mesh->skin_weights, 4, "skinweight", "weights", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read skin weights array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->skin_weights = tmp;
+		}
+
+	} else if(strcmp(c->name, "skinmatrix_list") == 0) {
+		if(!(tmp = read_intlist(mesh->skin_matrices, 4, "skinmatrix", "idx", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read skin matrix index array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->skin_matrices = tmp;
+		}
+
+	} else if(strcmp(c->name, "color_list") == 0) {
+		if(!(tmp = read_veclist(mesh->colors, 4, "color", "color", c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read color array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->colors = tmp;
+		}
+
+	} else if(strcmp(c->name, "bone_list") == 0) {
+		if(!(tmp = read_bonelist(g, mesh->bones, c))) {
+			goat3d_logmsg(LOG_WARNING, "read_mesh: failed to read bones array for mesh %s\n",
+					mesh->name);
+		} else {
+			mesh->bones = tmp;
+		}
+
+	} else if(strcmp(c->name, "face_list") == 0) {
+		if(!(tmp = read_intlist(mesh->faces, 3, "face", "idx", c))) {
+			goat3d_logmsg(LOG_ERROR, "read_mesh: failed to read faces array for mesh %s\n",
+					mesh->name);
+			return -1;
+		}
+		mesh->faces = tmp;
+	}
 	return 0;
 }
 
-static void *read_veclist(void *arr, int dim, const char *nodename, const char *attrname, struct ts_node *tslist)
+static void *read_veclist(void *prev, int dim, const char *nodename, const char *attrname, struct ts_node *tslist)
 {
 	int i, size, bufsz;
+	long len;
 	struct ts_node *c;
 	struct ts_attr *attr;
 	float vec[4];
 	const char *str;
+	void *arr, *tmp;
 
-	arr = dynarr_clear(arr);
-	assert(arr);
+	/* built in a new array, so that prev is still valid if this fails */
+	if(!(arr = dynarr_alloc(0, dim * sizeof(float)))) {
+		goat3d_logmsg(LOG_ERROR, "read_veclist: failed to allocate %s array\n", nodename);
+		return 0;
+	}
 
 	if((size = ts_get_attr_int(tslist, "list_size", -1)) <= 0) {
 		goat3d_logmsg(LOG_WARNING, "read_veclist: list_size attribute missing or invalid\n");
 		size = -1;
 	}
 
-	if((str = ts_get_attr_str(tslist, "base64", 0))) {
-		if(size == -1) size = calc_b64_size(str);
-		if(!(arr = dynarr_resize(arr, size))) {
+	/* the parser already knows the length of the base64 string, use it
+	 * instead of scanning the whole string for its end
+	 */
+	if((attr = ts_get_attr(tslist, "base64")) && (str = attr->val.str)) {
+		len = attr->val.str_len;
+		if(size == -1) size = calc_b64_size(str, len) / (dim * sizeof(float));
+		if(!(tmp = dynarr_resize(arr, size))) {
 			goat3d_logmsg(LOG_ERROR, "read_veclist: failed to resize %s array\n",
 					nodename);
-			return 0;
+			goto err;
 		}
+		arr = tmp;
 
 		bufsz = size * dim * sizeof(float);
-		b64decode(str, arr, &bufsz);
+		g3dimpl_b64decode(str, len, arr, &bufsz);
 #ifdef GOAT3D_BIGEND
 		goat3d_bswap32(arr, size * dim);
 #endif
@@ -431,11 +633,12 @@ static void *read_veclist(void *arr, int dim, const char *nodename, const char *
 				}
 			}
 
-			if(!(arr = dynarr_push(arr, vec))) {
+			if(!(tmp = dynarr_push(arr, vec))) {
 				goat3d_logmsg(LOG_ERROR, "read_veclist: failed to resize %s array\n",
 						nodename);
-				return 0;
+				goto err;
 			}
+			arr = tmp;
 		}
 		c = c->next;
 	}
@@ -443,35 +646,47 @@ static void *read_veclist(void *arr, int dim, const char *nodename, const char *
 	if(size > 0 && dynarr_size(arr) != size) {
 		goat3d_logmsg(LOG_WARNING, "read_veclist: expected %d items, read %d\n", size, dynarr_size(arr));
 	}
+	dynarr_free(prev);
 	return arr;
+
+err:
+	dynarr_free(arr);
+	return 0;
 }
 
-static void *read_intlist(void *arr, int dim, const char *nodename, const char *attrname, struct ts_node *tslist)
+static void *read_intlist(void *prev, int dim, const char *nodename, const char *attrname, struct ts_node *tslist)
 {
 	int i, size, bufsz;
+	long len;
 	struct ts_node *c;
 	struct ts_attr *attr;
 	int ivec[4];
 	const char *str;
+	void *arr, *tmp;
 
-	arr = dynarr_clear(arr);
-	assert(arr);
+	/* built in a new array, so that prev is still valid if this fails */
+	if(!(arr = dynarr_alloc(0, dim * sizeof(int)))) {
+		goat3d_logmsg(LOG_ERROR, "read_intlist: failed to allocate %s array\n", nodename);
+		return 0;
+	}
 
 	if((size = ts_get_attr_int(tslist, "list_size", -1)) <= 0) {
 		goat3d_logmsg(LOG_WARNING, "read_intlist: list_size attribute missing or invalid\n");
 		size = -1;
 	}
 
-	if((str = ts_get_attr_str(tslist, "base64", 0))) {
-		if(size == -1) size = calc_b64_size(str);
-		if(!(arr = dynarr_resize(arr, size))) {
+	if((attr = ts_get_attr(tslist, "base64")) && (str = attr->val.str)) {
+		len = attr->val.str_len;
+		if(size == -1) size = calc_b64_size(str, len) / (dim * sizeof(int));
+		if(!(tmp = dynarr_resize(arr, size))) {
 			goat3d_logmsg(LOG_ERROR, "read_intlist: failed to resize %s array\n",
 					nodename);
-			return 0;
+			goto err;
 		}
+		arr = tmp;
 
 		bufsz = size * dim * sizeof(int);
-		b64decode(str, arr, &bufsz);
+		g3dimpl_b64decode(str, len, arr, &bufsz);
 #ifdef GOAT3D_BIGEND
 		goat3d_bswap32(arr, size * dim);
 #endif
@@ -493,11 +708,12 @@ static void *read_intlist(void *arr, int dim, const char *nodename, const char *
 				}
 			}
 
-			if(!(arr = dynarr_push(arr, ivec))) {
+			if(!(tmp = dynarr_push(arr, ivec))) {
 				goat3d_logmsg(LOG_ERROR, "read_intlist: failed to resize %s array\n",
 						nodename);
-				return 0;
+				goto err;
 			}
+			arr = tmp;
 		}
 		c = c->next;
 	}
@@ -505,18 +721,26 @@ static void *read_intlist(void *arr, int dim, const char *nodename, const char *
 	if(size > 0 && dynarr_size(arr) != size) {
 		goat3d_logmsg(LOG_WARNING, "read_intlist: expected %d items, read %d\n", size, dynarr_size(arr));
 	}
+	dynarr_free(prev);
 	return arr;
+
+err:
+	dynarr_free(arr);
+	return 0;
 }
 
-static void *read_bonelist(struct goat3d *g, struct goat3d_node **arr, struct ts_node *tslist)
+static void *read_bonelist(struct goat3d *g, struct goat3d_node **prev, struct ts_node *tslist)
 {
 	int size, idx;
 	struct ts_node *c;
-	struct goat3d_node *bone;
+	struct goat3d_node *bone, **arr, **tmp;
 	const char *str;
 
-	arr = dynarr_clear(arr);
-	assert(arr);
+	/* built in a new array, so that prev is still valid if this fails */
+	if(!(arr = dynarr_alloc(0, sizeof *arr))) {
+		goat3d_logmsg(LOG_ERROR, "read_bonelist: failed to allocate bone array\n");
+		return 0;
+	}
 
 	if((size = ts_get_attr_int(tslist, "list_size", -1)) <= 0) {
 		goat3d_logmsg(LOG_WARNING, "read_bonelist: list_size attribute missing or invalid\n");
@@ -537,19 +761,22 @@ static void *read_bonelist(struct goat3d *g, struct goat3d_node **arr, struct ts
 		if((idx = ts_get_attr_int(c, "bone", -1)) >= 0) {
 			if(!(bone = goat3d_get_node(g, idx))) {
 				goat3d_logmsg(LOG_ERROR, "read_bonelist: reference to invalid bone: %d\n", idx);
-				return 0;
+				goto err;
 			}
 
 		} else if((str = ts_get_attr_str(c, "bone", 0))) {
 			if(!(bone = goat3d_get_node_by_name(g, str))) {
 				goat3d_logmsg(LOG_ERROR, "read_bonelist: reference to invalid bone: %s\n", str);
-				return 0;
+				goto err;
 			}
 		}
 
-		if(bone && !(arr = dynarr_push(arr, &bone))) {
-			goat3d_logmsg(LOG_ERROR, "read_bonelist: failed to resize bone array\n");
-			return 0;
+		if(bone) {
+			if(!(tmp = dynarr_push(arr, &bone))) {
+				goat3d_logmsg(LOG_ERROR, "read_bonelist: failed to resize bone array\n");
+				goto err;
+			}
+			arr = tmp;
 		}
 		c = c->next;
 	}
@@ -557,7 +784,12 @@ static void *read_bonelist(struct goat3d *g, struct goat3d_node **arr, struct ts
 	if(size > 0 && dynarr_size(arr) != size) {
 		goat3d_logmsg(LOG_WARNING, "read_bonelist: expected %d items, read %d\n", size, dynarr_size(arr));
 	}
+	dynarr_free(prev);
 	return arr;
+
+err:
+	dynarr_free(arr);
+	return 0;
 }
 
 #define GETREF(ptr, typestr, getname) \
@@ -715,7 +947,10 @@ static struct goat3d_track *read_track(struct goat3d *g, struct ts_node *tstrk)
 		return 0;
 	}
 	goat3d_set_track_node(trk, node);
-	goat3d_set_track_type(trk, type);
+	if(goat3d_set_track_type(trk, type) == -1) {
+		goat3d_destroy_track(trk);
+		return 0;
+	}
 
 	if((str = ts_get_attr_str(tstrk, "name", 0))) {
 		goat3d_set_track_name(trk, str);
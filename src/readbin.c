@@ -0,0 +1,1361 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "g3dscn.h"
+#include "chunk.h"
+#include "bvh.h"
+#include "log.h"
+#include "thread.h"
+#include "dynarr.h"
+
+/* value of a leaf chunk (CNK_INT, CNK_FLOAT3, CNK_STRING, etc) */
+struct value {
+	int type;
+	int count;
+	int i[4];
+	float f[4];
+	char *str;
+};
+
+/* references to nodes and objects by name or index are resolved after
+ * everything is loaded, since they might refer to things further down the
+ * file (bones referring to nodes, nodes referring to their parents...)
+ */
+enum { REF_PARENT, REF_MESH, REF_LIGHT, REF_CAMERA, REF_BONE, REF_TRACK };
+
+struct ref {
+	int type;
+	void *obj;
+	char *name;
+	int idx;
+};
+
+struct loader {
+	struct goat3d *g;
+	struct goat3d_io *io;
+	struct ref *refs;	/* dynarr */
+	struct memfile *mem;	/* non-null when loading from a memory-mapped file */
+	FILE *datafile;			/* non-null when mesh data are to be read on demand */
+};
+
+struct memfile {
+	char *buf;
+	long size, pos;
+};
+
+static int read_env(struct loader *ld, struct chunk_header *hdr);
+static int read_mtl(struct loader *ld, struct chunk_header *hdr);
+static int read_mtlattr(struct loader *ld, struct goat3d_material *mtl, struct chunk_header *hdr);
+static int read_mesh(struct loader *ld, struct chunk_header *hdr);
+static int read_bones(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr);
+static int read_light(struct loader *ld, struct chunk_header *hdr);
+static int read_camera(struct loader *ld, struct chunk_header *hdr);
+static int read_node(struct loader *ld, struct chunk_header *hdr);
+static int read_anim(struct loader *ld, struct chunk_header *hdr);
+static int read_track(struct loader *ld, struct goat3d_anim *anim, struct chunk_header *hdr);
+static int read_list(struct loader *ld, struct goat3d_mesh *mesh, int attr, struct chunk_header *hdr);
+static int read_bvh(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr);
+static int read_bounds(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr);
+static int resolve_refs(struct loader *ld);
+static int loadbin(struct goat3d *g, struct goat3d_io *io, struct memfile *mem, FILE *datafile);
+
+static int next_chunk(struct chunk_header *hdr, long *left, struct goat3d_io *io);
+static int skip_bytes(long count, struct goat3d_io *io);
+static int read_value(struct value *val, struct chunk_header *hdr, struct goat3d_io *io);
+static int read_rawval(struct value *val, struct chunk_header *hdr, struct goat3d_io *io);
+static int add_ref(struct loader *ld, int type, void *obj, struct value *val);
+
+static long mem_read(void *buf, size_t bytes, void *uptr);
+static long mem_seek(long offs, int whence, void *uptr);
+
+
+int g3dimpl_loadbin(struct goat3d *g, struct goat3d_io *io)
+{
+	return loadbin(g, io, 0, 0);
+}
+
+int g3dimpl_loadbin_mapped(struct goat3d *g, void *addr, long size)
+{
+	struct memfile mem;
+	struct goat3d_io io;
+
+	mem.buf = addr;
+	mem.size = size;
+	mem.pos = 0;
+
+	io.cls = &mem;
+	io.read = mem_read;
+	io.write = 0;
+	io.seek = mem_seek;
+
+	return loadbin(g, &io, &mem, 0);
+}
+
+int g3dimpl_loadbin_lazy(struct goat3d *g, struct goat3d_io *io, FILE *fp)
+{
+	return loadbin(g, io, 0, fp);
+}
+
+/* all fetching is serialized, since the meshes of a scene share the file, and
+ * the same mesh may be accessed from multiple threads. The mesh stays marked
+ * as lazy until its new lists are in place, so that nothing sees them half
+ * read.
+ */
+static g3dimpl_mutex fetch_lock = G3DIMPL_MUTEX_INITIALIZER;
+
+int g3dimpl_mesh_fetch(struct goat3d_mesh *mesh)
+{
+	int i, elemsz, res = 0;
+	void *arr[NUM_GOAT3D_MESH_ATTRIBS + 1] = {0};
+	struct mesh_lazy *lz;
+
+	if(!g3dimpl_load_acquire((void*const*)&mesh->lazy)) {
+		return mesh->lazy_done && mesh->lazy_done->failed ? -1 : 0;
+	}
+
+	g3dimpl_mutex_lock(&fetch_lock);
+	if(!(lz = mesh->lazy)) {
+		/* fetched by another thread while we were waiting */
+		g3dimpl_mutex_unlock(&fetch_lock);
+		return mesh->lazy_done->failed ? -1 : 0;
+	}
+
+	for(i=0; i<=MESH_FACES; i++) {
+		if(lz->offs[i] < 0) continue;
+
+		elemsz = g3dimpl_mesh_elemsize(i);
+		if(!(arr[i] = dynarr_alloc(lz->count[i], elemsz))) {
+			goat3d_logmsg(LOG_ERROR, "g3dimpl_mesh_fetch: failed to allocate array (%d)\n", lz->count[i]);
+			res = -1;
+			break;
+		}
+		if(fseek(lz->fp, lz->offs[i], SEEK_SET) == -1 ||
+				fread(arr[i], elemsz, lz->count[i], lz->fp) < (size_t)lz->count[i]) {
+			goat3d_logmsg(LOG_ERROR, "g3dimpl_mesh_fetch: failed to read mesh data: %s\n", mesh->name);
+			res = -1;
+			break;
+		}
+#ifdef GOAT3D_BIGEND
+		goat3d_bswap32(arr[i], lz->count[i] * elemsz / 4);
+#endif
+	}
+
+	if(res == -1) {
+		/* leave the lists empty rather than partially read, and don't retry,
+		 * but keep failing on later fetches (lz->failed). Bounds and BVH
+		 * read with the file don't apply to an empty mesh.
+		 */
+		for(i=0; i<=MESH_FACES; i++) {
+			if(arr[i]) {
+				dynarr_free(arr[i]);
+				arr[i] = 0;
+			}
+		}
+		g3dimpl_mesh_invalidate(mesh);
+	}
+
+	/* otherwise, the bounds and BVH read with the file hold for the new lists */
+	for(i=0; i<=MESH_FACES; i++) {
+		if(lz->offs[i] >= 0) {
+			g3dimpl_mesh_setarr(mesh, i, arr[i]);
+		}
+	}
+
+	lz->failed = res == -1;
+	mesh->lazy_done = lz;
+	g3dimpl_store_release((void**)&mesh->lazy, 0);
+	g3dimpl_mutex_unlock(&fetch_lock);
+	return res;
+}
+
+int g3dimpl_loadbin_mesh(struct goat3d_mesh *mesh, struct goat3d_io *io)
+{
+	long left;
+	struct chunk_header hdr, ck;
+	struct loader ld;
+
+	if(g3dimpl_read_chunk_header(&hdr, io) == -1 || hdr.id != CNK_MESH) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_loadbin_mesh: invalid mesh file, root chunk is not a mesh\n");
+		return -1;
+	}
+
+	memset(&ld, 0, sizeof ld);
+	ld.io = io;
+
+	left = hdr.size - sizeof hdr;
+	while(left > 0) {
+		if(next_chunk(&ck, &left, io) == -1) {
+			return -1;
+		}
+
+		switch(ck.id) {
+		case CNK_MESH_VERTEX_LIST:
+		case CNK_MESH_NORMAL_LIST:
+		case CNK_MESH_TANGENT_LIST:
+		case CNK_MESH_TEXCOORD_LIST:
+		case CNK_MESH_SKINWEIGHT_LIST:
+		case CNK_MESH_SKINMATRIX_LIST:
+		case CNK_MESH_COLOR_LIST:
+			if(read_list(&ld, mesh, ck.id - CNK_MESH_VERTEX_LIST, &ck) == -1) return -1;
+			break;
+		case CNK_MESH_FACE_LIST:
+			if(read_list(&ld, mesh, MESH_FACES, &ck) == -1) return -1;
+			break;
+
+		default:
+			/* names, materials and bones are defined by the scene */
+			g3dimpl_skip_chunk(&ck, io);
+		}
+	}
+	return 0;
+}
+
+static int loadbin(struct goat3d *g, struct goat3d_io *io, struct memfile *mem, FILE *datafile)
+{
+	int i, num, res = -1;
+	long left;
+	struct chunk_header hdr, ck;
+	struct loader ld;
+
+	if(g3dimpl_read_chunk_header(&hdr, io) == -1 || hdr.id != CNK_SCENE) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_loadbin: invalid scene file, root chunk is not a scene\n");
+		return -1;
+	}
+
+	ld.g = g;
+	ld.io = io;
+	ld.mem = mem;
+	ld.datafile = datafile;
+	if(!(ld.refs = dynarr_alloc(0, sizeof *ld.refs))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_loadbin: failed to allocate reference array\n");
+		return -1;
+	}
+
+	left = hdr.size - sizeof hdr;
+	while(left > 0) {
+		if(next_chunk(&ck, &left, io) == -1) {
+			goto end;
+		}
+
+		switch(ck.id) {
+		case CNK_ENV:
+			if(read_env(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_MTL:
+			if(read_mtl(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_MESH:
+			if(read_mesh(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_LIGHT:
+			if(read_light(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_CAMERA:
+			if(read_camera(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_NODE:
+			if(read_node(&ld, &ck) == -1) goto end;
+			break;
+		case CNK_ANIM:
+			if(read_anim(&ld, &ck) == -1) goto end;
+			break;
+		default:
+			g3dimpl_skip_chunk(&ck, io);
+		}
+	}
+
+	res = resolve_refs(&ld);
+
+end:
+	if(res == -1) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_loadbin: failed to load scene\n");
+	}
+	num = dynarr_size(ld.refs);
+	for(i=0; i<num; i++) {
+		free(ld.refs[i].name);
+	}
+	dynarr_free(ld.refs);
+	return res;
+}
+
+static int read_env(struct loader *ld, struct chunk_header *hdr)
+{
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			return -1;
+		}
+
+		switch(ck.id) {
+		case CNK_ENV_AMBIENT:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			goat3d_set_ambient(ld->g, val.f);
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+	return 0;
+}
+
+static int read_mtl(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_material *mtl;
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(mtl = goat3d_create_mtl())) {
+		goat3d_logmsg(LOG_ERROR, "read_mtl: failed to allocate material\n");
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_MTL_NAME:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			if(val.str) {
+				goat3d_set_mtl_name(mtl, val.str);
+				free(val.str);
+			}
+			break;
+
+		case CNK_MTL_ATTR:
+			if(read_mtlattr(ld, mtl, &ck) == -1) goto err;
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+
+	if(!mtl->name) {
+		goat3d_logmsg(LOG_WARNING, "read_mtl: ignoring material without a name\n");
+		goat3d_destroy_mtl(mtl);
+		return 0;
+	}
+	goat3d_add_mtl(ld->g, mtl);
+	return 0;
+
+err:
+	goat3d_destroy_mtl(mtl);
+	return -1;
+}
+
+static int read_mtlattr(struct loader *ld, struct goat3d_material *mtl, struct chunk_header *hdr)
+{
+	struct chunk_header ck;
+	struct value val;
+	char *name = 0, *map = 0;
+	float color[4] = {1, 1, 1, 1};
+	long left = hdr->size - sizeof *hdr;
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_MTL_ATTR_NAME:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			free(name);
+			name = val.str;
+			break;
+
+		case CNK_MTL_ATTR_VAL:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			if(val.type == CNK_FLOAT || val.type == CNK_FLOAT3 || val.type == CNK_FLOAT4) {
+				memcpy(color, val.f, (val.count < 4 ? val.count : 4) * sizeof *color);
+			} else {
+				goat3d_logmsg(LOG_WARNING, "read_mtlattr: ignoring non-float attribute value\n");
+				free(val.str);
+			}
+			break;
+
+		case CNK_MTL_ATTR_MAP:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			free(map);
+			map = val.str;
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+
+	if(name && *name) {
+		goat3d_set_mtl_attrib(mtl, name, color);
+		if(map && *map) {
+			goat3d_set_mtl_attrib_map(mtl, name, map);
+		}
+	}
+	free(name);
+	free(map);
+	return 0;
+
+err:
+	free(name);
+	free(map);
+	return -1;
+}
+
+static int read_mesh(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_mesh *mesh;
+	struct goat3d_material *mtl;
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(mesh = goat3d_create_mesh())) {
+		goat3d_logmsg(LOG_ERROR, "read_mesh: failed to allocate mesh\n");
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_MESH_NAME:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			if(val.str) {
+				goat3d_set_mesh_name(mesh, val.str);
+				free(val.str);
+			}
+			break;
+
+		case CNK_MESH_MATERIAL:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			mtl = 0;
+			if(val.str) {
+				mtl = goat3d_get_mtl_by_name(ld->g, val.str);
+			} else if(val.i[0] >= 0 && val.i[0] < goat3d_get_mtl_count(ld->g)) {
+				mtl = goat3d_get_mtl(ld->g, val.i[0]);
+			}
+			if(mtl) {
+				goat3d_set_mesh_mtl(mesh, mtl);
+			} else {
+				goat3d_logmsg(LOG_WARNING, "read_mesh: mesh %s refers to invalid material\n",
+						mesh->name);
+			}
+			free(val.str);
+			break;
+
+		case CNK_MESH_VERTEX_LIST:
+		case CNK_MESH_NORMAL_LIST:
+		case CNK_MESH_TANGENT_LIST:
+		case CNK_MESH_TEXCOORD_LIST:
+		case CNK_MESH_SKINWEIGHT_LIST:
+		case CNK_MESH_SKINMATRIX_LIST:
+		case CNK_MESH_COLOR_LIST:
+			/* list chunk ids are in the same order as enum goat3d_mesh_attrib */
+			if(read_list(ld, mesh, ck.id - CNK_MESH_VERTEX_LIST, &ck) == -1) goto err;
+			break;
+		case CNK_MESH_FACE_LIST:
+			if(read_list(ld, mesh, MESH_FACES, &ck) == -1) goto err;
+			break;
+
+		case CNK_MESH_BONES_LIST:
+			if(read_bones(ld, mesh, &ck) == -1) goto err;
+			break;
+
+		case CNK_MESH_BVH:
+			if(read_bvh(ld, mesh, &ck) == -1) goto err;
+			break;
+
+		case CNK_MESH_BOUNDS:
+			if(read_bounds(ld, mesh, &ck) == -1) goto err;
+			break;
+
+		case CNK_MESH_FILE:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			if(val.str) {
+				const char *fname = val.str;
+				char *pathbuf = 0;
+
+				if(ld->g->search_path) {
+					if(!(pathbuf = malloc(strlen(fname) + strlen(ld->g->search_path) + 2))) {
+						free(val.str);
+						goto err;
+					}
+					sprintf(pathbuf, "%s/%s", ld->g->search_path, fname);
+					fname = pathbuf;
+				}
+				if(g3dimpl_loadmesh(mesh, fname) == -1) {
+					goat3d_logmsg(LOG_ERROR, "read_mesh: failed to load external mesh: %s\n", fname);
+					free(pathbuf);
+					free(val.str);
+					goto err;
+				}
+				free(pathbuf);
+				free(val.str);
+			}
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+
+	goat3d_add_mesh(ld->g, mesh);
+	return 0;
+
+err:
+	goat3d_logmsg(LOG_ERROR, "read_mesh: failed to read mesh: %s\n", mesh->name);
+	goat3d_destroy_mesh(mesh);
+	return -1;
+}
+
+static int read_bones(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr)
+{
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			return -1;
+		}
+		if(ck.id != CNK_STRING && ck.id != CNK_INT) {
+			g3dimpl_skip_chunk(&ck, ld->io);
+			continue;
+		}
+
+		if(read_rawval(&val, &ck, ld->io) == -1) {
+			return -1;
+		}
+		if(add_ref(ld, REF_BONE, mesh, &val) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int read_light(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_light *lt;
+	struct chunk_header ck;
+	struct value val;
+	int has_dir = 0, has_cone = 0;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(lt = goat3d_create_light())) {
+		goat3d_logmsg(LOG_ERROR, "read_light: failed to allocate light\n");
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_LIGHT_NAME:
+		case CNK_LIGHT_POS:
+		case CNK_LIGHT_COLOR:
+		case CNK_LIGHT_ATTEN:
+		case CNK_LIGHT_DISTANCE:
+		case CNK_LIGHT_DIR:
+		case CNK_LIGHT_CONE_INNER:
+		case CNK_LIGHT_CONE_OUTER:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			break;
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+			continue;
+		}
+
+		switch(ck.id) {
+		case CNK_LIGHT_NAME:
+			if(val.str) goat3d_set_light_name(lt, val.str);
+			break;
+		case CNK_LIGHT_POS:
+			cgm_vcons(&lt->pos, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_LIGHT_COLOR:
+			cgm_vcons(&lt->color, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_LIGHT_ATTEN:
+			cgm_vcons(&lt->attenuation, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_LIGHT_DISTANCE:
+			lt->max_dist = val.f[0];
+			break;
+		case CNK_LIGHT_DIR:
+			cgm_vcons(&lt->dir, val.f[0], val.f[1], val.f[2]);
+			has_dir = 1;
+			break;
+		case CNK_LIGHT_CONE_INNER:
+			lt->inner_cone = val.f[0];
+			has_cone = 1;
+			break;
+		case CNK_LIGHT_CONE_OUTER:
+			lt->outer_cone = val.f[0];
+			has_cone = 1;
+			break;
+		}
+		free(val.str);
+	}
+
+	if(has_dir) {
+		lt->ltype = has_cone ? LTYPE_SPOT : LTYPE_DIR;
+	} else {
+		lt->ltype = LTYPE_POINT;
+	}
+
+	goat3d_add_light(ld->g, lt);
+	return 0;
+
+err:
+	goat3d_destroy_light(lt);
+	return -1;
+}
+
+static int read_camera(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_camera *cam;
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(cam = goat3d_create_camera())) {
+		goat3d_logmsg(LOG_ERROR, "read_camera: failed to allocate camera\n");
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_CAMERA_NAME:
+		case CNK_CAMERA_POS:
+		case CNK_CAMERA_TARGET:
+		case CNK_CAMERA_FOV:
+		case CNK_CAMERA_NEARCLIP:
+		case CNK_CAMERA_FARCLIP:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			break;
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+			continue;
+		}
+
+		switch(ck.id) {
+		case CNK_CAMERA_NAME:
+			if(val.str) goat3d_set_camera_name(cam, val.str);
+			break;
+		case CNK_CAMERA_POS:
+			cgm_vcons(&cam->pos, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_CAMERA_TARGET:
+			cgm_vcons(&cam->target, val.f[0], val.f[1], val.f[2]);
+			cam->camtype = CAMTYPE_TARGET;
+			break;
+		case CNK_CAMERA_FOV:
+			cam->fov = val.f[0];
+			break;
+		case CNK_CAMERA_NEARCLIP:
+			cam->near_clip = val.f[0];
+			break;
+		case CNK_CAMERA_FARCLIP:
+			cam->far_clip = val.f[0];
+			break;
+		}
+		free(val.str);
+	}
+
+	goat3d_add_camera(ld->g, cam);
+	return 0;
+
+err:
+	goat3d_destroy_camera(cam);
+	return -1;
+}
+
+static int read_node(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_node *node;
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(node = goat3d_create_node())) {
+		goat3d_logmsg(LOG_ERROR, "read_node: failed to allocate node\n");
+		return -1;
+	}
+	goat3d_add_node(ld->g, node);
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			return -1;
+		}
+
+		switch(ck.id) {
+		case CNK_NODE_NAME:
+		case CNK_NODE_PARENT:
+		case CNK_NODE_MESH:
+		case CNK_NODE_LIGHT:
+		case CNK_NODE_CAMERA:
+		case CNK_NODE_POS:
+		case CNK_NODE_ROT:
+		case CNK_NODE_SCALE:
+		case CNK_NODE_PIVOT:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			break;
+		default:
+			/* the matrix chunks are redundant, we only use pos/rot/scale */
+			g3dimpl_skip_chunk(&ck, ld->io);
+			continue;
+		}
+
+		switch(ck.id) {
+		case CNK_NODE_NAME:
+			if(val.str) goat3d_set_node_name(node, val.str);
+			break;
+		case CNK_NODE_PARENT:
+			if(add_ref(ld, REF_PARENT, node, &val) == -1) return -1;
+			continue;	/* add_ref took ownership of val.str */
+		case CNK_NODE_MESH:
+			if(add_ref(ld, REF_MESH, node, &val) == -1) return -1;
+			continue;
+		case CNK_NODE_LIGHT:
+			if(add_ref(ld, REF_LIGHT, node, &val) == -1) return -1;
+			continue;
+		case CNK_NODE_CAMERA:
+			if(add_ref(ld, REF_CAMERA, node, &val) == -1) return -1;
+			continue;
+		case CNK_NODE_POS:
+			goat3d_set_node_position(node, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_NODE_ROT:
+			goat3d_set_node_rotation(node, val.f[0], val.f[1], val.f[2], val.f[3]);
+			break;
+		case CNK_NODE_SCALE:
+			goat3d_set_node_scaling(node, val.f[0], val.f[1], val.f[2]);
+			break;
+		case CNK_NODE_PIVOT:
+			goat3d_set_node_pivot(node, val.f[0], val.f[1], val.f[2]);
+			break;
+		}
+		free(val.str);
+	}
+	return 0;
+}
+
+static int read_anim(struct loader *ld, struct chunk_header *hdr)
+{
+	struct goat3d_anim *anim;
+	struct chunk_header ck;
+	struct value val;
+	long left = hdr->size - sizeof *hdr;
+	int nrefs = dynarr_size(ld->refs);
+
+	if(!(anim = goat3d_create_anim())) {
+		goat3d_logmsg(LOG_ERROR, "read_anim: failed to allocate animation\n");
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			goto err;
+		}
+
+		switch(ck.id) {
+		case CNK_ANIM_NAME:
+			if(read_value(&val, &ck, ld->io) == -1) goto err;
+			if(val.str) {
+				goat3d_set_anim_name(anim, val.str);
+				free(val.str);
+			}
+			break;
+
+		case CNK_ANIM_TRACK:
+			if(read_track(ld, anim, &ck) == -1) goto err;
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+
+	if(!anim->name) {
+		goat3d_logmsg(LOG_WARNING, "read_anim: ignoring animation without a name\n");
+		/* drop the node references of its tracks along with it */
+		while(dynarr_size(ld->refs) > nrefs) {
+			free(ld->refs[dynarr_size(ld->refs) - 1].name);
+			ld->refs = dynarr_pop(ld->refs);
+		}
+		goat3d_destroy_anim(anim);
+		return 0;
+	}
+	goat3d_add_anim(ld->g, anim);
+	return 0;
+
+err:
+	goat3d_destroy_anim(anim);
+	return -1;
+}
+
+static int read_track(struct loader *ld, struct goat3d_anim *anim, struct chunk_header *hdr)
+{
+	static const int key_val_sz[] = {1, 3, 4, 4};
+	int i, j, nval, num, have_type = 0;
+	struct goat3d_track *trk;
+	struct chunk_header ck;
+	struct value val;
+	struct goat3d_key key;
+	uint32_t *buf;
+	long left = hdr->size - sizeof *hdr;
+
+	if(!(trk = goat3d_create_track())) {
+		goat3d_logmsg(LOG_ERROR, "read_track: failed to allocate track\n");
+		return -1;
+	}
+	if(goat3d_add_anim_track(anim, trk) == -1) {
+		goat3d_destroy_track(trk);
+		return -1;
+	}
+
+	while(left > 0) {
+		if(next_chunk(&ck, &left, ld->io) == -1) {
+			return -1;
+		}
+
+		switch(ck.id) {
+		case CNK_TRACK_NAME:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			if(val.str) {
+				goat3d_set_track_name(trk, val.str);
+				free(val.str);
+			}
+			break;
+
+		case CNK_TRACK_TYPE:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			if(!g3dimpl_trktypestr(val.i[0])) {
+				goat3d_logmsg(LOG_WARNING, "read_track: ignoring invalid track type: %d\n", val.i[0]);
+				break;
+			}
+			if(goat3d_set_track_type(trk, val.i[0]) == -1) {
+				return -1;
+			}
+			have_type = 1;
+			break;
+
+		case CNK_TRACK_INTERP:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			if(val.i[0] >= GOAT3D_INTERP_STEP && val.i[0] <= GOAT3D_INTERP_CUBIC) {
+				goat3d_set_track_interp(trk, val.i[0]);
+			}
+			break;
+
+		case CNK_TRACK_EXTRAP:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			if(val.i[0] >= GOAT3D_EXTRAP_EXTEND && val.i[0] <= GOAT3D_EXTRAP_PINGPONG) {
+				goat3d_set_track_extrap(trk, val.i[0]);
+			}
+			break;
+
+		case CNK_TRACK_NODE:
+			if(read_value(&val, &ck, ld->io) == -1) return -1;
+			if(add_ref(ld, REF_TRACK, trk, &val) == -1) return -1;
+			break;
+
+		case CNK_TRACK_KEYS:
+			/* the size of each key depends on the type */
+			if(!have_type) {
+				goat3d_logmsg(LOG_ERROR, "read_track: keyframes before the track type\n");
+				return -1;
+			}
+			nval = key_val_sz[trk->type & 0xff];
+			num = (ck.size - sizeof ck) / ((1 + nval) * 4);
+			if(!(buf = malloc(num * (1 + nval) * 4))) {
+				goat3d_logmsg(LOG_ERROR, "read_track: failed to allocate keyframe buffer\n");
+				return -1;
+			}
+			if(ld->io->read(buf, num * (1 + nval) * 4, ld->io->cls) < num * (1 + nval) * 4) {
+				free(buf);
+				return -1;
+			}
+#ifdef GOAT3D_BIGEND
+			goat3d_bswap32(buf, num * (1 + nval));
+#endif
+			for(i=0; i<num; i++) {
+				uint32_t *kptr = buf + i * (1 + nval);
+				key.tm = (int)kptr[0];
+				for(j=0; j<nval; j++) {
+					memcpy(key.val + j, kptr + j + 1, sizeof *key.val);
+				}
+				goat3d_set_track_key(trk, &key);
+			}
+			free(buf);
+			if(skip_bytes(ck.size - sizeof ck - num * (1 + nval) * 4, ld->io) == -1) {
+				return -1;
+			}
+			break;
+
+		default:
+			g3dimpl_skip_chunk(&ck, ld->io);
+		}
+	}
+
+	/* force lazy re-sorting of keyframes if necessary */
+	goat3d_get_track_key(trk, 0, &key);
+	return 0;
+}
+
+static int resolve_refs(struct loader *ld)
+{
+	int i, num;
+	struct ref *ref;
+	struct goat3d_node *node;
+	struct goat3d_mesh *mesh;
+	void *obj, *tmp;
+
+	num = dynarr_size(ld->refs);
+	for(i=0; i<num; i++) {
+		ref = ld->refs + i;
+
+		switch(ref->type) {
+		case REF_PARENT:
+		case REF_BONE:
+		case REF_TRACK:
+			if(ref->name) {
+				obj = goat3d_get_node_by_name(ld->g, ref->name);
+			} else {
+				obj = ref->idx >= 0 && ref->idx < goat3d_get_node_count(ld->g) ?
+					goat3d_get_node(ld->g, ref->idx) : 0;
+			}
+			break;
+
+		case REF_MESH:
+			if(ref->name) {
+				obj = goat3d_get_mesh_by_name(ld->g, ref->name);
+			} else {
+				obj = ref->idx >= 0 && ref->idx < goat3d_get_mesh_count(ld->g) ?
+					goat3d_get_mesh(ld->g, ref->idx) : 0;
+			}
+			break;
+
+		case REF_LIGHT:
+			if(ref->name) {
+				obj = goat3d_get_light_by_name(ld->g, ref->name);
+			} else {
+				obj = ref->idx >= 0 && ref->idx < goat3d_get_light_count(ld->g) ?
+					goat3d_get_light(ld->g, ref->idx) : 0;
+			}
+			break;
+
+		case REF_CAMERA:
+			if(ref->name) {
+				obj = goat3d_get_camera_by_name(ld->g, ref->name);
+			} else {
+				obj = ref->idx >= 0 && ref->idx < goat3d_get_camera_count(ld->g) ?
+					goat3d_get_camera(ld->g, ref->idx) : 0;
+			}
+			break;
+
+		default:
+			obj = 0;
+		}
+
+		if(!obj) {
+			if(ref->name) {
+				goat3d_logmsg(LOG_WARNING, "ignoring invalid reference: %s\n", ref->name);
+			} else {
+				goat3d_logmsg(LOG_WARNING, "ignoring invalid reference: %d\n", ref->idx);
+			}
+			continue;
+		}
+
+		switch(ref->type) {
+		case REF_PARENT:
+			goat3d_add_node_child(obj, ref->obj);
+			break;
+
+		case REF_MESH:
+			goat3d_set_node_object(ref->obj, GOAT3D_NODE_MESH, obj);
+			break;
+		case REF_LIGHT:
+			goat3d_set_node_object(ref->obj, GOAT3D_NODE_LIGHT, obj);
+			break;
+		case REF_CAMERA:
+			goat3d_set_node_object(ref->obj, GOAT3D_NODE_CAMERA, obj);
+			break;
+
+		case REF_BONE:
+			mesh = ref->obj;
+			node = obj;
+			if(!(tmp = dynarr_push(mesh->bones, &node))) {
+				goat3d_logmsg(LOG_ERROR, "resolve_refs: failed to resize bone array\n");
+				return -1;
+			}
+			mesh->bones = tmp;
+			break;
+
+		case REF_TRACK:
+			goat3d_set_track_node(ref->obj, obj);
+			break;
+		}
+	}
+	return 0;
+}
+
+
+/* reads the next child chunk header, and subtracts its size from the number
+ * of bytes left in the parent chunk
+ */
+static int next_chunk(struct chunk_header *hdr, long *left, struct goat3d_io *io)
+{
+	if(*left < (long)sizeof *hdr || g3dimpl_read_chunk_header(hdr, io) == -1) {
+		goat3d_logmsg(LOG_ERROR, "unexpected end of file while reading chunk header\n");
+		return -1;
+	}
+	if((long)hdr->size > *left) {
+		goat3d_logmsg(LOG_ERROR, "invalid chunk %d, size (%lu) exceeds parent chunk\n",
+				(int)hdr->id, (unsigned long)hdr->size);
+		return -1;
+	}
+	*left -= hdr->size;
+	return 0;
+}
+
+static int skip_bytes(long count, struct goat3d_io *io)
+{
+	if(count == 0) return 0;
+	return io->seek(count, SEEK_CUR, io->cls) == -1 ? -1 : 0;
+}
+
+/* reads the single value chunk contained in hdr (CNK_MTL_NAME, CNK_NODE_POS, ...)
+ * and skips anything else in it.
+ */
+static int read_value(struct value *val, struct chunk_header *hdr, struct goat3d_io *io)
+{
+	long left = hdr->size - sizeof *hdr;
+	struct chunk_header ck;
+
+	memset(val, 0, sizeof *val);
+
+	if(next_chunk(&ck, &left, io) == -1 || read_rawval(val, &ck, io) == -1) {
+		return -1;
+	}
+	if(skip_bytes(left, io) == -1) {
+		free(val->str);
+		val->str = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* reads the payload of a value chunk (CNK_INT, CNK_FLOAT3, CNK_STRING, ...) */
+static int read_rawval(struct value *val, struct chunk_header *hdr, struct goat3d_io *io)
+{
+	int i;
+	long size = hdr->size - sizeof *hdr;
+	uint32_t buf[4];
+
+	memset(val, 0, sizeof *val);
+
+	switch(hdr->id) {
+	case CNK_INT:
+	case CNK_FLOAT:
+		val->count = 1;
+		break;
+	case CNK_FLOAT3:
+		val->count = 3;
+		break;
+	case CNK_INT4:
+	case CNK_FLOAT4:
+		val->count = 4;
+		break;
+
+	case CNK_STRING:
+		val->count = size;
+		if(!(val->str = malloc(size + 1))) {
+			goat3d_logmsg(LOG_ERROR, "read_value: failed to allocate string\n");
+			return -1;
+		}
+		if(size > 0 && io->read(val->str, size, io->cls) < size) {
+			free(val->str);
+			val->str = 0;
+			return -1;
+		}
+		val->str[size] = 0;
+		val->type = hdr->id;
+		return 0;
+
+	default:
+		goat3d_logmsg(LOG_WARNING, "read_value: unexpected chunk %d\n", (int)hdr->id);
+		return skip_bytes(size, io);
+	}
+
+	if(size < val->count * 4) {
+		goat3d_logmsg(LOG_ERROR, "read_value: chunk %d too small\n", (int)hdr->id);
+		return -1;
+	}
+	if(io->read(buf, val->count * 4, io->cls) < val->count * 4) {
+		return -1;
+	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(buf, val->count);
+#endif
+
+	for(i=0; i<val->count; i++) {
+		if(hdr->id == CNK_INT || hdr->id == CNK_INT4) {
+			val->i[i] = (int)buf[i];
+			val->f[i] = (float)val->i[i];
+		} else {
+			memcpy(val->f + i, buf + i, sizeof *val->f);
+			val->i[i] = (int)val->f[i];
+		}
+	}
+	val->type = hdr->id;
+
+	return skip_bytes(size - val->count * 4, io);
+}
+
+/* reads a raw vertex attribute or face list directly into the dynarr, or
+ * references it in place when loading from a memory-mapped file.
+ */
+static int read_list(struct loader *ld, struct goat3d_mesh *mesh, int attr, struct chunk_header *hdr)
+{
+	long size = hdr->size - sizeof *hdr;
+	int elemsz = g3dimpl_mesh_elemsize(attr);
+	int count = size / elemsz;
+	void *arr;
+	struct mesh_lazy *lz;
+
+	if(ld->datafile) {
+		if(!(lz = mesh->lazy)) {
+			if(!(lz = malloc(sizeof *lz))) {
+				goat3d_logmsg(LOG_ERROR, "read_list: failed to allocate lazy list table\n");
+				return -1;
+			}
+			lz->fp = ld->datafile;
+			memset(lz->offs, 0xff, sizeof lz->offs);
+			memset(lz->count, 0, sizeof lz->count);
+			lz->failed = 0;
+			mesh->lazy = lz;
+		}
+		if((lz->offs[attr] = ld->io->seek(0, SEEK_CUR, ld->io->cls)) == -1) {
+			return -1;
+		}
+		lz->count[attr] = count;
+		return skip_bytes(size, ld->io);
+	}
+
+#ifndef GOAT3D_BIGEND
+	if(ld->mem) {
+		struct memfile *mem = ld->mem;
+		char *ptr = mem->buf + mem->pos;
+
+		/* data lists are 4-byte aligned in files written by goat3d, but don't
+		 * count on it for files produced by other means.
+		 */
+		if(((uintptr_t)ptr & 3) == 0) {
+			mesh->mapped[attr].data = count ? ptr : 0;
+			mesh->mapped[attr].count = count;
+			mem->pos += size;
+			return 0;
+		}
+	}
+#endif
+
+	if(!(arr = g3dimpl_mesh_alloc(mesh, attr, count))) {
+		goat3d_logmsg(LOG_ERROR, "read_list: failed to resize array (%d)\n", count);
+		return -1;
+	}
+	if(count && ld->io->read(arr, (long)count * elemsz, ld->io->cls) < (long)count * elemsz) {
+		goat3d_logmsg(LOG_ERROR, "read_list: unexpected end of file\n");
+		return -1;
+	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(arr, count * elemsz / 4);
+#endif
+
+	return skip_bytes(size - (long)count * elemsz, ld->io);
+}
+
+/* reads a CNK_MESH_BVH chunk. A BVH which doesn't match the faces, or is
+ * otherwise broken, is dropped with a warning, since it can be rebuilt.
+ */
+static int read_bvh(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr)
+{
+	long size = hdr->size - sizeof *hdr;
+	long count = size / 4, node_words = sizeof(struct bvh_node) / 4, nfaces, max_count;
+	int32_t *buf;
+	struct bvh *bvh;
+
+	/* at most 2n - 1 nodes for n faces, plus the face indices and the counts */
+	nfaces = g3dimpl_mesh_count(mesh, MESH_FACES);
+	max_count = 2 + (nfaces ? (2 * nfaces - 1) * node_words : 0) + nfaces;
+	if(count < 2 || count > max_count) {
+		goat3d_logmsg(LOG_WARNING, "read_bvh: ignoring invalid BVH in mesh %s\n", mesh->name);
+		return skip_bytes(size, ld->io);
+	}
+
+	if(!(buf = malloc(count * 4))) {
+		goat3d_logmsg(LOG_ERROR, "read_bvh: failed to allocate buffer\n");
+		return -1;
+	}
+	if(ld->io->read(buf, count * 4, ld->io->cls) < count * 4) {
+		goat3d_logmsg(LOG_ERROR, "read_bvh: unexpected end of file\n");
+		free(buf);
+		return -1;
+	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(buf, count);
+#endif
+
+	if(buf[0] < 0 || buf[1] != nfaces ||
+			count != 2 + buf[0] * node_words + buf[1]) {
+		goat3d_logmsg(LOG_WARNING, "read_bvh: ignoring BVH which doesn't match the faces of mesh %s\n", mesh->name);
+		free(buf);
+		return skip_bytes(size - count * 4, ld->io);
+	}
+
+	if(!(bvh = calloc(1, sizeof *bvh)) ||
+			!(bvh->nodes = malloc(buf[0] * sizeof *bvh->nodes + 1)) ||
+			!(bvh->items = malloc(buf[1] * sizeof *bvh->items + 1))) {
+		goat3d_logmsg(LOG_ERROR, "read_bvh: failed to allocate BVH\n");
+		if(bvh) {
+			free(bvh->nodes);
+			free(bvh);
+		}
+		free(buf);
+		return -1;
+	}
+	bvh->num_nodes = buf[0];
+	bvh->num_items = buf[1];
+	memcpy(bvh->nodes, buf + 2, bvh->num_nodes * sizeof *bvh->nodes);
+	memcpy(bvh->items, buf + 2 + bvh->num_nodes * node_words, bvh->num_items * sizeof *bvh->items);
+	free(buf);
+
+	if(g3dimpl_bvh_validate(bvh) == -1) {
+		goat3d_logmsg(LOG_WARNING, "read_bvh: ignoring invalid BVH in mesh %s\n", mesh->name);
+		g3dimpl_bvh_destroy(bvh);
+		free(bvh);
+		return skip_bytes(size - count * 4, ld->io);
+	}
+
+	g3dimpl_mesh_free_bvh(mesh);
+	mesh->bvh = bvh;
+	return skip_bytes(size - count * 4, ld->io);
+}
+
+/* reads a CNK_MESH_BOUNDS chunk into the cached mesh bounds, so that they
+ * don't have to be computed from the vertices, which might not be loaded yet.
+ * Bounds which don't make sense are ignored, and computed as usual instead.
+ */
+static int read_bounds(struct loader *ld, struct goat3d_mesh *mesh, struct chunk_header *hdr)
+{
+	long size = hdr->size - sizeof *hdr;
+	struct aabox bb;
+
+	if(size < (long)sizeof bb) {
+		goat3d_logmsg(LOG_WARNING, "read_bounds: ignoring invalid bounds in mesh %s\n", mesh->name);
+		return skip_bytes(size, ld->io);
+	}
+	if(ld->io->read(&bb, sizeof bb, ld->io->cls) < (long)sizeof bb) {
+		goat3d_logmsg(LOG_ERROR, "read_bounds: unexpected end of file\n");
+		return -1;
+	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(&bb, 6);
+#endif
+
+	/* also false for NaNs */
+	if(bb.bmin.x <= bb.bmax.x && bb.bmin.y <= bb.bmax.y && bb.bmin.z <= bb.bmax.z) {
+		mesh->bbox = bb;
+		mesh->bbox_valid = 1;
+	} else {
+		goat3d_logmsg(LOG_WARNING, "read_bounds: ignoring invalid bounds in mesh %s\n", mesh->name);
+	}
+	return skip_bytes(size - sizeof bb, ld->io);
+}
+
+/* adds a pending reference to a node or object. takes ownership of val->str */
+static int add_ref(struct loader *ld, int type, void *obj, struct value *val)
+{
+	struct ref ref;
+	void *tmp;
+
+	ref.type = type;
+	ref.obj = obj;
+	ref.name = val->str;
+	ref.idx = val->i[0];
+
+	if(!(tmp = dynarr_push(ld->refs, &ref))) {
+		goat3d_logmsg(LOG_ERROR, "add_ref: failed to resize reference array\n");
+		free(val->str);
+		return -1;
+	}
+	ld->refs = tmp;
+	return 0;
+}
+
+static long mem_read(void *buf, size_t bytes, void *uptr)
+{
+	struct memfile *mem = uptr;
+
+	if(bytes > (size_t)(mem->size - mem->pos)) {
+		bytes = mem->size - mem->pos;
+	}
+	memcpy(buf, mem->buf + mem->pos, bytes);
+	mem->pos += bytes;
+	return bytes;
+}
+
+static long mem_seek(long offs, int whence, void *uptr)
+{
+	struct memfile *mem = uptr;
+	long pos;
+
+	switch(whence) {
+	case SEEK_SET:
+		pos = offs;
+		break;
+	case SEEK_CUR:
+		pos = mem->pos + offs;
+		break;
+	case SEEK_END:
+		pos = mem->size + offs;
+		break;
+	default:
+		return -1;
+	}
+	if(pos < 0 || pos > mem->size) {
+		return -1;
+	}
+	mem->pos = pos;
+	return pos;
+}
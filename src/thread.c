@@ -0,0 +1,256 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "thread.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+struct parfor {
+	int count, next;
+	void (*func)(int, void*);
+	void *cls;
+	g3dimpl_mutex lock;
+};
+
+struct thread_start {
+	void (*func)(void*);
+	void *arg;
+};
+
+static void run_jobs(void *arg)
+{
+	int idx;
+	struct parfor *pf = arg;
+
+	for(;;) {
+		g3dimpl_mutex_lock(&pf->lock);
+		idx = pf->next++;
+		g3dimpl_mutex_unlock(&pf->lock);
+
+		if(idx >= pf->count) break;
+		pf->func(idx, pf->cls);
+	}
+}
+
+void g3dimpl_parallel_for(int count, int max_threads, void (*func)(int, void*), void *cls)
+{
+	int i, nthr = 0;
+	g3dimpl_thread *thr = 0;
+	struct parfor pf;
+
+	pf.count = count;
+	pf.next = 0;
+	pf.func = func;
+	pf.cls = cls;
+
+	if(max_threads > count) max_threads = count;
+	if(max_threads > 1 && g3dimpl_mutex_init(&pf.lock) == -1) {
+		max_threads = 1;
+	}
+	if(max_threads <= 1) {
+		for(i=0; i<count; i++) {
+			func(i, cls);
+		}
+		return;
+	}
+
+	if((thr = malloc((max_threads - 1) * sizeof *thr))) {
+		for(i=0; i<max_threads - 1; i++) {
+			if(g3dimpl_thread_create(thr + nthr, run_jobs, &pf) == -1) {
+				break;
+			}
+			nthr++;
+		}
+	}
+
+	run_jobs(&pf);
+
+	for(i=0; i<nthr; i++) {
+		g3dimpl_thread_join(thr[i]);
+	}
+	free(thr);
+	g3dimpl_mutex_destroy(&pf.lock);
+}
+
+#ifdef _WIN32
+int g3dimpl_mutex_init(g3dimpl_mutex *m)
+{
+	InitializeSRWLock(m);
+	return 0;
+}
+
+void g3dimpl_mutex_destroy(g3dimpl_mutex *m)
+{
+}
+
+void g3dimpl_mutex_lock(g3dimpl_mutex *m)
+{
+	AcquireSRWLockExclusive(m);
+}
+
+void g3dimpl_mutex_unlock(g3dimpl_mutex *m)
+{
+	ReleaseSRWLockExclusive(m);
+}
+
+void *g3dimpl_load_acquire(void *const *ptr)
+{
+	void *val = *(void *const volatile*)ptr;
+	MemoryBarrier();
+	return val;
+}
+
+void g3dimpl_store_release(void **ptr, void *val)
+{
+	MemoryBarrier();
+	*(void *volatile*)ptr = val;
+}
+
+static DWORD WINAPI thread_proc(void *arg)
+{
+	struct thread_start ts = *(struct thread_start*)arg;
+	free(arg);
+	ts.func(ts.arg);
+	return 0;
+}
+
+int g3dimpl_thread_create(g3dimpl_thread *thr, void (*func)(void*), void *arg)
+{
+	struct thread_start *ts;
+
+	if(!(ts = malloc(sizeof *ts))) {
+		return -1;
+	}
+	ts->func = func;
+	ts->arg = arg;
+
+	if(!(*thr = CreateThread(0, 0, thread_proc, ts, 0, 0))) {
+		free(ts);
+		return -1;
+	}
+	return 0;
+}
+
+void g3dimpl_thread_join(g3dimpl_thread thr)
+{
+	WaitForSingleObject(thr, INFINITE);
+	CloseHandle(thr);
+}
+
+int g3dimpl_num_cpus(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+#else	/* pthreads */
+
+int g3dimpl_mutex_init(g3dimpl_mutex *m)
+{
+	return pthread_mutex_init(m, 0) == 0 ? 0 : -1;
+}
+
+void g3dimpl_mutex_destroy(g3dimpl_mutex *m)
+{
+	pthread_mutex_destroy(m);
+}
+
+void g3dimpl_mutex_lock(g3dimpl_mutex *m)
+{
+	pthread_mutex_lock(m);
+}
+
+void g3dimpl_mutex_unlock(g3dimpl_mutex *m)
+{
+	pthread_mutex_unlock(m);
+}
+
+#ifdef __GNUC__
+void *g3dimpl_load_acquire(void *const *ptr)
+{
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+void g3dimpl_store_release(void **ptr, void *val)
+{
+	__atomic_store_n(ptr, val, __ATOMIC_RELEASE);
+}
+#else
+/* without compiler atomics, a mutex orders the accesses just as well */
+static pthread_mutex_t atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *g3dimpl_load_acquire(void *const *ptr)
+{
+	void *val;
+	pthread_mutex_lock(&atomic_lock);
+	val = *ptr;
+	pthread_mutex_unlock(&atomic_lock);
+	return val;
+}
+
+void g3dimpl_store_release(void **ptr, void *val)
+{
+	pthread_mutex_lock(&atomic_lock);
+	*ptr = val;
+	pthread_mutex_unlock(&atomic_lock);
+}
+#endif
+
+static void *thread_proc(void *arg)
+{
+	struct thread_start ts = *(struct thread_start*)arg;
+	free(arg);
+	ts.func(ts.arg);
+	return 0;
+}
+
+int g3dimpl_thread_create(g3dimpl_thread *thr, void (*func)(void*), void *arg)
+{
+	struct thread_start *ts;
+
+	if(!(ts = malloc(sizeof *ts))) {
+		return -1;
+	}
+	ts->func = func;
+	ts->arg = arg;
+
+	if(pthread_create(thr, 0, thread_proc, ts) != 0) {
+		free(ts);
+		return -1;
+	}
+	return 0;
+}
+
+void g3dimpl_thread_join(g3dimpl_thread thr)
+{
+	pthread_join(thr, 0);
+}
+
+int g3dimpl_num_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#else
+	return 1;
+#endif
+}
+#endif
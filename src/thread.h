@@ -0,0 +1,64 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GOAT3D_THREAD_H_
+#define GOAT3D_THREAD_H_
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK g3dimpl_mutex;
+typedef HANDLE g3dimpl_thread;
+#define G3DIMPL_MUTEX_INITIALIZER	SRWLOCK_INIT
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t g3dimpl_mutex;
+typedef pthread_t g3dimpl_thread;
+#define G3DIMPL_MUTEX_INITIALIZER	PTHREAD_MUTEX_INITIALIZER
+#endif
+
+/* mutexes are either statically initialized with G3DIMPL_MUTEX_INITIALIZER,
+ * or with g3dimpl_mutex_init, in which case they need g3dimpl_mutex_destroy
+ */
+int g3dimpl_mutex_init(g3dimpl_mutex *m);
+void g3dimpl_mutex_destroy(g3dimpl_mutex *m);
+void g3dimpl_mutex_lock(g3dimpl_mutex *m);
+void g3dimpl_mutex_unlock(g3dimpl_mutex *m);
+
+/* pointer load with acquire, and store with release semantics, for pointers
+ * checked without holding the lock which guards changing them
+ */
+void *g3dimpl_load_acquire(void *const *ptr);
+void g3dimpl_store_release(void **ptr, void *val);
+
+/* starts a thread running func(arg), returns -1 on failure. Every thread
+ * started must be joined.
+ */
+int g3dimpl_thread_create(g3dimpl_thread *thr, void (*func)(void*), void *arg);
+void g3dimpl_thread_join(g3dimpl_thread thr);
+
+int g3dimpl_num_cpus(void);
+
+/* calls func(i, cls) for every i in [0, count), spread over up to max_threads
+ * threads, including the calling thread, and returns when all are done. Runs
+ * everything on the calling thread if max_threads <= 1, or if no threads can
+ * be started.
+ */
+void g3dimpl_parallel_for(int count, int max_threads, void (*func)(int, void*), void *cls);
+
+#endif	/* GOAT3D_THREAD_H_ */
@@ -24,7 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "cgmath/cgmath.h"
 
-static int find_prev_key(const struct anm_keyframe *arr, int start, int end, anm_time_t tm);
+static int find_prev_key(const anm_time_t *arr, int start, int end, anm_time_t tm);
 
 static float interp_step(float v0, float v1, float v2, float v3, float t);
 static float interp_linear(float v0, float v1, float v2, float v3, float t);
@@ -52,14 +52,18 @@ static anm_time_t (*remap_time[])(anm_time_t, anm_time_t, anm_time_t) = {
 	0
 };
 
-int anm_init_track(struct anm_track *track)
+int anm_init_track(struct anm_track *track, int ncomp)
 {
 	memset(track, 0, sizeof *track);
 
-	if(!(track->keys = dynarr_alloc(0, sizeof *track->keys))) {
+	if(!(track->times = dynarr_alloc(0, sizeof *track->times))) {
 		return -1;
 	}
-	track->keys_sorted = 1;
+	if(!(track->vals = dynarr_alloc(0, sizeof *track->vals))) {
+		dynarr_free(track->times);
+		return -1;
+	}
+	track->ncomp = ncomp;
 	track->interp = ANM_INTERP_LINEAR;
 	track->extrap = ANM_EXTRAP_CLAMP;
 	return 0;
@@ -67,15 +71,17 @@ int anm_init_track(struct anm_track *track)
 
 void anm_destroy_track(struct anm_track *track)
 {
-	dynarr_free(track->keys);
+	free(track->name);
+	dynarr_free(track->times);
+	dynarr_free(track->vals);
 }
 
-struct anm_track *anm_create_track(void)
+struct anm_track *anm_create_track(int ncomp)
 {
 	struct anm_track *track;
 
 	if((track = malloc(sizeof *track))) {
-		if(anm_init_track(track) == -1) {
+		if(anm_init_track(track, ncomp) == -1) {
 			free(track);
 			return 0;
 		}
@@ -89,26 +95,38 @@ void anm_free_track(struct anm_track *track)
 	free(track);
 }
 
-void anm_copy_track(struct anm_track *dest, const struct anm_track *src)
+int anm_copy_track(struct anm_track *dest, const struct anm_track *src)
 {
-	free(dest->name);
-	if(dest->keys) {
-		dynarr_free(dest->keys);
+	anm_time_t *times;
+	float *vals;
+
+	if(!(times = dynarr_alloc(src->count, sizeof *times))) {
+		return -1;
 	}
+	if(!(vals = dynarr_alloc(src->count * src->ncomp, sizeof *vals))) {
+		dynarr_free(times);
+		return -1;
+	}
+	memcpy(times, src->times, src->count * sizeof *times);
+	memcpy(vals, src->vals, src->count * src->ncomp * sizeof *vals);
+
+	dynarr_free(dest->times);
+	dynarr_free(dest->vals);
+	dest->times = times;
+	dest->vals = vals;
 
+	free(dest->name);
+	dest->name = 0;
 	if(src->name) {
-		dest->name = malloc(strlen(src->name) + 1);
-		strcpy(dest->name, src->name);
+		anm_set_track_name(dest, src->name);
 	}
 
 	dest->count = src->count;
-	dest->keys = dynarr_alloc(src->count, sizeof *dest->keys);
-	memcpy(dest->keys, src->keys, src->count * sizeof *dest->keys);
-
-	dest->def_val = src->def_val;
+	dest->ncomp = src->ncomp;
+	memcpy(dest->def_val, src->def_val, sizeof dest->def_val);
 	dest->interp = src->interp;
 	dest->extrap = src->extrap;
-	dest->keys_sorted = src->keys_sorted;
+	return 0;
 }
 
 int anm_set_track_name(struct anm_track *track, const char *name)
@@ -118,6 +136,7 @@ int anm_set_track_name(struct anm_track *track, const char *name)
 	if(!(tmp = malloc(strlen(name) + 1))) {
 		return -1;
 	}
+	strcpy(tmp, name);
 	free(track->name);
 	track->name = tmp;
 	return 0;
@@ -128,6 +147,34 @@ const char *anm_get_track_name(const struct anm_track *track)
 	return track->name;
 }
 
+int anm_set_track_components(struct anm_track *track, int ncomp)
+{
+	int i, j, ncopy;
+	float *vals, *src, *dest;
+
+	if(ncomp == track->ncomp) return 0;
+
+	if(track->count) {
+		if(!(vals = dynarr_alloc(track->count * ncomp, sizeof *vals))) {
+			return -1;
+		}
+		ncopy = ncomp < track->ncomp ? ncomp : track->ncomp;
+		src = track->vals;
+		dest = vals;
+		for(i=0; i<track->count; i++) {
+			for(j=0; j<ncomp; j++) {
+				dest[j] = j < ncopy ? src[j] : track->def_val[j];
+			}
+			src += track->ncomp;
+			dest += ncomp;
+		}
+		dynarr_free(track->vals);
+		track->vals = vals;
+	}
+	track->ncomp = ncomp;
+	return 0;
+}
+
 void anm_set_track_interpolator(struct anm_track *track, enum anm_interpolator in)
 {
 	track->interp = in;
@@ -143,206 +190,227 @@ anm_time_t anm_remap_time(const struct anm_track *track, anm_time_t tm, anm_time
 	return remap_time[track->extrap](tm, start, end);
 }
 
-void anm_set_track_default(struct anm_track *track, float def)
+void anm_set_track_default(struct anm_track *track, int comp, float def)
 {
-	track->def_val = def;
+	track->def_val[comp] = def;
 }
 
-static int keycmp(const void *a, const void *b)
+int anm_set_keyframe(struct anm_track *track, anm_time_t tm, const float *val)
 {
-	return ((struct anm_keyframe*)a)->time - ((struct anm_keyframe*)b)->time;
-}
-
-int anm_set_keyframe(struct anm_track *track, struct anm_keyframe *key)
-{
-	int idx = anm_get_key_interval(track, key->time);
+	int i, idx = anm_get_key_interval(track, tm);
+	int ncomp = track->ncomp;
+	void *tmp;
 
 	/* if we got a valid keyframe index, compare them... */
-	if(idx >= 0 && idx < track->count && keycmp(key, track->keys + idx) == 0) {
+	if(idx >= 0 && track->times[idx] == tm) {
 		/* ... it's the same key, just update the value */
-		track->keys[idx].val = key->val;
-	} else {
-		/* ... it's a new key, add it and re-sort them if necessary */
-		void *tmp;
-		if(!(tmp = dynarr_push(track->keys, key))) {
+		memcpy(track->vals + idx * ncomp, val, ncomp * sizeof *val);
+		return 0;
+	}
+
+	/* ... it's a new key, which goes after idx, to keep the keys sorted */
+	if(!(tmp = dynarr_push(track->times, &tm))) {
+		return -1;
+	}
+	track->times = tmp;
+	for(i=0; i<ncomp; i++) {
+		if(!(tmp = dynarr_push(track->vals, (void*)(val + i)))) {
+			DYNARR_RESIZE(track->vals, track->count * ncomp);
+			DYNARR_POP(track->times);
 			return -1;
 		}
-		track->keys = tmp;
-		idx = track->count++;
-		if(idx > 0 && track->keys[idx - 1].time > key->time) {
-			/* key shold not go to the end, mark for re-sorting */
-			track->keys_sorted = 0;
-		}
+		track->vals = tmp;
 	}
+
+	if(++idx < track->count) {
+		/* not appending, move the following keys up by one */
+		memmove(track->times + idx + 1, track->times + idx,
+				(track->count - idx) * sizeof *track->times);
+		memmove(track->vals + (idx + 1) * ncomp, track->vals + idx * ncomp,
+				(track->count - idx) * ncomp * sizeof *track->vals);
+		track->times[idx] = tm;
+		memcpy(track->vals + idx * ncomp, val, ncomp * sizeof *val);
+	}
+	track->count++;
 	return 0;
 }
 
-#define lazysort_keys(track)	\
-	if(track->count > 1 && !track->keys_sorted) { \
-		qsort(track->keys, track->count, sizeof *track->keys, keycmp); \
-		((struct anm_track*)track)->keys_sorted = 1; \
+anm_time_t anm_get_key_time(const struct anm_track *track, int idx)
+{
+	if(idx < 0 || idx >= track->count) {
+		return ANM_TIME_INVAL;
 	}
+	return track->times[idx];
+}
 
-struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx)
+const float *anm_get_key_value(const struct anm_track *track, int idx)
 {
 	if(idx < 0 || idx >= track->count) {
 		return 0;
 	}
-	lazysort_keys(track);
-	return track->keys + idx;
+	return track->vals + idx * track->ncomp;
 }
 
 int anm_get_key_interval(const struct anm_track *track, anm_time_t tm)
 {
 	int last;
 
-	lazysort_keys(track);
-
-	if(!track->count || tm < track->keys[0].time) {
+	if(!track->count || tm < track->times[0]) {
 		return -1;
 	}
 
 	last = track->count - 1;
-	if(tm > track->keys[last].time) {
+	if(tm > track->times[last]) {
 		return last;
 	}
 
-	return find_prev_key(track->keys, 0, last, tm);
+	return find_prev_key(track->times, 0, last, tm);
 }
 
-static int find_prev_key(const struct anm_keyframe *arr, int start, int end, anm_time_t tm)
+static int find_prev_key(const anm_time_t *arr, int start, int end, anm_time_t tm)
 {
 	int mid;
 
 	if(end - start <= 1) {
-		return start;
+		return tm >= arr[end] ? end : start;
 	}
 
 	mid = (start + end) / 2;
-	if(tm < arr[mid].time) {
+	if(tm < arr[mid]) {
 		return find_prev_key(arr, start, mid, tm);
 	}
-	if(tm > arr[mid].time) {
+	if(tm > arr[mid]) {
 		return find_prev_key(arr, mid, end, tm);
 	}
 	return mid;
 }
 
-int anm_set_value(struct anm_track *track, anm_time_t tm, float val)
+/* find the keyframe interval containing tm, checking the interval of the
+ * previous call and the one after it, before falling back to a binary search.
+ */
+static int find_interval(const struct anm_track *track, anm_time_t tm, struct anm_cursor *cur)
 {
-	struct anm_keyframe key;
-	key.time = tm;
-	key.val = val;
+	int k, last_idx = track->count - 1;
+	const anm_time_t *times = track->times;
+
+	if(cur) {
+		k = cur->key;
+		if(k >= 0 && k <= last_idx && tm >= times[k]) {
+			if(k == last_idx || tm < times[k + 1]) {
+				return k;
+			}
+			/* advanced to the next interval */
+			if(++k == last_idx || tm < times[k + 1]) {
+				cur->key = k;
+				return k;
+			}
+		}
+	}
 
-	return anm_set_keyframe(track, &key);
+	k = anm_get_key_interval(track, tm);
+	if(cur) {
+		cur->key = k;
+	}
+	return k;
 }
 
-float anm_get_value(const struct anm_track *track, anm_time_t tm)
+/* find the keyframe interval for evaluating the track at time tm, after
+ * applying the extrapolation mode. Returns the index of the first key, and
+ * the interpolation parameter through tptr. If the time falls on the last key
+ * (or there's only one) the index of the last key is returned.
+ */
+static int eval_interval(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, float *tptr)
 {
-	int idx0, idx1, last_idx;
+	int idx, last_idx = track->count - 1;
 	anm_time_t tstart, tend;
-	float t, dt;
-	float v0, v1, v2, v3;
 
-	if(!track->count) {
-		return track->def_val;
-	}
-	lazysort_keys(track);
-
-	last_idx = track->count - 1;
-
-	tstart = track->keys[0].time;
-	tend = track->keys[last_idx].time;
+	tstart = track->times[0];
+	tend = track->times[last_idx];
 
 	if(tstart == tend) {
-		return track->keys[0].val;
+		return 0;
 	}
 
 	tm = remap_time[track->extrap](tm, tstart, tend);
 
-	idx0 = anm_get_key_interval(track, tm);
-	assert(idx0 >= 0 && idx0 < track->count);
-	idx1 = idx0 + 1;
+	idx = find_interval(track, tm, cur);
+	assert(idx >= 0 && idx < track->count);
 
-	if(idx0 == last_idx) {
-		return track->keys[idx0].val;
+	if(idx < last_idx) {
+		*tptr = (float)(tm - track->times[idx]) / (float)(track->times[idx + 1] - track->times[idx]);
 	}
-
-	dt = (float)(track->keys[idx1].time - track->keys[idx0].time);
-	t = (float)(tm - track->keys[idx0].time) / dt;
-
-	v1 = track->keys[idx0].val;
-	v2 = track->keys[idx1].val;
-
-	/* get the neigboring values to allow for cubic interpolation */
-	v0 = idx0 > 0 ? track->keys[idx0 - 1].val : v1;
-	v3 = idx1 < last_idx ? track->keys[idx1 + 1].val : v2;
-
-	return interp[track->interp](v0, v1, v2, v3, t);
+	return idx;
 }
 
+void anm_get_value(const struct anm_track *track, anm_time_t tm, float *res)
+{
+	anm_get_value_cursor(track, tm, 0, res);
+}
 
-void anm_get_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
-		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm, float *qres)
+void anm_get_value_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, float *res)
 {
-	int idx0, idx1, last_idx;
-	anm_time_t tstart, tend;
-	float t, dt;
-	cgm_quat q1, q2;
+	int i, idx0, idx1, last_idx;
+	int ncomp = track->ncomp;
+	float t;
+	const float *v0, *v1, *v2, *v3;
 
-	if(!xtrk->count) {
-		qres[0] = xtrk->def_val;
-		qres[1] = ytrk->def_val;
-		qres[2] = ztrk->def_val;
-		qres[3] = wtrk->def_val;
+	if(!track->count) {
+		memcpy(res, track->def_val, ncomp * sizeof *res);
 		return;
 	}
 
-	lazysort_keys(xtrk);
-	lazysort_keys(ytrk);
-	lazysort_keys(ztrk);
-	lazysort_keys(wtrk);
+	last_idx = track->count - 1;
+	idx0 = eval_interval(track, tm, cur, &t);
+	idx1 = idx0 + 1;
 
-	last_idx = xtrk->count - 1;
+	v1 = track->vals + idx0 * ncomp;
+	if(idx0 == last_idx) {
+		memcpy(res, v1, ncomp * sizeof *res);
+		return;
+	}
+	v2 = v1 + ncomp;
 
-	tstart = xtrk->keys[0].time;
-	tend = xtrk->keys[last_idx].time;
+	/* get the neigboring values to allow for cubic interpolation */
+	v0 = idx0 > 0 ? v1 - ncomp : v1;
+	v3 = idx1 < last_idx ? v2 + ncomp : v2;
 
-	if(tstart == tend) {
-		qres[0] = xtrk->keys[0].val;
-		qres[1] = ytrk->keys[0].val;
-		qres[2] = ztrk->keys[0].val;
-		qres[3] = wtrk->keys[0].val;
-		return;
+	for(i=0; i<ncomp; i++) {
+		res[i] = interp[track->interp](v0[i], v1[i], v2[i], v3[i], t);
 	}
+}
 
-	tm = anm_remap_time(xtrk, tm, tstart, tend);
 
-	idx0 = anm_get_key_interval(xtrk, tm);
-	assert(idx0 >= 0 && idx0 < xtrk->count);
-	idx1 = idx0 + 1;
+void anm_get_quat(const struct anm_track *track, anm_time_t tm, float *qres)
+{
+	anm_get_quat_cursor(track, tm, 0, qres);
+}
 
-	if(idx0 == last_idx) {
-		qres[0] = xtrk->keys[idx0].val;
-		qres[1] = ytrk->keys[idx0].val;
-		qres[2] = ztrk->keys[idx0].val;
-		qres[3] = wtrk->keys[idx0].val;
+void anm_get_quat_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, float *qres)
+{
+	int idx0, last_idx;
+	float t;
+	const float *v1;
+	cgm_quat q1, q2;
+
+	if(!track->count) {
+		memcpy(qres, track->def_val, 4 * sizeof *qres);
 		return;
 	}
 
-	dt = (float)(xtrk->keys[idx1].time - xtrk->keys[idx0].time);
-	t = (float)(tm - xtrk->keys[idx0].time) / dt;
-
-	q1.x = xtrk->keys[idx0].val;
-	q1.y = ytrk->keys[idx0].val;
-	q1.z = ztrk->keys[idx0].val;
-	q1.w = wtrk->keys[idx0].val;
+	last_idx = track->count - 1;
+	idx0 = eval_interval(track, tm, cur, &t);
 
-	q2.x = xtrk->keys[idx1].val;
-	q2.y = ytrk->keys[idx1].val;
-	q2.z = ztrk->keys[idx1].val;
-	q2.w = wtrk->keys[idx1].val;
+	v1 = track->vals + idx0 * 4;
+	if(idx0 == last_idx) {
+		memcpy(qres, v1, 4 * sizeof *qres);
+		return;
+	}
 
+	cgm_qcons(&q1, v1[0], v1[1], v1[2], v1[3]);
+	cgm_qcons(&q2, v1[4], v1[5], v1[6], v1[7]);
 	cgm_qslerp((cgm_quat*)qres, &q1, &q2, t);
 }
 
@@ -48,22 +48,32 @@ typedef long anm_time_t;
 #define ANM_TM2SEC(x)	((x) / 1000.0)
 #define ANM_TM2MSEC(x)	(x)
 
-struct anm_keyframe {
-	anm_time_t time;
-	float val;
-};
+#define ANM_MAX_COMP	4
 
+/* keyframes of all components share the same time array, and their values
+ * are packed together: vals[key * ncomp + comp]
+ */
 struct anm_track {
 	char *name;
 	int count;
-	struct anm_keyframe *keys;
+	int ncomp;			/* number of components per keyframe (1-4) */
+	anm_time_t *times;	/* dynarr, sorted in increasing time order */
+	float *vals;		/* dynarr, ncomp values per keyframe */
 
-	float def_val;
+	float def_val[ANM_MAX_COMP];
 
 	enum anm_interpolator interp;
 	enum anm_extrapolator extrap;
+};
 
-	int keys_sorted;
+/* Sampling cursor, for evaluating a track at successive times. It remembers
+ * the keyframe interval found by the last evaluation, so that when time moves
+ * forward by small steps, the interval is found in constant time instead of
+ * searching the keyframes. Any initial value is valid, and one cursor per
+ * track should be used.
+ */
+struct anm_cursor {
+	int key;
 };
 
 #ifdef __cplusplus
@@ -71,34 +81,43 @@ extern "C" {
 #endif
 
 /* track constructor and destructor */
-int anm_init_track(struct anm_track *track);
+int anm_init_track(struct anm_track *track, int ncomp);
 void anm_destroy_track(struct anm_track *track);
 
 /* helper functions that use anm_init_track and anm_destroy_track internally */
-struct anm_track *anm_create_track(void);
+struct anm_track *anm_create_track(int ncomp);
 void anm_free_track(struct anm_track *track);
 
 /* copies track src to dest
  * XXX: dest must have been initialized first
  */
-void anm_copy_track(struct anm_track *dest, const struct anm_track *src);
+int anm_copy_track(struct anm_track *dest, const struct anm_track *src);
 
 int anm_set_track_name(struct anm_track *track, const char *name);
 const char *anm_get_track_name(const struct anm_track *track);
 
+/* change the number of components per keyframe. Existing keyframe values are
+ * truncated, or extended with the default values of the new components.
+ */
+int anm_set_track_components(struct anm_track *track, int ncomp);
+
 void anm_set_track_interpolator(struct anm_track *track, enum anm_interpolator in);
 void anm_set_track_extrapolator(struct anm_track *track, enum anm_extrapolator ex);
 
 anm_time_t anm_remap_time(const struct anm_track *track, anm_time_t tm,
 		anm_time_t start, anm_time_t end);
 
-void anm_set_track_default(struct anm_track *track, float def);
+/* set the value of a component for times when the track has no keyframes */
+void anm_set_track_default(struct anm_track *track, int comp, float def);
 
-/* set or update a keyframe */
-int anm_set_keyframe(struct anm_track *track, struct anm_keyframe *key);
+/* set or update a keyframe, val points to ncomp values */
+int anm_set_keyframe(struct anm_track *track, anm_time_t tm, const float *val);
 
-/* get the idx-th keyframe, returns null if it doesn't exist */
-struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx);
+/* get the time and values of the idx-th keyframe. anm_get_key_value returns
+ * null if the keyframe doesn't exist.
+ */
+anm_time_t anm_get_key_time(const struct anm_track *track, int idx);
+const float *anm_get_key_value(const struct anm_track *track, int idx);
 
 /* Finds the 0-based index of the intra-keyframe interval which corresponds
  * to the specified time. If the time falls exactly onto the N-th keyframe
@@ -111,17 +130,20 @@ struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx);
  */
 int anm_get_key_interval(const struct anm_track *track, anm_time_t tm);
 
-int anm_set_value(struct anm_track *track, anm_time_t tm, float val);
+/* evaluates the track for a particular time, and writes ncomp values to res */
+void anm_get_value(const struct anm_track *track, anm_time_t tm, float *res);
 
-/* evaluates and returns the value of the track for a particular time */
-float anm_get_value(const struct anm_track *track, anm_time_t tm);
-
-/* evaluates a set of 4 tracks treated as a quaternion, to perform slerp instead
- * of linear interpolation. Result is returned through the last argument, which
+/* evaluates a 4-component track as a quaternion, to perform slerp instead of
+ * linear interpolation. Result is returned through the last argument, which
  * is expected to point to an array of 4 floats (x,y,z,w)
  */
-void anm_get_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
-		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm, float *qres);
+void anm_get_quat(const struct anm_track *track, anm_time_t tm, float *qres);
+
+/* same as anm_get_value and anm_get_quat, using and updating a sampling cursor */
+void anm_get_value_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, float *res);
+void anm_get_quat_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, float *qres);
 
 #ifdef __cplusplus
 }
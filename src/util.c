@@ -19,11 +19,43 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include "util.h"
 
-static int b64bits(int c);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define B64_SIMD_X86
+#include <immintrin.h>
+#endif
 
-int calc_b64_size(const char *s)
+/* base64 character to 6-bit value, or -1 for characters to skip */
+static const signed char b64tab[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/* vectorized decoders: consume as many whole blocks of valid base64
+ * characters as possible, and advance the source and destination pointers.
+ * They stop at the first block containing anything else (padding,
+ * whitespace), which is left for the scalar decoder.
+ */
+typedef void (*b64dec_func)(const char **srcp, const char *srcend,
+		unsigned char **destp, unsigned char *destend);
+
+static b64dec_func get_b64dec_simd(void);
+
+int calc_b64_size(const char *s, long len)
 {
-	int len = strlen(s);
 	const char *end = s + len;
 	while(end > s && *--end == '=') len--;
 	return len * 3 / 4;
@@ -31,79 +63,403 @@ int calc_b64_size(const char *s)
 
 
 GOAT3DAPI void *goat3d_b64decode(const char *str, void *buf, int *bufsz)
+{
+	return g3dimpl_b64decode(str, strlen(str), buf, bufsz);
+}
+
+void *g3dimpl_b64decode(const char *str, long len, void *buf, int *bufsz)
 {
 	unsigned char *dest, *end;
-	unsigned char acc;
+	unsigned int acc;
 	int bits, sz;
 	unsigned int gidx;
+	const char *srcend;
+	b64dec_func decode_simd = get_b64dec_simd();
+
+	srcend = str + len;
 
 	if(buf) {
 		sz = *bufsz;
 	} else {
-		sz = calc_b64_size(str);
+		const char *ptr = srcend;
+		while(ptr > str && ptr[-1] == '=') ptr--;
+		sz = (ptr - str) * 3 / 4;
 		if(!(buf = malloc(sz))) {
 			return 0;
 		}
-		if(bufsz) *bufsz = sz;
 	}
 	dest = buf;
 	end = (unsigned char*)buf + sz;
 
-	sz = 0;
 	gidx = 0;
 	acc = 0;
-	while(*str) {
-		if((bits = b64bits(*str++)) == -1) {
+	while(str < srcend) {
+		/* at group boundaries, let the vectorized decoder have a go */
+		if(decode_simd && !(gidx & 3)) {
+			decode_simd(&str, srcend, &dest, end);
+			if(str >= srcend) break;
+		}
+
+		if((bits = b64tab[(unsigned char)*str++]) == -1) {
 			continue;
 		}
+		acc = (acc << 6) | bits;
 
-		switch(gidx++ & 3) {
-		case 0:
-			acc = bits << 2;
-			break;
-		case 1:
-			if(dest < end) *dest = acc | (bits >> 4);
+		if((++gidx & 3) == 0) {
+			if(dest < end) *dest = acc >> 16;
 			dest++;
-			acc = bits << 4;
-			break;
-		case 2:
-			if(dest < end) *dest = acc | (bits >> 2);
+			if(dest < end) *dest = acc >> 8;
 			dest++;
-			acc = bits << 6;
-			break;
-		case 3:
-			if(dest < end) *dest = acc | bits;
+			if(dest < end) *dest = acc;
 			dest++;
-		default:
-			break;
 		}
 	}
 
-	if(gidx & 3) {
-		if(dest < end) *dest = acc;
+	/* trailing partial group of 2 or 3 characters, makes 1 or 2 bytes */
+	switch(gidx & 3) {
+	case 2:
+		if(dest < end) *dest = acc >> 4;
 		dest++;
+		break;
+	case 3:
+		if(dest < end) *dest = acc >> 10;
+		dest++;
+		if(dest < end) *dest = acc >> 2;
+		dest++;
+	default:
+		break;
 	}
 
 	if(bufsz) *bufsz = dest - (unsigned char*)buf;
 	return buf;
 }
 
-static int b64bits(int c)
+#ifdef B64_SIMD_X86
+/* Vectorized base64 decoding, after the method described by Wojciech Mula
+ * and Daniel Lemire: characters are validated and translated to 6-bit values
+ * with nibble-indexed lookup tables, then 4 6-bit values are packed to 3 bytes
+ * with multiply-add instructions.
+ */
+#define B64_LUT_LO(set) \
+	set(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+		0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a)
+#define B64_LUT_HI(set) \
+	set(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+		0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10)
+#define B64_LUT_ROLL(set) \
+	set(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0)
+
+__attribute__((target("ssse3")))
+static void b64dec_ssse3(const char **srcp, const char *srcend,
+		unsigned char **destp, unsigned char *destend)
+{
+	const char *src = *srcp;
+	unsigned char *dest = *destp;
+	__m128i in, hi_nib, lo_nib, roll, merged;
+	const __m128i lut_lo = B64_LUT_LO(_mm_setr_epi8);
+	const __m128i lut_hi = B64_LUT_HI(_mm_setr_epi8);
+	const __m128i lut_roll = B64_LUT_ROLL(_mm_setr_epi8);
+	const __m128i mask_lo = _mm_set1_epi8(0x0f);
+	const __m128i slash = _mm_set1_epi8('/');
+	const __m128i pack_shuf = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1);
+
+	/* 16 characters make 12 bytes, but the store writes 16 */
+	while(src + 16 <= srcend && dest + 16 <= destend) {
+		in = _mm_loadu_si128((const __m128i*)src);
+
+		hi_nib = _mm_and_si128(_mm_srli_epi32(in, 4), mask_lo);
+		lo_nib = _mm_and_si128(in, mask_lo);
+		if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(_mm_shuffle_epi8(lut_lo, lo_nib),
+					_mm_shuffle_epi8(lut_hi, hi_nib)), _mm_setzero_si128()))) {
+			break;
+		}
+		roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(in, slash), hi_nib));
+		in = _mm_add_epi8(in, roll);
+
+		merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+		merged = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+		merged = _mm_shuffle_epi8(merged, pack_shuf);
+		_mm_storeu_si128((__m128i*)dest, merged);
+
+		src += 16;
+		dest += 12;
+	}
+
+	*srcp = src;
+	*destp = dest;
+}
+
+__attribute__((target("avx2")))
+static void b64dec_avx2(const char **srcp, const char *srcend,
+		unsigned char **destp, unsigned char *destend)
 {
-	if(c >= 'A' && c <= 'Z') {
-		return c - 'A';
+	const char *src = *srcp;
+	unsigned char *dest = *destp;
+	__m256i in, hi_nib, lo_nib, roll, merged;
+	const __m256i lut_lo = _mm256_broadcastsi128_si256(B64_LUT_LO(_mm_setr_epi8));
+	const __m256i lut_hi = _mm256_broadcastsi128_si256(B64_LUT_HI(_mm_setr_epi8));
+	const __m256i lut_roll = _mm256_broadcastsi128_si256(B64_LUT_ROLL(_mm_setr_epi8));
+	const __m256i mask_lo = _mm256_set1_epi8(0x0f);
+	const __m256i slash = _mm256_set1_epi8('/');
+	const __m256i pack_shuf = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+			-1, -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m256i pack_perm = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+	/* 32 characters make 24 bytes, but the store writes 32 */
+	while(src + 32 <= srcend && dest + 32 <= destend) {
+		in = _mm256_loadu_si256((const __m256i*)src);
+
+		hi_nib = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask_lo);
+		lo_nib = _mm256_and_si256(in, mask_lo);
+		if(_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_and_si256(_mm256_shuffle_epi8(lut_lo, lo_nib),
+					_mm256_shuffle_epi8(lut_hi, hi_nib)), _mm256_setzero_si256()))) {
+			break;
+		}
+		roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, slash), hi_nib));
+		in = _mm256_add_epi8(in, roll);
+
+		merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, pack_shuf);
+		/* each 128bit lane has 12 bytes, move them together */
+		merged = _mm256_permutevar8x32_epi32(merged, pack_perm);
+		_mm256_storeu_si256((__m256i*)dest, merged);
+
+		src += 32;
+		dest += 24;
 	}
-	if(c >= 'a' && c <= 'z') {
-		return c - 'a' + 26;
+
+	*srcp = src;
+	*destp = dest;
+
+	/* finish off any remaining 16-character block */
+	b64dec_ssse3(srcp, srcend, destp, destend);
+}
+
+static b64dec_func get_b64dec_simd(void)
+{
+	/* no caching, this may be called from multiple threads, and checking
+	 * is cheap: the cpu model is initialized by libgcc at startup
+	 */
+	if(__builtin_cpu_supports("avx2")) {
+		return b64dec_avx2;
 	}
-	if(c >= '0' && c <= '9') {
-		return c - '0' + 52;
+	if(__builtin_cpu_supports("ssse3")) {
+		return b64dec_ssse3;
 	}
-	if(c == '+') return 62;
-	if(c == '/') return 63;
+	return 0;
+}
+
+#else	/* !B64_SIMD_X86 */
+static b64dec_func get_b64dec_simd(void)
+{
+	return 0;
+}
+#endif
+
+static const char *enctab =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	"abcdefghijklmnopqrstuvwxyz"
+	"0123456789+/";
+
+/* vectorized encoders: encode as many whole input blocks as possible, and
+ * advance the source and destination pointers. The rest is left for the
+ * scalar encoder.
+ */
+typedef void (*b64enc_func)(const unsigned char **srcp, const unsigned char *srcend,
+		char **destp);
+
+static b64enc_func get_b64enc_simd(void);
+
+GOAT3DAPI char *goat3d_b64encode(const void *data, int size, char *buf, int *bufsz)
+{
+	int outsz = (size + 2) / 3 * 4 + 1;
+
+	if(buf) {
+		if(*bufsz < outsz) {
+			*bufsz = outsz;
+			return 0;
+		}
+	} else {
+		if(bufsz) *bufsz = outsz;
 
-	return -1;
+		if(!(buf = malloc(outsz))) {
+			return 0;
+		}
+	}
+
+	buf[g3dimpl_b64encode(data, size, buf)] = 0;
+	return buf;
+}
+
+long g3dimpl_b64encode(const void *data, long size, char *dest)
+{
+	const unsigned char *src = data;
+	const unsigned char *end = src + size;
+	char *start = dest;
+	b64enc_func simd;
+	unsigned int bits;
+
+	if((simd = get_b64enc_simd())) {
+		simd(&src, end, &dest);
+	}
+
+	while(end - src >= 3) {
+		bits = ((unsigned int)src[0] << 16) | ((unsigned int)src[1] << 8) | src[2];
+		dest[0] = enctab[bits >> 18];
+		dest[1] = enctab[(bits >> 12) & 0x3f];
+		dest[2] = enctab[(bits >> 6) & 0x3f];
+		dest[3] = enctab[bits & 0x3f];
+		dest += 4;
+		src += 3;
+	}
+
+	if(src < end) {
+		bits = (unsigned int)src[0] << 16;
+		if(end - src > 1) {
+			bits |= (unsigned int)src[1] << 8;
+		}
+		dest[0] = enctab[bits >> 18];
+		dest[1] = enctab[(bits >> 12) & 0x3f];
+		dest[2] = end - src > 1 ? enctab[(bits >> 6) & 0x3f] : '=';
+		dest[3] = '=';
+		dest += 4;
+	}
+
+	return dest - start;
+}
+
+/* encoded in chunks through a fixed-size buffer; the chunk size is a multiple
+ * of 3 bytes, so that padding only ever appears at the end of the last chunk
+ */
+#define B64_CHUNK_SIZE	12288
+
+int g3dimpl_b64write(const void *data, long size,
+		long (*write)(const void*, size_t, void*), void *uptr)
+{
+	const unsigned char *src = data;
+	char buf[B64_CHUNK_SIZE / 3 * 4];
+	long sz, len;
+
+	while(size > 0) {
+		sz = size > B64_CHUNK_SIZE ? B64_CHUNK_SIZE : size;
+		len = g3dimpl_b64encode(src, sz, buf);
+		if(write(buf, len, uptr) < len) {
+			return -1;
+		}
+		src += sz;
+		size -= sz;
+	}
+	return 0;
+}
+
+#ifdef B64_SIMD_X86
+/* Vectorized base64 encoding, again after Mula and Lemire: each group of 3
+ * bytes is spread over a 32bit lane, the 4 6-bit fields are moved into
+ * separate bytes with multiplies, and then offset to their ASCII range with a
+ * small lookup table indexed by a reduced form of the 6-bit value.
+ */
+#define B64_ENC_SPREAD(set) \
+	set(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10)
+#define B64_ENC_OFFS(set) \
+	set('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, \
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0)
+
+__attribute__((target("ssse3")))
+static void b64enc_ssse3(const unsigned char **srcp, const unsigned char *srcend,
+		char **destp)
+{
+	const unsigned char *src = *srcp;
+	char *dest = *destp;
+	__m128i in, t0, t1, idx, res;
+	const __m128i spread = B64_ENC_SPREAD(_mm_setr_epi8);
+	const __m128i offs = B64_ENC_OFFS(_mm_setr_epi8);
+
+	/* 12 bytes make 16 characters, but the load reads 16 bytes */
+	while(src + 16 <= srcend) {
+		in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), spread);
+
+		t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)),
+				_mm_set1_epi32(0x04000040));
+		t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)),
+				_mm_set1_epi32(0x01000010));
+		idx = _mm_or_si128(t0, t1);
+
+		/* 0-25 -> 13, 26-51 -> 0, 52-61 -> 1-10, 62 -> 11, 63 -> 12 */
+		res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		res = _mm_or_si128(res, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+					_mm_set1_epi8(13)));
+		res = _mm_add_epi8(_mm_shuffle_epi8(offs, res), idx);
+		_mm_storeu_si128((__m128i*)dest, res);
+
+		src += 12;
+		dest += 16;
+	}
+
+	*srcp = src;
+	*destp = dest;
+}
+
+__attribute__((target("avx2")))
+static void b64enc_avx2(const unsigned char **srcp, const unsigned char *srcend,
+		char **destp)
+{
+	const unsigned char *src = *srcp;
+	char *dest = *destp;
+	__m256i in, t0, t1, idx, res;
+	const __m256i spread = _mm256_broadcastsi128_si256(B64_ENC_SPREAD(_mm_setr_epi8));
+	const __m256i offs = _mm256_broadcastsi128_si256(B64_ENC_OFFS(_mm_setr_epi8));
+
+	/* 24 bytes make 32 characters, 12 bytes for each 128bit lane, but the
+	 * second load reads up to 28 bytes in
+	 */
+	while(src + 28 <= srcend) {
+		in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+					_mm_loadu_si128((const __m128i*)src)),
+				_mm_loadu_si128((const __m128i*)(src + 12)), 1);
+		in = _mm256_shuffle_epi8(in, spread);
+
+		t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)),
+				_mm256_set1_epi32(0x04000040));
+		t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)),
+				_mm256_set1_epi32(0x01000010));
+		idx = _mm256_or_si256(t0, t1);
+
+		res = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+		res = _mm256_or_si256(res, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+					_mm256_set1_epi8(13)));
+		res = _mm256_add_epi8(_mm256_shuffle_epi8(offs, res), idx);
+		_mm256_storeu_si256((__m256i*)dest, res);
+
+		src += 24;
+		dest += 32;
+	}
+
+	*srcp = src;
+	*destp = dest;
+
+	b64enc_ssse3(srcp, srcend, destp);
+}
+
+static b64enc_func get_b64enc_simd(void)
+{
+	/* not cached, see get_b64dec_simd */
+	if(__builtin_cpu_supports("avx2")) {
+		return b64enc_avx2;
+	}
+	if(__builtin_cpu_supports("ssse3")) {
+		return b64enc_ssse3;
+	}
+	return 0;
+}
+
+#else	/* !B64_SIMD_X86 */
+static b64enc_func get_b64enc_simd(void)
+{
+	return 0;
 }
+#endif
 
 GOAT3DAPI void goat3d_bswap32(void *buf, int count)
 {
@@ -34,11 +34,29 @@ typedef unsigned __int32 uint32_t;
 #define GOAT3D_BIGEND
 #endif
 
-int calc_b64_size(const char *s);
+int calc_b64_size(const char *s, long len);
 
 GOAT3DAPI void *goat3d_b64decode(const char *str, void *buf, int *bufsz);
 #define b64decode goat3d_b64decode
 
+/* same as goat3d_b64decode, for the first len characters of str, when the
+ * length is already known
+ */
+void *g3dimpl_b64decode(const char *str, long len, void *buf, int *bufsz);
+
+GOAT3DAPI char *goat3d_b64encode(const void *data, int size, char *buf, int *bufsz);
+#define b64encode goat3d_b64encode
+
+/* encodes size bytes to dest, with padding but without a terminator. dest must
+ * have room for (size + 2) / 3 * 4 characters. Returns the encoded length.
+ */
+long g3dimpl_b64encode(const void *data, long size, char *dest);
+/* encodes and writes in fixed-size chunks, without ever holding the whole
+ * encoded string in memory
+ */
+int g3dimpl_b64write(const void *data, long size,
+		long (*write)(const void*, size_t, void*), void *uptr);
+
 GOAT3DAPI void goat3d_bswap32(void *buf, int count);
 
 #endif	/* GOAT3D_UTIL_H_ */
@@ -0,0 +1,346 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <float.h>
+#include "goat3d.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VEC_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VEC_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* Kernels over arrays of packed 3-component vectors (cgm_vec3, or the
+ * vertex/normal/tangent arrays returned by goat3d_get_mesh_attribs).
+ *
+ * Without a way to deinterleave on load like NEON's vld3, x86 versions work
+ * on blocks of 4 (SSE) or 8 (AVX) vectors as 3 or 6 plain loads, where each
+ * lane always holds the same component (lane i is component i % 3). Min/max
+ * reduction needs no shuffling at all that way. Each function consumes as many
+ * whole blocks as it can and returns how many vectors it processed, leaving
+ * the rest to the scalar loop.
+ */
+typedef int (*bounds_func)(const float *varr, int count, float *bmin, float *bmax);
+typedef int (*xform_func)(float *dest, const float *src, int count, const float *m, int pt);
+
+static bounds_func get_bounds_simd(void);
+static xform_func get_xform_simd(void);
+
+static void xform_vectors(float *dest, const float *src, int count, const float *m, int pt);
+
+
+GOAT3DAPI void goat3d_calc_bounds(const float *varr, int count, float *bmin, float *bmax)
+{
+	int i;
+	bounds_func simd;
+
+	bmin[0] = bmin[1] = bmin[2] = FLT_MAX;
+	bmax[0] = bmax[1] = bmax[2] = -FLT_MAX;
+
+	if((simd = get_bounds_simd())) {
+		i = simd(varr, count, bmin, bmax);
+		varr += i * 3;
+		count -= i;
+	}
+
+	for(i=0; i<count; i++) {
+		if(varr[0] < bmin[0]) bmin[0] = varr[0];
+		if(varr[1] < bmin[1]) bmin[1] = varr[1];
+		if(varr[2] < bmin[2]) bmin[2] = varr[2];
+		if(varr[0] > bmax[0]) bmax[0] = varr[0];
+		if(varr[1] > bmax[1]) bmax[1] = varr[1];
+		if(varr[2] > bmax[2]) bmax[2] = varr[2];
+		varr += 3;
+	}
+}
+
+GOAT3DAPI void goat3d_xform_points(float *dest, const float *src, int count, const float *xform)
+{
+	xform_vectors(dest, src, count, xform, 1);
+}
+
+GOAT3DAPI void goat3d_xform_dirs(float *dest, const float *src, int count, const float *xform)
+{
+	xform_vectors(dest, src, count, xform, 0);
+}
+
+static void xform_vectors(float *dest, const float *src, int count, const float *m, int pt)
+{
+	int i;
+	float x, y, z;
+	xform_func simd;
+
+	if((simd = get_xform_simd())) {
+		i = simd(dest, src, count, m, pt);
+		src += i * 3;
+		dest += i * 3;
+		count -= i;
+	}
+
+	for(i=0; i<count; i++) {
+		x = src[0];
+		y = src[1];
+		z = src[2];
+		dest[0] = x * m[0] + y * m[4] + z * m[8];
+		dest[1] = x * m[1] + y * m[5] + z * m[9];
+		dest[2] = x * m[2] + y * m[6] + z * m[10];
+		if(pt) {
+			dest[0] += m[12];
+			dest[1] += m[13];
+			dest[2] += m[14];
+		}
+		src += 3;
+		dest += 3;
+	}
+}
+
+/* merge per-lane results of the block kernels: lane i of the n stored lanes
+ * holds component i % 3
+ */
+static void merge_lanes(const float *lmin, const float *lmax, int n, float *bmin, float *bmax)
+{
+	int i;
+	for(i=0; i<n; i++) {
+		if(lmin[i] < bmin[i % 3]) bmin[i % 3] = lmin[i];
+		if(lmax[i] > bmax[i % 3]) bmax[i % 3] = lmax[i];
+	}
+}
+
+#ifdef VEC_SIMD_X86
+/* the vector being accumulated goes first in min/max, so that NaNs in the
+ * data are ignored like they are by the scalar comparisons
+ */
+__attribute__((target("sse")))
+static int bounds_sse(const float *varr, int count, float *bmin, float *bmax)
+{
+	int i, nblk = count / 4;
+	float lmin[12], lmax[12];
+	__m128 min0, min1, min2, max0, max1, max2, v0, v1, v2;
+
+	if(!nblk) return 0;
+
+	min0 = min1 = min2 = _mm_set1_ps(FLT_MAX);
+	max0 = max1 = max2 = _mm_set1_ps(-FLT_MAX);
+
+	for(i=0; i<nblk; i++) {
+		v0 = _mm_loadu_ps(varr);
+		v1 = _mm_loadu_ps(varr + 4);
+		v2 = _mm_loadu_ps(varr + 8);
+		min0 = _mm_min_ps(v0, min0);
+		min1 = _mm_min_ps(v1, min1);
+		min2 = _mm_min_ps(v2, min2);
+		max0 = _mm_max_ps(v0, max0);
+		max1 = _mm_max_ps(v1, max1);
+		max2 = _mm_max_ps(v2, max2);
+		varr += 12;
+	}
+
+	_mm_storeu_ps(lmin, min0);
+	_mm_storeu_ps(lmin + 4, min1);
+	_mm_storeu_ps(lmin + 8, min2);
+	_mm_storeu_ps(lmax, max0);
+	_mm_storeu_ps(lmax + 4, max1);
+	_mm_storeu_ps(lmax + 8, max2);
+	merge_lanes(lmin, lmax, 12, bmin, bmax);
+	return nblk * 4;
+}
+
+__attribute__((target("avx")))
+static int bounds_avx(const float *varr, int count, float *bmin, float *bmax)
+{
+	int i, nblk = count / 8;
+	float lmin[24], lmax[24];
+	__m256 min0, min1, min2, max0, max1, max2, v0, v1, v2;
+
+	if(!nblk) return 0;
+
+	min0 = min1 = min2 = _mm256_set1_ps(FLT_MAX);
+	max0 = max1 = max2 = _mm256_set1_ps(-FLT_MAX);
+
+	for(i=0; i<nblk; i++) {
+		v0 = _mm256_loadu_ps(varr);
+		v1 = _mm256_loadu_ps(varr + 8);
+		v2 = _mm256_loadu_ps(varr + 16);
+		min0 = _mm256_min_ps(v0, min0);
+		min1 = _mm256_min_ps(v1, min1);
+		min2 = _mm256_min_ps(v2, min2);
+		max0 = _mm256_max_ps(v0, max0);
+		max1 = _mm256_max_ps(v1, max1);
+		max2 = _mm256_max_ps(v2, max2);
+		varr += 24;
+	}
+
+	_mm256_storeu_ps(lmin, min0);
+	_mm256_storeu_ps(lmin + 8, min1);
+	_mm256_storeu_ps(lmin + 16, min2);
+	_mm256_storeu_ps(lmax, max0);
+	_mm256_storeu_ps(lmax + 8, max1);
+	_mm256_storeu_ps(lmax + 16, max2);
+	merge_lanes(lmin, lmax, 24, bmin, bmax);
+	return nblk * 8;
+}
+
+/* 4 vectors per iteration: each one is transformed whole in a register, as
+ * col0 * x + col1 * y + col2 * z (+ col3), and the 4 results are packed back
+ * into 3 registers. All 4 are loaded before storing, so dest may be src.
+ * A 256-bit version would spend its gains on shuffles across 128-bit lanes.
+ */
+#define SPLAT(v, i)		_mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+
+__attribute__((target("sse")))
+static int xform_sse(float *dest, const float *src, int count, const float *m, int pt)
+{
+	int i, nblk = count / 4;
+	__m128 c0, c1, c2, c3, v0, v1, v2, r0, r1, r2, r3, tmp;
+
+	c0 = _mm_setr_ps(m[0], m[1], m[2], 0);
+	c1 = _mm_setr_ps(m[4], m[5], m[6], 0);
+	c2 = _mm_setr_ps(m[8], m[9], m[10], 0);
+	c3 = pt ? _mm_setr_ps(m[12], m[13], m[14], 0) : _mm_setzero_ps();
+
+	for(i=0; i<nblk; i++) {
+		/* x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3 */
+		v0 = _mm_loadu_ps(src);
+		v1 = _mm_loadu_ps(src + 4);
+		v2 = _mm_loadu_ps(src + 8);
+
+		r0 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SPLAT(v0, 0)), _mm_mul_ps(c1, SPLAT(v0, 1))),
+				_mm_add_ps(_mm_mul_ps(c2, SPLAT(v0, 2)), c3));
+		r1 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SPLAT(v0, 3)), _mm_mul_ps(c1, SPLAT(v1, 0))),
+				_mm_add_ps(_mm_mul_ps(c2, SPLAT(v1, 1)), c3));
+		r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SPLAT(v1, 2)), _mm_mul_ps(c1, SPLAT(v1, 3))),
+				_mm_add_ps(_mm_mul_ps(c2, SPLAT(v2, 0)), c3));
+		r3 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, SPLAT(v2, 1)), _mm_mul_ps(c1, SPLAT(v2, 2))),
+				_mm_add_ps(_mm_mul_ps(c2, SPLAT(v2, 3)), c3));
+
+		/* r0x r0y r0z r1x */
+		tmp = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(0, 0, 2, 2));
+		v0 = _mm_shuffle_ps(r0, tmp, _MM_SHUFFLE(2, 0, 1, 0));
+		/* r1y r1z r2x r2y */
+		v1 = _mm_shuffle_ps(r1, r2, _MM_SHUFFLE(1, 0, 2, 1));
+		/* r2z r3x r3y r3z */
+		tmp = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(0, 0, 2, 2));
+		v2 = _mm_shuffle_ps(tmp, r3, _MM_SHUFFLE(2, 1, 2, 0));
+
+		_mm_storeu_ps(dest, v0);
+		_mm_storeu_ps(dest + 4, v1);
+		_mm_storeu_ps(dest + 8, v2);
+		src += 12;
+		dest += 12;
+	}
+	return nblk * 4;
+}
+
+static bounds_func get_bounds_simd(void)
+{
+	if(__builtin_cpu_supports("avx")) {
+		return bounds_avx;
+	}
+	if(__builtin_cpu_supports("sse")) {
+		return bounds_sse;
+	}
+	return 0;
+}
+
+static xform_func get_xform_simd(void)
+{
+	if(__builtin_cpu_supports("sse")) {
+		return xform_sse;
+	}
+	return 0;
+}
+
+#elif defined(VEC_SIMD_NEON)
+/* compare and select, instead of vminq/vmaxq, which would propagate NaNs */
+#define NEON_MIN(acc, v)	vbslq_f32(vcltq_f32(v, acc), v, acc)
+#define NEON_MAX(acc, v)	vbslq_f32(vcgtq_f32(v, acc), v, acc)
+
+static int bounds_neon(const float *varr, int count, float *bmin, float *bmax)
+{
+	int i, nblk = count / 4;
+	float lmin[12], lmax[12];
+	float32x4x3_t v, vmin, vmax;
+
+	if(!nblk) return 0;
+
+	vmin.val[0] = vmin.val[1] = vmin.val[2] = vdupq_n_f32(FLT_MAX);
+	vmax.val[0] = vmax.val[1] = vmax.val[2] = vdupq_n_f32(-FLT_MAX);
+
+	/* vld3 deinterleaves, so here val[i] holds component i in every lane */
+	for(i=0; i<nblk; i++) {
+		v = vld3q_f32(varr);
+		vmin.val[0] = NEON_MIN(vmin.val[0], v.val[0]);
+		vmin.val[1] = NEON_MIN(vmin.val[1], v.val[1]);
+		vmin.val[2] = NEON_MIN(vmin.val[2], v.val[2]);
+		vmax.val[0] = NEON_MAX(vmax.val[0], v.val[0]);
+		vmax.val[1] = NEON_MAX(vmax.val[1], v.val[1]);
+		vmax.val[2] = NEON_MAX(vmax.val[2], v.val[2]);
+		varr += 12;
+	}
+
+	/* store interleaved again, to merge lanes the same way as on x86 */
+	vst3q_f32(lmin, vmin);
+	vst3q_f32(lmax, vmax);
+	merge_lanes(lmin, lmax, 12, bmin, bmax);
+	return nblk * 4;
+}
+
+static int xform_neon(float *dest, const float *src, int count, const float *m, int pt)
+{
+	int i, j, nblk = count / 4;
+	float32x4x3_t v, r;
+
+	for(i=0; i<nblk; i++) {
+		v = vld3q_f32(src);
+		for(j=0; j<3; j++) {
+			r.val[j] = vmulq_n_f32(v.val[0], m[j]);
+			r.val[j] = vmlaq_n_f32(r.val[j], v.val[1], m[j + 4]);
+			r.val[j] = vmlaq_n_f32(r.val[j], v.val[2], m[j + 8]);
+			if(pt) {
+				r.val[j] = vaddq_f32(r.val[j], vdupq_n_f32(m[j + 12]));
+			}
+		}
+		vst3q_f32(dest, r);
+		src += 12;
+		dest += 12;
+	}
+	return nblk * 4;
+}
+
+static bounds_func get_bounds_simd(void)
+{
+	return bounds_neon;
+}
+
+static xform_func get_xform_simd(void)
+{
+	return xform_neon;
+}
+
+#else	/* no SIMD */
+static bounds_func get_bounds_simd(void)
+{
+	return 0;
+}
+
+static xform_func get_xform_simd(void)
+{
+	return 0;
+}
+#endif
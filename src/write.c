@@ -20,140 +20,116 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "g3dscn.h"
 #include "log.h"
 #include "dynarr.h"
+#include "util.h"
 #include "treestor.h"
 
 /* type passed to namegen */
 enum { MTL, MESH, LIGHT, CAMERA, NODE, ANIM, TRACK };
 
-static struct ts_node *create_mtltree(struct goat3d *g, const struct goat3d_material *mtl);
-static struct ts_node *create_meshtree(struct goat3d *g, const struct goat3d_mesh *mesh);
-static struct ts_node *create_lighttree(struct goat3d *g, const struct goat3d_light *light);
-static struct ts_node *create_camtree(struct goat3d *g, const struct goat3d_camera *cam);
-static struct ts_node *create_nodetree(struct goat3d *g, const struct goat3d_node *node);
-static struct ts_node *create_animtree(struct goat3d *g, const struct goat3d_anim *anim);
-static struct ts_node *create_tracktree(struct goat3d *g, const struct goat3d_track *trk);
+#define WRBUF_SIZE	4096
+
+/* The scene is written out as it's visited, in the treestore text format,
+ * without building a tree first. Output goes through a small buffer, and
+ * errors are sticky: once a write fails everything else is skipped, and
+ * the error is reported at the end.
+ */
+struct writer {
+	struct goat3d_io *io;
+	int level;
+	int inl;	/* current node is written on a single line */
+	int err;
+	int bufsz;
+	char buf[WRBUF_SIZE];
+};
+
+static void write_mtl(struct writer *w, struct goat3d *g, const struct goat3d_material *mtl);
+static void write_optmesh(struct writer *w, struct goat3d *g, const struct goat3d_mesh *mesh);
+static void write_mesh(struct writer *w, struct goat3d *g, const struct goat3d_mesh *mesh);
+static void write_light(struct writer *w, struct goat3d *g, const struct goat3d_light *light);
+static void write_camera(struct writer *w, struct goat3d *g, const struct goat3d_camera *cam);
+static void write_node(struct writer *w, struct goat3d *g, const struct goat3d_node *node);
+static void write_anim(struct writer *w, struct goat3d *g, const struct goat3d_anim *anim);
+static void write_track(struct writer *w, struct goat3d *g, const struct goat3d_track *trk);
+
+static void wr_flush(struct writer *w);
+static void wr_data(struct writer *w, const void *data, int sz);
+static void wr_str(struct writer *w, const char *s);
+static void wr_begin(struct writer *w, const char *name, int inl);
+static void wr_end(struct writer *w);
+static void wr_attr_str(struct writer *w, const char *name, const char *s);
+static void wr_attr_num(struct writer *w, const char *name, float x);
+static void wr_attr_vec(struct writer *w, const char *name, int count, const float *v);
+static void wr_attr_b64(struct writer *w, const char *name, const void *data, long size);
 
 static void init_namegen(struct goat3d *g);
 static const char *namegen(struct goat3d *g, const char *name, int type);
 
-GOAT3DAPI char *goat3d_b64encode(const void *data, int size, char *buf, int *bufsz);
-#define b64encode goat3d_b64encode
-
-#define create_tsnode(n, p, nstr) \
-	do { \
-		int len = strlen(nstr); \
-		if(!((n) = ts_alloc_node())) { \
-			goat3d_logmsg(LOG_ERROR, "failed to create treestore node\n"); \
-			goto err; \
-		} \
-		if(!((n)->name = malloc(len + 1))) { \
-			goat3d_logmsg(LOG_ERROR, "failed to allocate node name string\n"); \
-			ts_free_node(n); \
-			goto err; \
-		} \
-		memcpy((n)->name, (nstr), len + 1); \
-		if(p) { \
-			ts_add_child((p), (n)); \
-		} \
-	} while(0)
-
-#define create_tsattr(a, n, nstr, atype) \
-	do { \
-		if(!((a) = ts_alloc_attr())) { \
-			goat3d_logmsg(LOG_ERROR, "failed to create treestore attribute\n"); \
-			goto err; \
-		} \
-		if(ts_set_attr_name(a, nstr) == -1) { \
-			goat3d_logmsg(LOG_ERROR, "failed to allocate attrib name string\n"); \
-			ts_free_attr(a); \
-			goto err; \
-		} \
-		(a)->val.type = (atype); \
-		if(n) { \
-			ts_add_attr((n), (a)); \
-		} \
-	} while(0)
-
-
 
 int g3dimpl_scnsave(const struct goat3d *g, struct goat3d_io *io)
 {
 	int i, num;
-	struct ts_io tsio;
-	struct ts_node *tsroot = 0, *tsn, *tsenv;
-	struct ts_attr *tsa;
+	struct writer *w;
 
-	tsio.data = io->cls;
-	tsio.read = io->read;
-	tsio.write = io->write;
+	if(!(w = malloc(sizeof *w))) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_scnsave: failed to allocate writer\n");
+		return -1;
+	}
+	w->io = io;
+	w->level = 0;
+	w->inl = 0;
+	w->err = 0;
+	w->bufsz = 0;
 
 	init_namegen((struct goat3d*)g);
 
-	create_tsnode(tsroot, 0, "scene");
+	wr_begin(w, "scene", 0);
 
 	/* environment */
-	create_tsnode(tsenv, tsroot, "env");
-	create_tsattr(tsa, tsenv, "ambient", TS_VECTOR);
-	ts_set_valuefv(&tsa->val, 3, g->ambient.x, g->ambient.y, g->ambient.z);
+	wr_begin(w, "env", 1);
+	wr_attr_vec(w, "ambient", 3, &g->ambient.x);
 	/* TODO: fog */
+	wr_end(w);
 
 	num = dynarr_size(g->materials);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_mtltree((struct goat3d*)g, g->materials[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_mtl(w, (struct goat3d*)g, g->materials[i]);
 	}
 
 	num = dynarr_size(g->meshes);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_meshtree((struct goat3d*)g, g->meshes[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_optmesh(w, (struct goat3d*)g, g->meshes[i]);
 	}
 
 	num = dynarr_size(g->lights);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_lighttree((struct goat3d*)g, g->lights[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_light(w, (struct goat3d*)g, g->lights[i]);
 	}
 
 	num = dynarr_size(g->cameras);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_camtree((struct goat3d*)g, g->cameras[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_camera(w, (struct goat3d*)g, g->cameras[i]);
 	}
 
 	num = dynarr_size(g->nodes);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_nodetree((struct goat3d*)g, g->nodes[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_node(w, (struct goat3d*)g, g->nodes[i]);
 	}
 
 	num = dynarr_size(g->anims);
 	for(i=0; i<num; i++) {
-		if(!(tsn = create_animtree((struct goat3d*)g, g->anims[i]))) {
-			goto err;
-		}
-		ts_add_child(tsroot, tsn);
+		write_anim(w, (struct goat3d*)g, g->anims[i]);
 	}
 
-	if(ts_save_io(tsroot, &tsio) == -1) {
+	wr_end(w);
+	wr_flush(w);
+
+	if(w->err) {
 		goat3d_logmsg(LOG_ERROR, "g3dimpl_scnsave: failed\n");
-		goto err;
+		free(w);
+		return -1;
 	}
+	free(w);
 	return 0;
-
-err:
-	ts_free_tree(tsroot);
-	return -1;
 }
 
 int g3dimpl_anmsave(const struct goat3d *g, struct goat3d_io *io)
@@ -161,483 +137,415 @@ int g3dimpl_anmsave(const struct goat3d *g, struct goat3d_io *io)
 	return -1;
 }
 
-static struct ts_node *create_mtltree(struct goat3d *g, const struct goat3d_material *mtl)
+static void write_mtl(struct writer *w, struct goat3d *g, const struct goat3d_material *mtl)
 {
 	int i, num_attr;
-	struct ts_node *tsn, *tsmtl = 0;
-	struct ts_attr *tsa;
-
-	create_tsnode(tsmtl, 0, "mtl");
-	create_tsattr(tsa, tsmtl, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, mtl->name, MTL)) == -1) {
-		goto err;
-	}
 
 	num_attr = dynarr_size(mtl->attrib);
+
+	wr_begin(w, "mtl", num_attr == 0);
+	wr_attr_str(w, "name", namegen(g, mtl->name, MTL));
+
 	for(i=0; i<num_attr; i++) {
 		struct material_attrib *attr = mtl->attrib + i;
 
-		create_tsnode(tsn, tsmtl, "attr");
-		create_tsattr(tsa, tsn, "name", TS_STRING);
-		if(ts_set_value_str(&tsa->val, attr->name) == -1) {
-			goto err;
-		}
-		create_tsattr(tsa, tsn, "val", TS_VECTOR);
-		ts_set_valuefv(&tsa->val, 4, attr->value.x, attr->value.y, attr->value.z, attr->value.w);
+		wr_begin(w, "attr", 0);
+		wr_attr_str(w, "name", attr->name);
+		wr_attr_vec(w, "val", 4, &attr->value.x);
 		if(attr->map) {
-			create_tsattr(tsa, tsn, "map", TS_STRING);
-			if(ts_set_value_str(&tsa->val, attr->map) == -1) {
-				goto err;
-			}
+			wr_attr_str(w, "map", attr->map);
 		}
+		wr_end(w);
 	}
-	return tsmtl;
-
-err:
-	ts_free_tree(tsmtl);
-	return 0;
+	wr_end(w);
 }
 
-static struct ts_node *create_meshtree(struct goat3d *g, const struct goat3d_mesh *mesh)
+/* writes one of the mesh data lists, either as base64 or as one node per
+ * element. ncomp is the number of components per element in the data, and
+ * nout the number of components written for each, padded with zeros.
+ */
+static void write_list(struct writer *w, struct goat3d *g, const char *listname,
+		const char *itemname, const char *attrname, const void *data, int num,
+		int ncomp, int nout, int isint)
 {
-	int i, num;
-	struct ts_node *tsmesh = 0, *tslist, *tsitem;
-	struct ts_attr *tsa;
+	int i, j;
+	float vec[4];
+	const float *fptr = data;
+	const int *iptr = data;
 
-	create_tsnode(tsmesh, 0, "mesh");
-	create_tsattr(tsa, tsmesh, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, mesh->name, MESH)) == -1) {
-		goto err;
-	}
+	wr_begin(w, listname, 0);
+	wr_attr_num(w, "list_size", num);
 
-	if(mesh->mtl) {
-		if(mesh->mtl->name) {
-			create_tsattr(tsa, tsmesh, "material", TS_STRING);
-			if(ts_set_value_str(&tsa->val, mesh->mtl->name) == -1) {
-				goto err;
+	if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
+		wr_attr_b64(w, "base64", data, (long)num * ncomp * 4);
+	} else {
+		for(i=0; i<num; i++) {
+			for(j=0; j<nout; j++) {
+				if(j >= ncomp) {
+					vec[j] = 0.0f;
+				} else {
+					vec[j] = isint ? (float)*iptr++ : *fptr++;
+				}
 			}
-		} else {
-			create_tsattr(tsa, tsmesh, "material", TS_NUMBER);
-			ts_set_valuei(&tsa->val, mesh->mtl->idx);
+			wr_begin(w, itemname, 1);
+			wr_attr_vec(w, attrname, nout, vec);
+			wr_end(w);
 		}
 	}
+	wr_end(w);
+}
 
-	/* TODO option of saving separate mesh files */
-
-	if((num = dynarr_size(mesh->vertices))) {
-		create_tsnode(tslist, tsmesh, "vertex_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
+/* with GOAT3D_OPT_OPTMESH, write an optimized copy instead of the mesh */
+static void write_optmesh(struct writer *w, struct goat3d *g, const struct goat3d_mesh *mesh)
+{
+	struct goat3d_mesh *opt = 0;
 
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->vertices, num * 3 * sizeof(float), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec3 *vptr = mesh->vertices + i;
-				create_tsnode(tsitem, tslist, "vertex");
-				create_tsattr(tsa, tsitem, "pos", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 3, vptr->x, vptr->y, vptr->z);
-			}
-		}
+	if(goat3d_getopt(g, GOAT3D_OPT_OPTMESH) && !(opt = g3dimpl_mesh_optcopy(mesh))) {
+		goat3d_logmsg(LOG_WARNING, "failed to optimize mesh: %s\n", mesh->name);
 	}
+	write_mesh(w, g, opt ? opt : mesh);
+	g3dimpl_mesh_free_optcopy(opt);
+}
 
-	if((num = dynarr_size(mesh->normals))) {
-		create_tsnode(tslist, tsmesh, "normal_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
+static void write_mesh(struct writer *w, struct goat3d *g, const struct goat3d_mesh *mesh)
+{
+	int i, num, inl;
 
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->normals, num * 3 * sizeof(float), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec3 *nptr = mesh->normals + i;
-				create_tsnode(tsitem, tslist, "normal");
-				create_tsattr(tsa, tsitem, "dir", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 3, nptr->x, nptr->y, nptr->z);
-			}
-		}
+	inl = !mesh->mtl && !dynarr_size(mesh->bones);
+	for(i=0; i<=MESH_FACES; i++) {
+		if(g3dimpl_mesh_count(mesh, i)) inl = 0;
 	}
 
-	if((num = dynarr_size(mesh->tangents))) {
-		create_tsnode(tslist, tsmesh, "tangent_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
+	wr_begin(w, "mesh", inl);
+	wr_attr_str(w, "name", namegen(g, mesh->name, MESH));
 
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->tangents, num * 3 * sizeof(float), 0, 0))) {
-				goto err;
-			}
+	if(mesh->mtl) {
+		if(mesh->mtl->name) {
+			wr_attr_str(w, "material", mesh->mtl->name);
 		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec3 *tptr = mesh->tangents + i;
-				create_tsnode(tsitem, tslist, "tangent");
-				create_tsattr(tsa, tsitem, "dir", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 3, tptr->x, tptr->y, tptr->z);
-			}
+			wr_attr_num(w, "material", mesh->mtl->idx);
 		}
 	}
 
-	if((num = dynarr_size(mesh->texcoords))) {
-		create_tsnode(tslist, tsmesh, "texcoord_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
+	/* TODO option of saving separate mesh files */
 
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->texcoords, num * 3 * sizeof(float), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec2 *uvptr = mesh->texcoords + i;
-				create_tsnode(tsitem, tslist, "texcoord");
-				create_tsattr(tsa, tsitem, "uv", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 3, uvptr->x, uvptr->y, 0.0f);
-			}
-		}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX))) {
+		write_list(w, g, "vertex_list", "vertex", "pos",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_VERTEX), num, 3, 3, 0);
 	}
-
-	if((num = dynarr_size(mesh->skin_weights))) {
-		create_tsnode(tslist, tsmesh, "skinweight_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
-
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->skin_weights, num * 4 * sizeof(float), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec4 *wptr = mesh->skin_weights + i;
-				create_tsnode(tsitem, tslist, "skinweight");
-				create_tsattr(tsa, tsitem, "weights", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 4, wptr->x, wptr->y, wptr->z, wptr->w);
-			}
-		}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_NORMAL))) {
+		write_list(w, g, "normal_list", "normal", "dir",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_NORMAL), num, 3, 3, 0);
 	}
-
-	if((num = dynarr_size(mesh->skin_matrices))) {
-		create_tsnode(tslist, tsmesh, "skinmatrix_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
-
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->skin_matrices, num * 4 * sizeof(int), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				int4 *iptr = mesh->skin_matrices + i;
-				create_tsnode(tsitem, tslist, "skinmatrix");
-				create_tsattr(tsa, tsitem, "idx", TS_VECTOR);
-				ts_set_valueiv(&tsa->val, 4, iptr->x, iptr->y, iptr->z, iptr->w);
-			}
-		}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_TANGENT))) {
+		write_list(w, g, "tangent_list", "tangent", "dir",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_TANGENT), num, 3, 3, 0);
 	}
-
-	if((num = dynarr_size(mesh->colors))) {
-		create_tsnode(tslist, tsmesh, "color_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
-
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->colors, num * 4 * sizeof(float), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				cgm_vec4 *cptr = mesh->colors + i;
-				create_tsnode(tsitem, tslist, "color");
-				create_tsattr(tsa, tsitem, "color", TS_VECTOR);
-				ts_set_valuefv(&tsa->val, 4, cptr->x, cptr->y, cptr->z, cptr->w);
-			}
-		}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_TEXCOORD))) {
+		write_list(w, g, "texcoord_list", "texcoord", "uv",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_TEXCOORD), num, 2, 3, 0);
+	}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_SKIN_WEIGHT))) {
+		write_list(w, g, "skinweight_list", "skinweight", "weights",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_SKIN_WEIGHT), num, 4, 4, 0);
+	}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_SKIN_MATRIX))) {
+		write_list(w, g, "skinmatrix_list", "skinmatrix", "idx",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_SKIN_MATRIX), num, 4, 4, 1);
+	}
+	if((num = g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_COLOR))) {
+		write_list(w, g, "color_list", "color", "color",
+				g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_COLOR), num, 4, 4, 0);
 	}
 
 	if((num = dynarr_size(mesh->bones))) {
-		create_tsnode(tslist, tsmesh, "bone_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
+		wr_begin(w, "bone_list", 0);
+		wr_attr_num(w, "list_size", num);
 
 		/* TODO: base64 option */
 		for(i=0; i<num; i++) {
-			create_tsnode(tsitem, tslist, "bone");
-			create_tsattr(tsa, tsitem, "name", TS_STRING);
-			if(ts_set_value_str(&tsa->val, mesh->bones[i]->name) == -1) {
-				goto err;
-			}
+			wr_begin(w, "bone", 1);
+			wr_attr_str(w, "name", mesh->bones[i]->name);
+			wr_end(w);
 		}
+		wr_end(w);
 	}
 
-	if((num = dynarr_size(mesh->faces))) {
-		create_tsnode(tslist, tsmesh, "face_list");
-		create_tsattr(tsa, tslist, "list_size", TS_NUMBER);
-		ts_set_valuei(&tsa->val, num);
-
-		if(goat3d_getopt(g, GOAT3D_OPT_SAVEBINDATA)) {
-			create_tsattr(tsa, tslist, "base64", TS_STRING);
-			if(!(tsa->val.str = b64encode(mesh->faces, num * 3 * sizeof(int), 0, 0))) {
-				goto err;
-			}
-		} else {
-			for(i=0; i<num; i++) {
-				struct face *fptr = mesh->faces + i;
-				create_tsnode(tsitem, tslist, "face");
-				create_tsattr(tsa, tsitem, "idx", TS_VECTOR);
-				ts_set_valueiv(&tsa->val, 3, fptr->v[0], fptr->v[1], fptr->v[2]);
-			}
-		}
+	if((num = g3dimpl_mesh_count(mesh, MESH_FACES))) {
+		write_list(w, g, "face_list", "face", "idx",
+				g3dimpl_mesh_data(mesh, MESH_FACES), num, 3, 3, 1);
 	}
 
-	return tsmesh;
-
-err:
-	ts_free_tree(tsmesh);
-	return 0;
+	wr_end(w);
 }
 
-static struct ts_node *create_lighttree(struct goat3d *g, const struct goat3d_light *light)
+static void write_light(struct writer *w, struct goat3d *g, const struct goat3d_light *light)
 {
-	struct ts_node *tslight = 0;
-	struct ts_attr *tsa;
-
-	create_tsnode(tslight, 0, "light");
-	create_tsattr(tsa, tslight, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, light->name, LIGHT)) == -1) {
-		goto err;
-	}
+	wr_begin(w, "light", 0);
+	wr_attr_str(w, "name", namegen(g, light->name, LIGHT));
 
 	if(light->ltype != LTYPE_DIR) {
-		create_tsattr(tsa, tslight, "pos", TS_VECTOR);
-		ts_set_valuefv(&tsa->val, 3, light->pos.x, light->pos.y, light->pos.z);
+		wr_attr_vec(w, "pos", 3, &light->pos.x);
 	}
 
 	if(light->ltype != LTYPE_POINT) {
-		create_tsattr(tsa, tslight, "dir", TS_VECTOR);
-		ts_set_valuefv(&tsa->val, 3, light->dir.x, light->dir.y, light->dir.z);
+		wr_attr_vec(w, "dir", 3, &light->dir.x);
 	}
 
 	if(light->ltype == LTYPE_SPOT) {
-		create_tsattr(tsa, tslight, "cone_inner", TS_NUMBER);
-		ts_set_valuef(&tsa->val, light->inner_cone);
-		create_tsattr(tsa, tslight, "cone_outer", TS_NUMBER);
-		ts_set_valuef(&tsa->val, light->outer_cone);
+		wr_attr_num(w, "cone_inner", light->inner_cone);
+		wr_attr_num(w, "cone_outer", light->outer_cone);
 	}
 
-	create_tsattr(tsa, tslight, "color", TS_VECTOR);
-	ts_set_valuefv(&tsa->val, 3, light->color.x, light->color.y, light->color.z);
-
-	create_tsattr(tsa, tslight, "atten", TS_VECTOR);
-	ts_set_valuefv(&tsa->val, 3, light->attenuation.x, light->attenuation.y, light->attenuation.z);
+	wr_attr_vec(w, "color", 3, &light->color.x);
+	wr_attr_vec(w, "atten", 3, &light->attenuation.x);
+	wr_attr_num(w, "distance", light->max_dist);
 
-	create_tsattr(tsa, tslight, "distance", TS_NUMBER);
-	ts_set_valuef(&tsa->val, light->max_dist);
-
-	return tslight;
-
-err:
-	ts_free_tree(tslight);
-	return 0;
+	wr_end(w);
 }
 
-static struct ts_node *create_camtree(struct goat3d *g, const struct goat3d_camera *cam)
+static void write_camera(struct writer *w, struct goat3d *g, const struct goat3d_camera *cam)
 {
-	struct ts_node *tscam = 0;
-	struct ts_attr *tsa;
-
-	create_tsnode(tscam, 0, "camera");
-	create_tsattr(tsa, tscam, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, cam->name, CAMERA)) == -1) {
-		goto err;
-	}
+	wr_begin(w, "camera", 0);
+	wr_attr_str(w, "name", namegen(g, cam->name, CAMERA));
 
-	create_tsattr(tsa, tscam, "pos", TS_VECTOR);
-	ts_set_valuefv(&tsa->val, 3, cam->pos.x, cam->pos.y, cam->pos.z);
+	wr_attr_vec(w, "pos", 3, &cam->pos.x);
 
 	if(cam->camtype == CAMTYPE_TARGET) {
-		create_tsattr(tsa, tscam, "target", TS_VECTOR);
-		ts_set_valuefv(&tsa->val, 3, cam->target.x, cam->target.y, cam->target.z);
+		wr_attr_vec(w, "target", 3, &cam->target.x);
 	}
 
-	create_tsattr(tsa, tscam, "fov", TS_NUMBER);
-	ts_set_valuef(&tsa->val, cam->fov);
+	wr_attr_num(w, "fov", cam->fov);
+	wr_attr_num(w, "nearclip", cam->near_clip);
+	wr_attr_num(w, "farclip", cam->far_clip);
 
-	create_tsattr(tsa, tscam, "nearclip", TS_NUMBER);
-	ts_set_valuef(&tsa->val, cam->near_clip);
-
-	create_tsattr(tsa, tscam, "farclip", TS_NUMBER);
-	ts_set_valuef(&tsa->val, cam->far_clip);
-
-	return tscam;
-
-err:
-	ts_free_tree(tscam);
-	return 0;
+	wr_end(w);
 }
 
-static struct ts_node *create_nodetree(struct goat3d *g, const struct goat3d_node *node)
+static void write_node(struct writer *w, struct goat3d *g, const struct goat3d_node *node)
 {
-	struct ts_node *tsnode = 0;
-	struct ts_attr *tsa;
 	struct goat3d_node *par;
 	static const char *objtypestr[] = {"null", "mesh", "light", "camera"};
 	float vec[4];
 	float xform[16];
 
-	create_tsnode(tsnode, 0, "node");
-	create_tsattr(tsa, tsnode, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, node->name, NODE)) == -1) {
-		goto err;
-	}
+	wr_begin(w, "node", 0);
+	wr_attr_str(w, "name", namegen(g, node->name, NODE));
 
 	if((par = goat3d_get_node_parent(node))) {
-		create_tsattr(tsa, tsnode, "parent", TS_STRING);
-		if(ts_set_value_str(&tsa->val, goat3d_get_node_name(par)) == -1) {
-			goto err;
-		}
+		wr_attr_str(w, "parent", goat3d_get_node_name(par));
 	}
 
 	if(node->obj && node->type != GOAT3D_NODE_NULL) {
-		create_tsattr(tsa, tsnode, objtypestr[node->type], TS_STRING);
-		if(ts_set_value_str(&tsa->val, ((struct object*)node->obj)->name) == -1) {
-			goto err;
-		}
+		wr_attr_str(w, objtypestr[node->type], ((struct object*)node->obj)->name);
 	}
 
 	goat3d_get_node_position(node, vec, vec + 1, vec + 2);
-	create_tsattr(tsa, tsnode, "pos", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 3, vec);
+	wr_attr_vec(w, "pos", 3, vec);
 
 	goat3d_get_node_rotation(node, vec, vec + 1, vec + 2, vec + 3);
-	create_tsattr(tsa, tsnode, "rot", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 4, vec);
+	wr_attr_vec(w, "rot", 4, vec);
 
 	goat3d_get_node_scaling(node, vec, vec + 1, vec + 2);
-	create_tsattr(tsa, tsnode, "scale", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 3, vec);
+	wr_attr_vec(w, "scale", 3, vec);
 
 	goat3d_get_node_pivot(node, vec, vec + 1, vec + 2);
-	create_tsattr(tsa, tsnode, "pivot", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 3, vec);
+	wr_attr_vec(w, "pivot", 3, vec);
 
 	goat3d_get_node_matrix(node, xform);
 	cgm_mtranspose(xform);
-	create_tsattr(tsa, tsnode, "matrix0", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 4, xform);
-	create_tsattr(tsa, tsnode, "matrix1", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 4, xform + 4);
-	create_tsattr(tsa, tsnode, "matrix2", TS_VECTOR);
-	ts_set_valuef_arr(&tsa->val, 4, xform + 8);
-
-	return tsnode;
+	wr_attr_vec(w, "matrix0", 4, xform);
+	wr_attr_vec(w, "matrix1", 4, xform + 4);
+	wr_attr_vec(w, "matrix2", 4, xform + 8);
 
-err:
-	ts_free_tree(tsnode);
-	return 0;
+	wr_end(w);
 }
 
-static struct ts_node *create_animtree(struct goat3d *g, const struct goat3d_anim *anim)
+static void write_anim(struct writer *w, struct goat3d *g, const struct goat3d_anim *anim)
 {
 	int i, num_trk;
-	struct ts_node *tsanim, *tstrk;
-	struct ts_attr *tsa;
 
-	create_tsnode(tsanim, 0, "anim");
-	create_tsattr(tsa, tsanim, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, anim->name, ANIM)) == -1) {
-		goto err;
-	}
+	num_trk = goat3d_get_anim_track_count(anim);
 
+	wr_begin(w, "anim", num_trk == 0);
+	wr_attr_str(w, "name", namegen(g, anim->name, ANIM));
 
-	num_trk = goat3d_get_anim_track_count(anim);
 	for(i=0; i<num_trk; i++) {
-		if((tstrk = create_tracktree(g, goat3d_get_anim_track(anim, i)))) {
-			ts_add_child(tsanim, tstrk);
-		}
+		write_track(w, g, goat3d_get_anim_track(anim, i));
 	}
-
-	return tsanim;
-
-err:
-	ts_free_tree(tsanim);
-	return 0;
+	wr_end(w);
 }
 
 static const char *instr[] = {"step", "linear", "cubic"};
 static const char *exstr[] = {"extend", "clamp", "repeat", "pingpong"};
 
-static struct ts_node *create_tracktree(struct goat3d *g, const struct goat3d_track *trk)
+static void write_track(struct writer *w, struct goat3d *g, const struct goat3d_track *trk)
 {
 	int i, num_keys;
-	struct ts_node *tstrk, *tskey;
-	struct ts_attr *tsa;
 	struct goat3d_key key;
 	enum goat3d_track_type basetype;
 
-	create_tsnode(tstrk, 0, "track");
-	create_tsattr(tsa, tstrk, "name", TS_STRING);
-	if(ts_set_value_str(&tsa->val, namegen(g, trk->name, TRACK)) == -1) {
-		goto err;
-	}
-
-	create_tsattr(tsa, tstrk, "type", TS_STRING);
-	if(ts_set_value_str(&tsa->val, g3dimpl_trktypestr(trk->type)) == -1) {
-		goto err;
-	}
+	wr_begin(w, "track", 0);
+	wr_attr_str(w, "name", namegen(g, trk->name, TRACK));
+	wr_attr_str(w, "type", g3dimpl_trktypestr(trk->type));
 	basetype = trk->type & 0xff;
 
-	create_tsattr(tsa, tstrk, "interp", TS_STRING);
-	if(ts_set_value_str(&tsa->val, instr[trk->trk[0].interp]) == -1) {
-		goto err;
-	}
-	create_tsattr(tsa, tstrk, "extrap", TS_STRING);
-	if(ts_set_value_str(&tsa->val, exstr[trk->trk[0].extrap]) == -1) {
-		goto err;
-	}
+	wr_attr_str(w, "interp", instr[trk->trk.interp]);
+	wr_attr_str(w, "extrap", exstr[trk->trk.extrap]);
 
 	if(trk->node) {
-		create_tsattr(tsa, tstrk, "node", TS_STRING);
-		if(ts_set_value_str(&tsa->val, trk->node->name) == -1) {
-			goto err;
-		}
+		wr_attr_str(w, "node", trk->node->name);
 	}
 
 	num_keys = goat3d_get_track_key_count(trk);
 	for(i=0; i<num_keys; i++) {
 		goat3d_get_track_key(trk, i, &key);
 
-		create_tsnode(tskey, tstrk, "key");
-		create_tsattr(tsa, tskey, "time", TS_NUMBER);
-		ts_set_valuei(&tsa->val, key.tm);
+		wr_begin(w, "key", 0);
+		wr_attr_num(w, "time", key.tm);
 
 		if(basetype == GOAT3D_TRACK_VAL) {
-			create_tsattr(tsa, tskey, "value", TS_NUMBER);
-			ts_set_valuef(&tsa->val, key.val[0]);
+			wr_attr_num(w, "value", key.val[0]);
 		} else {
 			static const int typecount[] = {1, 3, 4, 4};
-			create_tsattr(tsa, tskey, "value", TS_VECTOR);
-			ts_set_valuef_arr(&tsa->val, typecount[basetype], key.val);
+			wr_attr_vec(w, "value", typecount[basetype], key.val);
 		}
+		wr_end(w);
 	}
 
-	return tstrk;
+	wr_end(w);
+}
 
-err:
-	ts_free_tree(tstrk);
-	return 0;
+static const char *indent(int x)
+{
+	static const char buf[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+	const char *end = buf + sizeof buf - 1;
+	return x > sizeof buf - 1 ? buf : end - x;
+}
+
+static void wr_flush(struct writer *w)
+{
+	if(!w->err && w->bufsz > 0) {
+		if(w->io->write(w->buf, w->bufsz, w->io->cls) < w->bufsz) {
+			goat3d_logmsg(LOG_ERROR, "failed to write %d bytes\n", w->bufsz);
+			w->err = 1;
+		}
+	}
+	w->bufsz = 0;
+}
+
+static void wr_data(struct writer *w, const void *data, int sz)
+{
+	if(w->err) return;
+
+	if(w->bufsz + sz > WRBUF_SIZE) {
+		wr_flush(w);
+		if(sz > WRBUF_SIZE) {
+			if(w->io->write(data, sz, w->io->cls) < sz) {
+				goat3d_logmsg(LOG_ERROR, "failed to write %d bytes\n", sz);
+				w->err = 1;
+			}
+			return;
+		}
+	}
+	memcpy(w->buf + w->bufsz, data, sz);
+	w->bufsz += sz;
 }
 
+static void wr_str(struct writer *w, const char *s)
+{
+	wr_data(w, s, strlen(s));
+}
 
+/* inline nodes are written on a single line, and can't have children */
+static void wr_begin(struct writer *w, const char *name, int inl)
+{
+	wr_str(w, indent(w->level));
+	wr_str(w, name);
+	wr_str(w, inl ? " {" : " {\n");
+	w->inl = inl;
+	w->level++;
+}
+
+static void wr_end(struct writer *w)
+{
+	if(--w->level < 0) w->level = 0;
+
+	if(w->inl) {
+		wr_str(w, "}\n");
+	} else {
+		wr_str(w, indent(w->level));
+		wr_str(w, "}\n");
+	}
+	w->inl = 0;
+}
+
+static void wr_attr_begin(struct writer *w, const char *name)
+{
+	if(w->inl) {
+		wr_str(w, " ");
+	} else {
+		wr_str(w, indent(w->level));
+	}
+	wr_str(w, name);
+	wr_str(w, " = ");
+}
+
+static void wr_attr_end(struct writer *w)
+{
+	wr_str(w, w->inl ? " " : "\n");
+}
+
+static void wr_attr_str(struct writer *w, const char *name, const char *s)
+{
+	if(!s) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_scnsave: missing value for attribute: %s\n", name);
+		w->err = 1;
+		return;
+	}
+	wr_attr_begin(w, name);
+	wr_str(w, "\"");
+	wr_str(w, s);
+	wr_str(w, "\"");
+	wr_attr_end(w);
+}
+
+static void wr_attr_num(struct writer *w, const char *name, float x)
+{
+	char buf[TS_NUMSTR_MAX];
+
+	wr_attr_begin(w, name);
+	wr_data(w, buf, ts_format_num(buf, x));
+	wr_attr_end(w);
+}
+
+static void wr_attr_vec(struct writer *w, const char *name, int count, const float *v)
+{
+	int i;
+	char buf[TS_NUMSTR_MAX];
+
+	wr_attr_begin(w, name);
+	wr_str(w, "[");
+	for(i=0; i<count; i++) {
+		if(i) wr_str(w, ", ");
+		wr_data(w, buf, ts_format_num(buf, v[i]));
+	}
+	wr_str(w, "]");
+	wr_attr_end(w);
+}
+
+static void wr_attr_b64(struct writer *w, const char *name, const void *data, long size)
+{
+	wr_attr_begin(w, name);
+	wr_str(w, "\"");
+	wr_flush(w);
+	if(!w->err && g3dimpl_b64write(data, size, w->io->write, w->io->cls) == -1) {
+		goat3d_logmsg(LOG_ERROR, "failed to write base64 data\n");
+		w->err = 1;
+	}
+	wr_str(w, "\"");
+	wr_attr_end(w);
+}
 
 static void init_namegen(struct goat3d *g)
 {
@@ -663,74 +571,3 @@ static const char *namegen(struct goat3d *g, const char *name, int type)
 	sprintf(g->namebuf, fmt[type], g->namecnt[type]++);
 	return g->namebuf;
 }
-
-static const char *enctab =
-	"ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-	"abcdefghijklmnopqrstuvwxyz"
-	"0123456789+/";
-
-GOAT3DAPI char *goat3d_b64encode(const void *data, int size, char *buf, int *bufsz)
-{
-	const unsigned char *src = data;
-	char *dest;
-	int i;
-	int outsz = size * 4 / 3 + 1;
-	int bitgrp[4];
-	int leftover;
-
-	if(buf) {
-		if(*bufsz < outsz) {
-			*bufsz = outsz;
-			return 0;
-		}
-	} else {
-		if(bufsz) *bufsz = outsz;
-
-		/* reserve more space for up to two padding bytes */
-		if(!(buf = malloc(outsz + 2))) {
-			return 0;
-		}
-	}
-	dest = buf;
-
-	leftover = 0;
-	while(size > 0) {
-		bitgrp[0] = (src[0] & 0xfc) >> 2;
-		bitgrp[1] = (src[0] & 3) << 4;
-		if(--size <= 0) {
-			leftover = 2;
-			break;
-		}
-		bitgrp[1] |= src[1] >> 4;
-		bitgrp[2] = (src[1] & 0xf) << 2;
-		if(--size <= 0) {
-			leftover = 3;
-			break;
-		}
-		bitgrp[2] |= src[2] >> 6;
-		bitgrp[3] = src[2] & 0x3f;
-
-		dest[0] = enctab[bitgrp[0]];
-		dest[1] = enctab[bitgrp[1]];
-		dest[2] = enctab[bitgrp[2]];
-		dest[3] = enctab[bitgrp[3]];
-
-		dest += 4;
-		src += 3;
-		leftover = 0;
-		size--;
-	}
-
-	if(leftover) {
-		for(i=0; i<4; i++) {
-			if(i < leftover) {
-				*dest++ = enctab[bitgrp[i]];
-			} else {
-				*dest++ = '=';
-			}
-		}
-	}
-
-	*dest = 0;
-	return buf;
-}
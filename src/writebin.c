@@ -0,0 +1,536 @@
+/*
+goat3d - 3D scene, and animation file format library.
+Copyright (C) 2013-2023  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "g3dscn.h"
+#include "chunk.h"
+#include "bvh.h"
+#include "log.h"
+#include "dynarr.h"
+
+static int write_mtl(const struct goat3d_material *mtl, struct goat3d_io *io);
+static int write_optmesh(const struct goat3d *g, const struct goat3d_mesh *mesh, struct goat3d_io *io);
+static int write_mesh(const struct goat3d *g, const struct goat3d_mesh *mesh, struct goat3d_io *io);
+static int write_light(const struct goat3d_light *lt, struct goat3d_io *io);
+static int write_camera(const struct goat3d_camera *cam, struct goat3d_io *io);
+static int write_node(const struct goat3d *g, const struct goat3d_node *node, struct goat3d_io *io);
+static int write_anim(const struct goat3d *g, const struct goat3d_anim *anim, struct goat3d_io *io);
+static int write_track(const struct goat3d *g, const struct goat3d_track *trk, struct goat3d_io *io);
+
+static int write_data(int id, const void *data, long size, struct goat3d_io *io);
+static int write_list(int id, const void *data, int count, int elemsz, struct goat3d_io *io);
+static int write_bvh(int id, const struct bvh *bvh, struct goat3d_io *io);
+static int write_str(int id, const char *str, struct goat3d_io *io);
+static int write_strdata(const char *str, struct goat3d_io *io);
+static int write_ref(int id, const char *name, int idx, struct goat3d_io *io);
+static int write_refdata(const char *name, int idx, struct goat3d_io *io);
+static int write_int(int id, int val, struct goat3d_io *io);
+static int write_float(int id, float val, struct goat3d_io *io);
+static int write_vec3(int id, const cgm_vec3 *v, struct goat3d_io *io);
+static int write_vec4(int id, const cgm_vec4 *v, struct goat3d_io *io);
+
+#define CHECK(x)	do { if((x) == -1) goto err; } while(0)
+
+/* index of a node or object in its scene array, or -1 if it's not in g */
+#define SCENE_IDX(g, x)	((x)->scn == (g) ? (x)->idx : -1)
+
+int g3dimpl_savebin(const struct goat3d *g, struct goat3d_io *io)
+{
+	int i, num;
+	long start, env_start;
+	struct chunk_header hdr, envhdr;
+
+	if((start = g3dimpl_begin_chunk(&hdr, CNK_SCENE, io)) == -1) {
+		goat3d_logmsg(LOG_ERROR, "g3dimpl_savebin: failed to write scene chunk (stream not seekable?)\n");
+		return -1;
+	}
+
+	CHECK(env_start = g3dimpl_begin_chunk(&envhdr, CNK_ENV, io));
+	CHECK(write_vec3(CNK_ENV_AMBIENT, &g->ambient, io));
+	/* TODO: fog */
+	CHECK(g3dimpl_end_chunk(&envhdr, env_start, io));
+
+	num = dynarr_size(g->materials);
+	for(i=0; i<num; i++) {
+		CHECK(write_mtl(g->materials[i], io));
+	}
+	num = dynarr_size(g->meshes);
+	for(i=0; i<num; i++) {
+		CHECK(write_optmesh(g, g->meshes[i], io));
+	}
+	num = dynarr_size(g->lights);
+	for(i=0; i<num; i++) {
+		CHECK(write_light(g->lights[i], io));
+	}
+	num = dynarr_size(g->cameras);
+	for(i=0; i<num; i++) {
+		CHECK(write_camera(g->cameras[i], io));
+	}
+	num = dynarr_size(g->nodes);
+	for(i=0; i<num; i++) {
+		CHECK(write_node(g, g->nodes[i], io));
+	}
+	num = dynarr_size(g->anims);
+	for(i=0; i<num; i++) {
+		CHECK(write_anim(g, g->anims[i], io));
+	}
+
+	CHECK(g3dimpl_end_chunk(&hdr, start, io));
+	return 0;
+
+err:
+	goat3d_logmsg(LOG_ERROR, "g3dimpl_savebin: failed\n");
+	return -1;
+}
+
+static int write_mtl(const struct goat3d_material *mtl, struct goat3d_io *io)
+{
+	int i, num;
+	long start, attr_start;
+	struct chunk_header hdr, attrhdr;
+	struct material_attrib *attr;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_MTL, io));
+	if(mtl->name) {
+		CHECK(write_str(CNK_MTL_NAME, mtl->name, io));
+	}
+
+	num = dynarr_size(mtl->attrib);
+	for(i=0; i<num; i++) {
+		attr = mtl->attrib + i;
+
+		CHECK(attr_start = g3dimpl_begin_chunk(&attrhdr, CNK_MTL_ATTR, io));
+		CHECK(write_str(CNK_MTL_ATTR_NAME, attr->name, io));
+		CHECK(write_vec4(CNK_MTL_ATTR_VAL, &attr->value, io));
+		if(attr->map) {
+			CHECK(write_str(CNK_MTL_ATTR_MAP, attr->map, io));
+		}
+		CHECK(g3dimpl_end_chunk(&attrhdr, attr_start, io));
+	}
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+/* with GOAT3D_OPT_OPTMESH, write an optimized copy instead of the mesh */
+static int write_optmesh(const struct goat3d *g, const struct goat3d_mesh *mesh, struct goat3d_io *io)
+{
+	int res;
+	struct goat3d_mesh *opt = 0;
+
+	if(goat3d_getopt(g, GOAT3D_OPT_OPTMESH) && !(opt = g3dimpl_mesh_optcopy(mesh))) {
+		goat3d_logmsg(LOG_WARNING, "failed to optimize mesh: %s\n", mesh->name);
+	}
+	res = write_mesh(g, opt ? opt : mesh, io);
+	g3dimpl_mesh_free_optcopy(opt);
+	return res;
+}
+
+static int write_mesh(const struct goat3d *g, const struct goat3d_mesh *mesh, struct goat3d_io *io)
+{
+	int i, num;
+	long start, bones_start;
+	struct chunk_header hdr, boneshdr;
+	struct aabox bbox;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_MESH, io));
+	if(mesh->name) {
+		CHECK(write_str(CNK_MESH_NAME, mesh->name, io));
+	}
+
+	if(mesh->mtl) {
+		CHECK(write_ref(CNK_MESH_MATERIAL, mesh->mtl->name, SCENE_IDX(g, mesh->mtl), io));
+	}
+
+	CHECK(write_list(CNK_MESH_VERTEX_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_VERTEX),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_VERTEX), io));
+	CHECK(write_list(CNK_MESH_NORMAL_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_NORMAL),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_NORMAL), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_NORMAL), io));
+	CHECK(write_list(CNK_MESH_TANGENT_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_TANGENT),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_TANGENT), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_TANGENT), io));
+	CHECK(write_list(CNK_MESH_TEXCOORD_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_TEXCOORD),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_TEXCOORD), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_TEXCOORD), io));
+	CHECK(write_list(CNK_MESH_SKINWEIGHT_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_SKIN_WEIGHT),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_SKIN_WEIGHT), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_SKIN_WEIGHT), io));
+	CHECK(write_list(CNK_MESH_SKINMATRIX_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_SKIN_MATRIX),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_SKIN_MATRIX), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_SKIN_MATRIX), io));
+	CHECK(write_list(CNK_MESH_COLOR_LIST, g3dimpl_mesh_data(mesh, GOAT3D_MESH_ATTR_COLOR),
+				g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_COLOR), g3dimpl_mesh_elemsize(GOAT3D_MESH_ATTR_COLOR), io));
+
+	if((num = dynarr_size(mesh->bones))) {
+		CHECK(bones_start = g3dimpl_begin_chunk(&boneshdr, CNK_MESH_BONES_LIST, io));
+		for(i=0; i<num; i++) {
+			CHECK(write_refdata(mesh->bones[i]->name, SCENE_IDX(g, mesh->bones[i]), io));
+		}
+		CHECK(g3dimpl_end_chunk(&boneshdr, bones_start, io));
+	}
+
+	CHECK(write_list(CNK_MESH_FACE_LIST, g3dimpl_mesh_data(mesh, MESH_FACES),
+				g3dimpl_mesh_count(mesh, MESH_FACES), g3dimpl_mesh_elemsize(MESH_FACES), io));
+
+	/* bounds let lazily loaded meshes be culled without reading their data */
+	if(g3dimpl_mesh_count(mesh, GOAT3D_MESH_ATTR_VERTEX)) {
+		g3dimpl_mesh_bounds(&bbox, (struct goat3d_mesh*)mesh, 0);
+		CHECK(write_list(CNK_MESH_BOUNDS, &bbox, 1, sizeof bbox, io));
+	}
+
+	if(mesh->bvh) {
+		CHECK(write_bvh(CNK_MESH_BVH, mesh->bvh, io));
+	}
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+static int write_light(const struct goat3d_light *lt, struct goat3d_io *io)
+{
+	long start;
+	struct chunk_header hdr;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_LIGHT, io));
+	if(lt->name) {
+		CHECK(write_str(CNK_LIGHT_NAME, lt->name, io));
+	}
+
+	if(lt->ltype != LTYPE_DIR) {
+		CHECK(write_vec3(CNK_LIGHT_POS, &lt->pos, io));
+	}
+	if(lt->ltype != LTYPE_POINT) {
+		CHECK(write_vec3(CNK_LIGHT_DIR, &lt->dir, io));
+	}
+	if(lt->ltype == LTYPE_SPOT) {
+		CHECK(write_float(CNK_LIGHT_CONE_INNER, lt->inner_cone, io));
+		CHECK(write_float(CNK_LIGHT_CONE_OUTER, lt->outer_cone, io));
+	}
+	CHECK(write_vec3(CNK_LIGHT_COLOR, &lt->color, io));
+	CHECK(write_vec3(CNK_LIGHT_ATTEN, &lt->attenuation, io));
+	CHECK(write_float(CNK_LIGHT_DISTANCE, lt->max_dist, io));
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+static int write_camera(const struct goat3d_camera *cam, struct goat3d_io *io)
+{
+	long start;
+	struct chunk_header hdr;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_CAMERA, io));
+	if(cam->name) {
+		CHECK(write_str(CNK_CAMERA_NAME, cam->name, io));
+	}
+	CHECK(write_vec3(CNK_CAMERA_POS, &cam->pos, io));
+	if(cam->camtype == CAMTYPE_TARGET) {
+		CHECK(write_vec3(CNK_CAMERA_TARGET, &cam->target, io));
+	}
+	CHECK(write_float(CNK_CAMERA_FOV, cam->fov, io));
+	CHECK(write_float(CNK_CAMERA_NEARCLIP, cam->near_clip, io));
+	CHECK(write_float(CNK_CAMERA_FARCLIP, cam->far_clip, io));
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+static int write_node(const struct goat3d *g, const struct goat3d_node *node, struct goat3d_io *io)
+{
+	static const int objcnk[] = {0, CNK_NODE_MESH, CNK_NODE_LIGHT, CNK_NODE_CAMERA};
+	long start;
+	struct chunk_header hdr;
+	struct object *obj;
+	cgm_vec3 v;
+	cgm_vec4 q;
+	float xform[16];
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_NODE, io));
+	if(node->name) {
+		CHECK(write_str(CNK_NODE_NAME, node->name, io));
+	}
+	if(node->parent) {
+		CHECK(write_ref(CNK_NODE_PARENT, node->parent->name, SCENE_IDX(g, node->parent), io));
+	}
+	if((obj = node->obj) && node->type != GOAT3D_NODE_NULL) {
+		CHECK(write_ref(objcnk[node->type], obj->name, SCENE_IDX(g, obj), io));
+	}
+
+	goat3d_get_node_position(node, &v.x, &v.y, &v.z);
+	CHECK(write_vec3(CNK_NODE_POS, &v, io));
+	goat3d_get_node_rotation(node, &q.x, &q.y, &q.z, &q.w);
+	CHECK(write_vec4(CNK_NODE_ROT, &q, io));
+	goat3d_get_node_scaling(node, &v.x, &v.y, &v.z);
+	CHECK(write_vec3(CNK_NODE_SCALE, &v, io));
+	goat3d_get_node_pivot(node, &v.x, &v.y, &v.z);
+	CHECK(write_vec3(CNK_NODE_PIVOT, &v, io));
+
+	goat3d_get_node_matrix(node, xform);
+	cgm_mtranspose(xform);
+	CHECK(write_vec4(CNK_NODE_MATRIX0, (cgm_vec4*)xform, io));
+	CHECK(write_vec4(CNK_NODE_MATRXI1, (cgm_vec4*)(xform + 4), io));
+	CHECK(write_vec4(CNK_NODE_MATRIX2, (cgm_vec4*)(xform + 8), io));
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+static int write_anim(const struct goat3d *g, const struct goat3d_anim *anim, struct goat3d_io *io)
+{
+	int i, num;
+	long start;
+	struct chunk_header hdr;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_ANIM, io));
+	if(anim->name) {
+		CHECK(write_str(CNK_ANIM_NAME, anim->name, io));
+	}
+
+	num = dynarr_size(anim->tracks);
+	for(i=0; i<num; i++) {
+		CHECK(write_track(g, anim->tracks[i], io));
+	}
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+static int write_track(const struct goat3d *g, const struct goat3d_track *trk, struct goat3d_io *io)
+{
+	static const int key_val_sz[] = {1, 3, 4, 4};
+	int i, j, num, nval;
+	long start;
+	struct chunk_header hdr, keyshdr;
+	struct goat3d_key key;
+	int ival;
+	float fval;
+
+	CHECK(start = g3dimpl_begin_chunk(&hdr, CNK_ANIM_TRACK, io));
+	if(trk->name) {
+		CHECK(write_str(CNK_TRACK_NAME, trk->name, io));
+	}
+	CHECK(write_int(CNK_TRACK_TYPE, trk->type, io));
+	CHECK(write_int(CNK_TRACK_INTERP, goat3d_get_track_interp(trk), io));
+	CHECK(write_int(CNK_TRACK_EXTRAP, goat3d_get_track_extrap(trk), io));
+	if(trk->node) {
+		CHECK(write_ref(CNK_TRACK_NODE, trk->node->name, SCENE_IDX(g, trk->node), io));
+	}
+
+	nval = key_val_sz[trk->type & 0xff];
+	num = goat3d_get_track_key_count(trk);
+
+	g3dimpl_chunk_header(&keyshdr, CNK_TRACK_KEYS);
+	keyshdr.size += num * (1 + nval) * 4;
+	CHECK(g3dimpl_put_chunk_header(&keyshdr, io));
+
+	for(i=0; i<num; i++) {
+		goat3d_get_track_key(trk, i, &key);
+		ival = key.tm;
+#ifdef GOAT3D_BIGEND
+		goat3d_bswap32(&ival, 1);
+#endif
+		if(io->write(&ival, 4, io->cls) < 4) goto err;
+
+		for(j=0; j<nval; j++) {
+			fval = key.val[j];
+#ifdef GOAT3D_BIGEND
+			goat3d_bswap32(&fval, 1);
+#endif
+			if(io->write(&fval, 4, io->cls) < 4) goto err;
+		}
+	}
+
+	return g3dimpl_end_chunk(&hdr, start, io);
+err:
+	return -1;
+}
+
+
+static int write_data(int id, const void *data, long size, struct goat3d_io *io)
+{
+	struct chunk_header hdr;
+
+	g3dimpl_chunk_header(&hdr, id);
+	hdr.size += size;
+	if(g3dimpl_put_chunk_header(&hdr, io) == -1) {
+		return -1;
+	}
+	if(size > 0 && io->write(data, size, io->cls) < size) {
+		return -1;
+	}
+	return 0;
+}
+
+/* vertex attribute and face lists are written as raw arrays of 32bit values,
+ * directly from the mesh arrays on little-endian machines.
+ */
+static int write_list(int id, const void *data, int count, int elemsz, struct goat3d_io *io)
+{
+#ifdef GOAT3D_BIGEND
+	int res;
+	void *tmp;
+#endif
+	long size = (long)count * elemsz;
+
+	if(!count) return 0;
+
+#ifdef GOAT3D_BIGEND
+	if(!(tmp = malloc(size))) {
+		goat3d_logmsg(LOG_ERROR, "write_list: failed to allocate byteswap buffer\n");
+		return -1;
+	}
+	memcpy(tmp, data, size);
+	goat3d_bswap32(tmp, size / 4);
+	res = write_data(id, tmp, size, io);
+	free(tmp);
+	return res;
+#else
+	return write_data(id, data, size, io);
+#endif
+}
+
+/* the BVH is packed into a single array of 32bit values, to be written like
+ * the other lists (see CNK_MESH_BVH in chunk.h)
+ */
+static int write_bvh(int id, const struct bvh *bvh, struct goat3d_io *io)
+{
+	int res;
+	long count;
+	int32_t *buf;
+
+	count = 2 + (long)bvh->num_nodes * (sizeof *bvh->nodes / 4) + bvh->num_items;
+	if(!(buf = malloc(count * 4))) {
+		goat3d_logmsg(LOG_ERROR, "write_bvh: failed to allocate buffer\n");
+		return -1;
+	}
+	buf[0] = bvh->num_nodes;
+	buf[1] = bvh->num_items;
+	memcpy(buf + 2, bvh->nodes, bvh->num_nodes * sizeof *bvh->nodes);
+	memcpy(buf + 2 + bvh->num_nodes * (sizeof *bvh->nodes / 4), bvh->items,
+			bvh->num_items * sizeof *bvh->items);
+
+	res = write_list(id, buf, count, 4, io);
+	free(buf);
+	return res;
+}
+
+#define PADDED_LEN(x)	(((x) + 3) & ~3)
+
+static int write_str(int id, const char *str, struct goat3d_io *io)
+{
+	struct chunk_header hdr;
+
+	g3dimpl_chunk_header(&hdr, id);
+	hdr.size += sizeof hdr + PADDED_LEN(strlen(str));
+	if(g3dimpl_put_chunk_header(&hdr, io) == -1) {
+		return -1;
+	}
+	return write_strdata(str, io);
+}
+
+/* strings are padded with zeros to a multiple of 4 bytes, to keep all chunks
+ * (and therefore the mesh data lists) 4-byte aligned in the file. This allows
+ * goat3d_load_mapped to use the mesh data in place.
+ */
+static int write_strdata(const char *str, struct goat3d_io *io)
+{
+	static const char zeros[4];
+	struct chunk_header hdr;
+	int len = strlen(str);
+	int pad = PADDED_LEN(len) - len;
+
+	g3dimpl_chunk_header(&hdr, CNK_STRING);
+	hdr.size += len + pad;
+	if(g3dimpl_put_chunk_header(&hdr, io) == -1) {
+		return -1;
+	}
+	if(len > 0 && io->write(str, len, io->cls) < len) {
+		return -1;
+	}
+	if(pad > 0 && io->write(zeros, pad, io->cls) < pad) {
+		return -1;
+	}
+	return 0;
+}
+
+/* references to nodes and objects are written by name, or by index in the
+ * scene arrays for unnamed ones, which the reader resolves the same way.
+ * Unnamed objects outside the scene can't be referenced at all.
+ */
+static int write_ref(int id, const char *name, int idx, struct goat3d_io *io)
+{
+	if(name) {
+		return write_str(id, name, io);
+	}
+	return idx >= 0 ? write_int(id, idx, io) : 0;
+}
+
+/* bare reference in a list, where an invalid one still has to take its place */
+static int write_refdata(const char *name, int idx, struct goat3d_io *io)
+{
+	uint32_t val = idx;
+
+	if(name || idx < 0) {
+		return write_strdata(name ? name : "", io);
+	}
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(&val, 1);
+#endif
+	return write_data(CNK_INT, &val, 4, io);
+}
+
+static int write_vals(int id, int valtype, const void *vals, int count, struct goat3d_io *io)
+{
+	struct chunk_header hdr;
+	uint32_t buf[4];
+
+	memcpy(buf, vals, count * 4);
+#ifdef GOAT3D_BIGEND
+	goat3d_bswap32(buf, count);
+#endif
+
+	g3dimpl_chunk_header(&hdr, id);
+	hdr.size += sizeof hdr + count * 4;
+	if(g3dimpl_put_chunk_header(&hdr, io) == -1) {
+		return -1;
+	}
+	return write_data(valtype, buf, count * 4, io);
+}
+
+static int write_int(int id, int val, struct goat3d_io *io)
+{
+	int ival = val;
+	return write_vals(id, CNK_INT, &ival, 1, io);
+}
+
+static int write_float(int id, float val, struct goat3d_io *io)
+{
+	return write_vals(id, CNK_FLOAT, &val, 1, io);
+}
+
+static int write_vec3(int id, const cgm_vec3 *v, struct goat3d_io *io)
+{
+	return write_vals(id, CNK_FLOAT3, v, 3, io);
+}
+
+static int write_vec4(int id, const cgm_vec4 *v, struct goat3d_io *io)
+{
+	return write_vals(id, CNK_FLOAT4, v, 4, io);
+}